@@ -20,6 +20,15 @@
 #include "misc.h"
 #include "functions.h"
 #include "camera.h"
+#include "draw_list.h"
+#include "mesh_pool.h"
+#include "png_writer.h"
+#include "trace.h"
+#include "frame_pacing.h"
+#include "benchmark.h"
+#include "scene.h"
+#include "jobs.h"
+#include "simulation.h"
 
 
 #ifndef RELEASE_MODE
@@ -36,9 +45,35 @@ const size_t validation_layer_count = sizeof validation_layers / sizeof(char*);
 // Inputs
 static vec2 last_mouse_position;
 static bool is_mouse_clicked;
+// glfw callbacks queue input deltas for the simulation, replaced by script or log input in benchmark and replay
+static InputQueue input_queue;
+static FrameInput unqueued_input; // what didn't fit into the queue, goes with the next event
+static InputLog input_log;
+static bool input_replay;
+static const char *input_record_path;
+static size_t game_frame;
 // Game state
-static clock_t start_time;
-static Camera camera;
+typedef struct {
+    Camera camera;
+    quaternion model_orientation;
+} SimState;
+
+// a tick and the one before it, so the renderer can blend between them
+typedef struct {
+    SimState previous;
+    SimState current;
+    double time; // when current was due
+} SimSnapshot;
+
+static double start_time;
+static Camera camera; // what is rendered, interpolated from the simulation
+// Simulation runs at a fixed rate on its own thread. Deterministic runs(headless, benchmark, replay) and --sim-rate 0 tick once per frame instead
+#define SIM_DEFAULT_RATE 120.0
+static double sim_rate = SIM_DEFAULT_RATE;
+static SimulationThread *simulation; // NULL when ticking on the render thread
+static SimState sim_state; // simulation only
+static SimSnapshot sim_snapshots[3];
+static TripleBuffer sim_buffer;
 // GLFW
 #define WINDOW_WIDTH 800
 #define WINDOW_HEIGHT 600
@@ -46,8 +81,206 @@ static GLFWwindow *window;
 // Vulkan
 static Vulkan vulkan;
 // Drawing
-static Model model;
+// instances are children of model_root, rotating the model only dirties the root
+static Scene scene;
+static SceneHandle model_root;
+static MeshPool mesh_pool;
+static uint32_t teapot_mesh;
+static DrawList draw_list;
+static InstanceList instances;
+// Stress scene, 0 instances means regular single teapot scene
+#define STRESS_DEFAULT_INSTANCES 100000
+static size_t stress_instances;
+// stress instances are split into this many draws, to have something to record in parallel
+static size_t stress_draws = 1;
+static uint32_t record_threads; // number of secondary buffers recorded as jobs, 0 records inline
+static bool no_bindless; // --no-bindless, objects bind their own set even where bindless tables are supported
+static bool vertex_pulling; // --vertex-pulling, vertices and instances are read from storage buffers
+static bool cluster_culling; // --clusters, meshlets are culled on the gpu
+static bool no_mesh_shaders; // --no-mesh-shaders, clusters are culled in a compute pass even where mesh shaders are supported
+// --hot-reload recompiles shaders when their sources change, for development
+static bool hot_reload;
+static const char *shader_sources[SHADER_SLOTS] = {
+    [SHADER_SCENE_VERT] = "shaders/shader.vert",
+    [SHADER_SCENE_FRAG] = "shaders/shader.frag",
+    [SHADER_BINDLESS_VERT] = "shaders/shader_bindless.vert",
+    [SHADER_PULL_VERT] = "shaders/shader_pull.vert",
+    [SHADER_CLUSTER_VERT] = "shaders/shader_cluster.vert",
+    [SHADER_MESHLET_TASK] = "shaders/meshlet.task",
+    [SHADER_MESHLET_MESH] = "shaders/meshlet.mesh",
+    [SHADER_CULL] = "shaders/cull.comp",
+    [SHADER_COMPACT] = "shaders/compact.comp",
+    [SHADER_CLUSTER_CULL] = "shaders/cluster_cull.comp",
+    [SHADER_POST_VERT] = "shaders/fullscreen.vert",
+    [SHADER_FXAA] = "shaders/fxaa.frag",
+    [SHADER_UPSCALE] = "shaders/upscale.frag",
+};
+static const char *shader_outputs[SHADER_SLOTS] = {
+    [SHADER_SCENE_VERT] = "shaders_out/vert.spv",
+    [SHADER_SCENE_FRAG] = "shaders_out/frag.spv",
+    [SHADER_BINDLESS_VERT] = "shaders_out/vert_bindless.spv",
+    [SHADER_PULL_VERT] = "shaders_out/vert_pull.spv",
+    [SHADER_CLUSTER_VERT] = "shaders_out/vert_cluster.spv",
+    [SHADER_MESHLET_TASK] = "shaders_out/meshlet_task.spv",
+    [SHADER_MESHLET_MESH] = "shaders_out/meshlet_mesh.spv",
+    [SHADER_CULL] = "shaders_out/cull.spv",
+    [SHADER_COMPACT] = "shaders_out/compact.spv",
+    [SHADER_CLUSTER_CULL] = "shaders_out/cluster_cull.spv",
+    [SHADER_POST_VERT] = "shaders_out/fullscreen.spv",
+    [SHADER_FXAA] = "shaders_out/fxaa.spv",
+    [SHADER_UPSCALE] = "shaders_out/upscale.spv",
+};
+// loading, scene sync and recording run on this, --threads 0 is a worker for every other core
+static JobSystem *jobs;
+static uint32_t job_threads;
+#define SCENE_SYNC_GRAIN 4096
+// Headless mode renders a fixed number of frames offscreen, without glfw
+static bool headless;
+static uint32_t headless_width = WINDOW_WIDTH;
+static uint32_t headless_height = WINDOW_HEIGHT;
+static size_t headless_frames = 100;
+static const char *headless_png_path;
+// M key cycles through these, --aa picks one at startup
+// Frame pacing, windowed only. V key cycles present modes, L toggles low latency
+static FramePacer pacer;
+static const VkPresentModeKHR present_modes[] = {VK_PRESENT_MODE_FIFO_KHR, VK_PRESENT_MODE_FIFO_RELAXED_KHR, VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_IMMEDIATE_KHR};
+static const char *present_mode_names[] = {"fifo", "relaxed", "mailbox", "immediate"};
+static size_t present_mode_index = 2;
+static bool present_mode_requested;
+// --benchmark: warm up, then a fixed number of measured frames driven by a script or --input-log, results go to json
+static bool benchmark_mode;
+static size_t benchmark_frames = 600;
+static size_t benchmark_warmup = 60;
+static const char *benchmark_json_path = "benchmark.json";
+static Benchmark benchmark;
+static double last_gpu_ms = -1.0; // gpu time read during the last frame, -1 if none
+// C key and exit write the cpu trace here
+static const char *trace_path;
+static const char *aa_presets[] = {"off", "fxaa", "msaa2", "msaa4", "msaa8", "msaa8s"};
+static size_t aa_preset;
+static bool aa_requested;
+static AntiAliasing requested_aa;
+// F key cycles scene pipeline variants, --shading picks the first one. Constant 0 is SHADING in shader.frag
+// culled is lit with back faces culled, cluster culling then rejects back facing meshlets too
+static const char *shading_names[] = {"lit", "depth", "wireframe", "xray", "culled"};
+static const PipelineVariant shading_variants[] = {
+    {0, {0}},
+    {0, {1}},
+    {RENDER_STATE_WIREFRAME, {2}},
+    {RENDER_STATE_BLEND | RENDER_STATE_NO_DEPTH_WRITE, {3}},
+    {RENDER_STATE_CULL_BACK, {0}},
+};
+static size_t shading;
+// variants this run asked for are written here on exit and built during the next startup
+static const char *pipeline_usage_path = "pipeline_usage.bin";
+// --dynamic-resolution [target_ms], D key toggles it
+static bool dynamic_resolution;
+static float dynamic_resolution_target_ms;
+
+
+/*
+ * Has to be called when draws are added or removed, draw list is baked into recorded command buffers.
+ * Transforms live in the scene and reach the gpu through instances, so moving things doesn't need it
+ */
+void gameBuildDrawList() {
+    mat4t model_matrix = linal_mat4t_identity;
+
+    drawListClear(&draw_list);
+    size_t draws = stress_instances > 0 ? stress_draws : 1;
+    for (size_t i=0; i<draws; ++i) {
+        uint32_t first_instance = instances.len * i / draws;
+        uint32_t end_instance = instances.len * (i + 1) / draws;
+        float shade = 0.5f + 0.5f * (float)(i % 8) / 7.0f;
+
+        drawListPush(&draw_list, (RenderObject) {
+            model_matrix,
+            draws == 1 ? (vec4){1, 1, 1, 1} : (vec4){shade, 1, shade, 1},
+            teapot_mesh,
+            first_instance,
+            end_instance - first_instance
+        });
+    }
 
+    vulkanInvalidateCommandBuffers(&vulkan);
+}
+
+/* Stress scene is a cube of small teapots in front of the camera. Instance data is filled in by gameSyncScene */
+void gameBuildInstances() {
+    instanceListClear(&instances);
+    sceneClear(&scene);
+    model_root = sceneCreateNode(&scene, (SceneHandle){SCENE_NONE, 0}, (vec3){0, 0, 0}, (quaternion){0, 0, 0, 1}, 1, (vec4){0, 0, 0, 0}, SCENE_NONE);
+    vec4 bounds = mesh_pool.meshes[teapot_mesh].bounds;
+
+    if (stress_instances == 0) {
+        instanceListPush(&instances, (InstanceData){0});
+        sceneCreateNode(&scene, model_root, (vec3){0, 0, 0}, (quaternion){0, 0, 0, 1}, 1, bounds, 0);
+    } else {
+        const float spacing = 8.0f;
+        const float start_z = 50.0f;
+
+        size_t side = (size_t)ceil(cbrt((double)stress_instances));
+        float half_side = (side - 1) * spacing / 2.0f;
+        for (size_t i=0; i<stress_instances; ++i) {
+            size_t x = i % side;
+            size_t y = (i / side) % side;
+            size_t z = i / (side * side);
+
+            quaternion orientation = quat_from_angle_axis((float)(i % 16) / 16.0f, (vec3){0, 1, 0});
+            vec3 position = (vec3){x * spacing - half_side, y * spacing - half_side, start_z + z * spacing};
+            instanceListPush(&instances, (InstanceData){0});
+            sceneCreateNode(&scene, model_root, position, orientation, 0.1f, bounds, (uint32_t)i);
+        }
+    }
+
+    instanceBufferMarkDirty(&vulkan.instance_buffer);
+}
+
+void gameWriteInstancesJob(void *data, uint32_t begin, uint32_t end) {
+    (void)data;
+    for (uint32_t i=begin; i<end; ++i) {
+        uint32_t node = scene.changed[i];
+        uint32_t instance = scene.user[node];
+        if (instance != SCENE_NONE) {
+            instances.data[instance] = (InstanceData){scene.world_orientation[node], scene.world_position[node], scene.world_scale[node]};
+        }
+    }
+}
+
+/* Propagates scene edits, only instances whose world transform changed are written and uploaded */
+void gameSyncScene() {
+    sceneUpdate(&scene);
+
+    // moving the whole stress scene touches every instance, that is spread over the workers
+    JobCounter counter = {0};
+    jobsParallelFor(jobs, gameWriteInstancesJob, NULL, scene.changed_len, SCENE_SYNC_GRAIN, &counter);
+    jobsWait(jobs, &counter);
+
+    // changed is reused for the instance indices, the node indices are not needed after this
+    uint32_t changed_instances = 0;
+    for (uint32_t i=0; i<scene.changed_len; ++i) {
+        uint32_t instance = scene.user[scene.changed[i]];
+        if (instance != SCENE_NONE) {
+            scene.changed[changed_instances++] = instance;
+        }
+    }
+    scene.changed_len = 0;
+
+    if (changed_instances > 0) {
+        instanceBufferMarkChanged(&vulkan.instance_buffer, scene.changed, changed_instances, (uint32_t)vulkan.swapchain.imageCount);
+    }
+}
+
+/* Input thread side of the queue, a full queue keeps the delta and sends it along with the next one */
+void gameQueueInput(FrameInput event) {
+    unqueued_input.camera_pitch += event.camera_pitch;
+    unqueued_input.camera_yaw += event.camera_yaw;
+    unqueued_input.camera_forward += event.camera_forward;
+    unqueued_input.model_pitch += event.model_pitch;
+    unqueued_input.model_yaw += event.model_yaw;
+    if (inputQueuePush(&input_queue, unqueued_input)) {
+        unqueued_input = (FrameInput){0};
+    }
+}
 
 void gameUpdateModelDirection() {
     if (!is_mouse_clicked) {
@@ -74,8 +307,10 @@ void gameUpdateModelDirection() {
     quaternion x_diff = quat_lerp(min_x, max_x, tx);
     quaternion y_diff = quat_lerp(min_y, max_y, ty);
 
-    model.orientation = quat_mult(model.orientation, x_diff);
-    model.orientation = quat_mult(model.orientation, y_diff);
+    quaternion orientation = sceneOrientation(&scene, model_root);
+    orientation = quat_mult(orientation, x_diff);
+    orientation = quat_mult(orientation, y_diff);
+    sceneSetOrientation(&scene, model_root, orientation);
     
     last_mouse_position.x = (float) x;
     last_mouse_position.y = (float) y;
@@ -91,11 +326,7 @@ void gameUpdateModelDirection() {
     float angle_x = -(y - last_mouse_position.y) / (float)WINDOW_HEIGHT * rotations_per_screen;
     float angle_y = (x - last_mouse_position.x) / (float)WINDOW_WIDTH * rotations_per_screen;
     
-    quaternion x_diff = quat_from_angle_axis(angle_x, (vec3){1, 0, 0});
-    quaternion y_diff = quat_from_angle_axis(angle_y, (vec3){0, 1, 0});
-
-    model.orientation = quat_mult(model.orientation, x_diff);
-    model.orientation = quat_mult(model.orientation, y_diff);
+    gameQueueInput((FrameInput){0, 0, 0, angle_x, angle_y});
     
     last_mouse_position.x = (float) x;
     last_mouse_position.y = (float) y;
@@ -110,41 +341,83 @@ void gameUpdateCameraPosition() {
 
 #endif
 
-void gameUpdateCameraDirection() {
-    /* in our world x and y are swaped*/
-    
-    if (!is_mouse_clicked) {
-        return;
+/* Replayed log wins over the benchmark script, queued live input is used only when neither is there */
+FrameInput gameTickInput(uint64_t tick) {
+    FrameInput input = inputQueueDrain(&input_queue);
+
+    if (input_replay) {
+        // past the end of the log nothing moves
+        input = tick < input_log.len ? input_log.data[tick] : (FrameInput){0};
+    } else if (benchmark_mode) {
+        input = benchmarkScriptInput(tick);
+    } else if (input_record_path != NULL) {
+        inputLogPush(&input_log, input);
     }
-    const float rotations_per_screen = 0.5;
+    return input;
+}
 
-    double x;
-    double y;
-    
-    glfwGetCursorPos(window, &x, &y); 
-    float angle_x = -(y - last_mouse_position.y) / (float)WINDOW_HEIGHT * rotations_per_screen;
-    float angle_y = -(x - last_mouse_position.x) / (float)WINDOW_WIDTH * rotations_per_screen;
+void gameApplyInput(SimState *state, FrameInput input) {
+    fps_camera_rotate(&state->camera, input.camera_pitch, input.camera_yaw);
+    state->camera.position.z += input.camera_forward;
 
-    fps_camera_rotate(&camera, angle_x, angle_y);
+    if (input.model_pitch != 0.0f || input.model_yaw != 0.0f) {
+        state->model_orientation = quat_mult(state->model_orientation, quat_from_angle_axis(input.model_pitch, (vec3){1, 0, 0}));
+        state->model_orientation = quat_mult(state->model_orientation, quat_from_angle_axis(input.model_yaw, (vec3){0, 1, 0}));
+    }
+}
 
-    last_mouse_position.x = (float) x;
-    last_mouse_position.y = (float) y;
+/* Simulation thread's tick, or the render thread's when there is no simulation thread */
+void gameSimTick(void *user, uint64_t tick, double time) {
+    (void)user;
+    SimSnapshot *snapshot = &sim_snapshots[sim_buffer.back];
+    snapshot->previous = sim_state;
+    gameApplyInput(&sim_state, gameTickInput(tick));
+    snapshot->current = sim_state;
+    snapshot->time = time;
+    tripleBufferPublish(&sim_buffer);
+}
+
+/*
+ * State to render. The threaded simulation is shown a tick late, blended between its last two ticks by how far
+ * into the next tick we are, so motion stays smooth however render and tick rates line up
+ */
+SimState gameSimulate(double now) {
+    if (simulation == NULL) {
+        gameSimTick(NULL, game_frame, now);
+    }
+
+    bool fresh;
+    SimSnapshot snapshot = sim_snapshots[tripleBufferAcquire(&sim_buffer, &fresh)];
+    if (simulation == NULL) {
+        return snapshot.current;
+    }
+
+    float t = (float)((now - snapshot.time) * sim_rate);
+    t = t < 0.0f ? 0.0f : (t > 1.0f ? 1.0f : t);
+
+    SimState state;
+    state.camera.position = vec3_lerp(snapshot.previous.camera.position, snapshot.current.camera.position, t);
+    state.camera.direction = quat_nlerp(snapshot.previous.camera.direction, snapshot.current.camera.direction, t);
+    state.model_orientation = quat_nlerp(snapshot.previous.model_orientation, snapshot.current.model_orientation, t);
+    return state;
+}
+
+/* Model root is dirtied only when the orientation actually changed, a still scene uploads nothing */
+void gameShowModel(quaternion orientation) {
+    quaternion shown = sceneOrientation(&scene, model_root);
+    if (memcmp(&shown, &orientation, sizeof(quaternion)) != 0) {
+        sceneSetOrientation(&scene, model_root, orientation);
+    }
 }
 
 /* @SPEED: view and projection matrices are recomputed on each frame */
-void gameUpdateUniformBuffer(UniformBuffer uniform, clock_t game_start) {
+void gameUpdateUniformBuffer(UniformBuffer uniform, uint32_t image_index, double game_start) {
 #if 0 /* currently unused */
-    clock_t now = clock();
-
-    float diff_seconds = (now - game_start) / (float)CLOCKS_PER_SEC;
+    float diff_seconds = (float)(monotonicSeconds() - game_start);
 #endif
+    (void)game_start;
     Ubo ubo;
 
-    ubo.model = quat_to_mat4t(model.orientation);
-    ubo.model.m[3][0] = model.position.x;
-    ubo.model.m[3][1] = model.position.y;
-    ubo.model.m[3][2] = model.position.z;
-
     mat4t view_inv = quat_to_mat4t(camera.direction);
     view_inv.m[3][0] = camera.position.x;
     view_inv.m[3][1] = camera.position.y;
@@ -159,86 +432,245 @@ void gameUpdateUniformBuffer(UniformBuffer uniform, clock_t game_start) {
 #endif
 
     ubo.projection = linal_mat4t_frustum(15.0f, 1000.0f, -15.0f, 15.0f, -15.0f, 15.0f);
-    memcpy(uniform.mapped_memory, &ubo, sizeof(Ubo)); 
+    memcpy(uniformBufferSlot(uniform, image_index), &ubo, sizeof(Ubo)); 
 }
 
 
 // @TODO: I should compose SyncObjects with something else
-VkResult gameDrawFrame(Vulkan *vulkan, clock_t start_time) {
-    vkWaitForFences(vulkan->device, 1, &vulkan->sync.inFlight, VK_TRUE, UINT64_MAX);
+VkResult gameDrawFrame(Vulkan *vulkan, double start_time) {
+    SyncObjects sync = vulkan->sync[vulkan->current_frame];
+
+    TRACE_BEGIN(wait_zone, "wait frame fence");
+    vkWaitForFences(vulkan->device, 1, &sync.inFlight, VK_TRUE, UINT64_MAX);
+    vulkanCollectRetired(vulkan);
+    TRACE_END(wait_zone);
+    // pipelines rebuilt by the shader watcher are swapped in between frames
+    vulkanApplyShaderReload(vulkan);
+    // finished variant builds are picked up, newly asked for ones go out to the workers
+    vulkanUpdatePipelineVariants(vulkan);
     VkResult res;
 
     uint32_t image_index;
-    res = vkAcquireNextImageKHR(vulkan->device, vulkan->swapchain.swapchain, UINT64_MAX, vulkan->sync.imageAvailable, VK_NULL_HANDLE, &image_index);
-    if (res == VK_ERROR_OUT_OF_DATE_KHR) {
-        return res; 
-    } 
+    if (vulkan->headless) {
+        // there is an offscreen image per frame in flight
+        image_index = vulkan->current_frame;
+    } else {
+        TRACE_BEGIN(acquire_zone, "acquire");
+        res = vkAcquireNextImageKHR(vulkan->device, vulkan->swapchain.swapchain, UINT64_MAX, sync.imageAvailable, VK_NULL_HANDLE, &image_index);
+        TRACE_END(acquire_zone);
+        if (res == VK_ERROR_OUT_OF_DATE_KHR) {
+            return res; 
+        } 
+    }
+
+    // image may still be used by the other frame in flight, its command buffer and ubo slot are not ours yet
+    if (vulkan->images_in_flight[image_index] != VK_NULL_HANDLE) {
+        TRACE_BEGIN(zone, "wait image fence");
+        vkWaitForFences(vulkan->device, 1, &vulkan->images_in_flight[image_index], VK_TRUE, UINT64_MAX);
+        TRACE_END(zone);
+    }
+    // previous frame of this image is done, its queries are ready
+    vulkanProfilerCollect(vulkan, image_index);
+    float gpu_ms;
+    last_gpu_ms = -1.0;
+    if (vulkanReadGpuFrameTime(vulkan, image_index, &gpu_ms)) {
+        vulkanUpdateDynamicResolution(vulkan, gpu_ms);
+        framePacerGpuTime(&pacer, gpu_ms);
+        last_gpu_ms = gpu_ms;
+    }
+    vulkan->images_in_flight[image_index] = sync.inFlight;
+
+    vkResetFences(vulkan->device, 1, &sync.inFlight);
 
-    vkResetFences(vulkan->device, 1, &vulkan->sync.inFlight);
- 
     /* game state apdate */ {
-        gameUpdateCameraDirection();
+        TRACE_BEGIN(zone, "update");
+        SimState state = gameSimulate(monotonicSeconds());
+        camera = state.camera;
+        gameShowModel(state.model_orientation);
+        gameSyncScene();
+        instanceBufferUpload(&vulkan->instance_buffer, image_index, instances);
+        game_frame += 1;
         //gameUpdateCameraPosition();
-        gameUpdateUniformBuffer(vulkan->uniform_buffer, start_time);
+        gameUpdateUniformBuffer(vulkan->uniform_buffer, image_index, start_time);
+        TRACE_END(zone);
     }
 
-    vkResetCommandBuffer(vulkan->command_buffer, 0);
-    vulkanRecordCommandBuffer(vulkan->command_buffer, vulkan->swapchain, vulkan->pipeline, vulkan->pipeline_layout.layout, vulkan->vertex_buffer, vulkan->uniform_buffer, image_index, model.vertices_len);
+    VkCommandBuffer command_buffer = vulkan->command_buffers[image_index];
+    if (!vulkan->settings.reuse_command_buffers || !vulkan->command_buffers_recorded[image_index]) {
+        TRACE_BEGIN(zone, "record");
+        vkResetCommandBuffer(command_buffer, 0);
+        vulkanRecordCommandBuffer(vulkan, command_buffer, image_index, draw_list);
+        vulkan->command_buffers_recorded[image_index] = vulkan->settings.reuse_command_buffers;
+        TRACE_END(zone);
+    }
 
     
     VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
     VkSubmitInfo submit_info = {0};
     submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submit_info.waitSemaphoreCount = 1;
-    submit_info.pWaitSemaphores = &vulkan->sync.imageAvailable;
+    submit_info.waitSemaphoreCount = vulkan->headless ? 0 : 1;
+    submit_info.pWaitSemaphores = &sync.imageAvailable;
     submit_info.pWaitDstStageMask = &wait_stage;
     submit_info.commandBufferCount = 1;
-    submit_info.pCommandBuffers = &vulkan->command_buffer;
-    submit_info.signalSemaphoreCount = 1;
-    submit_info.pSignalSemaphores = &vulkan->sync.renderFinished;
+    submit_info.pCommandBuffers = &command_buffer;
+    submit_info.signalSemaphoreCount = vulkan->headless ? 0 : 1;
+    submit_info.pSignalSemaphores = &sync.renderFinished;
 
     // Probably should return here instead of failing? I don't know API well enough
-    VK_CHECK(vkQueueSubmit(vulkan->graphics_queue, 1, &submit_info, vulkan->sync.inFlight));
+    TRACE_BEGIN(submit_zone, "submit");
+    VK_CHECK(vkQueueSubmit(vulkan->graphics_queue, 1, &submit_info, sync.inFlight));
+    TRACE_END(submit_zone);
+
+    if (vulkan->headless) {
+        vulkan->current_frame = (vulkan->current_frame + 1) % MAX_FRAMES_IN_FLIGHT;
+        return VK_SUCCESS;
+    }
     
     VkPresentInfoKHR present_info = {0};
     present_info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
     present_info.waitSemaphoreCount = 1;
-    present_info.pWaitSemaphores = &vulkan->sync.renderFinished;
+    present_info.pWaitSemaphores = &sync.renderFinished;
     present_info.swapchainCount = 1;
     present_info.pSwapchains = &vulkan->swapchain.swapchain;
     present_info.pImageIndices = &image_index;
     present_info.pResults = NULL;
 
-    return vkQueuePresentKHR(vulkan->present_queue, &present_info);
-}
+    uint64_t present_id = ++vulkan->present_id;
+    VkPresentIdKHR present_id_info = {0};
+    present_id_info.sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR;
+    present_id_info.swapchainCount = 1;
+    present_id_info.pPresentIds = &present_id;
+    if (vulkan->wait_for_present != NULL) {
+        present_info.pNext = &present_id_info;
+    }
 
+    // lets vulkanCollectRetired know when old swapchains are done presenting
+    VkFence present_fence = vulkanPresentFence(vulkan, sync);
+    VkSwapchainPresentFenceInfoEXT present_fence_info = {0};
+    present_fence_info.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_PRESENT_FENCE_INFO_EXT;
+    present_fence_info.swapchainCount = 1;
+    present_fence_info.pFences = &present_fence;
+    if (present_fence != VK_NULL_HANDLE) {
+        present_fence_info.pNext = present_info.pNext;
+        present_info.pNext = &present_fence_info;
+    }
 
-// @TODO: make smooth window resizing, as for now it is terrible
-static void framebufferResizeCallback(GLFWwindow *window, int width, int height) {
-    (void)window;
-    (void)width;
-    (void)height;
-    /*
-    vkDeviceWaitIdle(device);
+    vulkan->current_frame = (vulkan->current_frame + 1) % MAX_FRAMES_IN_FLIGHT;
+    TRACE_BEGIN(present_zone, "present");
+    res = vkQueuePresentKHR(vulkan->present_queue, &present_info);
+    TRACE_END(present_zone);
+    framePacerPresented(&pacer, present_id, monotonicSeconds());
+    return res;
+}
 
-    freeSwapchain(device, swapchain);
-    
-    swapchain = vulkanInitSwapchain(gpu,device, surface, window); 
-    vulkanSwapchainCreateRenderPass(device, &swapchain);
-    vulkanSwapchainCreateFramebuffers(device, &swapchain); 
-    */
-    
-    gameDrawFrame(
-        &vulkan, 
-        start_time
-    );
 
-    /*
+/* Draws a frame and recreates the swapchain when it no longer matches the window */
+void gameFrame(GLFWwindow *window) {
+    TRACE_BEGIN(frame_zone, "frame");
+    VkResult res = gameDrawFrame(&vulkan, start_time);
+    TRACE_END(frame_zone);
+
+    if (res == VK_ERROR_OUT_OF_DATE_KHR || res == VK_SUBOPTIMAL_KHR) {
+        TRACE_BEGIN(zone, "recreate swapchain");
+        vulkanRecreateSwapchain(&vulkan, window);
+        TRACE_END(zone);
+        return;
+    }
     if (res != VK_SUCCESS) {
-        fprintf(stderr, "Failed to draw frame after resize");
+        fprintf(stderr, "Failed to accuire next image. Error code: %d", res);
         exit(1);
     }
-    */
+}
+
+
+/*
+ * Runs right before input is sampled. Frame cap sleeps first. Low latency mode waits for the frame slot's fence here instead of
+ * in gameDrawFrame, and with present wait also sleeps until the latest start that still makes the next vblank
+ */
+void gamePaceFrame() {
+    framePacerWaitForCap(&pacer);
+    if (!pacer.low_latency) {
+        return;
+    }
+
+    TRACE_BEGIN(zone, "pace frame");
+    vkWaitForFences(vulkan.device, 1, &vulkan.sync[vulkan.current_frame].inFlight, VK_TRUE, UINT64_MAX);
+    // occluded windows may never display anything, so the wait is bounded
+    if (vulkanWaitForPresent(&vulkan, vulkan.present_id, 100 * 1000 * 1000)) {
+        framePacerDisplayed(&pacer, vulkan.present_id, monotonicSeconds());
+        framePacerSleepUntil(framePacerLowLatencyDeadline(&pacer));
+    }
+    TRACE_END(zone);
+}
+
+
+/* 
+ * Windows doesn't return from glfwPollEvents while the window is being resized, so frames are drawn from here.
+ * Recreation doesn't wait for the device, so doing it on every size change is fine
+ */
+static void framebufferResizeCallback(GLFWwindow *window, int width, int height) {
+    // minimized, main loop waits until the window has a size again
+    if (width == 0 || height == 0) {
+        return;
+    }
+
+    vulkanRecreateSwapchain(&vulkan, window);
+    gameFrame(window);
+}
+
+/* off, fxaa or msaa2/4/8, "s" at the end of MSAA turns on sample shading(msaa4s) */
+bool gameParseAntiAliasing(const char *name, AntiAliasing *out) {
+    if (strcmp(name, "off") == 0) {
+        *out = (AntiAliasing){ANTI_ALIASING_OFF, VK_SAMPLE_COUNT_1_BIT, false};
+        return true;
+    }
+    if (strcmp(name, "fxaa") == 0) {
+        *out = (AntiAliasing){ANTI_ALIASING_FXAA, VK_SAMPLE_COUNT_1_BIT, false};
+        return true;
+    }
+
+    unsigned samples = 0;
+    char shading = 0;
+    int matched = sscanf(name, "msaa%u%c", &samples, &shading);
+    if (matched < 1 || (samples != 2 && samples != 4 && samples != 8) || (matched == 2 && shading != 's')) {
+        return false;
+    }
+    *out = (AntiAliasing){ANTI_ALIASING_MSAA, (VkSampleCountFlagBits)samples, matched == 2};
+    return true;
+}
+
+void gameWriteTrace() {
+#if TRACE_ENABLED
+    const char *path = trace_path != NULL ? trace_path : "trace.json";
+    if (traceWriteChromeJson(path)) {
+        fprintf(stderr, "INFO: Cpu trace is written to %s\n", path);
+    } else {
+        fprintf(stderr, "ERROR: Failed to write %s\n", path);
+    }
+#else
+    fprintf(stderr, "INFO: Tracing is compiled out, build without RELEASE_MODE or with TRACE_IN_RELEASE\n");
+#endif
+}
+
+void gamePrintGpuProfile() {
+    GpuProfileRow rows[GPU_PROFILER_MAX_SCOPES];
+    uint32_t count = vulkanProfilerTable(&vulkan, rows, GPU_PROFILER_MAX_SCOPES);
+    if (count == 0) {
+        fprintf(stderr, "INFO: Gpu profile is empty\n");
+        return;
+    }
+
+    fprintf(stderr, "INFO: Gpu profile over the last %d frames(ms min/avg/max):\n", GPU_PROFILER_HISTORY);
+    for (uint32_t i=0; i<count; ++i) {
+        GpuProfileRow row = rows[i];
+        fprintf(stderr, "    %-10s %8.3f %8.3f %8.3f", row.name, row.min_ms, row.avg_ms, row.max_ms);
+        if (row.has_statistics) {
+            fprintf(stderr, "  vs: %llu, clip in: %llu, clip out: %llu, fs: %llu",
+                (unsigned long long)row.vertex_invocations, (unsigned long long)row.clipping_invocations,
+                (unsigned long long)row.clipping_primitives, (unsigned long long)row.fragment_invocations);
+        }
+        fprintf(stderr, "\n");
+    }
 }
 
 void keyCallback(
@@ -259,7 +691,7 @@ void keyCallback(
         //camera.distance += 5.0f;
         //gameUpdateCameraPosition();
         //
-        camera.position.z += 5.0;
+        gameQueueInput((FrameInput){0, 0, 5.0f, 0, 0});
         return;
     }
 
@@ -268,7 +700,99 @@ void keyCallback(
         //camera.distance -= 5.0f;
         //gameUpdateCameraPosition();
         //
-        camera.position.z -= 5.0;
+        gameQueueInput((FrameInput){0, 0, -5.0f, 0, 0});
+        return;
+    }
+
+    if (key == GLFW_KEY_G && action == GLFW_PRESS) {
+        vulkan.settings.gpu_driven = !vulkan.settings.gpu_driven;
+        vulkanInvalidateCommandBuffers(&vulkan);
+        fprintf(stderr, "INFO: Gpu driven rendering: %d(supported: %d)\n", vulkan.settings.gpu_driven, vulkan.gpu_driven.supported);
+        return;
+    }
+
+    if (key == GLFW_KEY_B && action == GLFW_PRESS) {
+        vulkan.settings.bindless = !vulkan.settings.bindless;
+        vulkanInvalidateCommandBuffers(&vulkan);
+        fprintf(stderr, "INFO: Bindless tables: %d(created: %d)\n", vulkan.settings.bindless, vulkan.bindless.created);
+        return;
+    }
+
+    if (key == GLFW_KEY_X && action == GLFW_PRESS) {
+        vulkan.settings.vertex_pulling = !vulkan.settings.vertex_pulling;
+        vulkanInvalidateCommandBuffers(&vulkan);
+        fprintf(stderr, "INFO: Vertex pulling: %d(created: %d)\n", vulkan.settings.vertex_pulling, vulkan.pulling.created);
+        return;
+    }
+
+    if (key == GLFW_KEY_K && action == GLFW_PRESS) {
+        vulkan.settings.cluster_culling = !vulkan.settings.cluster_culling;
+        vulkanInvalidateCommandBuffers(&vulkan);
+        fprintf(stderr, "INFO: Cluster culling: %d(created: %d)\n", vulkan.settings.cluster_culling, vulkan.clusters.created);
+        return;
+    }
+
+    if (key == GLFW_KEY_N && action == GLFW_PRESS) {
+        vulkan.settings.mesh_shaders = !vulkan.settings.mesh_shaders;
+        vulkanInvalidateCommandBuffers(&vulkan);
+        fprintf(stderr, "INFO: Mesh shaders: %d(supported: %d)\n", vulkan.settings.mesh_shaders, vulkan.clusters.mesh_shaders);
+        return;
+    }
+
+    if (key == GLFW_KEY_F && action == GLFW_PRESS) {
+        shading = (shading + 1) % (sizeof shading_names / sizeof(const char *));
+        vulkan.settings.scene_variant = shading_variants[shading];
+        vulkanInvalidateCommandBuffers(&vulkan);
+        fprintf(stderr, "INFO: Shading: %s\n", shading_names[shading]);
+        return;
+    }
+
+    if (key == GLFW_KEY_T && action == GLFW_PRESS) {
+        vulkan.settings.parallel_recording = !vulkan.settings.parallel_recording;
+        vulkanInvalidateCommandBuffers(&vulkan);
+        fprintf(stderr, "INFO: Parallel recording: %d(slices: %u, job workers: %u)\n", vulkan.settings.parallel_recording, record_threads, jobs->thread_count);
+        return;
+    }
+
+    if (key == GLFW_KEY_M && action == GLFW_PRESS) {
+        aa_preset = (aa_preset + 1) % (sizeof aa_presets / sizeof(const char *));
+        AntiAliasing aa;
+        gameParseAntiAliasing(aa_presets[aa_preset], &aa);
+        vulkanSetAntiAliasing(&vulkan, aa);
+        return;
+    }
+
+    if (key == GLFW_KEY_D && action == GLFW_PRESS) {
+        vulkanSetDynamicResolution(&vulkan, !vulkan.settings.dynamic_resolution);
+        return;
+    }
+
+    if (key == GLFW_KEY_P && action == GLFW_PRESS) {
+        gamePrintGpuProfile();
+        return;
+    }
+
+    if (key == GLFW_KEY_V && action == GLFW_PRESS) {
+        present_mode_index = (present_mode_index + 1) % (sizeof present_modes / sizeof(VkPresentModeKHR));
+        vulkanSetPresentMode(&vulkan, window, present_modes[present_mode_index]);
+        return;
+    }
+
+    if (key == GLFW_KEY_L && action == GLFW_PRESS) {
+        pacer.low_latency = !pacer.low_latency;
+        fprintf(stderr, "INFO: Low latency mode: %d(present wait: %d)\n", pacer.low_latency, vulkan.wait_for_present != NULL);
+        return;
+    }
+
+    if (key == GLFW_KEY_C && action == GLFW_PRESS) {
+        gameWriteTrace();
+        return;
+    }
+
+    if (key == GLFW_KEY_R && action == GLFW_PRESS) {
+        vulkan.settings.reuse_command_buffers = !vulkan.settings.reuse_command_buffers;
+        vulkanInvalidateCommandBuffers(&vulkan);
+        fprintf(stderr, "INFO: Reusing recorded command buffers: %d\n", vulkan.settings.reuse_command_buffers);
         return;
     }
     
@@ -296,57 +820,405 @@ void mouseButtonCallback(
     }
 }
 
-int main() {
-    // @LEAK
-    /* reading teapot data */ {
-        vec3 *raw_teapot_vert = readVerticesFromFile("assets/teapot_bezier2.tris", &model.vertices_len);
-        if (raw_teapot_vert == NULL) {
-            fprintf(stderr, "ERROR: failed to load teapot vertices\n");
-            exit(1);
-        }
+/* Camera look, in our world x and y are swaped */
+void cursorPositionCallback(GLFWwindow *window, double x, double y) {
+    (void) window;
 
-        /* some scaling */
-        for (size_t i=0;i<model.vertices_len;++i) {
-            raw_teapot_vert[i] = vec3_scale(raw_teapot_vert[i], 10);
-            raw_teapot_vert[i].y = -raw_teapot_vert[i].y;
-        }
+    if (!is_mouse_clicked) {
+        return;
+    }
+    const float rotations_per_screen = 0.5;
+
+    FrameInput event = {0};
+    event.camera_pitch = -(y - last_mouse_position.y) / (float)WINDOW_HEIGHT * rotations_per_screen;
+    event.camera_yaw = -(x - last_mouse_position.x) / (float)WINDOW_WIDTH * rotations_per_screen;
+    gameQueueInput(event);
+
+    last_mouse_position.x = (float) x;
+    last_mouse_position.y = (float) y;
+}
+
+/* Missing lod files are skipped, max_distance is in object radii */
+typedef struct {
+    const char *filename;
+    float max_distance;
+    Vertex *vertices; // NULL if the file is not there
+    size_t vertices_len;
+} TeapotLod;
+
+Vertex *gameReadTeapotLod(const char *filename, size_t *out_len) {
+    size_t vertices_len;
+    vec3 *raw_teapot_vert = readVerticesFromFile(filename, &vertices_len);
+    if (raw_teapot_vert == NULL) {
+        fprintf(stderr, "INFO: teapot lod(%s) is not loaded, skipping\n", filename);
+        return NULL;
+    }
+
+    /* some scaling */
+    for (size_t i=0;i<vertices_len;++i) {
+        raw_teapot_vert[i] = vec3_scale(raw_teapot_vert[i], 10);
+        raw_teapot_vert[i].y = -raw_teapot_vert[i].y;
+    }
 
-        /* centering the model */
-        float miny = FLT_MAX;
-        float maxy = 0.0;
+    /* centering the model */
+    float miny = FLT_MAX;
+    float maxy = 0.0;
 
-        for (size_t i=0;i<model.vertices_len;++i) {
-            vec3 v = raw_teapot_vert[i];
-            miny = v.y < miny ? v.y : miny; 
-            maxy = v.y > maxy ? v.y : maxy;
+    for (size_t i=0;i<vertices_len;++i) {
+        vec3 v = raw_teapot_vert[i];
+        miny = v.y < miny ? v.y : miny; 
+        maxy = v.y > maxy ? v.y : maxy;
+    }
+
+    vec3 mids = {0, (maxy - miny)/2.0, 0};
+
+    Vertex *vertices = malloc(vertices_len * sizeof(Vertex));
+    if (vertices == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate memory for teapot vertices");
+        exit(1);
+    }
+
+    for (size_t i=0; i<vertices_len; ++i) {
+        if (i % 9 <= 2) {
+            vertices[i] = (Vertex){vec3_add(raw_teapot_vert[i], mids), (vec4){1, 1, 1, 1}};
+        } else if (i % 9 <= 5) {
+            vertices[i] = (Vertex){vec3_add(raw_teapot_vert[i], mids), (vec4){1, 1, 0, 1}}; 
+        } else {
+            vertices[i] = (Vertex){vec3_add(raw_teapot_vert[i], mids), (vec4){0, 0, 1, 1}};
         }
+    } 
+
+    free(raw_teapot_vert);
+    *out_len = vertices_len;
+    return vertices;
+}
+
+/* Parsing is independent per file and runs as a job, lods go into the mesh pool in order afterwards */
+void gameLoadTeapotLodJob(void *data, uint32_t begin, uint32_t end) {
+    TeapotLod *lods = data;
+    for (uint32_t lod=begin; lod<end; ++lod) {
+        TRACE_BEGIN(zone, "parse lod");
+        lods[lod].vertices = gameReadTeapotLod(lods[lod].filename, &lods[lod].vertices_len);
+        TRACE_END(zone);
+    }
+}
 
-        vec3 mids = {0, (maxy - miny)/2.0, 0};
     
-        model.vertices = malloc(model.vertices_len * sizeof(Vertex));
-        if (model.vertices == NULL) {
-            fprintf(stderr, "ERROR: failed to allocate memory for teapot vertices");
+typedef struct {
+    double start;
+    double last_frame;
+    double worst_frame;
+    size_t frames;
+} FrameStats;
+
+/* Call once per frame, prints average and worst frame time once a second */
+void frameStatsTick(FrameStats *stats) {
+    double now = monotonicSeconds();
+    if (stats->start == 0.0) {
+        stats->start = now;
+        stats->last_frame = now;
+        return;
+    }
+
+    double frame_time = now - stats->last_frame;
+    stats->last_frame = now;
+    stats->worst_frame = frame_time > stats->worst_frame ? frame_time : stats->worst_frame;
+    stats->frames += 1;
+
+    if (now - stats->start >= 1.0) {
+        double average = (now - stats->start) / stats->frames;
+        fprintf(stderr, "INFO: %zu instances: %.3f ms/frame average, %.3f ms worst, %.1f fps\n", instances.len, average * 1000.0, stats->worst_frame * 1000.0, 1.0 / average);
+        stats->start = now;
+        stats->worst_frame = 0.0;
+        stats->frames = 0;
+    }
+}
+
+/* Whole process, record workers and driver threads included */
+double gameCpuSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Call after every frame, a frame that wasn't drawn(swapchain was recreated instead) is not sampled */
+void gameBenchmarkTick() {
+    static size_t seen_frame;
+    static double last_time;
+    static double last_cpu;
+
+    double now = monotonicSeconds();
+    double cpu = gameCpuSeconds();
+    if (seen_frame != 0 && game_frame != seen_frame) {
+        benchmarkAddFrame(&benchmark, game_frame - 1, (now - last_time) * 1000.0, (cpu - last_cpu) * 1000.0, last_gpu_ms);
+    }
+    seen_frame = game_frame;
+    last_time = now;
+    last_cpu = cpu;
+}
+
+void gameWriteBenchmark() {
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(vulkan.gpu.device, &props);
+    const char *aa_names[] = {"off", "msaa", "fxaa"};
+    const char *cluster_path = "off";
+    if (vulkanUseClusters(&vulkan, draw_list)) {
+        cluster_path = vulkanUseMeshlets(&vulkan) ? "mesh" : "compute";
+    }
+
+    char config[1024];
+    snprintf(config, sizeof config,
+        "{\"gpu\": \"%s\", \"instances\": %zu, \"draws\": %zu, \"width\": %u, \"height\": %u, \"headless\": %s, "
+        "\"anti_aliasing\": \"%s\", \"samples\": %d, \"present_mode\": \"%s\", \"gpu_driven\": %s, \"bindless\": %s, \"vertex_pulling\": %s, \"clusters\": \"%s\", "
+        "\"record_threads\": %u, \"input\": \"%s\"}",
+        props.deviceName, instances.len, draw_list.len, vulkan.swapchain.extent.width, vulkan.swapchain.extent.height, headless ? "true" : "false",
+        aa_names[vulkan.settings.anti_aliasing.mode], vulkan.settings.anti_aliasing.samples,
+        headless ? "none" : vulkanPresentModeName(vulkan.swapchain.presentMode),
+        vulkan.settings.gpu_driven && vulkan.gpu_driven.supported ? "true" : "false",
+        vulkan.settings.bindless && vulkan.bindless.created ? "true" : "false",
+        vulkan.settings.vertex_pulling && vulkan.pulling.created ? "true" : "false", cluster_path, record_threads, input_replay ? "log" : "script");
+
+    if (!benchmarkWriteJson(benchmark_json_path, &benchmark, config)) {
+        fprintf(stderr, "ERROR: Failed to write %s\n", benchmark_json_path);
+        exit(1);
+    }
+    fprintf(stderr, "INFO: Benchmark of %zu frames is written to %s\n", benchmark.len, benchmark_json_path);
+}
+
+int main(int argc, char **argv) {
+    traceInit();
+    traceThreadName("main");
+    TRACE_BEGIN(startup_zone, "startup");
+
+    /* command line */ {
+        for (int i=1; i<argc; ++i) {
+            if (strcmp(argv[i], "--stress") == 0) {
+                stress_instances = STRESS_DEFAULT_INSTANCES;
+                if (i + 1 < argc && argv[i + 1][0] != '-') {
+                    stress_instances = strtoull(argv[++i], NULL, 10);
+                }
+                continue;
+            }
+
+            if (strcmp(argv[i], "--draws") == 0 && i + 1 < argc) {
+                stress_draws = strtoull(argv[++i], NULL, 10);
+                stress_draws = stress_draws == 0 ? 1 : stress_draws;
+                continue;
+            }
+
+            if (strcmp(argv[i], "--record-threads") == 0 && i + 1 < argc) {
+                record_threads = strtoul(argv[++i], NULL, 10);
+                continue;
+            }
+
+            if (strcmp(argv[i], "--hot-reload") == 0) {
+                hot_reload = true;
+                continue;
+            }
+
+            if (strcmp(argv[i], "--no-bindless") == 0) {
+                no_bindless = true;
+                continue;
+            }
+
+            if (strcmp(argv[i], "--vertex-pulling") == 0) {
+                vertex_pulling = true;
+                continue;
+            }
+
+            if (strcmp(argv[i], "--clusters") == 0) {
+                cluster_culling = true;
+                continue;
+            }
+
+            if (strcmp(argv[i], "--no-mesh-shaders") == 0) {
+                no_mesh_shaders = true;
+                continue;
+            }
+
+            if (strcmp(argv[i], "--sim-rate") == 0 && i + 1 < argc) {
+                sim_rate = strtod(argv[++i], NULL);
+                continue;
+            }
+
+            if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+                job_threads = strtoul(argv[++i], NULL, 10);
+                continue;
+            }
+
+            if (strcmp(argv[i], "--aa") == 0 && i + 1 < argc) {
+                const char *name = argv[++i];
+                if (!gameParseAntiAliasing(name, &requested_aa)) {
+                    fprintf(stderr, "ERROR: --aa expects off, fxaa, msaa2, msaa4 or msaa8(msaa8s for sample shading), got %s\n", name);
+                    exit(1);
+                }
+                for (size_t p=0; p<sizeof aa_presets / sizeof(const char *); ++p) {
+                    if (strcmp(aa_presets[p], name) == 0) {
+                        aa_preset = p;
+                    }
+                }
+                aa_requested = true;
+                continue;
+            }
+
+            if (strcmp(argv[i], "--shading") == 0 && i + 1 < argc) {
+                const char *name = argv[++i];
+                bool found = false;
+                for (size_t v=0; v<sizeof shading_names / sizeof(const char *); ++v) {
+                    if (strcmp(shading_names[v], name) == 0) {
+                        shading = v;
+                        found = true;
+                    }
+                }
+                if (!found) {
+                    fprintf(stderr, "ERROR: --shading expects lit, depth, wireframe, xray or culled, got %s\n", name);
+                    exit(1);
+                }
+                continue;
+            }
+
+            if (strcmp(argv[i], "--pipeline-usage") == 0 && i + 1 < argc) {
+                pipeline_usage_path = argv[++i];
+                continue;
+            }
+
+            if (strcmp(argv[i], "--dynamic-resolution") == 0) {
+                dynamic_resolution = true;
+                if (i + 1 < argc && argv[i + 1][0] != '-') {
+                    dynamic_resolution_target_ms = strtof(argv[++i], NULL);
+                }
+                continue;
+            }
+
+            if (strcmp(argv[i], "--headless") == 0) {
+                headless = true;
+                continue;
+            }
+
+            if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+                headless_frames = strtoull(argv[++i], NULL, 10);
+                continue;
+            }
+
+            if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+                if (sscanf(argv[++i], "%ux%u", &headless_width, &headless_height) != 2 || headless_width == 0 || headless_height == 0) {
+                    fprintf(stderr, "ERROR: --size expects WIDTHxHEIGHT, got %s\n", argv[i]);
+                    exit(1);
+                }
+                continue;
+            }
+
+            if (strcmp(argv[i], "--png") == 0 && i + 1 < argc) {
+                headless_png_path = argv[++i];
+                continue;
+            }
+
+            if (strcmp(argv[i], "--present-mode") == 0 && i + 1 < argc) {
+                const char *name = argv[++i];
+                present_mode_requested = false;
+                for (size_t m=0; m<sizeof present_mode_names / sizeof(const char *); ++m) {
+                    if (strcmp(present_mode_names[m], name) == 0) {
+                        present_mode_index = m;
+                        present_mode_requested = true;
+                    }
+                }
+                if (!present_mode_requested) {
+                    fprintf(stderr, "ERROR: --present-mode expects fifo, relaxed, mailbox or immediate, got %s\n", name);
+                    exit(1);
+                }
+                continue;
+            }
+
+            if (strcmp(argv[i], "--fps-cap") == 0 && i + 1 < argc) {
+                pacer.fps_cap = strtod(argv[++i], NULL);
+                continue;
+            }
+
+            if (strcmp(argv[i], "--low-latency") == 0) {
+                pacer.low_latency = true;
+                continue;
+            }
+
+            if (strcmp(argv[i], "--benchmark") == 0) {
+                benchmark_mode = true;
+                if (i + 1 < argc && argv[i + 1][0] != '-') {
+                    benchmark_frames = strtoull(argv[++i], NULL, 10);
+                }
+                continue;
+            }
+
+            if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+                benchmark_warmup = strtoull(argv[++i], NULL, 10);
+                continue;
+            }
+
+            if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+                benchmark_json_path = argv[++i];
+                continue;
+            }
+
+            if (strcmp(argv[i], "--input-log") == 0 && i + 1 < argc) {
+                const char *path = argv[++i];
+                if (!inputLogRead(path, &input_log)) {
+                    exit(1);
+                }
+                input_replay = true;
+                continue;
+            }
+
+            if (strcmp(argv[i], "--record-input") == 0 && i + 1 < argc) {
+                input_record_path = argv[++i];
+                continue;
+            }
+
+            if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+                trace_path = argv[++i];
+                continue;
+            }
+
+            fprintf(stderr, "Usage: %s [--stress [instances]] [--draws count] [--record-threads count] [--threads count] [--sim-rate hz] [--aa mode] [--dynamic-resolution [target_ms]] [--present-mode mode] [--fps-cap fps] [--low-latency] [--trace path] [--benchmark [frames] [--warmup frames] [--json path]] [--input-log path] [--record-input path] [--headless [--frames count] [--size WxH] [--png path]]\n", argv[0]);
             exit(1);
         }
 
-        for (size_t i=0; i<model.vertices_len; ++i) {
-            if (i % 9 <= 2) {
-                model.vertices[i] = (Vertex){vec3_add(raw_teapot_vert[i], mids), (vec4){1, 1, 1, 1}};
-            } else if (i % 9 <= 5) {
-                model.vertices[i] = (Vertex){vec3_add(raw_teapot_vert[i], mids), (vec4){1, 1, 0, 1}}; 
-            } else {
-                model.vertices[i] = (Vertex){vec3_add(raw_teapot_vert[i], mids), (vec4){0, 0, 1, 1}};
+        if (benchmark_mode) {
+            benchmark = benchmarkCreate(benchmark_warmup, benchmark_frames);
+            // first frame has nothing to be timed against
+            headless_frames = benchmark_warmup + benchmark_frames + 1;
+        }
+    }
+
+    jobs = jobsCreate(job_threads);
+
+    /* reading teapot data, most detailed lod first */ {
+        TRACE_BEGIN(zone, "load assets");
+        teapot_mesh = 0;
+        TeapotLod lods[] = {
+            {"assets/teapot_bezier2.tris", 15.0f, NULL, 0},
+            {"assets/teapot_bezier1.tris", 40.0f, NULL, 0},
+            {"assets/teapot_bezier0.tris", FLT_MAX, NULL, 0},
+        };
+        uint32_t lod_count = sizeof lods / sizeof(TeapotLod);
+
+        JobCounter counter = {0};
+        jobsParallelFor(jobs, gameLoadTeapotLodJob, lods, lod_count, 1, &counter);
+        jobsWait(jobs, &counter);
+
+        for (uint32_t i=0; i<lod_count; ++i) {
+            if (lods[i].vertices != NULL) {
+                meshPoolAddLod(&mesh_pool, teapot_mesh, lods[i].vertices, lods[i].vertices_len, lods[i].max_distance);
+                free(lods[i].vertices);
             }
-        } 
+        }
 
-        free(raw_teapot_vert);
+        if (mesh_pool.meshes[teapot_mesh].lod_count == 0) {
+            fprintf(stderr, "ERROR: failed to load teapot vertices\n");
+            exit(1);
+        }
+        TRACE_END(zone);
     }
 
     /* App state init */ {
-        start_time = clock(); 
-
-        model.orientation = (quaternion) {0.0, 0.0, 0.0, 0.0}; /*quat_from_angle_axis(0.125, (vec3){0.0, 0.0, 1.0}); */
-        model.position = (vec3){0.0, 0.0, 0.0};
+        start_time = monotonicSeconds();
 
         /*
         camera.direction = quat_from_angle_axis(0.0, (vec3){0.0, 0.0, 1.0});
@@ -355,9 +1227,16 @@ int main() {
 
         camera.position = VEC3(0, 0, 0);
         camera.direction = quat_from_angle_axis(0.1, (vec3){0.1, 0.0, 0.0});
+
+        sim_state = (SimState){camera, (quaternion){0, 0, 0, 1}};
+        sim_buffer = tripleBufferCreate();
+        for (size_t i=0; i<3; ++i) {
+            sim_snapshots[i] = (SimSnapshot){sim_state, sim_state, start_time};
+        }
     }
 
-    /* GLFW init */ {
+    /* GLFW init */ if (!headless) {
+        TRACE_BEGIN(zone, "create window");
         glfwInit();
         glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
         glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
@@ -372,32 +1251,159 @@ int main() {
         glfwSetFramebufferSizeCallback(window, framebufferResizeCallback);
         glfwSetKeyCallback(window, keyCallback);
         glfwSetMouseButtonCallback(window, mouseButtonCallback);
+        glfwSetCursorPosCallback(window, cursorPositionCallback);
+        TRACE_END(zone);
     }
 
     /* Vulkan init */ {
-        vulkan = vulkanCompleteInit(window, validation_layers, validation_layer_count, "shaders_out/vert.spv", "shaders_out/frag.spv");
-        vulkanCreateVertexBuffer(&vulkan, model.vertices, model.vertices_len * sizeof(Vertex));
+        TRACE_BEGIN(zone, "vulkan init");
+        if (headless) {
+            VkExtent2D extent = {headless_width, headless_height};
+            vulkan = vulkanCompleteInitHeadless(extent, validation_layers, validation_layer_count, shader_outputs[SHADER_SCENE_VERT], shader_outputs[SHADER_SCENE_FRAG], "pipeline_cache.bin");
+        } else {
+            vulkan = vulkanCompleteInit(window, validation_layers, validation_layer_count, shader_outputs[SHADER_SCENE_VERT], shader_outputs[SHADER_SCENE_FRAG], "pipeline_cache.bin");
+        }
+        vulkanUploadMeshPool(&vulkan, &mesh_pool);
+        vulkan.instance_buffer = vulkanCreateInstanceBuffer(vulkan.gpu, vulkan.device, stress_instances > 0 ? stress_instances : 1);
+        vulkanCreateGpuDriven(&vulkan, shader_outputs[SHADER_CULL], shader_outputs[SHADER_COMPACT]);
+        vulkanCreatePostProcess(&vulkan, shader_outputs[SHADER_POST_VERT], shader_outputs[SHADER_FXAA], shader_outputs[SHADER_UPSCALE]);
+        vulkanCreateBindless(&vulkan, shader_outputs[SHADER_BINDLESS_VERT]);
+        vulkan.settings.bindless = !no_bindless;
+        vulkanCreateVertexPulling(&vulkan, &mesh_pool, shader_outputs[SHADER_PULL_VERT]);
+        vulkan.settings.vertex_pulling = vertex_pulling;
+        /* Meshlets only live until they are uploaded */ {
+            MeshletPool meshlets;
+            meshletPoolBuild(&meshlets, &mesh_pool);
+            vulkanCreateClusterCulling(
+                &vulkan, &meshlets, shader_outputs[SHADER_CLUSTER_CULL], shader_outputs[SHADER_CLUSTER_VERT],
+                shader_outputs[SHADER_MESHLET_TASK], shader_outputs[SHADER_MESHLET_MESH]
+            );
+            meshletPoolFree(&meshlets);
+        }
+        vulkan.settings.cluster_culling = cluster_culling;
+        vulkan.settings.mesh_shaders = !no_mesh_shaders;
+        if (aa_requested) {
+            vulkanSetAntiAliasing(&vulkan, requested_aa);
+        }
+        if (dynamic_resolution_target_ms > 0.0f) {
+            vulkan.settings.target_frame_ms = dynamic_resolution_target_ms;
+        }
+        if (dynamic_resolution) {
+            vulkanSetDynamicResolution(&vulkan, true);
+        }
+        if (present_mode_requested) {
+            vulkanSetPresentMode(&vulkan, window, present_modes[present_mode_index]);
+        }
+        // after anti aliasing, so pre-warmed variants are built for the render pass frames start with
+        vulkanCreatePipelineVariants(&vulkan, jobs, pipeline_usage_path);
+        vulkan.settings.scene_variant = shading_variants[shading];
+        if (record_threads > 0) {
+            vulkan.recorder = vulkanCreateParallelRecorder(&vulkan, jobs, record_threads);
+            vulkan.settings.parallel_recording = true;
+        }
+        if (hot_reload) {
+            vulkanStartShaderReload(&vulkan, shader_sources, shader_outputs);
+        }
+        gameBuildInstances();
+        gameBuildDrawList();
+        TRACE_END(zone);
+    }
+    TRACE_END(startup_zone);
+
+    // frame time stats, printed once a second in stress and headless modes
+    FrameStats stats = {0};
+
+    if (headless) {
+        double headless_start = monotonicSeconds();
+        for (size_t frame=0; frame<headless_frames; ++frame) {
+            frameStatsTick(&stats);
+
+            VkResult res = gameDrawFrame(&vulkan, start_time);
+            if (res != VK_SUCCESS) {
+                fprintf(stderr, "ERROR: Failed to draw headless frame. Error code: %d", res);
+                exit(1);
+            }
+            gameBenchmarkTick();
+        }
+        vkDeviceWaitIdle(vulkan.device);
+        double headless_time = monotonicSeconds() - headless_start;
+        fprintf(stderr, "INFO: Rendered %zu frames in %.3f s, %.3f ms/frame\n", headless_frames, headless_time, headless_time * 1000.0 / (headless_frames > 0 ? headless_frames : 1));
+        gamePrintGpuProfile();
+
+        if (headless_png_path != NULL && headless_frames > 0) {
+            uint32_t last_image = (vulkan.current_frame + MAX_FRAMES_IN_FLIGHT - 1) % MAX_FRAMES_IN_FLIGHT;
+            uint8_t *pixels = vulkanReadbackImage(&vulkan, last_image);
+            if (!writePng(headless_png_path, pixels, headless_width, headless_height)) {
+                fprintf(stderr, "ERROR: Failed to write %s\n", headless_png_path);
+                exit(1);
+            }
+            fprintf(stderr, "INFO: Last frame is written to %s\n", headless_png_path);
+        }
     }
     
-    gameUpdateUniformBuffer(vulkan.uniform_buffer, start_time);
-    while(!glfwWindowShouldClose(window)) {
+    // replay and benchmark have to see the same ticks on every run, they tick per frame
+    if (!headless && !benchmark_mode && !input_replay && sim_rate > 0.0) {
+        simulation = simulationStart(sim_rate, gameSimTick, NULL);
+    }
+
+    while(!headless && !glfwWindowShouldClose(window)) {
+        if (stress_instances > 0) {
+            frameStatsTick(&stats);
+        }
+
+
+        // input is sampled as late as the pacer allows
+        gamePaceFrame();
         glfwPollEvents(); 
-        VkResult res = gameDrawFrame(
-            &vulkan, 
-            start_time
-        );
+        framePacerInputSampled(&pacer, vulkan.present_id + 1, monotonicSeconds());
 
-        if (res == VK_ERROR_OUT_OF_DATE_KHR || res == VK_SUBOPTIMAL_KHR) {
-            vulkanRecreateSwapchain(&vulkan, window);
+        int width, height;
+        glfwGetFramebufferSize(window, &width, &height);
+        if (width == 0 || height == 0) {
+            glfwWaitEvents();
             continue;
         }
-        if (res != VK_SUCCESS) {
-            fprintf(stderr, "Failed to accuire next image. Error code: %d", res);
-            exit(1);
+
+        gameFrame(window);
+        if (pacer.low_latency) {
+            framePacerReport(&pacer, monotonicSeconds());
+        }
+
+        gameBenchmarkTick();
+        if (benchmark_mode && benchmarkDone(&benchmark)) {
+            glfwSetWindowShouldClose(window, GLFW_TRUE);
         }
     }
+
+    simulationStop(simulation);
+    simulation = NULL;
+
+    if (benchmark_mode) {
+        gameWriteBenchmark();
+        benchmarkFree(&benchmark);
+    }
+    if (input_record_path != NULL) {
+        if (inputLogWrite(input_record_path, input_log)) {
+            fprintf(stderr, "INFO: Input of %zu frames is written to %s\n", input_log.len, input_record_path);
+        } else {
+            fprintf(stderr, "ERROR: Failed to write %s\n", input_record_path);
+        }
+    }
+    inputLogFree(&input_log);
     
+    drawListFree(&draw_list);
+    instanceListFree(&instances);
+    sceneFree(&scene);
+    meshPoolFree(&mesh_pool);
     vulkanFree(&vulkan);
-    glfwDestroyWindow(window);
-    glfwTerminate(); 
+    jobsFree(jobs);
+    if (!headless) {
+        glfwDestroyWindow(window);
+        glfwTerminate(); 
+    }
+
+    if (trace_path != NULL) {
+        gameWriteTrace();
+    }
+    traceFree();
 }
@@ -0,0 +1,227 @@
+/*
+ * Deterministic benchmark: camera and model are driven by FrameInput from a script or a recorded log instead of live input,
+ * measured frames come after a warm up and are summarized as json
+ */
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include "stdint.h"
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "stdbool.h"
+#include "math.h"
+
+#include "file_helpers.h"
+
+/* Everything that moves the scene during one frame. Effects are stored rather than raw mouse positions, so replay doesn't depend on window size */
+typedef struct {
+    float camera_pitch;
+    float camera_yaw;
+    float camera_forward;
+    float model_pitch;
+    float model_yaw;
+} FrameInput;
+
+typedef struct {
+    FrameInput *data;
+    size_t len;
+    size_t capacity;
+} InputLog;
+
+void inputLogPush(InputLog *log, FrameInput input) {
+    if (log->len >= log->capacity) {
+        size_t new_capacity = log->capacity == 0 ? 256 : log->capacity * 2;
+        FrameInput *new_data = realloc(log->data, new_capacity * sizeof(FrameInput));
+        if (new_data == NULL) {
+            fprintf(stderr, "ERROR: failed to allocate memory for input log");
+            exit(1);
+        }
+        log->data = new_data;
+        log->capacity = new_capacity;
+    }
+
+    log->data[log->len++] = input;
+}
+
+void inputLogFree(InputLog *log) {
+    free(log->data);
+    *log = (InputLog){0};
+}
+
+/* Text, a frame per line: camera pitch, camera yaw, camera forward, model pitch, model yaw */
+bool inputLogRead(const char *filename, InputLog *out) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        fprintf(stderr, "%s: failed to open %s\n", __FUNCTION__, filename);
+        return false;
+    }
+
+    InputLog log = {0};
+    FrameInput input;
+    while (fscanf(file, "%f %f %f %f %f", &input.camera_pitch, &input.camera_yaw, &input.camera_forward, &input.model_pitch, &input.model_yaw) == 5) {
+        inputLogPush(&log, input);
+    }
+    bool ok = feof(file);
+    fclose(file);
+
+    if (!ok) {
+        fprintf(stderr, "%s: %s is malformed after frame %zu\n", __FUNCTION__, filename, log.len);
+        inputLogFree(&log);
+        return false;
+    }
+    *out = log;
+    return true;
+}
+
+bool inputLogWrite(const char *filename, InputLog log) {
+    // 5 floats with 9 significant digits fit in 96 bytes
+    char *text = malloc(log.len * 96 + 1);
+    if (text == NULL) {
+        fprintf(stderr, "%s: failed to allocate memory\n", __FUNCTION__);
+        return false;
+    }
+
+    size_t len = 0;
+    for (size_t i=0; i<log.len; ++i) {
+        FrameInput input = log.data[i];
+        len += snprintf(text + len, 96, "%.9g %.9g %.9g %.9g %.9g\n", input.camera_pitch, input.camera_yaw, input.camera_forward, input.model_pitch, input.model_yaw);
+    }
+
+    bool result = writeEntireFileAtomic(filename, text, len);
+    free(text);
+    return result;
+}
+
+
+/* Built in path: camera sways left and right while flying back and forth, model turns every 30 frames so recording is measured too */
+FrameInput benchmarkScriptInput(size_t frame) {
+    FrameInput input = {0};
+    float t = (float)frame / 240.0f;
+    input.camera_yaw = 0.002f * sinf(t * 6.2831853f);
+    input.camera_forward = 0.5f * cosf(t * 3.1415926f);
+    if (frame % 30 == 29) {
+        input.model_yaw = 0.05f;
+    }
+    return input;
+}
+
+
+typedef struct {
+    double avg;
+    double median;
+    double p95;
+    double p99;
+    double min;
+    double max;
+} BenchmarkStats;
+
+typedef struct {
+    size_t warmup;
+    size_t frames;
+    double *frame_ms;
+    double *cpu_ms;
+    double *gpu_ms;
+    size_t len;
+    size_t gpu_len; // gpu time is a frame late and not measured without timestamps
+} Benchmark;
+
+Benchmark benchmarkCreate(size_t warmup, size_t frames) {
+    Benchmark bench = {0};
+    bench.warmup = warmup;
+    bench.frames = frames;
+    bench.frame_ms = calloc(frames + 1, sizeof(double));
+    bench.cpu_ms = calloc(frames + 1, sizeof(double));
+    bench.gpu_ms = calloc(frames + 1, sizeof(double));
+    if (bench.frame_ms == NULL || bench.cpu_ms == NULL || bench.gpu_ms == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate memory for benchmark samples");
+        exit(1);
+    }
+    return bench;
+}
+
+void benchmarkFree(Benchmark *bench) {
+    free(bench->frame_ms);
+    free(bench->cpu_ms);
+    free(bench->gpu_ms);
+    *bench = (Benchmark){0};
+}
+
+bool benchmarkDone(Benchmark *bench) {
+    return bench->len >= bench->frames;
+}
+
+/* frame is the index of the frame since start, warm up frames are skipped. gpu_ms < 0 if it wasn't measured */
+void benchmarkAddFrame(Benchmark *bench, size_t frame, double frame_ms, double cpu_ms, double gpu_ms) {
+    if (frame < bench->warmup || benchmarkDone(bench)) {
+        return;
+    }
+
+    bench->frame_ms[bench->len] = frame_ms;
+    bench->cpu_ms[bench->len] = cpu_ms;
+    bench->len += 1;
+    if (gpu_ms >= 0.0) {
+        bench->gpu_ms[bench->gpu_len++] = gpu_ms;
+    }
+}
+
+
+int benchmarkCompareDouble(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest rank percentiles, sorts samples in place */
+BenchmarkStats benchmarkStats(double *samples, size_t len) {
+    BenchmarkStats stats = {0};
+    if (len == 0) {
+        return stats;
+    }
+
+    qsort(samples, len, sizeof(double), benchmarkCompareDouble);
+    double sum = 0.0;
+    for (size_t i=0; i<len; ++i) {
+        sum += samples[i];
+    }
+
+    stats.avg = sum / len;
+    stats.median = samples[(len - 1) / 2];
+    stats.p95 = samples[(size_t)ceil(len * 0.95) - 1];
+    stats.p99 = samples[(size_t)ceil(len * 0.99) - 1];
+    stats.min = samples[0];
+    stats.max = samples[len - 1];
+    return stats;
+}
+
+
+size_t benchmarkPutStats(char *out, size_t size, const char *name, BenchmarkStats stats, size_t samples) {
+    return snprintf(out, size, "  \"%s\": {\"samples\": %zu, \"avg\": %.4f, \"median\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"min\": %.4f, \"max\": %.4f}",
+                    name, samples, stats.avg, stats.median, stats.p95, stats.p99, stats.min, stats.max);
+}
+
+/* config is a json object describing the run, written as is. Sorts the samples */
+bool benchmarkWriteJson(const char *filename, Benchmark *bench, const char *config) {
+    size_t size = strlen(config) + 4096;
+    char *json = malloc(size);
+    if (json == NULL) {
+        fprintf(stderr, "%s: failed to allocate memory\n", __FUNCTION__);
+        return false;
+    }
+
+    size_t len = 0;
+    len += snprintf(json + len, size - len, "{\n  \"config\": %s,\n  \"warmup_frames\": %zu,\n", config, bench->warmup);
+    len += benchmarkPutStats(json + len, size - len, "frame_ms", benchmarkStats(bench->frame_ms, bench->len), bench->len);
+    len += snprintf(json + len, size - len, ",\n");
+    len += benchmarkPutStats(json + len, size - len, "cpu_ms", benchmarkStats(bench->cpu_ms, bench->len), bench->len);
+    len += snprintf(json + len, size - len, ",\n");
+    len += benchmarkPutStats(json + len, size - len, "gpu_ms", benchmarkStats(bench->gpu_ms, bench->gpu_len), bench->gpu_len);
+    len += snprintf(json + len, size - len, "\n}\n");
+
+    bool result = writeEntireFileAtomic(filename, json, len);
+    free(json);
+    return result;
+}
+
+#endif /* BENCHMARK_H */
@@ -0,0 +1,89 @@
+#ifndef DRAW_LIST_H
+#define DRAW_LIST_H
+
+#include "stdlib.h"
+#include "stdio.h"
+
+#include "linal.h"
+#include "linal_quat.h"
+
+/* 
+ * Everything needed to draw one object. model goes through push constants, the rest through the object ring.
+ * Object's mesh from MeshPool is drawn instance_count times, once for every InstanceData starting from first_instance
+ */
+typedef struct {
+    mat4t model;
+    vec4 tint;
+    uint32_t mesh_index;
+    uint32_t first_instance;
+    uint32_t instance_count;
+} RenderObject;
+
+typedef struct {
+    RenderObject *data;
+    size_t len;
+    size_t capacity;
+} DrawList;
+
+/* Layout matches instance vertex binding, position and scale share one vec4 */
+typedef struct {
+    quaternion orientation;
+    vec3 position;
+    float scale;
+} InstanceData;
+
+typedef struct {
+    InstanceData *data;
+    size_t len;
+    size_t capacity;
+} InstanceList;
+
+void drawListClear(DrawList *list) {
+    list->len = 0;
+}
+
+void drawListPush(DrawList *list, RenderObject object) {
+    if (list->len >= list->capacity) {
+        size_t new_capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+        RenderObject *new_data = realloc(list->data, new_capacity * sizeof(RenderObject));
+        if (new_data == NULL) {
+            fprintf(stderr, "ERROR: failed to allocate memory for draw list");
+            exit(1);
+        }
+        list->data = new_data;
+        list->capacity = new_capacity;
+    }
+
+    list->data[list->len++] = object;
+}
+
+void drawListFree(DrawList *list) {
+    free(list->data);
+    *list = (DrawList){0};
+}
+
+void instanceListClear(InstanceList *list) {
+    list->len = 0;
+}
+
+void instanceListPush(InstanceList *list, InstanceData instance) {
+    if (list->len >= list->capacity) {
+        size_t new_capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+        InstanceData *new_data = realloc(list->data, new_capacity * sizeof(InstanceData));
+        if (new_data == NULL) {
+            fprintf(stderr, "ERROR: failed to allocate memory for instance list");
+            exit(1);
+        }
+        list->data = new_data;
+        list->capacity = new_capacity;
+    }
+
+    list->data[list->len++] = instance;
+}
+
+void instanceListFree(InstanceList *list) {
+    free(list->data);
+    *list = (InstanceList){0};
+}
+
+#endif /* DRAW_LIST_H */
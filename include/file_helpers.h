@@ -3,6 +3,15 @@
 
 #include "stdio.h"
 #include "stdbool.h"
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include "windows.h"
+// 16 bit pointer leftovers of windef.h, linal.h uses them as names
+#undef near
+#undef far
+#endif
 
 size_t fileSize(FILE *file) {
     fseek(file, 0, SEEK_END);
@@ -41,4 +50,50 @@ char *readEntireFile(const char *filename, size_t *out_size) {
     return data;
 }
 
+/* Renames tmp_filename over filename in one step, tmp_filename is removed either way */
+bool replaceFile(const char *tmp_filename, const char *filename) {
+#ifdef _WIN32
+    // rename() does not replace existing files on windows, removing the target first would lose it on a crash
+    bool renamed = MoveFileExA(tmp_filename, filename, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    bool renamed = rename(tmp_filename, filename) == 0;
+#endif
+    if (!renamed) {
+        fprintf(stderr, "%s: failed to rename %s\n", __FUNCTION__, tmp_filename);
+        remove(tmp_filename);
+        return false;
+    }
+
+    return true;
+}
+
+/* 
+ * Writes data to a temporary file next to the target and renames it over the target,
+ * so readers never see a half written file if we crash in the middle.
+ */
+bool writeEntireFileAtomic(const char *filename, const void *data, size_t size) {
+    char tmp_filename[1024];
+    int len = snprintf(tmp_filename, sizeof tmp_filename, "%s.tmp", filename);
+    if (len < 0 || (size_t)len >= sizeof tmp_filename) {
+        fprintf(stderr, "%s: file name is too long\n", __FUNCTION__);
+        return false;
+    }
+
+    FILE *file = fopen(tmp_filename, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "%s: failed to open file\n", __FUNCTION__);
+        return false;
+    }
+
+    size_t res = fwrite(data, sizeof(char), size, file);
+    bool ok = (res == size);
+    ok = (fclose(file) == 0) && ok;
+    if (!ok) {
+        remove(tmp_filename);
+        return false;
+    }
+
+    return replaceFile(tmp_filename, filename);
+}
+
 #endif /* FILE_HELPERS */
@@ -0,0 +1,206 @@
+/*
+ * Frame rate cap, low latency pacing and input to present latency.
+ * Knows nothing about vulkan: the caller reports when input was sampled, when the frame was submitted,
+ * presented and displayed. Times are seconds of monotonicSeconds
+ */
+
+#ifndef FRAME_PACING_H
+#define FRAME_PACING_H
+
+#include "stdint.h"
+#include "stdio.h"
+#include "stdbool.h"
+#include "time.h"
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include "windows.h"
+// 16 bit pointer leftovers of windef.h, linal.h uses them as names
+#undef near
+#undef far
+#endif
+
+#include "misc.h"
+
+#define FRAME_PACER_SLOTS 16 // input times of the frames that can be queued for display at once
+#define FRAME_PACER_SMOOTHING 0.1 // weight of a new sample in the running averages
+#define FRAME_PACER_MARGIN 0.002 // low latency wakes up this much earlier than predicted, missing vblank costs a whole frame
+#define FRAME_PACER_SPIN 0.002 // os sleep is too coarse for the last couple of milliseconds
+// nanosleep goes through Sleep() on mingw, which rounds up to the 15.6ms scheduler tick. Spin that long when there is no better timer
+#define FRAME_PACER_COARSE_SPIN 0.016
+
+#ifdef _WIN32
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+// NULL when the system has no high resolution timers(before windows 10 1803)
+static _Thread_local HANDLE frame_pacer_timer;
+static _Thread_local bool frame_pacer_timer_created;
+#endif
+
+typedef struct {
+    double sum;
+    double max;
+    uint32_t count;
+} FrameLatency;
+
+typedef struct {
+    double fps_cap; // 0 is uncapped
+    bool low_latency;
+    double next_frame;
+
+    // running averages, low latency mode starts input sampling so that cpu and gpu work ends right at the display deadline
+    double cpu_frame;
+    double gpu_frame;
+    double display_interval;
+    double last_display;
+    uint64_t last_display_id;
+
+    double input_time[FRAME_PACER_SLOTS];
+    // since the last report: until the present call returned, until the frame was on screen(needs present wait)
+    FrameLatency queued;
+    FrameLatency displayed;
+    double report_start;
+} FramePacer;
+
+
+/* How early framePacerSleep has to wake up to not overshoot, whatever is left is spun */
+double framePacerSpinMargin() {
+#ifdef _WIN32
+    if (!frame_pacer_timer_created) {
+        frame_pacer_timer_created = true;
+        frame_pacer_timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    }
+    return frame_pacer_timer != NULL ? FRAME_PACER_SPIN : FRAME_PACER_COARSE_SPIN;
+#else
+    return FRAME_PACER_SPIN;
+#endif
+}
+
+void framePacerSleep(double seconds) {
+#ifdef _WIN32
+    if (frame_pacer_timer != NULL) {
+        // negative is relative, in 100ns units
+        LARGE_INTEGER due;
+        due.QuadPart = -(LONGLONG)(seconds * 1e7);
+        if (SetWaitableTimer(frame_pacer_timer, &due, 0, NULL, NULL, FALSE)) {
+            WaitForSingleObject(frame_pacer_timer, INFINITE);
+        }
+        return;
+    }
+#endif
+    struct timespec ts;
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+}
+
+/* Sleeps most of the way and spins the rest, so wake up is accurate even with a coarse scheduler */
+void framePacerSleepUntil(double deadline) {
+    double spin = framePacerSpinMargin();
+    double remaining = deadline - monotonicSeconds();
+    if (remaining > spin) {
+        framePacerSleep(remaining - spin);
+    }
+
+    while (monotonicSeconds() < deadline) {
+        // spin
+    }
+}
+
+
+double framePacerAverage(double average, double sample) {
+    return average == 0.0 ? sample : average + (sample - average) * FRAME_PACER_SMOOTHING;
+}
+
+
+void frameLatencyAdd(FrameLatency *latency, double sample) {
+    latency->sum += sample;
+    latency->max = sample > latency->max ? sample : latency->max;
+    latency->count += 1;
+}
+
+
+/* Blocks until the frame cap allows the next frame, a late frame doesn't make the following ones faster */
+void framePacerWaitForCap(FramePacer *pacer) {
+    if (pacer->fps_cap <= 0.0) {
+        return;
+    }
+
+    double now = monotonicSeconds();
+    if (pacer->next_frame > now) {
+        framePacerSleepUntil(pacer->next_frame);
+        now = pacer->next_frame;
+    }
+    pacer->next_frame = now + 1.0 / pacer->fps_cap;
+}
+
+
+/* Frame frame_id was scanned out at now */
+void framePacerDisplayed(FramePacer *pacer, uint64_t frame_id, double now) {
+    if (pacer->last_display_id != 0 && frame_id > pacer->last_display_id) {
+        double interval = (now - pacer->last_display) / (frame_id - pacer->last_display_id);
+        pacer->display_interval = framePacerAverage(pacer->display_interval, interval);
+    }
+    pacer->last_display = now;
+    pacer->last_display_id = frame_id;
+
+    frameLatencyAdd(&pacer->displayed, now - pacer->input_time[frame_id % FRAME_PACER_SLOTS]);
+}
+
+
+/*
+ * When to sample input for the frame after the last displayed one: late enough that nothing waits for the display,
+ * early enough that cpu and gpu work fits before the next vblank. 0 when there is no prediction yet
+ */
+double framePacerLowLatencyDeadline(FramePacer *pacer) {
+    if (pacer->last_display_id == 0 || pacer->display_interval == 0.0) {
+        return 0.0;
+    }
+    return pacer->last_display + pacer->display_interval - pacer->cpu_frame - pacer->gpu_frame - FRAME_PACER_MARGIN;
+}
+
+
+void framePacerInputSampled(FramePacer *pacer, uint64_t frame_id, double now) {
+    pacer->input_time[frame_id % FRAME_PACER_SLOTS] = now;
+}
+
+
+void framePacerGpuTime(FramePacer *pacer, float gpu_ms) {
+    pacer->gpu_frame = framePacerAverage(pacer->gpu_frame, gpu_ms / 1000.0);
+}
+
+
+/* Frame went to vkQueuePresentKHR, cpu part of the frame ends here */
+void framePacerPresented(FramePacer *pacer, uint64_t frame_id, double now) {
+    double latency = now - pacer->input_time[frame_id % FRAME_PACER_SLOTS];
+    pacer->cpu_frame = framePacerAverage(pacer->cpu_frame, latency);
+    frameLatencyAdd(&pacer->queued, latency);
+}
+
+
+/* Prints latency once a second */
+void framePacerReport(FramePacer *pacer, double now) {
+    if (pacer->report_start == 0.0) {
+        pacer->report_start = now;
+        return;
+    }
+    if (now - pacer->report_start < 1.0 || pacer->queued.count == 0) {
+        return;
+    }
+
+    FrameLatency queued = pacer->queued;
+    fprintf(stderr, "INFO: Input to present: %.2f ms average, %.2f ms worst", queued.sum * 1000.0 / queued.count, queued.max * 1000.0);
+    FrameLatency displayed = pacer->displayed;
+    if (displayed.count > 0) {
+        fprintf(stderr, ", input to display: %.2f ms average, %.2f ms worst", displayed.sum * 1000.0 / displayed.count, displayed.max * 1000.0);
+    }
+    fprintf(stderr, "\n");
+
+    pacer->queued = (FrameLatency){0};
+    pacer->displayed = (FrameLatency){0};
+    pacer->report_start = now;
+}
+
+#endif /* FRAME_PACING_H */
@@ -0,0 +1,477 @@
+/*
+ * Job system: a worker thread per core, each with a work stealing deque(Chase-Lev).
+ * Jobs are functions over an index range, completion is tracked with counters that jobs can also depend on.
+ * The thread that created the system owns deque 0 and runs jobs while it waits, so it is never just blocked
+ */
+
+#ifndef JOBS_H
+#define JOBS_H
+
+#include "stdint.h"
+#include "stdlib.h"
+#include "stdio.h"
+#include "stdbool.h"
+#include "stdatomic.h"
+#include "pthread.h"
+#include "sched.h"
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include "windows.h"
+// 16 bit pointer leftovers of windef.h, linal.h uses them as names
+#undef near
+#undef far
+#else
+#include "unistd.h"
+#endif
+
+#include "trace.h"
+
+#define MAX_JOB_THREADS 32
+#define JOB_DEQUE_CAPACITY 4096 // per thread, a full deque runs new jobs right away
+#define JOB_MAX_DEPENDENTS 16
+#define JOB_SPINS_BEFORE_SLEEP 64
+#define JOB_BACKGROUND_CAPACITY 64
+
+typedef void (*JobFunction)(void *data, uint32_t begin, uint32_t end);
+
+typedef struct JobCounter JobCounter;
+
+typedef struct {
+    JobFunction function;
+    void *data;
+    uint32_t begin;
+    uint32_t end;
+    JobCounter *counter; // can be NULL
+} Job;
+
+/* Zero initialized is ready to use. Has to outlive every job submitted with it */
+struct JobCounter {
+    _Atomic uint32_t pending;
+    atomic_flag lock;
+    // submitted once pending drops to zero
+    Job dependents[JOB_MAX_DEPENDENTS];
+    uint32_t dependents_len;
+};
+
+typedef struct {
+    _Atomic int64_t top;
+    char padding[64]; // thieves hammer top, owner hammers bottom
+    _Atomic int64_t bottom;
+    Job jobs[JOB_DEQUE_CAPACITY];
+} JobDeque;
+
+typedef struct JobSystem JobSystem;
+
+typedef struct {
+    JobSystem *jobs;
+    uint32_t index;
+    pthread_t thread;
+} JobThread;
+
+struct JobSystem {
+    uint32_t thread_count; // workers only, the owner thread comes on top
+    JobThread threads[MAX_JOB_THREADS];
+    JobDeque *deques; // thread_count + 1, 0 is the owner's
+    _Atomic bool quit;
+
+    // idle workers sleep here, queued is the number of jobs sitting in deques
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    _Atomic uint32_t queued;
+    _Atomic uint32_t sleeping;
+
+    // long jobs(pipeline builds) that must not end up on the owner thread while it waits for frame work, only workers take them
+    pthread_mutex_t background_lock;
+    Job background[JOB_BACKGROUND_CAPACITY];
+    uint32_t background_head;
+    uint32_t background_len;
+};
+
+static _Thread_local JobSystem *job_thread_system;
+static _Thread_local uint32_t job_thread_index;
+static _Thread_local uint32_t job_thread_random;
+
+
+bool jobDequePush(JobDeque *deque, Job job) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (bottom - top >= JOB_DEQUE_CAPACITY) {
+        return false;
+    }
+
+    deque->jobs[bottom % JOB_DEQUE_CAPACITY] = job;
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+    return true;
+}
+
+/* Owner only, takes the newest job */
+bool jobDequePop(JobDeque *deque, Job *out) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return false;
+    }
+
+    *out = deque->jobs[bottom % JOB_DEQUE_CAPACITY];
+    if (top == bottom) {
+        // last job, a thief may be after it too
+        bool won = atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed);
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return won;
+    }
+    return true;
+}
+
+/* Any thread, takes the oldest job. Slot can't be reused before top moves, so the copy is intact if the exchange wins */
+bool jobDequeSteal(JobDeque *deque, Job *out) {
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) {
+        return false;
+    }
+
+    Job job = deque->jobs[top % JOB_DEQUE_CAPACITY];
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+        return false;
+    }
+    *out = job;
+    return true;
+}
+
+
+void jobsWake(JobSystem *jobs) {
+    if (atomic_load(&jobs->sleeping) > 0) {
+        pthread_mutex_lock(&jobs->mutex);
+        pthread_cond_broadcast(&jobs->wake);
+        pthread_mutex_unlock(&jobs->mutex);
+    }
+}
+
+
+/* Threads outside of the system have no deque, their jobs run right away */
+void jobsPush(JobSystem *jobs, Job job);
+
+void jobCounterLock(JobCounter *counter) {
+    while (atomic_flag_test_and_set_explicit(&counter->lock, memory_order_acquire)) {
+        // spin
+    }
+}
+
+void jobCounterUnlock(JobCounter *counter) {
+    atomic_flag_clear_explicit(&counter->lock, memory_order_release);
+}
+
+/*
+ * Drop to zero only happens under the lock, so a waiter that saw zero and then took the lock
+ * knows nobody touches the counter anymore. Dependents to submit go to out
+ */
+uint32_t jobCounterDone(JobCounter *counter, Job *out) {
+    uint32_t pending = atomic_load(&counter->pending);
+    while (pending > 1) {
+        if (atomic_compare_exchange_weak(&counter->pending, &pending, pending - 1)) {
+            return 0;
+        }
+    }
+
+    jobCounterLock(counter);
+    uint32_t dependents_len = 0;
+    if (atomic_fetch_sub(&counter->pending, 1) == 1) {
+        dependents_len = counter->dependents_len;
+        for (uint32_t i=0; i<dependents_len; ++i) {
+            out[i] = counter->dependents[i];
+        }
+        counter->dependents_len = 0;
+    }
+    jobCounterUnlock(counter);
+    return dependents_len;
+}
+
+void jobsRun(JobSystem *jobs, Job job) {
+    job.function(job.data, job.begin, job.end);
+    if (job.counter == NULL) {
+        return;
+    }
+
+    Job dependents[JOB_MAX_DEPENDENTS];
+    uint32_t dependents_len = jobCounterDone(job.counter, dependents);
+    for (uint32_t i=0; i<dependents_len; ++i) {
+        jobsPush(jobs, dependents[i]);
+    }
+    if (dependents_len > 0) {
+        jobsWake(jobs);
+    }
+}
+
+void jobsPush(JobSystem *jobs, Job job) {
+    // counted before it can be stolen, so queued never goes below zero
+    atomic_fetch_add(&jobs->queued, 1);
+    if (job_thread_system != jobs || !jobDequePush(&jobs->deques[job_thread_index], job)) {
+        atomic_fetch_sub(&jobs->queued, 1);
+        jobsRun(jobs, job);
+    }
+}
+
+
+bool jobsTakeBackground(JobSystem *jobs, Job *out) {
+    pthread_mutex_lock(&jobs->background_lock);
+    bool found = jobs->background_len > 0;
+    if (found) {
+        *out = jobs->background[jobs->background_head];
+        jobs->background_head = (jobs->background_head + 1) % JOB_BACKGROUND_CAPACITY;
+        jobs->background_len -= 1;
+    }
+    pthread_mutex_unlock(&jobs->background_lock);
+    return found;
+}
+
+
+/* Own deque first, then a round over the others starting at a random one, background jobs last and never on the owner */
+bool jobsFind(JobSystem *jobs, uint32_t index, Job *out) {
+    if (jobDequePop(&jobs->deques[index], out)) {
+        atomic_fetch_sub(&jobs->queued, 1);
+        return true;
+    }
+
+    uint32_t deque_count = jobs->thread_count + 1;
+    job_thread_random ^= job_thread_random << 13;
+    job_thread_random ^= job_thread_random >> 17;
+    job_thread_random ^= job_thread_random << 5;
+    uint32_t start = job_thread_random % deque_count;
+    for (uint32_t i=0; i<deque_count; ++i) {
+        uint32_t victim = (start + i) % deque_count;
+        if (victim != index && jobDequeSteal(&jobs->deques[victim], out)) {
+            atomic_fetch_sub(&jobs->queued, 1);
+            return true;
+        }
+    }
+
+    if (index != 0 && jobsTakeBackground(jobs, out)) {
+        atomic_fetch_sub(&jobs->queued, 1);
+        return true;
+    }
+    return false;
+}
+
+
+void *jobThreadMain(void *arg) {
+    JobThread *thread = arg;
+    JobSystem *jobs = thread->jobs;
+    job_thread_system = jobs;
+    job_thread_index = thread->index;
+    job_thread_random = 2654435761u * (thread->index + 1);
+    traceThreadName("job worker");
+
+    uint32_t spins = 0;
+    while (!atomic_load(&jobs->quit)) {
+        Job job;
+        if (jobsFind(jobs, thread->index, &job)) {
+            TRACE_BEGIN(zone, "job");
+            jobsRun(jobs, job);
+            TRACE_END(zone);
+            spins = 0;
+            continue;
+        }
+
+        if (++spins < JOB_SPINS_BEFORE_SLEEP) {
+            sched_yield();
+            continue;
+        }
+
+        // sleeping is raised before queued is checked and pushers raise queued before checking sleeping, one of them sees the other
+        pthread_mutex_lock(&jobs->mutex);
+        atomic_fetch_add(&jobs->sleeping, 1);
+        if (atomic_load(&jobs->queued) == 0 && !atomic_load(&jobs->quit)) {
+            pthread_cond_wait(&jobs->wake, &jobs->mutex);
+        }
+        atomic_fetch_sub(&jobs->sleeping, 1);
+        pthread_mutex_unlock(&jobs->mutex);
+        spins = 0;
+    }
+
+    return NULL;
+}
+
+
+/* Logical processors, sysconf can't be relied on with mingw */
+uint32_t jobsCoreCount() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (uint32_t)info.dwNumberOfProcessors : 1;
+#else
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (uint32_t)cores : 1;
+#endif
+}
+
+
+/* Calling thread becomes the owner. thread_count 0 picks a worker for every other core */
+JobSystem *jobsCreate(uint32_t thread_count) {
+    if (thread_count == 0) {
+        uint32_t cores = jobsCoreCount();
+        thread_count = cores > 1 ? cores - 1 : 1;
+    }
+    thread_count = thread_count < MAX_JOB_THREADS ? thread_count : MAX_JOB_THREADS;
+
+    JobSystem *jobs = calloc(1, sizeof(JobSystem));
+    JobDeque *deques = jobs == NULL ? NULL : calloc(thread_count + 1, sizeof(JobDeque));
+    if (deques == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate memory for job system");
+        exit(1);
+    }
+    jobs->deques = deques;
+    jobs->thread_count = thread_count;
+    pthread_mutex_init(&jobs->mutex, NULL);
+    pthread_cond_init(&jobs->wake, NULL);
+    pthread_mutex_init(&jobs->background_lock, NULL);
+
+    job_thread_system = jobs;
+    job_thread_index = 0;
+    job_thread_random = 2654435761u;
+
+    for (uint32_t i=0; i<thread_count; ++i) {
+        JobThread *thread = &jobs->threads[i];
+        thread->jobs = jobs;
+        thread->index = i + 1;
+        if (pthread_create(&thread->thread, NULL, jobThreadMain, thread) != 0) {
+            fprintf(stderr, "ERROR: failed to create job thread");
+            exit(1);
+        }
+    }
+
+    fprintf(stderr, "INFO: Job system created successfully(%u workers)\n", thread_count);
+    return jobs;
+}
+
+
+/* Every counter has to be waited for before this */
+void jobsFree(JobSystem *jobs) {
+    if (jobs == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&jobs->mutex);
+    atomic_store(&jobs->quit, true);
+    pthread_cond_broadcast(&jobs->wake);
+    pthread_mutex_unlock(&jobs->mutex);
+
+    for (uint32_t i=0; i<jobs->thread_count; ++i) {
+        pthread_join(jobs->threads[i].thread, NULL);
+    }
+
+    if (job_thread_system == jobs) {
+        job_thread_system = NULL;
+    }
+    pthread_cond_destroy(&jobs->wake);
+    pthread_mutex_destroy(&jobs->mutex);
+    pthread_mutex_destroy(&jobs->background_lock);
+    free(jobs->deques);
+    free(jobs);
+}
+
+
+void jobsSubmit(JobSystem *jobs, JobFunction function, void *data, uint32_t begin, uint32_t end, JobCounter *counter) {
+    if (counter != NULL) {
+        atomic_fetch_add(&counter->pending, 1);
+    }
+    jobsPush(jobs, (Job){function, data, begin, end, counter});
+    jobsWake(jobs);
+}
+
+
+/* 
+ * For jobs that take long enough to cause a hitch if the owner ran them inside jobsWait.
+ * Only workers pick them up, after everything else they could run
+ */
+void jobsSubmitBackground(JobSystem *jobs, JobFunction function, void *data, uint32_t begin, uint32_t end, JobCounter *counter) {
+    if (counter != NULL) {
+        atomic_fetch_add(&counter->pending, 1);
+    }
+
+    pthread_mutex_lock(&jobs->background_lock);
+    if (jobs->background_len == JOB_BACKGROUND_CAPACITY) {
+        fprintf(stderr, "ERROR: Too many background jobs(%d)", JOB_BACKGROUND_CAPACITY);
+        exit(1);
+    }
+    jobs->background[(jobs->background_head + jobs->background_len) % JOB_BACKGROUND_CAPACITY] = (Job){function, data, begin, end, counter};
+    jobs->background_len += 1;
+    atomic_fetch_add(&jobs->queued, 1);
+    pthread_mutex_unlock(&jobs->background_lock);
+    jobsWake(jobs);
+}
+
+
+/* Job is submitted once dependency drops to zero, right away if it already did. counter tracks the job itself */
+void jobsSubmitAfter(JobSystem *jobs, JobCounter *dependency, JobFunction function, void *data, uint32_t begin, uint32_t end, JobCounter *counter) {
+    if (counter != NULL) {
+        atomic_fetch_add(&counter->pending, 1);
+    }
+    Job job = {function, data, begin, end, counter};
+
+    jobCounterLock(dependency);
+    bool waiting = atomic_load(&dependency->pending) > 0;
+    if (waiting) {
+        if (dependency->dependents_len >= JOB_MAX_DEPENDENTS) {
+            fprintf(stderr, "ERROR: Job counter can have only %d dependents", JOB_MAX_DEPENDENTS);
+            exit(1);
+        }
+        dependency->dependents[dependency->dependents_len++] = job;
+    }
+    jobCounterUnlock(dependency);
+
+    if (!waiting) {
+        jobsPush(jobs, job);
+        jobsWake(jobs);
+    }
+}
+
+
+/*
+ * Splits [0, count) into jobs of grain indices, grain 0 aims at a few jobs per thread so stealing can even things out.
+ * Wait on counter for the whole range, it can be NULL like in jobsSubmit
+ */
+void jobsParallelFor(JobSystem *jobs, JobFunction function, void *data, uint32_t count, uint32_t grain, JobCounter *counter) {
+    if (count == 0) {
+        return;
+    }
+    if (grain == 0) {
+        uint32_t target_jobs = (jobs->thread_count + 1) * 4;
+        grain = (count + target_jobs - 1) / target_jobs;
+    }
+
+    uint32_t job_count = (count + grain - 1) / grain;
+    if (counter != NULL) {
+        atomic_fetch_add(&counter->pending, job_count);
+    }
+    for (uint32_t begin=0; begin<count; begin+=grain) {
+        uint32_t end = count - begin > grain ? begin + grain : count;
+        jobsPush(jobs, (Job){function, data, begin, end, counter});
+    }
+    jobsWake(jobs);
+}
+
+
+/* Runs jobs, ours or stolen, until counter drops to zero */
+void jobsWait(JobSystem *jobs, JobCounter *counter) {
+    bool member = job_thread_system == jobs;
+    while (atomic_load(&counter->pending) > 0) {
+        Job job;
+        if (member && jobsFind(jobs, job_thread_index, &job)) {
+            jobsRun(jobs, job);
+        } else {
+            sched_yield();
+        }
+    }
+    // the job that dropped it to zero may still be inside the lock
+    jobCounterLock(counter);
+    jobCounterUnlock(counter);
+}
+
+#endif /* JOBS_H */
@@ -3,6 +3,14 @@
 
 // where does Vertex struct belong?
 #include "misc.h"
+#include "draw_list.h"
+#include "mesh_pool.h"
+#include "meshlet.h"
+#include "render_graph.h"
+#include "trace.h"
+#include "jobs.h"
+#include "shader_watch.h"
+
 
 
 #define VK_CHECK(expr) \
@@ -17,13 +25,49 @@ uint32_t uint32Clamp(uint32_t val, uint32_t min, uint32_t max) {
 
 
 
+/* Swapchain images get their own command buffers and uniform slots, so we keep fixed size arrays of those */
+#define MAX_SWAPCHAIN_IMAGES 8
+#define MAX_FRAMES_IN_FLIGHT 2
+#define VULKAN_DEFAULT_PRESENT_MODE VK_PRESENT_MODE_MAILBOX_KHR
+
 #define QueueFamilyIndex int64_t
 #define NO_QUEUE_FAMILY -1
+
+/* Optional features and extensions, everything that is true here is enabled on the logical device */
+typedef struct {
+    bool sampleRateShading;
+    // needed by gpu driven rendering
+    bool drawIndirectFirstInstance;
+    bool multiDrawIndirect;
+    bool drawIndirectCount;
+    // gpu profiler, pipeline statistics inside secondary command buffers need inheritedQueries
+    bool pipelineStatisticsQuery;
+    bool inheritedQueries;
+    // bindless buffers table is indexed with push constants
+    bool shaderStorageBufferArrayDynamicIndexing;
+    // need VK_KHR_get_physical_device_properties2 on the instance to be queried
+    bool timelineSemaphore;
+    bool descriptorIndexing;
+    bool dynamicRendering;
+    bool memoryBudget;
+    // present id and present wait together, frame pacing can see when a frame reaches the display
+    bool presentWait;
+    // wireframe pipeline variants
+    bool fillModeNonSolid;
+    // task and mesh shaders, need Vulkan 1.1 on both the instance and the device
+    bool meshShader;
+    // present fences, need VK_EXT_surface_maintenance1 on the instance. Retired swapchains are freed once their presents are done
+    bool swapchainMaintenance1;
+} GpuCapabilities;
+
 typedef struct {
     VkPhysicalDevice device;
     QueueFamilyIndex graphicsFamilyIndex;
     QueueFamilyIndex presentFamilyIndex; 
     VkSampleCountFlagBits multisampling;
+    GpuCapabilities caps;
+    // no surface, no swapchain extension, present queue is the graphics one
+    bool headless;
 } GPU;
 
 typedef struct {
@@ -50,6 +94,37 @@ typedef struct {
     SwapChainPresentModes presentModes;
 } SwapChainDetails;
 
+typedef enum {
+    ANTI_ALIASING_OFF,
+    ANTI_ALIASING_MSAA,
+    // single sample scene, then a fullscreen FXAA pass writes the swapchain image
+    ANTI_ALIASING_FXAA,
+} AntiAliasingMode;
+
+/* Changed at runtime with vulkanSetAntiAliasing, vulkanSupportedAntiAliasing clamps it to what gpu can do */
+typedef struct {
+    AntiAliasingMode mode;
+    VkSampleCountFlagBits samples; // 1 unless mode is MSAA
+    bool sample_shading;           // MSAA only, shades every sample instead of every pixel
+} AntiAliasing;
+
+/* 
+ * Attachments of a swapchain are suballocated from two blocks, transient ones (lazily allocated where supported) and the rest.
+ * They grow with headroom, so resizing the window reuses them most of the time instead of reallocating
+ */
+#define ATTACHMENT_MEMORY_HEADROOM 4 // block grows to required + required / HEADROOM
+typedef enum {
+    ATTACHMENT_MEMORY_PERSISTENT,
+    ATTACHMENT_MEMORY_TRANSIENT,
+    ATTACHMENT_MEMORY_KINDS,
+} AttachmentMemoryKind;
+
+typedef struct {
+    VkDeviceMemory memory;
+    VkDeviceSize capacity;
+    uint32_t memoryType;
+} AttachmentMemory;
+
 typedef struct {
     VkSwapchainKHR swapchain;
     VkPresentModeKHR presentMode;
@@ -59,13 +134,62 @@ typedef struct {
     VkImage *images;
     VkImageView *views;
     size_t imageCount;
-    VulkanImage z_buffer;
     VkFramebuffer *framebuffers;
     size_t framebufferCount; 
-    VulkanImage MSAAbuffer;
     VkRenderPass renderPass;
+    // offscreen swapchains own their images, NULL for real ones
+    VkDeviceMemory *imageMemories;
+    // render targets depend on it, they are rebuilt without touching the swapchain itself
+    AntiAliasing antiAliasing;
+    // internal resources of the frame graph, indexed like the graph's resources
+    VulkanImage attachments[RENDER_GRAPH_MAX_RESOURCES];
+    uint32_t sceneColorResource; // FXAA and scaled only, RENDER_GRAPH_NONE otherwise
+    VkRenderPass postRenderPass;
+    VkFramebuffer *postFramebuffers; // FXAA and scaled only
+    // scene is rendered into top left renderExtent of full size attachments, then post pass upscales it
+    bool scaled;
+    VkExtent2D renderExtent;
+    // attachments live here, handed over to the next swapchain on recreation
+    AttachmentMemory attachmentMemory[ATTACHMENT_MEMORY_KINDS];
 } Swapchain;
 
+/* 
+ * Replaced swapchain, freed by vulkanCollectRetired once every frame that could use it has finished and so have its presents.
+ * Pipelines built for its render passes go with it
+ */
+#define RETIRED_SWAPCHAIN_MAX_PIPELINES 8
+typedef struct {
+    Swapchain swapchain;
+    VkPipeline pipelines[RETIRED_SWAPCHAIN_MAX_PIPELINES];
+    uint32_t pipeline_count;
+    // fence of the frame slot wasn't seen signaled since retirement, or since the extra round started
+    bool pending[MAX_FRAMES_IN_FLIGHT];
+    // same for present fences
+    bool pending_present[MAX_FRAMES_IN_FLIGHT];
+    // without present fences another round of frame fences stands in for them
+    bool extra_round;
+    // extra round starts once this present is made, by then every frame slot was submitted again. 0 until the first round is done
+    uint64_t round_present_id;
+} RetiredSwapchain;
+
+/* Every shader the renderer loads, hot reload rebuilds the pipelines of a slot when its source changes */
+typedef enum {
+    SHADER_SCENE_VERT,
+    SHADER_SCENE_FRAG,
+    SHADER_BINDLESS_VERT,
+    SHADER_PULL_VERT,
+    SHADER_CLUSTER_VERT,
+    SHADER_MESHLET_TASK,
+    SHADER_MESHLET_MESH,
+    SHADER_CULL,
+    SHADER_COMPACT,
+    SHADER_CLUSTER_CULL,
+    SHADER_POST_VERT,
+    SHADER_FXAA,
+    SHADER_UPSCALE,
+    SHADER_SLOTS
+} ShaderSlot;
+
 typedef struct {
     VkShaderModule module;
     char *code;
@@ -85,16 +209,66 @@ typedef struct {
     VkSemaphore imageAvailable;
     VkSemaphore renderFinished;
     VkFence inFlight;
+    // signaled once the frame's present is done with its image, VK_NULL_HANDLE without swapchain maintenance1
+    VkFence presentDone;
 } SyncObjects;
 
+/* 
+ * Persistently mapped buffer for per-object blocks that don't fit into push constants, bound with
+ * VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC. Every swapchain image owns a segment of it, so objects
+ * of image i can be rewritten while other images are still in flight.
+ */
+#define OBJECT_RING_CAPACITY 16384
+typedef struct {
+    VulkanBuffer buffer;
+    void *mapped_memory;
+    VkDeviceSize block_stride;
+    VkDeviceSize segment_size;
+    uint32_t blocks_per_segment;
+} UniformRing;
+
+/* 
+ * Per-instance vertex buffer, split into a segment per swapchain image just like UniformRing.
+ * dirty_images has a bit for every image whose segment is behind the cpu side InstanceList as a whole,
+ * pending lists single instances that changed since and pending_images has the images each of them still has to reach
+ */
+typedef struct {
+    VulkanBuffer buffer;
+    void *mapped_memory;
+    VkDeviceSize segment_size;
+    uint32_t capacity;
+    uint32_t dirty_images;
+    uint8_t *pending_images;
+    uint32_t *pending;
+    uint32_t pending_len;
+} InstanceBuffer;
+
+/* One Ubo slot and one descriptor set per swapchain image, so recorded command buffers never have to change */
 typedef struct {
     VulkanBuffer buffer; 
     void *mapped_memory;
-    VkDescriptorPool pool;
-    VkDescriptorSet set; 
+    VkDeviceSize stride;
+    VkDescriptorSet sets[MAX_SWAPCHAIN_IMAGES]; 
     VkDescriptorSetLayout layout;
 } UniformBuffer;
 
+/* 
+ * Descriptor sets come from a list of pools, when the current one runs out the next one is used or created twice as big,
+ * so nobody has to know up front how many sets will be allocated. Sets are never freed one by one,
+ * the allocator is reset as a whole once nothing allocated from it is in use, pools are kept for next time
+ */
+#define DESCRIPTOR_ALLOCATOR_MAX_POOLS 16
+#define DESCRIPTOR_ALLOCATOR_FIRST_POOL_SETS 16
+#define DESCRIPTOR_ALLOCATOR_MAX_POOL_SETS 4096
+typedef struct {
+    VkDevice device;
+    VkDescriptorPool pools[DESCRIPTOR_ALLOCATOR_MAX_POOLS];
+    uint32_t pools_len;
+    // pools before it are full
+    uint32_t current;
+    uint32_t next_pool_sets;
+} DescriptorAllocator;
+
 typedef struct {
     VkCommandPool *pool;
     VkCommandBuffer cmd;
@@ -103,11 +277,468 @@ typedef struct {
 } Frame;
 
 typedef struct {
-    alignas(16) mat4t model;
     alignas(16) mat4t view;
     alignas(16) mat4t projection;
 } Ubo;
 
+/* Model matrix goes through push constants, it is baked into the command buffer when it is recorded */
+typedef struct {
+    mat4t model;
+} PushConstants;
+
+/* Per-object block living in UniformRing. Push constants are only guaranteed to have 128 bytes, so anything else goes here */
+typedef struct {
+    alignas(16) vec4 tint;
+} ObjectUbo;
+
+/* 
+ * What a scene pipeline variant changes on top of the base pipeline. Specialization constants go to both stages,
+ * constant_id is the index into constants. All zero is the base pipeline itself, built without specialization
+ */
+#define PIPELINE_MAX_CONSTANTS 4
+#define RENDER_STATE_CULL_BACK 1
+#define RENDER_STATE_WIREFRAME 2 // dropped without fillModeNonSolid
+#define RENDER_STATE_BLEND 4 // alpha blending
+#define RENDER_STATE_NO_DEPTH_WRITE 8
+typedef struct {
+    uint32_t render_state;
+    uint32_t constants[PIPELINE_MAX_CONSTANTS];
+} PipelineVariant;
+
+typedef struct {
+    // Record command buffers once per swapchain image and resubmit them until something invalidates them
+    bool reuse_command_buffers;
+    // Cull and pick lods in a compute shader and draw with indirect commands, ignored if gpu doesn't support it
+    bool gpu_driven;
+    // Split draw list between record workers, ignored if they weren't created
+    bool parallel_recording;
+    // Index object data through the bindless tables instead of binding a set per draw, ignored if they weren't created
+    bool bindless;
+    // Fetch vertices and instances from storage buffers in the vertex shader, ignored if it wasn't created. Takes over from bindless
+    bool vertex_pulling;
+    // Cull meshlets on the gpu and draw only triangles of visible ones, ignored if it wasn't created. Takes over from gpu_driven
+    bool cluster_culling;
+    // Cluster culling goes through task and mesh shaders instead of a compute pass, ignored if the gpu doesn't have them
+    bool mesh_shaders;
+    // Read only, use vulkanSetAntiAliasing
+    AntiAliasing anti_aliasing;
+    // Read only, use vulkanSetDynamicResolution
+    bool dynamic_resolution;
+    // gpu time that dynamic resolution tries to hold
+    float target_frame_ms;
+    // Read only, use vulkanSetPresentMode. Swapchain falls back to FIFO when the surface doesn't support it
+    VkPresentModeKHR present_mode;
+    // Scene is drawn with this variant once it is built, the base pipeline stands in until then. Ignored without vulkanCreatePipelineVariants
+    PipelineVariant scene_variant;
+} RendererSettings;
+
+/* Same push constants for both cull.comp and compact.comp */
+typedef struct {
+    mat4t model;
+    uint32_t first_instance;
+    uint32_t instance_count;
+    uint32_t mesh_index;
+    uint32_t object_index;
+    uint32_t compact;
+} CullPushConstants;
+
+/* 
+ * Every object of the draw list gets a slot in indirect buffer: draw count padded to 16 bytes,
+ * then a VkDrawIndexedIndirectCommand per lod. Visible instances of lod l of an object are written
+ * to [first_instance * MAX_LODS + l * instance_count], so instance capacity is multiplied by MAX_LODS.
+ * 
+ * Buffers are shared between all swapchain images, each recording starts with a barrier against
+ * reads of the previous frames instead
+ */
+#define MAX_GPU_DRIVEN_OBJECTS 256
+#define GPU_DRIVEN_OBJECT_STRIDE (16 + MAX_LODS * sizeof(VkDrawIndexedIndirectCommand))
+typedef struct {
+    bool supported;
+    PFN_vkCmdDrawIndexedIndirectCountKHR cmdDrawIndexedIndirectCount; // NULL without VK_KHR_draw_indirect_count
+    Shader cull_shader;
+    Shader compact_shader;
+    VkDescriptorSetLayout set_layout;
+    VkDescriptorSet sets[MAX_SWAPCHAIN_IMAGES];
+    VkPipelineLayout layout;
+    VkPipeline cull_pipeline;
+    VkPipeline compact_pipeline;
+    VulkanBuffer mesh_table;
+    VulkanBuffer lod_counts;
+    VulkanBuffer visible_instances;
+    VulkanBuffer indirect;
+} GpuDriven;
+
+/* Our own header in front of vkGetPipelineCacheData blob, vulkan header has no driver version */
+#define PIPELINE_CACHE_FILE_MAGIC 0x4350564c /* "LVPC" */
+typedef struct {
+    uint32_t magic;
+    uint32_t vendor_id;
+    uint32_t device_id;
+    uint32_t driver_version;
+    uint8_t uuid[VK_UUID_SIZE];
+    uint64_t data_size;
+} PipelineCacheFileHeader;
+
+/* Fullscreen pass, samples swapchain.sceneColor and writes the swapchain image. Either FXAA or a plain bilinear upscale */
+typedef struct {
+    bool created;
+    Shader vert;
+    Shader fxaa_frag;
+    Shader upscale_frag;
+    VkSampler sampler;
+    // set is allocated from the image's transient descriptors whenever its command buffer is recorded, so it always sees the current sceneColor
+    VkDescriptorSetLayout set_layout;
+    VkPipelineLayout layout;
+    VkPipeline fxaa_pipeline;
+    VkPipeline upscale_pipeline;
+} PostProcess;
+
+/* 
+ * Shader hot reload, development only. Watcher thread compiles a changed shader and builds its pipelines,
+ * render thread swaps them in at the start of a frame. Replaced pipelines are kept until frames that used them are done.
+ * Pipelines are built against a snapshot of the targets, which is guarded by targets_lock
+ */
+#define SHADER_RELOAD_MAX_PIPELINES 6
+#define MAX_RETIRED_PIPELINES 16
+typedef struct {
+    ShaderSlot slot;
+    Shader shader;
+    VkPipeline pipelines[SHADER_RELOAD_MAX_PIPELINES]; // same order as vulkanShaderSlotPipelines
+    uint32_t pipeline_count;
+    // render passes changed since the build if this is behind
+    uint64_t targets_generation;
+} ShaderReload;
+
+typedef struct {
+    VkPipeline pipelines[SHADER_RELOAD_MAX_PIPELINES];
+    uint32_t count;
+    bool pending[MAX_FRAMES_IN_FLIGHT];
+} RetiredPipelines;
+
+typedef struct {
+    ShaderWatcher *watcher;
+    pthread_mutex_t targets_lock;
+    Swapchain swapchain;
+    uint64_t targets_generation;
+    // one at a time, watcher waits until the render thread took it
+    ShaderReload result;
+    _Atomic bool has_result;
+    // render thread only
+    RetiredPipelines retired[MAX_RETIRED_PIPELINES];
+    uint32_t retired_len;
+} ShaderReloader;
+
+typedef enum {
+    // vertex and instance bindings, see vulkanScenePipelineInfo
+    VERTEX_LAYOUT_INSTANCED,
+    // no vertex input, the shader fetches everything itself
+    VERTEX_LAYOUT_PULLED,
+} VertexLayout;
+
+/* 
+ * Everything a scene pipeline variant is built from. Shaders are slots rather than modules, so keys stay
+ * the same across hot reloads and runs. All fields are 32 bit, keys are hashed and compared as bytes
+ */
+typedef struct {
+    uint32_t vert; // ShaderSlot
+    uint32_t frag;
+    uint32_t vertex_layout;
+    uint32_t samples;
+    uint32_t sample_shading;
+    PipelineVariant variant;
+} PipelineKey;
+
+/* Create info together with every state it points to, several of them go into one vkCreateGraphicsPipelines */
+typedef struct {
+    VkPipelineShaderStageCreateInfo stages[3]; // third one is for the task shader of meshlet pipelines
+    VkSpecializationMapEntry constant_entries[PIPELINE_MAX_CONSTANTS];
+    uint32_t constants[PIPELINE_MAX_CONSTANTS];
+    VkSpecializationInfo specialization;
+    VkVertexInputBindingDescription bindings[2];
+    VkVertexInputAttributeDescription attributes[4];
+    VkPipelineVertexInputStateCreateInfo vertex_input;
+    VkPipelineInputAssemblyStateCreateInfo input_assembly;
+    VkDynamicState dynamic_states[2];
+    VkPipelineDynamicStateCreateInfo dynamic_state;
+    VkViewport viewport;
+    VkRect2D scissors;
+    VkPipelineViewportStateCreateInfo viewport_state;
+    VkPipelineRasterizationStateCreateInfo rasterization;
+    VkPipelineMultisampleStateCreateInfo multisampling;
+    VkPipelineColorBlendAttachmentState colorblend_attachment;
+    VkPipelineColorBlendStateCreateInfo colorblend;
+    VkPipelineDepthStencilStateCreateInfo depth_stencil;
+    VkGraphicsPipelineCreateInfo info;
+} ScenePipelineInfo;
+
+/* 
+ * Pipeline variant cache: an open addressing table of keys, render thread only.
+ * Missing variants are queued and built in batches on job workers, one vkCreateGraphicsPipelines per batch.
+ * Used keys are saved to a usage list, the next run queues them all at start so they are built before they are needed
+ */
+#define PIPELINE_VARIANTS_MAX 256
+#define PIPELINE_VARIANTS_TABLE 512 // power of two, at most half full
+#define PIPELINE_BATCH_MAX 16
+#define PIPELINE_BATCHES_MAX 4
+#define PIPELINE_USAGE_MAGIC 0x52415650 // PVAR
+#define PIPELINE_USAGE_VERSION 1
+
+/* Usage list file is this header followed by count keys */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+} PipelineUsageHeader;
+
+typedef enum {
+    PIPELINE_VARIANT_EMPTY,
+    PIPELINE_VARIANT_QUEUED,
+    PIPELINE_VARIANT_BUILDING,
+    PIPELINE_VARIANT_READY,
+    PIPELINE_VARIANT_FAILED,
+} PipelineVariantState;
+
+typedef struct {
+    PipelineKey key;
+    PipelineVariantState state;
+    VkPipeline pipeline;
+} PipelineVariantEntry;
+
+/* Everything the worker reads is copied in on submit, modules and render pass stay alive until the batch is collected */
+typedef struct {
+    bool busy;
+    JobCounter counter;
+    VkDevice device;
+    VkPipelineCache cache;
+    uint32_t len;
+    uint32_t entries[PIPELINE_BATCH_MAX]; // table slots
+    ScenePipelineInfo infos[PIPELINE_BATCH_MAX];
+    VkPipeline pipelines[PIPELINE_BATCH_MAX];
+    VkResult result;
+} PipelineBatch;
+
+typedef struct {
+    VkPipeline pipeline;
+    bool pending[MAX_FRAMES_IN_FLIGHT];
+} RetiredVariant;
+
+typedef struct {
+    JobSystem *jobs;
+    const char *usage_path;
+    PipelineVariantEntry table[PIPELINE_VARIANTS_TABLE];
+    uint32_t len;
+    // table slots waiting for a batch, oldest first
+    uint32_t queue[PIPELINE_VARIANTS_MAX];
+    uint32_t queue_len;
+    PipelineBatch batches[PIPELINE_BATCHES_MAX];
+    RetiredVariant retired[PIPELINE_VARIANTS_MAX];
+    uint32_t retired_len;
+    // what draws bind, picked by vulkanResolveScenePipelines before every recording
+    VkPipeline scene_pipeline;
+    VkPipeline bindless_pipeline;
+    VkPipeline pulling_pipeline;
+    VkPipeline cluster_pipeline;
+} PipelineVariants;
+
+/* Same for fxaa.frag and upscale.frag */
+typedef struct {
+    vec2 inverse_size; // texel size of sceneColor
+    vec2 uv_scale;     // renderExtent / extent, the part of sceneColor that has the scene
+} PostPushConstants;
+
+/* 
+ * Bindless tables: one set with an array of every storage buffer and every sampled image shaders may read.
+ * It is bound once per command buffer and draws pick their data with indices in push constants.
+ * Buffers are registered at init, image binding is update after bind, so images can be added while frames are in flight.
+ * Needs descriptor indexing, without it draws keep binding the per object set
+ */
+#define BINDLESS_MAX_BUFFERS 64
+#define BINDLESS_MAX_IMAGES 4096
+typedef struct {
+    bool created;
+    Shader vert;
+    VkDescriptorSetLayout set_layout;
+    VkDescriptorPool pool;
+    VkDescriptorSet set;
+    uint32_t buffer_capacity;
+    uint32_t buffers_len;
+    uint32_t image_capacity;
+    uint32_t images_len;
+    // buffers table index of vulkan->object_ring
+    uint32_t object_ring;
+    VkPipelineLayout layout;
+    VkPipeline pipeline;
+} Bindless;
+
+/* shader_bindless.vert, object block is read from buffers[objects].data[object_block] */
+typedef struct {
+    mat4t model;
+    uint32_t objects;
+    uint32_t object_block; // in vec4s from the start of the buffer
+} BindlessPushConstants;
+
+/* 
+ * Vertex pulling: shader_pull.vert reads PackedVertex by gl_VertexIndex and InstanceData by gl_InstanceIndex from storage buffers.
+ * The pipeline has no vertex input, so vertex formats and meshes can change without new pipelines.
+ * Indices stay with the input assembler, indexed draws keep post transform cache reuse
+ */
+typedef struct {
+    bool created;
+    Shader vert;
+    VulkanBuffer vertices;
+    VertexDecode decode[MAX_MESHES];
+    VkDescriptorSetLayout set_layout;
+    // instance segment of every image, and culling output for gpu driven draws
+    VkDescriptorSet sets[MAX_SWAPCHAIN_IMAGES];
+    VkDescriptorSet culled_set;
+    VkPipelineLayout layout;
+    VkPipeline pipeline;
+} VertexPulling;
+
+typedef struct {
+    mat4t model;
+    VertexDecode decode;
+} PullPushConstants;
+
+/* 
+ * Cluster culling: every meshlet of every instance is culled on its own, against the frustum and,
+ * when back faces are culled anyway, against its normal cone. Vertices come from vertex pulling's packed buffer.
+ * Compute path: cluster_cull.comp writes triangles of visible clusters into indices, then one indexed indirect draw per object.
+ * An index is visible cluster slot * MESHLET_MAX_VERTICES + meshlet vertex, shader_cluster.vert looks the slot up in clusters.
+ * Mesh shader path: meshlet.task culls and meshlet.mesh emits what is left, nothing goes through memory.
+ * Each object gets the worst case range of clusters and indices, draw lists that don't fit are drawn without it
+ */
+#define CLUSTER_MAX_OBJECTS 64
+#define CLUSTER_MAX_CLUSTERS (1u << 18)
+#define CLUSTER_MAX_INDICES (1u << 22)
+// VkDrawIndexedIndirectCommand, visible cluster count, padding. Same as OBJECT_STRIDE in cluster_cull.comp
+#define CLUSTER_OBJECT_STRIDE 32
+// instances are the y of task dispatches, this is the smallest maxTaskWorkGroupCount allowed
+#define CLUSTER_MAX_INSTANCES 65535
+#define MESHLET_TASK_GROUP_SIZE 32 // TASK_GROUP_SIZE in meshlet.task
+#define CLUSTER_MAX_TASK_GROUPS (1u << 22) // smallest maxTaskWorkGroupTotalCount allowed
+typedef struct {
+    bool created;
+    // task and mesh shaders were created too
+    bool mesh_shaders;
+    MeshletRange meshes[MAX_MESHES];
+    VulkanBuffer meshlets;
+    VulkanBuffer meshlet_vertices;
+    VulkanBuffer meshlet_triangles;
+    VulkanBuffer clusters;
+    VulkanBuffer indices;
+    VulkanBuffer commands;
+    // set 1 of every stage, per image because of the instance segment
+    VkDescriptorSetLayout set_layout;
+    VkDescriptorSet sets[MAX_SWAPCHAIN_IMAGES];
+    Shader cull_shader;
+    VkPipelineLayout cull_layout;
+    VkPipeline cull_pipeline;
+    Shader vert;
+    VkPipelineLayout layout;
+    VkPipeline pipeline;
+    Shader task;
+    Shader mesh;
+    VkPipelineLayout mesh_layout;
+    VkPipeline mesh_pipelines[2]; // without and with back face culling
+    PFN_vkCmdDrawMeshTasksEXT cmdDrawMeshTasks;
+    // meshlets of an object are the x of its culling dispatch
+    uint32_t max_dispatch_x;
+} ClusterCulling;
+
+typedef struct {
+    mat4t model;
+    uint32_t first_instance;
+    uint32_t instance_count;
+    uint32_t first_meshlet;
+    uint32_t meshlet_count;
+    uint32_t object_index;
+    uint32_t cluster_base;
+    uint32_t index_base;
+    uint32_t cull_back;
+} ClusterCullPushConstants;
+
+/* Same for meshlet.task and meshlet.mesh */
+typedef struct {
+    mat4t model;
+    VertexDecode decode;
+    uint32_t first_instance;
+    uint32_t first_meshlet;
+    uint32_t meshlet_count;
+    uint32_t cull_back;
+} MeshletPushConstants;
+
+/* 
+ * Named gpu scopes: a pair of timestamps and, when the device can, pipeline statistics per scope.
+ * Every swapchain image has its own range of queries. They are read after images_in_flight fence of the image,
+ * so results are a frame late and reading never stalls
+ */
+#define GPU_PROFILER_MAX_SCOPES 12
+// scene draws are timed in this many consecutive batches of the draw list, "draws 0" and on
+#define GPU_PROFILER_DRAW_BATCHES 4
+#define GPU_PROFILER_HISTORY 64 // frames in the rolling min/avg/max window
+#define GPU_PROFILER_NONE UINT32_MAX
+#define GPU_PROFILER_STATISTICS_LEN 4
+// results are written in bit order: vertex invocations, clipping invocations, clipping primitives, fragment invocations
+#define GPU_PROFILER_STATISTICS (VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT | VK_QUERY_PIPELINE_STATISTIC_CLIPPING_INVOCATIONS_BIT | \
+                                 VK_QUERY_PIPELINE_STATISTIC_CLIPPING_PRIMITIVES_BIT | VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT)
+
+typedef struct {
+    const char *name;
+    // ring of the last frames the scope was recorded in
+    float ms[GPU_PROFILER_HISTORY];
+    uint64_t statistics[GPU_PROFILER_HISTORY][GPU_PROFILER_STATISTICS_LEN];
+    bool has_statistics[GPU_PROFILER_HISTORY];
+    uint32_t len;
+    uint32_t next;
+} GpuProfilerScope;
+
+typedef struct {
+    VkQueryPool timestamps;  // 2 per scope per image
+    VkQueryPool statistics;  // 1 per scope per image, VK_NULL_HANDLE without pipelineStatisticsQuery
+    float period_ns;
+    uint64_t valid_mask;
+    GpuProfilerScope scopes[GPU_PROFILER_MAX_SCOPES];
+    uint32_t scope_count;
+    // bit per scope that was recorded into the image's command buffer
+    uint32_t recorded[MAX_SWAPCHAIN_IMAGES];
+    uint32_t recorded_statistics[MAX_SWAPCHAIN_IMAGES];
+    // "frame" scope of the last collected image
+    uint32_t frame_image;
+    bool frame_valid;
+    float frame_ms;
+} GpuProfiler;
+
+/* Row of vulkanProfilerTable, statistics are averages per frame */
+typedef struct {
+    const char *name;
+    float min_ms;
+    float avg_ms;
+    float max_ms;
+    bool has_statistics;
+    uint64_t vertex_invocations;
+    uint64_t clipping_invocations;
+    uint64_t clipping_primitives;
+    uint64_t fragment_invocations;
+} GpuProfileRow;
+
+/* 
+ * Render scale controller: every RESOLUTION_CONTROLLER_PERIOD frames the average gpu time is compared against the target.
+ * Scale goes down as soon as frames are too slow, but goes up only when there is RESOLUTION_HEADROOM to spare
+ */
+#define RESOLUTION_SCALE_MIN 0.5f
+#define RESOLUTION_SCALE_MAX 1.0f
+#define RESOLUTION_SCALE_STEP 0.05f
+#define RESOLUTION_CONTROLLER_PERIOD 8
+#define RESOLUTION_HEADROOM 0.8f
+typedef struct {
+    float scale;
+    float accumulated_ms;
+    uint32_t frames;
+} ResolutionController;
+
+typedef struct ParallelRecorder ParallelRecorder;
+
 typedef struct {
     VkInstance instance;
     VkSurfaceKHR surface;
@@ -117,17 +748,92 @@ typedef struct {
     VkQueue present_queue;
     Swapchain swapchain;
     VulkanPipelineLayout pipeline_layout;
+    VkPipelineCache pipeline_cache;
+    const char *pipeline_cache_path;
     VkPipeline pipeline;
     VkCommandPool command_pool;
-    VkCommandBuffer command_buffer;
-    SyncObjects sync;
+    VkCommandBuffer command_buffers[MAX_SWAPCHAIN_IMAGES];
+    bool command_buffers_recorded[MAX_SWAPCHAIN_IMAGES];
+    SyncObjects sync[MAX_FRAMES_IN_FLIGHT];
+    // fence of the frame that is currently using the swapchain image, VK_NULL_HANDLE if none
+    VkFence images_in_flight[MAX_SWAPCHAIN_IMAGES];
+    uint32_t current_frame;
+    RendererSettings settings;
     UniformBuffer uniform_buffer;
+    UniformRing object_ring;
+    // sets that live as long as the renderer
+    DescriptorAllocator descriptors;
+    // sets recorded into the image's command buffer, reset every time it is recorded again
+    DescriptorAllocator frame_descriptors[MAX_SWAPCHAIN_IMAGES];
+    Bindless bindless;
+    VertexPulling pulling;
+    ClusterCulling clusters;
     Shader frag;
     Shader vert;
-    VulkanBuffer staging_buffer;
     VulkanBuffer vertex_buffer; 
+    VulkanBuffer index_buffer;
+    MeshInfo meshes[MAX_MESHES];
+    uint32_t meshes_len;
+    InstanceBuffer instance_buffer;
+    GpuDriven gpu_driven;
+    PostProcess post_process;
+    // NULL when the graphics queue can't write timestamps
+    GpuProfiler *profiler;
+    ResolutionController resolution;
+    // grows instead of waiting when the window is resized faster than frames finish
+    RetiredSwapchain *retired;
+    uint32_t retired_len;
+    uint32_t retired_capacity;
+    ParallelRecorder *recorder;
+    // NULL unless vulkanStartShaderReload was called
+    ShaderReloader *reloader;
+    // NULL unless vulkanCreatePipelineVariants was called
+    PipelineVariants *variants;
+    // id of the last present, ids start over with every swapchain from first_present_id
+    uint64_t present_id;
+    uint64_t first_present_id;
+    PFN_vkWaitForPresentKHR wait_for_present; // NULL without presentWait
+    // headless only: every offscreen image is copied into its slot of readback buffer at the end of the frame
+    bool headless;
+    VulkanBuffer readback_buffer;
+    void *readback_memory;
+    VkDeviceSize readback_stride;
 } Vulkan;
 
+/* 
+ * Parallel recording: every slice of the draw list is recorded into a secondary command buffer by a job,
+ * primary buffer only begins the render pass and executes them
+ */
+#define MAX_RECORD_SLICES 16
+#define MIN_DRAWS_PER_RECORD_SLICE 64
+
+typedef struct {
+    Vulkan *vulkan;
+    uint32_t image_index;
+    DrawList draw_list;
+    uint32_t used_slices;
+    bool gpu_driven;
+    bool clusters;
+    // statistics query of the primary is active while secondaries execute, they have to inherit it
+    VkQueryPipelineStatisticFlags pipeline_statistics;
+    // reserved before the jobs run, a batch starts in its first slice and ends in its last one
+    uint32_t draw_scopes[GPU_PROFILER_DRAW_BATCHES];
+    uint32_t draw_batches;
+} RecordJob;
+
+/* A slice is recorded by one job at a time, so its pools need no locking whichever thread runs it */
+typedef struct {
+    VkCommandPool pools[MAX_SWAPCHAIN_IMAGES];
+    VkCommandBuffer buffers[MAX_SWAPCHAIN_IMAGES];
+} RecordSlice;
+
+struct ParallelRecorder {
+    JobSystem *jobs;
+    RecordJob job;
+    uint32_t count;
+    RecordSlice slices[MAX_RECORD_SLICES];
+};
+
 
 void vulkanFillMemory(VkDevice device, VkDeviceMemory mem, void *data, size_t data_size) {
     void *mapped_memory;
@@ -237,6 +943,60 @@ VulkanImage vulkanCreateImage(
 };
 
 
+/* 
+ * Binds images at offsets, size is what they need altogether. When they don't fit, a bigger block replaces memory->memory,
+ * the old one is NOT freed because images of a retired swapchain may still use it, caller owns it
+ */
+void vulkanBindAttachmentMemory(GPU gpu, VkDevice device, AttachmentMemory *memory, VkImage *images, VkDeviceSize *offsets, size_t count, VkDeviceSize size, VkMemoryPropertyFlags preferred_props) {
+    if (count == 0) {
+        return;
+    }
+
+    uint32_t type_bits = UINT32_MAX;
+    for (size_t i=0; i<count; ++i) {
+        VkMemoryRequirements reqs;
+        vkGetImageMemoryRequirements(device, images[i], &reqs);
+        type_bits &= reqs.memoryTypeBits;
+    }
+
+    bool fits = memory->memory != VK_NULL_HANDLE && size <= memory->capacity && (type_bits & (1u << memory->memoryType));
+    if (!fits) {
+        VkPhysicalDeviceMemoryProperties device_props;
+        vkGetPhysicalDeviceMemoryProperties(gpu.device, &device_props); 
+
+        // preferred properties first, then any device local memory
+        VkMemoryPropertyFlags wanted[] = {VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | preferred_props, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT};
+        int64_t memory_type_index = -1;
+        for (size_t w=0; w<sizeof wanted / sizeof(VkMemoryPropertyFlags) && memory_type_index == -1; ++w) {
+            for (uint32_t i=0; i<device_props.memoryTypeCount; ++i) {
+                if ((type_bits & (1u << i)) && (device_props.memoryTypes[i].propertyFlags & wanted[w]) == wanted[w]) {
+                    memory_type_index = i;
+                    break;
+                }
+            }
+        }
+        if (memory_type_index == -1) {
+            fprintf(stderr, "ERROR: Failed to find memory that suits every attachment");
+            exit(1);
+        }
+
+        VkMemoryAllocateInfo mem_info = {0};
+        mem_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        mem_info.allocationSize = size + size / ATTACHMENT_MEMORY_HEADROOM; 
+        mem_info.memoryTypeIndex = memory_type_index;
+        VK_CHECK(vkAllocateMemory(device, &mem_info, NULL, &memory->memory));
+
+        memory->capacity = mem_info.allocationSize;
+        memory->memoryType = memory_type_index;
+        fprintf(stderr, "INFO: Attachment memory allocated(%llu bytes, memory type: %u)\n", (unsigned long long)memory->capacity, memory->memoryType);
+    }
+
+    for (size_t i=0; i<count; ++i) {
+        VK_CHECK(vkBindImageMemory(device, images[i], memory->memory, offsets[i]));
+    }
+}
+
+
 VulkanBuffer vulkanCreateBuffer(GPU gpu, VkDevice device, VkBufferUsageFlags usage, VkMemoryPropertyFlags required_props, size_t size) {
     VkBufferCreateInfo buffer_info = {0};
     buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO; 
@@ -295,6 +1055,58 @@ VulkanBuffer vulkanCreateBuffer(GPU gpu, VkDevice device, VkBufferUsageFlags usa
 }
 
 
+/* 
+ * Finds memory that is both device local and host visible, so buffers can be written by the cpu without staging.
+ * Only heaps at least as big as the biggest device local heap count, that is unified memory(integrated and software
+ * gpus) or resizable BAR. Small 256MB BAR windows of discrete gpus are left alone.
+ * Coherent memory is preferred, out_coherent tells the caller if flushes are needed.
+ */
+int64_t vulkanFindDirectUploadMemoryType(GPU gpu, uint32_t memory_type_bits, bool *out_coherent) {
+    VkPhysicalDeviceMemoryProperties device_props;
+    vkGetPhysicalDeviceMemoryProperties(gpu.device, &device_props); 
+
+    VkDeviceSize largest_device_local_heap = 0;
+    for (uint32_t i=0; i<device_props.memoryHeapCount; ++i) {
+        VkMemoryHeap heap = device_props.memoryHeaps[i];
+        if ((heap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) && heap.size > largest_device_local_heap) {
+            largest_device_local_heap = heap.size;
+        }
+    }
+
+    VkMemoryPropertyFlags required_props = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+    int64_t memory_type_index = -1;
+    bool coherent = false;
+    for (uint32_t i=0; i<device_props.memoryTypeCount; ++i) {
+        if (!(memory_type_bits & (1 << i))) {
+            continue;
+        }
+
+        VkMemoryType type = device_props.memoryTypes[i];
+        if (!((type.propertyFlags & required_props) == required_props)) {
+            continue;
+        }
+
+        if (device_props.memoryHeaps[type.heapIndex].size < largest_device_local_heap) {
+            continue;
+        }
+
+        if (memory_type_index == -1 || (type.propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
+            memory_type_index = i;
+            coherent = (type.propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) != 0;
+        }
+
+        if (coherent) {
+            break;
+        }
+    }
+
+    if (out_coherent != NULL) {
+        *out_coherent = coherent;
+    }
+    return memory_type_index;
+}
+
+
 VkCommandPool vulkanCreateCommandPool(VkDevice device, GPU gpu) {
     VkCommandPoolCreateInfo pool_info = {0};
     pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
@@ -313,190 +1125,667 @@ VkCommandPool vulkanCreateCommandPool(VkDevice device, GPU gpu) {
 }
 
 
-VkCommandBuffer vulkanCreateCommandBuffer(VkDevice device, VkCommandPool pool) {
-    VkCommandBufferAllocateInfo buffer_info = {0};
-    buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    buffer_info.commandPool = pool;
-    buffer_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    buffer_info.commandBufferCount = 1;
+/* Not every graphics queue can write timestamps, then nothing is profiled and NULL is returned */
+GpuProfiler *vulkanCreateGpuProfiler(GPU gpu, VkDevice device) {
+    uint32_t queue_family_count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(gpu.device, &queue_family_count, NULL);
+    VkQueueFamilyProperties queue_families[queue_family_count];
+    vkGetPhysicalDeviceQueueFamilyProperties(gpu.device, &queue_family_count, queue_families);
 
-    VkResult res;
-    VkCommandBuffer buffer;
-    if ((res = vkAllocateCommandBuffers(device, &buffer_info, &buffer)) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: failed to create command buffer. Error code: %d", res);
+    uint32_t valid_bits = queue_families[gpu.graphicsFamilyIndex].timestampValidBits;
+    if (valid_bits == 0) {
+        fprintf(stderr, "INFO: Graphics queue doesn't support timestamps, gpu is not profiled\n");
+        return NULL;
+    }
+
+    GpuProfiler *profiler = calloc(1, sizeof(GpuProfiler));
+    if (profiler == NULL) {
+        fprintf(stderr, "ERROR: Failed to allocate gpu profiler\n");
         exit(1);
     }
 
-    fprintf(stderr, "INFO: Command buffer created successfully\n");
-    return buffer;
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(gpu.device, &properties);
+
+    VkQueryPoolCreateInfo pool_info = {0};
+    pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    pool_info.queryCount = MAX_SWAPCHAIN_IMAGES * GPU_PROFILER_MAX_SCOPES * 2;
+    VK_CHECK(vkCreateQueryPool(device, &pool_info, NULL, &profiler->timestamps));
+
+    if (gpu.caps.pipelineStatisticsQuery) {
+        VkQueryPoolCreateInfo statistics_info = {0};
+        statistics_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        statistics_info.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+        statistics_info.queryCount = MAX_SWAPCHAIN_IMAGES * GPU_PROFILER_MAX_SCOPES;
+        statistics_info.pipelineStatistics = GPU_PROFILER_STATISTICS;
+        VK_CHECK(vkCreateQueryPool(device, &statistics_info, NULL, &profiler->statistics));
+    } else {
+        fprintf(stderr, "INFO: Pipeline statistics are not supported, gpu profiler measures only time\n");
+    }
+
+    profiler->period_ns = properties.limits.timestampPeriod;
+    profiler->valid_mask = valid_bits >= 64 ? UINT64_MAX : (1ull << valid_bits) - 1;
+    return profiler;
 }
 
 
-bool vulkanTryGetSampleCount(VkPhysicalDevice device, VkSampleCountFlagBits count) {
-    VkPhysicalDeviceProperties props; 
-    vkGetPhysicalDeviceProperties(device, &props);
+void freeGpuProfiler(VkDevice device, GpuProfiler *profiler) {
+    if (profiler == NULL) {
+        return;
+    }
 
-    return (props.limits.framebufferColorSampleCounts & props.limits.framebufferDepthSampleCounts) & count;
+    vkDestroyQueryPool(device, profiler->timestamps, NULL);
+    if (profiler->statistics != VK_NULL_HANDLE) {
+        vkDestroyQueryPool(device, profiler->statistics, NULL);
+    }
+    free(profiler);
 }
 
 
-GPU vulkanChooseGpu(VkInstance instance, VkSurfaceKHR surface) {
-    uint32_t device_count = 0;
-    vkEnumeratePhysicalDevices(instance, &device_count, NULL);
+/* Scopes are found by name, so a name can be used once per command buffer. GPU_PROFILER_NONE when all scopes are taken */
+uint32_t vulkanProfilerScope(GpuProfiler *profiler, const char *name) {
+    for (uint32_t i=0; i<profiler->scope_count; ++i) {
+        if (strcmp(profiler->scopes[i].name, name) == 0) {
+            return i;
+        }
+    }
 
-    if (device_count == 0) {
-        fprintf(stderr, "ERROR: Failed to find GPU that supports Vulkan");
-        exit(1);
+    if (profiler->scope_count == GPU_PROFILER_MAX_SCOPES) {
+        return GPU_PROFILER_NONE;
     }
+    profiler->scopes[profiler->scope_count].name = name;
+    return profiler->scope_count++;
+}
 
-    GPU target_gpu = (GPU) {
-        VK_NULL_HANDLE,
-        NO_QUEUE_FAMILY,
-        NO_QUEUE_FAMILY,
-        (VkSampleCountFlagBits)0
-    };
 
-    VkPhysicalDevice devices[device_count];
-    vkEnumeratePhysicalDevices(instance, &device_count, devices);
+/* Resets the image's queries, has to be recorded outside of a render pass before any scope */
+void vulkanProfilerReset(GpuProfiler *profiler, VkCommandBuffer command_buffer, uint32_t image_index) {
+    if (profiler == NULL) {
+        return;
+    }
 
-    // picking the first available device, in the real world i should choose the most powerful one or something 
-    for (uint32_t i=0;i<device_count;++i) {
-        VkPhysicalDevice device = devices[i];
-        
-        /* Check if device is a gpu */ { 
-            VkPhysicalDeviceProperties props;
-            vkGetPhysicalDeviceProperties(device, &props);
-            VkPhysicalDeviceFeatures features;
-            vkGetPhysicalDeviceFeatures(device, &features);
-    
-            if (!((props.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU || props.deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU) && features.geometryShader)) {
-                continue;
-            }
-        }
-        
-         
-        int64_t graphics_family_index = NO_QUEUE_FAMILY;
-        int64_t present_family_index = NO_QUEUE_FAMILY;
-        /* Graphics queue support */ {
-            uint32_t queue_family_count;
-            vkGetPhysicalDeviceQueueFamilyProperties(device, &queue_family_count, NULL);
-            VkQueueFamilyProperties queue_families[queue_family_count]; 
-            vkGetPhysicalDeviceQueueFamilyProperties(device, &queue_family_count, queue_families);
-    
-            // Probably a suboptimal way to do that, so
-            // @TODO: Learn how to find queueFamilies properly
-            for (uint32_t i=0;i<queue_family_count;++i) {
-                VkQueueFamilyProperties queue_family = queue_families[i];  
-                if (queue_family.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
-                    graphics_family_index = i;
-                }
-                
-                VkBool32 supports_present = false;
-                vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &supports_present);
-                if(supports_present) {
-                    present_family_index = i;
-                }
-                
-                if (graphics_family_index != NO_QUEUE_FAMILY &&
-                    present_family_index != NO_QUEUE_FAMILY) {
-                    break;
-                }
-            }
-            
-            if (graphics_family_index == NO_QUEUE_FAMILY ||
-                present_family_index == NO_QUEUE_FAMILY) {
-                continue;
-            }
-        } 
+    uint32_t first = image_index * GPU_PROFILER_MAX_SCOPES;
+    vkCmdResetQueryPool(command_buffer, profiler->timestamps, first * 2, GPU_PROFILER_MAX_SCOPES * 2);
+    if (profiler->statistics != VK_NULL_HANDLE) {
+        vkCmdResetQueryPool(command_buffer, profiler->statistics, first, GPU_PROFILER_MAX_SCOPES);
+    }
+    profiler->recorded[image_index] = 0;
+    profiler->recorded_statistics[image_index] = 0;
+}
 
-        /* Check if we can use swap chain extensions */ {
-            uint32_t extension_count;
-            vkEnumerateDeviceExtensionProperties(device, NULL, &extension_count, NULL);
-            VkExtensionProperties extensions[extension_count];
-            vkEnumerateDeviceExtensionProperties(device, NULL, &extension_count, extensions);
-    
-            bool khr_swap_extension_found = false;
-            for (uint32_t i=0;i<extension_count;++i) {
-                VkExtensionProperties extension = extensions[i];
-                if (strcmp(extension.extensionName, VK_KHR_SWAPCHAIN_EXTENSION_NAME) == 0) {
-                    khr_swap_extension_found = true;
-                    break;
-                }
-            }
-            if (!khr_swap_extension_found) {
-                continue;  
-            } 
-        }
 
-        /* Check if gpu support 8xMSAA, @TODO: unhardcode */ {
-            if (!vulkanTryGetSampleCount(device, VK_SAMPLE_COUNT_8_BIT)) {
-                continue;
-            }
-        }
+/* 
+ * Returns the scope to pass to vulkanProfilerEnd. Statistics are collected only when the device supports them,
+ * a scope with statistics has to begin and end inside the same render pass or both outside of render passes.
+ * Start timestamp is written once work before it is done with stage
+ */
+uint32_t vulkanProfilerBeginAt(GpuProfiler *profiler, VkCommandBuffer command_buffer, uint32_t image_index, const char *name, bool statistics, VkPipelineStageFlagBits stage) {
+    if (profiler == NULL) {
+        return GPU_PROFILER_NONE;
+    }
 
-        target_gpu.device = device;
-        target_gpu.graphicsFamilyIndex = graphics_family_index; 
-        target_gpu.presentFamilyIndex = present_family_index; 
-        target_gpu.multisampling = VK_SAMPLE_COUNT_8_BIT;
+    uint32_t scope = vulkanProfilerScope(profiler, name);
+    if (scope == GPU_PROFILER_NONE) {
+        return scope;
     }
 
-    if (target_gpu.device == VK_NULL_HANDLE) {
-        fprintf(stderr, "ERROR: Supported GPU was found, but it not suitable for rendering");
-        exit(1);
+    uint32_t query = image_index * GPU_PROFILER_MAX_SCOPES + scope;
+    vkCmdWriteTimestamp(command_buffer, stage, profiler->timestamps, query * 2);
+    profiler->recorded[image_index] |= 1u << scope;
+
+    if (statistics && profiler->statistics != VK_NULL_HANDLE) {
+        vkCmdBeginQuery(command_buffer, profiler->statistics, query, 0);
+        profiler->recorded_statistics[image_index] |= 1u << scope;
     }
+    return scope;
+}
 
-    fprintf(stderr, "INFO: Target gpu is found\n");
 
-    fprintf(stderr, "INFO: Graphics queue index(%lld), Present queue index(%lld)\n", target_gpu.graphicsFamilyIndex, target_gpu.presentFamilyIndex);
-    return target_gpu;
+uint32_t vulkanProfilerBegin(GpuProfiler *profiler, VkCommandBuffer command_buffer, uint32_t image_index, const char *name, bool statistics) {
+    return vulkanProfilerBeginAt(profiler, command_buffer, image_index, name, statistics, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT);
 }
 
 
-VkSurfaceFormatKHR chooseSwapSurfaceFormat(SwapChainFormats formats) {
-    for (uint32_t i=0; i<formats.len; ++i) {
-        VkSurfaceFormatKHR format = formats.data[i];
+/* 
+ * Scope without statistics whose timestamps are written later with vulkanProfilerTimestamp, possibly by other threads.
+ * Reserving is not thread safe, do it before they start
+ */
+uint32_t vulkanProfilerReserve(GpuProfiler *profiler, uint32_t image_index, const char *name) {
+    if (profiler == NULL) {
+        return GPU_PROFILER_NONE;
+    }
 
-        if (format.format == VK_FORMAT_B8G8R8A8_SRGB &&
-            format.colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
-            return format; 
-        }
+    uint32_t scope = vulkanProfilerScope(profiler, name);
+    if (scope != GPU_PROFILER_NONE) {
+        profiler->recorded[image_index] |= 1u << scope;
     }
-    
-    fprintf(stderr, "Unable to found sufficient surface format");
-    exit(1);
+    return scope;
 }
 
 
-VkPresentModeKHR chooseSwapPresentMode(SwapChainPresentModes modes) {
-    for (uint32_t i=0;i<modes.len;++i) {
-        VkPresentModeKHR mode = modes.data[i];
-        if (mode == VK_PRESENT_MODE_MAILBOX_KHR) {
-            return mode;
-        }
+/* Start or end timestamp of a reserved scope, only records the command so any thread can call it */
+void vulkanProfilerTimestamp(GpuProfiler *profiler, VkCommandBuffer command_buffer, uint32_t image_index, uint32_t scope, bool end) {
+    if (profiler == NULL || scope == GPU_PROFILER_NONE) {
+        return;
     }
 
-    return VK_PRESENT_MODE_FIFO_KHR;
+    uint32_t query = image_index * GPU_PROFILER_MAX_SCOPES + scope;
+    VkPipelineStageFlagBits stage = end ? VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+    vkCmdWriteTimestamp(command_buffer, stage, profiler->timestamps, query * 2 + (end ? 1 : 0));
 }
 
 
-VkExtent2D chooseSwapExtent(VkSurfaceCapabilitiesKHR capabilities, GLFWwindow *window) {
-    if (capabilities.currentExtent.width == UINT32_MAX) {
-        return capabilities.currentExtent;
+static const char *gpu_profiler_draw_batch_names[GPU_PROFILER_DRAW_BATCHES] = {"draws 0", "draws 1", "draws 2", "draws 3"};
+
+/* Reserves a scope per batch of draws, returns how many batches there are. Fewer than GPU_PROFILER_DRAW_BATCHES when there is less to split */
+uint32_t vulkanProfilerReserveDraws(GpuProfiler *profiler, uint32_t image_index, uint32_t parts, uint32_t *scopes) {
+    uint32_t batches = parts < GPU_PROFILER_DRAW_BATCHES ? parts : GPU_PROFILER_DRAW_BATCHES;
+    for (uint32_t i=0; i<batches; ++i) {
+        scopes[i] = vulkanProfilerReserve(profiler, image_index, gpu_profiler_draw_batch_names[i]);
     }
-        
-    int32_t width, height;
-    glfwGetFramebufferSize(window, &width, &height);
-    
-    VkExtent2D extent;
+    return batches;
+}
 
-    // clamping values
-    extent.width = uint32Clamp (
-        (uint32_t)width, 
-        capabilities.minImageExtent.width,
-        capabilities.maxImageExtent.width
-    );
 
-    extent.height = uint32Clamp (
+void vulkanProfilerEnd(GpuProfiler *profiler, VkCommandBuffer command_buffer, uint32_t image_index, uint32_t scope) {
+    if (profiler == NULL || scope == GPU_PROFILER_NONE) {
+        return;
+    }
+
+    uint32_t query = image_index * GPU_PROFILER_MAX_SCOPES + scope;
+    if (profiler->recorded_statistics[image_index] & (1u << scope)) {
+        vkCmdEndQuery(command_buffer, profiler->statistics, query);
+    }
+    vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, profiler->timestamps, query * 2 + 1);
+}
+
+
+VkCommandBuffer vulkanCreateCommandBuffer(VkDevice device, VkCommandPool pool) {
+    VkCommandBufferAllocateInfo buffer_info = {0};
+    buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    buffer_info.commandPool = pool;
+    buffer_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    buffer_info.commandBufferCount = 1;
+
+    VkResult res;
+    VkCommandBuffer buffer;
+    if ((res = vkAllocateCommandBuffers(device, &buffer_info, &buffer)) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create command buffer. Error code: %d", res);
+        exit(1);
+    }
+
+    fprintf(stderr, "INFO: Command buffer created successfully\n");
+    return buffer;
+}
+
+
+bool vulkanTryGetSampleCount(VkPhysicalDevice device, VkSampleCountFlagBits count) {
+    VkPhysicalDeviceProperties props; 
+    vkGetPhysicalDeviceProperties(device, &props);
+
+    return (props.limits.framebufferColorSampleCounts & props.limits.framebufferDepthSampleCounts) & count;
+}
+
+
+/* Render pass always resolves, so at least 2 samples are needed. 4 is guaranteed by the spec */
+VkSampleCountFlagBits vulkanBestSampleCount(VkPhysicalDevice device, VkSampleCountFlagBits max) {
+    VkSampleCountFlagBits counts[] = {VK_SAMPLE_COUNT_8_BIT, VK_SAMPLE_COUNT_4_BIT, VK_SAMPLE_COUNT_2_BIT};
+    for (size_t i=0; i<sizeof counts / sizeof(VkSampleCountFlagBits); ++i) {
+        if (counts[i] <= max && vulkanTryGetSampleCount(device, counts[i])) {
+            return counts[i];
+        }
+    }
+    return (VkSampleCountFlagBits)0;
+}
+
+
+bool vulkanHasExtension(VkExtensionProperties *extensions, uint32_t extension_count, const char *name) {
+    for (uint32_t i=0; i<extension_count; ++i) {
+        if (strcmp(extensions[i].extensionName, name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+bool vulkanHasExtensions(VkExtensionProperties *extensions, uint32_t extension_count, const char **names, size_t names_count) {
+    for (size_t i=0; i<names_count; ++i) {
+        if (!vulkanHasExtension(extensions, extension_count, names[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+bool vulkanInstanceHasExtension(const char *name) {
+    uint32_t extension_count;
+    vkEnumerateInstanceExtensionProperties(NULL, &extension_count, NULL);
+    VkExtensionProperties extensions[extension_count];
+    vkEnumerateInstanceExtensionProperties(NULL, &extension_count, extensions);
+    return vulkanHasExtension(extensions, extension_count, name);
+}
+
+
+/* Device extensions optional capabilities need, dependencies included. Only what is core in Vulkan 1.0 is left out */
+static const char *timeline_semaphore_extensions[] = {
+    VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME
+};
+static const char *descriptor_indexing_extensions[] = {
+    VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME,
+    VK_KHR_MAINTENANCE_3_EXTENSION_NAME
+};
+static const char *dynamic_rendering_extensions[] = {
+    VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME,
+    VK_KHR_DEPTH_STENCIL_RESOLVE_EXTENSION_NAME,
+    VK_KHR_CREATE_RENDERPASS_2_EXTENSION_NAME,
+    VK_KHR_MULTIVIEW_EXTENSION_NAME,
+    VK_KHR_MAINTENANCE_2_EXTENSION_NAME
+};
+static const char *present_wait_extensions[] = {
+    VK_KHR_PRESENT_ID_EXTENSION_NAME,
+    VK_KHR_PRESENT_WAIT_EXTENSION_NAME
+};
+static const char *mesh_shader_extensions[] = {
+    VK_EXT_MESH_SHADER_EXTENSION_NAME,
+    VK_KHR_SPIRV_1_4_EXTENSION_NAME,
+    VK_KHR_SHADER_FLOAT_CONTROLS_EXTENSION_NAME
+};
+static const char *swapchain_maintenance1_extensions[] = {
+    VK_EXT_SWAPCHAIN_MAINTENANCE_1_EXTENSION_NAME
+};
+// instance side of swapchain maintenance1, vulkanInit enables them for windowed runs when both are there
+static const char *surface_maintenance1_extensions[] = {
+    VK_KHR_GET_SURFACE_CAPABILITIES_2_EXTENSION_NAME,
+    VK_EXT_SURFACE_MAINTENANCE_1_EXTENSION_NAME
+};
+#define EXTENSIONS_LEN(array) (sizeof array / sizeof(const char *))
+
+
+/* Vulkan 1.1 when the loader has it, mesh shaders can't work on a 1.0 instance. Nothing else depends on the version */
+uint32_t vulkanInstanceApiVersion() {
+    PFN_vkEnumerateInstanceVersion enumerate_version = (PFN_vkEnumerateInstanceVersion)vkGetInstanceProcAddr(NULL, "vkEnumerateInstanceVersion");
+    uint32_t version = VK_API_VERSION_1_0;
+    // 1.0 loaders don't have the function at all
+    if (enumerate_version == NULL || enumerate_version(&version) != VK_SUCCESS) {
+        return VK_API_VERSION_1_0;
+    }
+    return version >= VK_API_VERSION_1_1 ? VK_API_VERSION_1_1 : VK_API_VERSION_1_0;
+}
+
+
+GpuCapabilities vulkanQueryCapabilities(VkInstance instance, VkPhysicalDevice device) {
+    GpuCapabilities caps = {0};
+
+    VkPhysicalDeviceFeatures features;
+    vkGetPhysicalDeviceFeatures(device, &features);
+    caps.sampleRateShading = features.sampleRateShading;
+    caps.drawIndirectFirstInstance = features.drawIndirectFirstInstance;
+    caps.multiDrawIndirect = features.multiDrawIndirect;
+    caps.pipelineStatisticsQuery = features.pipelineStatisticsQuery;
+    caps.inheritedQueries = features.inheritedQueries;
+    caps.shaderStorageBufferArrayDynamicIndexing = features.shaderStorageBufferArrayDynamicIndexing;
+    caps.fillModeNonSolid = features.fillModeNonSolid;
+
+    uint32_t extension_count;
+    vkEnumerateDeviceExtensionProperties(device, NULL, &extension_count, NULL);
+    VkExtensionProperties extensions[extension_count];
+    vkEnumerateDeviceExtensionProperties(device, NULL, &extension_count, extensions);
+
+    caps.drawIndirectCount = vulkanHasExtension(extensions, extension_count, VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+
+    // vulkanInit enables VK_KHR_get_physical_device_properties2 whenever it is available
+    PFN_vkGetPhysicalDeviceFeatures2 get_features2 = (PFN_vkGetPhysicalDeviceFeatures2)vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceFeatures2KHR");
+    if (get_features2 == NULL) {
+        return caps;
+    }
+    caps.memoryBudget = vulkanHasExtension(extensions, extension_count, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+
+    bool has_timeline = vulkanHasExtensions(extensions, extension_count, timeline_semaphore_extensions, EXTENSIONS_LEN(timeline_semaphore_extensions));
+    bool has_indexing = vulkanHasExtensions(extensions, extension_count, descriptor_indexing_extensions, EXTENSIONS_LEN(descriptor_indexing_extensions));
+    bool has_dynamic_rendering = vulkanHasExtensions(extensions, extension_count, dynamic_rendering_extensions, EXTENSIONS_LEN(dynamic_rendering_extensions));
+    bool has_present_wait = vulkanHasExtensions(extensions, extension_count, present_wait_extensions, EXTENSIONS_LEN(present_wait_extensions));
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(device, &props);
+    bool has_mesh_shader = 
+        props.apiVersion >= VK_API_VERSION_1_1 && vulkanInstanceApiVersion() >= VK_API_VERSION_1_1 &&
+        vulkanHasExtensions(extensions, extension_count, mesh_shader_extensions, EXTENSIONS_LEN(mesh_shader_extensions));
+    bool has_swapchain_maintenance1 = 
+        vulkanInstanceHasExtension(VK_EXT_SURFACE_MAINTENANCE_1_EXTENSION_NAME) && vulkanInstanceHasExtension(VK_KHR_GET_SURFACE_CAPABILITIES_2_EXTENSION_NAME) &&
+        vulkanHasExtensions(extensions, extension_count, swapchain_maintenance1_extensions, EXTENSIONS_LEN(swapchain_maintenance1_extensions));
+
+    // feature structs can be chained only for extensions the device has
+    void *chain = NULL;
+    VkPhysicalDeviceTimelineSemaphoreFeatures timeline = {0};
+    timeline.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+    if (has_timeline) {
+        timeline.pNext = chain;
+        chain = &timeline;
+    }
+    VkPhysicalDeviceDescriptorIndexingFeatures indexing = {0};
+    indexing.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES;
+    if (has_indexing) {
+        indexing.pNext = chain;
+        chain = &indexing;
+    }
+    VkPhysicalDeviceDynamicRenderingFeatures dynamic_rendering = {0};
+    dynamic_rendering.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES;
+    if (has_dynamic_rendering) {
+        dynamic_rendering.pNext = chain;
+        chain = &dynamic_rendering;
+    }
+    VkPhysicalDevicePresentIdFeaturesKHR present_id = {0};
+    present_id.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+    VkPhysicalDevicePresentWaitFeaturesKHR present_wait = {0};
+    present_wait.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+    if (has_present_wait) {
+        present_id.pNext = chain;
+        present_wait.pNext = &present_id;
+        chain = &present_wait;
+    }
+    VkPhysicalDeviceMeshShaderFeaturesEXT mesh_shader = {0};
+    mesh_shader.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MESH_SHADER_FEATURES_EXT;
+    if (has_mesh_shader) {
+        mesh_shader.pNext = chain;
+        chain = &mesh_shader;
+    }
+    VkPhysicalDeviceSwapchainMaintenance1FeaturesEXT swapchain_maintenance1 = {0};
+    swapchain_maintenance1.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SWAPCHAIN_MAINTENANCE_1_FEATURES_EXT;
+    if (has_swapchain_maintenance1) {
+        swapchain_maintenance1.pNext = chain;
+        chain = &swapchain_maintenance1;
+    }
+
+    VkPhysicalDeviceFeatures2 features2 = {0};
+    features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    features2.pNext = chain;
+    get_features2(device, &features2);
+
+    caps.timelineSemaphore = timeline.timelineSemaphore;
+    caps.dynamicRendering = dynamic_rendering.dynamicRendering;
+    caps.presentWait = present_id.presentId && present_wait.presentWait;
+    caps.meshShader = mesh_shader.taskShader && mesh_shader.meshShader;
+    caps.swapchainMaintenance1 = swapchain_maintenance1.swapchainMaintenance1;
+    // the subset bindless textures need, see vulkanEnableDescriptorIndexing
+    caps.descriptorIndexing = 
+        indexing.runtimeDescriptorArray &&
+        indexing.descriptorBindingPartiallyBound &&
+        indexing.descriptorBindingVariableDescriptorCount &&
+        indexing.descriptorBindingSampledImageUpdateAfterBind &&
+        indexing.descriptorBindingUpdateUnusedWhilePending &&
+        indexing.shaderSampledImageArrayNonUniformIndexing;
+
+    return caps;
+}
+
+
+VkPhysicalDeviceDescriptorIndexingFeatures vulkanEnableDescriptorIndexing() {
+    VkPhysicalDeviceDescriptorIndexingFeatures indexing = {0};
+    indexing.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES;
+    indexing.runtimeDescriptorArray = VK_TRUE;
+    indexing.descriptorBindingPartiallyBound = VK_TRUE;
+    indexing.descriptorBindingVariableDescriptorCount = VK_TRUE;
+    indexing.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+    indexing.descriptorBindingUpdateUnusedWhilePending = VK_TRUE;
+    indexing.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+    return indexing;
+}
+
+
+/* Higher is better. Device type dominates, then memory, queue layout, MSAA and optional features break ties */
+uint64_t vulkanScoreGpu(GPU candidate) {
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(candidate.device, &props);
+
+    uint64_t score = 0;
+    switch (props.deviceType) {
+        case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:   score += 10000; break;
+        case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: score += 5000;  break;
+        case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:    score += 2000;  break;
+        case VK_PHYSICAL_DEVICE_TYPE_CPU:            score += 100;   break;
+        default:                                     score += 500;   break;
+    }
+
+    /* Largest device local heap, a point per 64MB up to 64GB */ {
+        VkPhysicalDeviceMemoryProperties memory_props;
+        vkGetPhysicalDeviceMemoryProperties(candidate.device, &memory_props);
+
+        VkDeviceSize largest_heap = 0;
+        for (uint32_t i=0; i<memory_props.memoryHeapCount; ++i) {
+            VkMemoryHeap heap = memory_props.memoryHeaps[i];
+            if ((heap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) && heap.size > largest_heap) {
+                largest_heap = heap.size;
+            }
+        }
+        VkDeviceSize heap_points = largest_heap / (64ull << 20);
+        score += heap_points < 1024 ? heap_points : 1024;
+    }
+
+    // one family for both means no queue ownership transfers and a single queue
+    if (candidate.graphicsFamilyIndex == candidate.presentFamilyIndex) {
+        score += 500;
+    }
+    score += candidate.multisampling * 50;
+
+    GpuCapabilities caps = candidate.caps;
+    bool features[] = {
+        caps.sampleRateShading, caps.drawIndirectFirstInstance, caps.multiDrawIndirect, caps.drawIndirectCount,
+        caps.pipelineStatisticsQuery, caps.inheritedQueries, caps.timelineSemaphore, caps.descriptorIndexing, caps.dynamicRendering, caps.memoryBudget,
+        caps.presentWait, caps.meshShader, caps.swapchainMaintenance1
+    };
+    for (size_t i=0; i<sizeof features / sizeof(bool); ++i) {
+        score += features[i] ? 100 : 0;
+    }
+
+    return score;
+}
+
+
+void vulkanPrintMemoryBudget(VkInstance instance, GPU gpu) {
+    if (!gpu.caps.memoryBudget) {
+        return;
+    }
+
+    PFN_vkGetPhysicalDeviceMemoryProperties2 get_memory_properties2 = (PFN_vkGetPhysicalDeviceMemoryProperties2)vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceMemoryProperties2KHR");
+    if (get_memory_properties2 == NULL) {
+        return;
+    }
+
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budget = {0};
+    budget.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+    VkPhysicalDeviceMemoryProperties2 props = {0};
+    props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+    props.pNext = &budget;
+    get_memory_properties2(gpu.device, &props);
+
+    for (uint32_t i=0; i<props.memoryProperties.memoryHeapCount; ++i) {
+        VkMemoryHeap heap = props.memoryProperties.memoryHeaps[i];
+        fprintf(stderr, "INFO: Heap(%u)%s: %llu MB, budget %llu MB, used %llu MB\n", i,
+            heap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT ? " device local" : "",
+            (unsigned long long)(heap.size >> 20),
+            (unsigned long long)(budget.heapBudget[i] >> 20),
+            (unsigned long long)(budget.heapUsage[i] >> 20));
+    }
+}
+
+
+/* 
+ * Every usable device is scored and the best one wins. 
+ * surface is VK_NULL_HANDLE in headless mode, then there is no present support and swapchain requirements 
+ */
+GPU vulkanChooseGpu(VkInstance instance, VkSurfaceKHR surface) {
+    uint32_t device_count = 0;
+    vkEnumeratePhysicalDevices(instance, &device_count, NULL);
+
+    if (device_count == 0) {
+        fprintf(stderr, "ERROR: Failed to find GPU that supports Vulkan");
+        exit(1);
+    }
+
+    GPU target_gpu = {0};
+    target_gpu.device = VK_NULL_HANDLE;
+    target_gpu.graphicsFamilyIndex = NO_QUEUE_FAMILY;
+    target_gpu.presentFamilyIndex = NO_QUEUE_FAMILY;
+    uint64_t target_score = 0;
+
+    VkPhysicalDevice devices[device_count];
+    vkEnumeratePhysicalDevices(instance, &device_count, devices);
+
+    for (uint32_t i=0;i<device_count;++i) {
+        VkPhysicalDevice device = devices[i];
+        VkPhysicalDeviceProperties props;
+        vkGetPhysicalDeviceProperties(device, &props);
+
+        GPU candidate = {0};
+        candidate.device = device;
+        candidate.graphicsFamilyIndex = NO_QUEUE_FAMILY;
+        candidate.presentFamilyIndex = NO_QUEUE_FAMILY;
+        candidate.headless = surface == VK_NULL_HANDLE;
+        
+        /* Queue families, a family that can do both is preferred */ {
+            uint32_t queue_family_count;
+            vkGetPhysicalDeviceQueueFamilyProperties(device, &queue_family_count, NULL);
+            VkQueueFamilyProperties queue_families[queue_family_count]; 
+            vkGetPhysicalDeviceQueueFamilyProperties(device, &queue_family_count, queue_families);
+    
+            for (uint32_t i=0;i<queue_family_count;++i) {
+                bool supports_graphics = queue_families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT;
+                
+                VkBool32 supports_present = false;
+                if (candidate.headless) {
+                    supports_present = supports_graphics;
+                } else {
+                    vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &supports_present);
+                }
+
+                if (supports_graphics && supports_present) {
+                    candidate.graphicsFamilyIndex = i;
+                    candidate.presentFamilyIndex = i;
+                    break;
+                }
+                if (supports_graphics && candidate.graphicsFamilyIndex == NO_QUEUE_FAMILY) {
+                    candidate.graphicsFamilyIndex = i;
+                }
+                if (supports_present && candidate.presentFamilyIndex == NO_QUEUE_FAMILY) {
+                    candidate.presentFamilyIndex = i;
+                }
+            }
+            
+            if (candidate.graphicsFamilyIndex == NO_QUEUE_FAMILY ||
+                candidate.presentFamilyIndex == NO_QUEUE_FAMILY) {
+                fprintf(stderr, "INFO: GPU(%u) %s: skipped, no graphics or present queue\n", i, props.deviceName);
+                continue;
+            }
+        } 
+
+        /* Check if we can use swap chain extensions */ if (!candidate.headless) {
+            uint32_t extension_count;
+            vkEnumerateDeviceExtensionProperties(device, NULL, &extension_count, NULL);
+            VkExtensionProperties extensions[extension_count];
+            vkEnumerateDeviceExtensionProperties(device, NULL, &extension_count, extensions);
+    
+            if (!vulkanHasExtension(extensions, extension_count, VK_KHR_SWAPCHAIN_EXTENSION_NAME)) {
+                fprintf(stderr, "INFO: GPU(%u) %s: skipped, no swapchain support\n", i, props.deviceName);
+                continue;  
+            } 
+        }
+
+        /* Best MSAA up to 8x, @TODO: unhardcode */ 
+        candidate.multisampling = vulkanBestSampleCount(device, VK_SAMPLE_COUNT_8_BIT);
+        if (candidate.multisampling == 0) {
+            fprintf(stderr, "INFO: GPU(%u) %s: skipped, no MSAA support\n", i, props.deviceName);
+            continue;
+        }
+
+        candidate.caps = vulkanQueryCapabilities(instance, device);
+
+        uint64_t score = vulkanScoreGpu(candidate);
+        fprintf(stderr, "INFO: GPU(%u) %s: score %llu\n", i, props.deviceName, (unsigned long long)score);
+        if (score > target_score) {
+            target_gpu = candidate;
+            target_score = score;
+        }
+    }
+
+    if (target_gpu.device == VK_NULL_HANDLE) {
+        fprintf(stderr, "ERROR: Supported GPU was found, but it not suitable for rendering");
+        exit(1);
+    }
+
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(target_gpu.device, &props);
+    fprintf(stderr, "INFO: Target gpu is %s\n", props.deviceName);
+
+    fprintf(stderr, "INFO: Graphics queue index(%lld), Present queue index(%lld), MSAA(%d)\n", target_gpu.graphicsFamilyIndex, target_gpu.presentFamilyIndex, target_gpu.multisampling);
+    GpuCapabilities caps = target_gpu.caps;
+    fprintf(stderr, "INFO: Capabilities: sample shading(%d), draw indirect count(%d), multi draw(%d), pipeline statistics(%d), timeline semaphores(%d), descriptor indexing(%d), dynamic rendering(%d), memory budget(%d), present wait(%d), mesh shaders(%d), present fences(%d)\n",
+        caps.sampleRateShading, caps.drawIndirectCount, caps.multiDrawIndirect, caps.pipelineStatisticsQuery, caps.timelineSemaphore, caps.descriptorIndexing, caps.dynamicRendering, caps.memoryBudget, caps.presentWait, caps.meshShader, caps.swapchainMaintenance1);
+    vulkanPrintMemoryBudget(instance, target_gpu);
+
+    return target_gpu;
+}
+
+
+VkSurfaceFormatKHR chooseSwapSurfaceFormat(SwapChainFormats formats) {
+    for (uint32_t i=0; i<formats.len; ++i) {
+        VkSurfaceFormatKHR format = formats.data[i];
+
+        if (format.format == VK_FORMAT_B8G8R8A8_SRGB &&
+            format.colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
+            return format; 
+        }
+    }
+    
+    fprintf(stderr, "Unable to found sufficient surface format");
+    exit(1);
+}
+
+
+const char *vulkanPresentModeName(VkPresentModeKHR mode) {
+    switch (mode) {
+        case VK_PRESENT_MODE_IMMEDIATE_KHR: return "immediate";
+        case VK_PRESENT_MODE_MAILBOX_KHR: return "mailbox";
+        case VK_PRESENT_MODE_FIFO_KHR: return "fifo";
+        case VK_PRESENT_MODE_FIFO_RELAXED_KHR: return "fifo relaxed";
+        default: return "unknown";
+    }
+}
+
+
+/* FIFO is the only mode every surface has */
+VkPresentModeKHR chooseSwapPresentMode(SwapChainPresentModes modes, VkPresentModeKHR requested) {
+    for (uint32_t i=0;i<modes.len;++i) {
+        VkPresentModeKHR mode = modes.data[i];
+        if (mode == requested) {
+            return mode;
+        }
+    }
+
+    fprintf(stderr, "INFO: Present mode %s is not supported, using fifo\n", vulkanPresentModeName(requested));
+    return VK_PRESENT_MODE_FIFO_KHR;
+}
+
+
+VkExtent2D chooseSwapExtent(VkSurfaceCapabilitiesKHR capabilities, GLFWwindow *window) {
+    if (capabilities.currentExtent.width == UINT32_MAX) {
+        return capabilities.currentExtent;
+    }
+        
+    int32_t width, height;
+    glfwGetFramebufferSize(window, &width, &height);
+    
+    VkExtent2D extent;
+
+    // clamping values
+    extent.width = uint32Clamp (
+        (uint32_t)width, 
+        capabilities.minImageExtent.width,
+        capabilities.maxImageExtent.width
+    );
+
+    extent.height = uint32Clamp (
         (uint32_t)height,
         capabilities.minImageExtent.height,
         capabilities.maxImageExtent.height
@@ -507,25 +1796,50 @@ VkExtent2D chooseSwapExtent(VkSurfaceCapabilitiesKHR capabilities, GLFWwindow *w
 
 
 
-VkInstance vulkanInit(const char *validation_layers[], size_t validation_layer_count) {
+void vulkanPushExtensions(const char **extensions, uint32_t *extension_count, const char **names, size_t names_count) {
+    for (size_t i=0; i<names_count; ++i) {
+        extensions[(*extension_count)++] = names[i];
+    }
+}
+
+
+/* Headless instance has no surface extensions, so glfw doesn't even have to be initialized */
+VkInstance vulkanInit(const char *validation_layers[], size_t validation_layer_count, bool headless) {
     VkApplicationInfo app_info = {0};
     app_info.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO; 
     app_info.pApplicationName = "Game?";
     app_info.pEngineName = "No Engine";
     // @LEAK?
     app_info.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-    app_info.apiVersion = VK_API_VERSION_1_0;
+    app_info.apiVersion = vulkanInstanceApiVersion();
 
     // i'm not going to bother myself with callbacks now, so no VK_EXT_debug_utils for now
     uint32_t glfw_extension_count = {0};
-    const char **glfw_extensions;
-    glfw_extensions = glfwGetRequiredInstanceExtensions(&glfw_extension_count);
+    const char **glfw_extensions = NULL;
+    if (!headless) {
+        glfw_extensions = glfwGetRequiredInstanceExtensions(&glfw_extension_count);
+    }
+    
+    // properties2 lets vulkanChooseGpu query features of extensions
+    const char *instance_extensions[glfw_extension_count + 3];
+    uint32_t instance_extension_count = 0;
+    for (uint32_t i=0; i<glfw_extension_count; ++i) {
+        instance_extensions[instance_extension_count++] = glfw_extensions[i];
+    }
+    if (vulkanInstanceHasExtension(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME)) {
+        instance_extensions[instance_extension_count++] = VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME;
+    }
+    bool surface_maintenance1 = 
+        vulkanInstanceHasExtension(surface_maintenance1_extensions[0]) && vulkanInstanceHasExtension(surface_maintenance1_extensions[1]);
+    if (!headless && surface_maintenance1) {
+        vulkanPushExtensions(instance_extensions, &instance_extension_count, surface_maintenance1_extensions, EXTENSIONS_LEN(surface_maintenance1_extensions));
+    }
     
     VkInstanceCreateInfo instance_info = {0};
     instance_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
     instance_info.pApplicationInfo = &app_info;
-    instance_info.enabledExtensionCount = glfw_extension_count;
-    instance_info.ppEnabledExtensionNames = glfw_extensions;
+    instance_info.enabledExtensionCount = instance_extension_count;
+    instance_info.ppEnabledExtensionNames = instance_extensions;
 
     /* Check if all validation layers are found */ {
         uint32_t available_layer_count;
@@ -564,28 +1878,119 @@ VkInstance vulkanInit(const char *validation_layers[], size_t validation_layer_c
 }
 
 
+/* Enables everything that is negotiated in gpu.caps */
 VkDevice createLogicalDevice(GPU gpu) {
-    VkDeviceQueueCreateInfo queue_create_info = {0};
-    queue_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-    queue_create_info.queueFamilyIndex = gpu.graphicsFamilyIndex;
-    queue_create_info.queueCount = 1;
     float queue_priority = 1;
-    queue_create_info.pQueuePriorities = &queue_priority;
+    QueueFamilyIndex families[2] = {gpu.graphicsFamilyIndex, gpu.presentFamilyIndex};
+    uint32_t queue_create_info_count = gpu.graphicsFamilyIndex == gpu.presentFamilyIndex ? 1 : 2;
+
+    VkDeviceQueueCreateInfo queue_create_infos[2] = {0};
+    for (uint32_t i=0; i<queue_create_info_count; ++i) {
+        queue_create_infos[i].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+        queue_create_infos[i].queueFamilyIndex = families[i];
+        queue_create_infos[i].queueCount = 1;
+        queue_create_infos[i].pQueuePriorities = &queue_priority;
+    }
 
     VkDeviceCreateInfo device_create_info = {0};
     device_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-    device_create_info.pQueueCreateInfos = &queue_create_info;
-    device_create_info.queueCreateInfoCount = 1;
-    // @TODO: learn what values it should be filles with
+    device_create_info.pQueueCreateInfos = queue_create_infos;
+    device_create_info.queueCreateInfoCount = queue_create_info_count;
     VkPhysicalDeviceFeatures device_features = {0};
-    // @SPEED: this thing slows down 
-    device_features.sampleRateShading = VK_TRUE;
+    // costs nothing until a pipeline enables sample shading
+    device_features.sampleRateShading = gpu.caps.sampleRateShading;
+    device_features.drawIndirectFirstInstance = gpu.caps.drawIndirectFirstInstance;
+    device_features.multiDrawIndirect = gpu.caps.multiDrawIndirect;
+    device_features.pipelineStatisticsQuery = gpu.caps.pipelineStatisticsQuery;
+    device_features.inheritedQueries = gpu.caps.inheritedQueries;
+    device_features.shaderStorageBufferArrayDynamicIndexing = gpu.caps.shaderStorageBufferArrayDynamicIndexing;
+    device_features.fillModeNonSolid = gpu.caps.fillModeNonSolid;
     device_create_info.pEnabledFeatures = &device_features;
     device_create_info.enabledLayerCount = 0;
-    // @TODO: unhardcode extenstions here and in PickGpu functions
-    const char *extension = VK_KHR_SWAPCHAIN_EXTENSION_NAME; 
-    device_create_info.ppEnabledExtensionNames = &extension;
-    device_create_info.enabledExtensionCount = 1;
+
+    /* Extension features */ 
+    void *chain = NULL;
+    VkPhysicalDeviceTimelineSemaphoreFeatures timeline = {0};
+    timeline.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+    timeline.timelineSemaphore = VK_TRUE;
+    if (gpu.caps.timelineSemaphore) {
+        timeline.pNext = chain;
+        chain = &timeline;
+    }
+    VkPhysicalDeviceDescriptorIndexingFeatures indexing = vulkanEnableDescriptorIndexing();
+    if (gpu.caps.descriptorIndexing) {
+        indexing.pNext = chain;
+        chain = &indexing;
+    }
+    VkPhysicalDeviceDynamicRenderingFeatures dynamic_rendering = {0};
+    dynamic_rendering.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES;
+    dynamic_rendering.dynamicRendering = VK_TRUE;
+    if (gpu.caps.dynamicRendering) {
+        dynamic_rendering.pNext = chain;
+        chain = &dynamic_rendering;
+    }
+    // there is nothing to present without a swapchain
+    bool present_wait_enabled = gpu.caps.presentWait && !gpu.headless;
+    VkPhysicalDevicePresentIdFeaturesKHR present_id = {0};
+    present_id.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+    present_id.presentId = VK_TRUE;
+    VkPhysicalDevicePresentWaitFeaturesKHR present_wait = {0};
+    present_wait.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+    present_wait.presentWait = VK_TRUE;
+    if (present_wait_enabled) {
+        present_id.pNext = chain;
+        present_wait.pNext = &present_id;
+        chain = &present_wait;
+    }
+    VkPhysicalDeviceMeshShaderFeaturesEXT mesh_shader = {0};
+    mesh_shader.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MESH_SHADER_FEATURES_EXT;
+    mesh_shader.taskShader = VK_TRUE;
+    mesh_shader.meshShader = VK_TRUE;
+    if (gpu.caps.meshShader) {
+        mesh_shader.pNext = chain;
+        chain = &mesh_shader;
+    }
+    bool swapchain_maintenance1_enabled = gpu.caps.swapchainMaintenance1 && !gpu.headless;
+    VkPhysicalDeviceSwapchainMaintenance1FeaturesEXT swapchain_maintenance1 = {0};
+    swapchain_maintenance1.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SWAPCHAIN_MAINTENANCE_1_FEATURES_EXT;
+    swapchain_maintenance1.swapchainMaintenance1 = VK_TRUE;
+    if (swapchain_maintenance1_enabled) {
+        swapchain_maintenance1.pNext = chain;
+        chain = &swapchain_maintenance1;
+    }
+    device_create_info.pNext = chain;
+
+    const char *extensions[24];
+    uint32_t extension_count = 0;
+    if (!gpu.headless) {
+        extensions[extension_count++] = VK_KHR_SWAPCHAIN_EXTENSION_NAME;
+    }
+    if (gpu.caps.drawIndirectCount) {
+        extensions[extension_count++] = VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME;
+    }
+    if (gpu.caps.memoryBudget) {
+        extensions[extension_count++] = VK_EXT_MEMORY_BUDGET_EXTENSION_NAME;
+    }
+    if (gpu.caps.timelineSemaphore) {
+        vulkanPushExtensions(extensions, &extension_count, timeline_semaphore_extensions, EXTENSIONS_LEN(timeline_semaphore_extensions));
+    }
+    if (gpu.caps.descriptorIndexing) {
+        vulkanPushExtensions(extensions, &extension_count, descriptor_indexing_extensions, EXTENSIONS_LEN(descriptor_indexing_extensions));
+    }
+    if (gpu.caps.dynamicRendering) {
+        vulkanPushExtensions(extensions, &extension_count, dynamic_rendering_extensions, EXTENSIONS_LEN(dynamic_rendering_extensions));
+    }
+    if (present_wait_enabled) {
+        vulkanPushExtensions(extensions, &extension_count, present_wait_extensions, EXTENSIONS_LEN(present_wait_extensions));
+    }
+    if (gpu.caps.meshShader) {
+        vulkanPushExtensions(extensions, &extension_count, mesh_shader_extensions, EXTENSIONS_LEN(mesh_shader_extensions));
+    }
+    if (swapchain_maintenance1_enabled) {
+        vulkanPushExtensions(extensions, &extension_count, swapchain_maintenance1_extensions, EXTENSIONS_LEN(swapchain_maintenance1_extensions));
+    }
+    device_create_info.ppEnabledExtensionNames = extensions;
+    device_create_info.enabledExtensionCount = extension_count;
 
     VkDevice device;
     int32_t err;
@@ -600,17 +2005,165 @@ VkDevice createLogicalDevice(GPU gpu) {
 
 
 // Maybe i should perform some checks when choosing gpu but whatever
-Swapchain vulkanInitSwapchain(GPU gpu, VkDevice logical_device, VkSurfaceKHR surface, GLFWwindow *window) { 
-    VkPhysicalDevice device = gpu.device;
+/* z buffer and MSAA color buffer, both depend only on swapchain extent and format */
+/* Scene goes through sceneColor and a fullscreen pass instead of straight into the swapchain image */
+bool vulkanSwapchainUsesPostPass(Swapchain swapchain) {
+    return swapchain.antiAliasing.mode == ANTI_ALIASING_FXAA || swapchain.scaled;
+}
 
-    SwapChainDetails details;
 
-    vkGetPhysicalDeviceSurfaceCapabilitiesKHR(device, surface, &details.capabilities);
+VkFormat vulkanFindZBufferFormat(GPU gpu) {
+    // software implementations don't always have D24
+    VkFormat desired_z_formats[] = {VK_FORMAT_D24_UNORM_S8_UINT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D32_SFLOAT};
 
+    for (size_t i=0; i<sizeof desired_z_formats / sizeof(VkFormat); ++i) {
+        VkFormatProperties props;
+        vkGetPhysicalDeviceFormatProperties(gpu.device, desired_z_formats[i], &props);
+        if (props.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT) {
+            return desired_z_formats[i];
+        }
+    }
 
-    vkGetPhysicalDeviceSurfaceFormatsKHR(device, surface, &details.formats.len, NULL);
-    details.formats.data = malloc(details.formats.len * sizeof(VkSurfaceFormatKHR));
-    vkGetPhysicalDeviceSurfaceFormatsKHR(device, surface, &details.formats.len, details.formats.data);
+    fprintf(stderr, "ERROR: Failed to find desired z buffer format");
+    exit(1);
+}
+
+
+/* Passes of the frame graph, post pass is there only when vulkanSwapchainUsesPostPass */
+enum {
+    FRAME_PASS_SCENE,
+    FRAME_PASS_POST,
+};
+
+/* 
+ * Scene pass draws into the MSAA buffer, sceneColor or straight into the output, post pass samples sceneColor into the output.
+ * Scene attachments are added as color, depth, resolve, clear values in vulkanRecordCommandBuffer follow that order
+ */
+RenderGraph vulkanSwapchainBuildGraph(Swapchain *swapchain) {
+    AntiAliasing aa = swapchain->antiAliasing;
+    bool msaa = aa.mode == ANTI_ALIASING_MSAA;
+    bool post = vulkanSwapchainUsesPostPass(*swapchain);
+    bool offscreen = swapchain->swapchain == VK_NULL_HANDLE;
+    VkFormat format = swapchain->surfaceFormat.format;
+
+    RenderGraph graph = {0};
+    // presented or read back
+    uint32_t output = renderGraphAddExternal(&graph, format, offscreen ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+    uint32_t scene_output = post ? renderGraphAddResource(&graph, format, VK_SAMPLE_COUNT_1_BIT) : output;
+    uint32_t color = msaa ? renderGraphAddResource(&graph, format, aa.samples) : scene_output;
+    uint32_t depth = renderGraphAddResource(&graph, swapchain->zBufferFormat, aa.samples);
+
+    uint32_t scene = renderGraphAddPass(&graph);
+    renderGraphUse(&graph, scene, color, RENDER_GRAPH_COLOR);
+    renderGraphUse(&graph, scene, depth, RENDER_GRAPH_DEPTH);
+    if (msaa) {
+        renderGraphUse(&graph, scene, scene_output, RENDER_GRAPH_RESOLVE);
+    }
+
+    if (post) {
+        uint32_t post_pass = renderGraphAddPass(&graph);
+        renderGraphUse(&graph, post_pass, scene_output, RENDER_GRAPH_SAMPLED);
+        // fullscreen triangle overwrites every pixel
+        renderGraphUse(&graph, post_pass, output, RENDER_GRAPH_COLOR_OVERWRITE);
+    }
+
+    renderGraphCompile(&graph);
+    swapchain->sceneColorResource = post ? scene_output : RENDER_GRAPH_NONE;
+    return graph;
+}
+
+
+/* 
+ * Creates internal resources of the graph, suballocated from swapchain->attachmentMemory. 
+ * Old attachments have to be freed (or retired with the old swapchain) before
+ */
+void vulkanSwapchainCreateAttachments(GPU gpu, VkDevice device, Swapchain *swapchain, RenderGraph *graph) {
+    VkExtent2D extent = swapchain->extent;
+
+    VkImage images[RENDER_GRAPH_MAX_RESOURCES] = {0};
+    VkImageUsageFlags usages[RENDER_GRAPH_MAX_RESOURCES] = {0};
+    VkMemoryRequirements reqs[RENDER_GRAPH_MAX_RESOURCES] = {0};
+    for (uint32_t r=0; r<graph->resource_count; ++r) {
+        RenderGraphResource resource = graph->resources[r];
+        if (resource.external || resource.first_pass == RENDER_GRAPH_NONE) {
+            continue;
+        }
+        usages[r] = renderGraphImageUsage(graph, r);
+
+        VkImageCreateInfo image_info = {0};
+        image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        image_info.imageType = VK_IMAGE_TYPE_2D;
+        image_info.extent.width = extent.width;
+        image_info.extent.height = extent.height;
+        image_info.extent.depth = 1;
+        image_info.mipLevels = 1;
+        image_info.arrayLayers = 1;
+        image_info.format = resource.format;
+        image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+        image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        image_info.usage = usages[r];
+        image_info.samples = resource.samples;
+        VK_CHECK(vkCreateImage(device, &image_info, NULL, &images[r]));
+        vkGetImageMemoryRequirements(device, images[r], &reqs[r]);
+    }
+
+    for (int kind=0; kind<ATTACHMENT_MEMORY_KINDS; ++kind) {
+        bool transient = kind == ATTACHMENT_MEMORY_TRANSIENT;
+        VkDeviceSize offsets[RENDER_GRAPH_MAX_RESOURCES] = {0};
+        VkDeviceSize size = renderGraphPlaceMemory(graph, transient, reqs, offsets);
+
+        VkImage kind_images[RENDER_GRAPH_MAX_RESOURCES];
+        VkDeviceSize kind_offsets[RENDER_GRAPH_MAX_RESOURCES];
+        size_t count = 0;
+        for (uint32_t r=0; r<graph->resource_count; ++r) {
+            if (images[r] != VK_NULL_HANDLE && graph->resources[r].transient == transient) {
+                kind_images[count] = images[r];
+                kind_offsets[count] = offsets[r];
+                count += 1;
+            }
+        }
+
+        // tilers keep transient attachments in tile memory, lazily allocated memory never gets backed then
+        VkMemoryPropertyFlags preferred = transient ? VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT : 0;
+        vulkanBindAttachmentMemory(gpu, device, &swapchain->attachmentMemory[kind], kind_images, kind_offsets, count, size, preferred);
+    }
+
+    for (uint32_t r=0; r<graph->resource_count; ++r) {
+        if (images[r] == VK_NULL_HANDLE) {
+            continue;
+        }
+
+        VkImageViewCreateInfo view_info = {0};
+        view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        view_info.image = images[r];
+        view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        view_info.format = graph->resources[r].format;
+        view_info.subresourceRange.aspectMask = (usages[r] & VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT) ? VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT;
+        view_info.subresourceRange.baseMipLevel = 0;
+        view_info.subresourceRange.levelCount = 1;
+        view_info.subresourceRange.baseArrayLayer = 0;
+        view_info.subresourceRange.layerCount = 1;
+
+        VkImageView view;
+        VK_CHECK(vkCreateImageView(device, &view_info, NULL, &view));
+        // memory belongs to attachmentMemory, freeVulkanImage won't free it
+        swapchain->attachments[r] = (VulkanImage){images[r], VK_NULL_HANDLE, view};
+    }
+}
+
+
+Swapchain vulkanInitSwapchain(GPU gpu, VkDevice logical_device, VkSurfaceKHR surface, GLFWwindow *window, VkPresentModeKHR present_mode, VkSwapchainKHR old_swapchain) { 
+    VkPhysicalDevice device = gpu.device;
+
+    SwapChainDetails details;
+
+    vkGetPhysicalDeviceSurfaceCapabilitiesKHR(device, surface, &details.capabilities);
+
+
+    vkGetPhysicalDeviceSurfaceFormatsKHR(device, surface, &details.formats.len, NULL);
+    details.formats.data = malloc(details.formats.len * sizeof(VkSurfaceFormatKHR));
+    vkGetPhysicalDeviceSurfaceFormatsKHR(device, surface, &details.formats.len, details.formats.data);
 
 #if 0
     fprintf(stderr, "INFO: available surfaces:\n");
@@ -638,7 +2191,7 @@ Swapchain vulkanInitSwapchain(GPU gpu, VkDevice logical_device, VkSurfaceKHR sur
         exit(1);
     }
  
-    VkPresentModeKHR mode = chooseSwapPresentMode(details.presentModes);
+    VkPresentModeKHR mode = chooseSwapPresentMode(details.presentModes, present_mode);
     uint32_t image_count = uint32Clamp (
             details.capabilities.minImageCount + 1,
             details.capabilities.minImageCount,
@@ -646,12 +2199,6 @@ Swapchain vulkanInitSwapchain(GPU gpu, VkDevice logical_device, VkSurfaceKHR sur
     );
 
     VkSurfaceFormatKHR format = chooseSwapSurfaceFormat(details.formats);
-   
-    // @TODO: support sharing between queues
-    if (gpu.graphicsFamilyIndex != gpu.presentFamilyIndex) {
-        fprintf(stderr, "Graphics and Present queues differ and sharing of swap chain images is not supported");
-        exit(1);
-    }
 
     VkExtent2D extent = chooseSwapExtent(details.capabilities, window);
 
@@ -665,17 +2212,29 @@ Swapchain vulkanInitSwapchain(GPU gpu, VkDevice logical_device, VkSurfaceKHR sur
     swapchain_info.imageArrayLayers = 1;
     swapchain_info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
     swapchain_info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    // @SPEED: exclusive images with queue family ownership transfers are faster, but such devices are rare
+    uint32_t queue_families[] = {gpu.graphicsFamilyIndex, gpu.presentFamilyIndex};
+    if (gpu.graphicsFamilyIndex != gpu.presentFamilyIndex) {
+        swapchain_info.imageSharingMode = VK_SHARING_MODE_CONCURRENT;
+        swapchain_info.queueFamilyIndexCount = 2;
+        swapchain_info.pQueueFamilyIndices = queue_families;
+    }
     swapchain_info.preTransform = details.capabilities.currentTransform;
     swapchain_info.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
     swapchain_info.presentMode = mode;
     swapchain_info.clipped = VK_FALSE;
-    swapchain_info.oldSwapchain = VK_NULL_HANDLE;
+    // lets the driver reuse resources and keep presenting the old images while the new ones are set up
+    swapchain_info.oldSwapchain = old_swapchain;
     
     VkSwapchainKHR swapchain;
     VkResult err;
     VK_CHECK(vkCreateSwapchainKHR(logical_device, &swapchain_info, NULL, &swapchain));
 
     vkGetSwapchainImagesKHR(logical_device, swapchain, &image_count, NULL); 
+    if (image_count > MAX_SWAPCHAIN_IMAGES) {
+        fprintf(stderr, "ERROR: swapchain has %u images, at most %d are supported", image_count, MAX_SWAPCHAIN_IMAGES);
+        exit(1);
+    }
     VkImage *images = malloc(image_count * sizeof(VkImageView));
     if (images == NULL) {
         fprintf(stderr, "ERROR: failed to allocate memory for swapchain images");
@@ -711,27 +2270,44 @@ Swapchain vulkanInitSwapchain(GPU gpu, VkDevice logical_device, VkSurfaceKHR sur
         }
     }
 
-    VulkanImage z_buffer;
-    VkFormat found_z_format;
-    /* z buffer */ {
-        VkFormat desired_z_formats[] = {VK_FORMAT_D24_UNORM_S8_UINT};
+    /* cleanup, @TODO: probaly allocations shouldn't be here in the first place */ {
+        free(details.formats.data); 
+        free(details.presentModes.data);
+    }
 
-        bool found = false;
-        for (size_t i=0; i<sizeof desired_z_formats / sizeof(VkFormat); ++i) {
-            VkFormatProperties props;
-            vkGetPhysicalDeviceFormatProperties(device, desired_z_formats[i], &props);
-            if (props.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT) {
-                found_z_format = desired_z_formats[i];
-                found = true;
-                break;
-            }
-        }
+    //fprintf(stderr, "INFO: Swapchain created successfully\n");
+    Swapchain result = {0};
+    result.swapchain = swapchain;
+    result.presentMode = mode;
+    result.surfaceFormat = format;
+    result.extent = extent;
+    result.images = images;
+    result.views = views;
+    result.imageCount = image_count;
+    result.sceneColorResource = RENDER_GRAPH_NONE;
+    result.renderExtent = extent;
+    return result;
+}
 
-        if (!found) {
-            fprintf(stderr, "ERROR: Failed to find desired z buffer format");
-            exit(1);
-        }
 
+/* 
+ * Headless replacement of the swapchain: our own images that are never presented, one per frame in flight.
+ * Render pass leaves them in TRANSFER_SRC_OPTIMAL so frames can be read back
+ */
+Swapchain vulkanInitOffscreenSwapchain(GPU gpu, VkDevice logical_device, VkExtent2D extent) {
+    uint32_t image_count = MAX_FRAMES_IN_FLIGHT;
+    VkImage *images = malloc(image_count * sizeof(VkImage));
+    VkImageView *views = malloc(image_count * sizeof(VkImageView));
+    VkDeviceMemory *memories = malloc(image_count * sizeof(VkDeviceMemory));
+    if (images == NULL || views == NULL || memories == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate memory for offscreen images");
+        exit(1);
+    }
+
+    // stays rgba, so readback doesn't need swizzling
+    VkSurfaceFormatKHR format = {VK_FORMAT_R8G8B8A8_SRGB, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR};
+
+    for (uint32_t i=0; i<image_count; ++i) {
         VkImageCreateInfo image_info = {0};
         image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
         image_info.imageType = VK_IMAGE_TYPE_2D;
@@ -740,93 +2316,72 @@ Swapchain vulkanInitSwapchain(GPU gpu, VkDevice logical_device, VkSurfaceKHR sur
         image_info.extent.depth = 1;
         image_info.mipLevels = 1;
         image_info.arrayLayers = 1;
-        image_info.format = found_z_format;
+        image_info.format = format.format;
         image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
         image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
         image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-        image_info.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
-        image_info.samples = gpu.multisampling;
+        image_info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+        image_info.samples = VK_SAMPLE_COUNT_1_BIT;
 
         VkImageViewCreateInfo view_info = {0};
         view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
         view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
-        view_info.format = found_z_format;
-        view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+        view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
         view_info.subresourceRange.baseMipLevel = 0;
         view_info.subresourceRange.levelCount = 1;
         view_info.subresourceRange.baseArrayLayer = 0;
         view_info.subresourceRange.layerCount = 1;
-        
-        z_buffer = vulkanCreateImage(
-            gpu,
-            logical_device,
-            image_info,
-            view_info,
-            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
-        );    
-    }
-
-    VulkanImage MSAAbuffer;
-    /* MSAA */ {
-        VkImageCreateInfo MSAA_buffer_info = {0};
-        MSAA_buffer_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-        MSAA_buffer_info.imageType = VK_IMAGE_TYPE_2D;
-        MSAA_buffer_info.extent.width = extent.width;
-        MSAA_buffer_info.extent.height = extent.height;
-        MSAA_buffer_info.extent.depth = 1;
-        MSAA_buffer_info.mipLevels = 1;
-        MSAA_buffer_info.arrayLayers = 1;
-        MSAA_buffer_info.format = format.format;
-        MSAA_buffer_info.tiling = VK_IMAGE_TILING_OPTIMAL;
-        MSAA_buffer_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        MSAA_buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE; 
-        MSAA_buffer_info.usage = VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT |VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
-        MSAA_buffer_info.samples = gpu.multisampling;
-
-        VkImageViewCreateInfo MSAA_buffer_view_info = {0};
-        MSAA_buffer_view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-        MSAA_buffer_view_info.format = format.format;
-        MSAA_buffer_view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
-        MSAA_buffer_view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        MSAA_buffer_view_info.subresourceRange.layerCount = 1;
-        MSAA_buffer_view_info.subresourceRange.levelCount = 1;
-        MSAA_buffer_view_info.subresourceRange.baseArrayLayer = 0;
-        MSAA_buffer_view_info.subresourceRange.baseMipLevel = 0;
-
-        MSAAbuffer = vulkanCreateImage(
-                gpu, 
-                logical_device, 
-                MSAA_buffer_info,
-                MSAA_buffer_view_info,
-                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
-        );
-    } 
 
-    /* cleanup, @TODO: probaly allocations shouldn't be here in the first place */ {
-        free(details.formats.data); 
-        free(details.presentModes.data);
+        VulkanImage image = vulkanCreateImage(gpu, logical_device, image_info, view_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        images[i] = image.image;
+        views[i] = image.view;
+        memories[i] = image.memory;
     }
 
-    //fprintf(stderr, "INFO: Swapchain created successfully\n");
-    return (Swapchain) {
-        swapchain,
-        mode, 
-        format,
-        found_z_format,
-        extent,
-        images,
-        views,
-        image_count,
-        z_buffer,
-        NULL,
-        0,
-        MSAAbuffer,
-        NULL
-    };
+    Swapchain result = {0};
+    result.swapchain = VK_NULL_HANDLE;
+    result.presentMode = VK_PRESENT_MODE_FIFO_KHR;
+    result.surfaceFormat = format;
+    result.extent = extent;
+    result.images = images;
+    result.views = views;
+    result.imageCount = image_count;
+    result.imageMemories = memories;
+    result.sceneColorResource = RENDER_GRAPH_NONE;
+    result.renderExtent = extent;
+
+    fprintf(stderr, "INFO: Offscreen images created successfully(%ux%u)\n", extent.width, extent.height);
+    return result;
+}
+
+
+VkFramebuffer vulkanCreateGraphFramebuffer(VkDevice device, Swapchain *swapchain, RenderGraph *graph, uint32_t pass_index, VkRenderPass render_pass, size_t image_index) {
+    RenderGraphPass *pass = &graph->passes[pass_index];
+
+    VkImageView views[RENDER_GRAPH_MAX_ACCESSES];
+    for (uint32_t a=0; a<pass->attachment_count; ++a) {
+        uint32_t resource = pass->attachment_resources[a];
+        views[a] = graph->resources[resource].external ? swapchain->views[image_index] : swapchain->attachments[resource].view;
+    }
+
+    VkFramebufferCreateInfo framebuffer_info = {0};
+    framebuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+    framebuffer_info.renderPass = render_pass;
+    framebuffer_info.attachmentCount = pass->attachment_count;
+    framebuffer_info.pAttachments = views;
+    framebuffer_info.width = swapchain->extent.width;
+    framebuffer_info.height = swapchain->extent.height;
+    framebuffer_info.layers = 1;
+
+    VkFramebuffer framebuffer;
+    VK_CHECK(vkCreateFramebuffer(device, &framebuffer_info, NULL, &framebuffer));
+    return framebuffer;
 }
 
 
-void vulkanSwapchainCreateFramebuffers(VkDevice device, Swapchain *swapchain) {
+void vulkanSwapchainCreateFramebuffers(VkDevice device, Swapchain *swapchain, RenderGraph *graph) {
+    bool post = vulkanSwapchainUsesPostPass(*swapchain);
+
     // swapchain framebufferCount is probably redundant 
     swapchain->framebufferCount = swapchain->imageCount;
     swapchain->framebuffers = malloc(swapchain->framebufferCount * sizeof(VkFramebuffer));
@@ -834,37 +2389,35 @@ void vulkanSwapchainCreateFramebuffers(VkDevice device, Swapchain *swapchain) {
         fprintf(stderr, "ERROR: failed to allocate memory for framebuffers");
         exit(1);
     }
+    if (post) {
+        swapchain->postFramebuffers = malloc(swapchain->framebufferCount * sizeof(VkFramebuffer));
+        if (swapchain->postFramebuffers == NULL) {
+            fprintf(stderr, "ERROR: failed to allocate memory for framebuffers");
+            exit(1);
+        }
+    }
 
     for (size_t i = 0; i<swapchain->framebufferCount; ++i) {
-        VkImageView all_attachments[] = {swapchain->MSAAbuffer.view, swapchain->z_buffer.view, swapchain->views[i]};
-        size_t all_attachments_size = sizeof all_attachments / sizeof(VkImageView); 
-
-        VkFramebufferCreateInfo framebuffer_info = {0};
-        framebuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-        framebuffer_info.renderPass = swapchain->renderPass;
-        framebuffer_info.attachmentCount = all_attachments_size;
-        framebuffer_info.pAttachments = all_attachments;
-        framebuffer_info.width = swapchain->extent.width;
-        framebuffer_info.height = swapchain->extent.height;
-        framebuffer_info.layers = 1;
-
-        VK_CHECK(vkCreateFramebuffer(device, &framebuffer_info, NULL, &(swapchain->framebuffers[i])));
+        swapchain->framebuffers[i] = vulkanCreateGraphFramebuffer(device, swapchain, graph, FRAME_PASS_SCENE, swapchain->renderPass, i);
+        if (post) {
+            swapchain->postFramebuffers[i] = vulkanCreateGraphFramebuffer(device, swapchain, graph, FRAME_PASS_POST, swapchain->postRenderPass, i);
+        }
     }
 
     fprintf(stderr, "INFO: Framebuffers created successfully\n");
 }
 
 
-
-Shader vulkanCreateShaderModule(VkDevice device, const char *filename) {
+/* For callers that can carry on without the shader(hot reload), an unreadable file is VK_ERROR_INITIALIZATION_FAILED */
+VkResult vulkanTryCreateShaderModule(VkDevice device, const char *filename, Shader *out) {
     // I don't really know if VkShaderModule uses our code pointer or if it copies its contents?
     // Also, is mallocs result properly alligned? 
     
     size_t shader_code_size;
     char *code = readEntireFile(filename, &shader_code_size);
     if (code == NULL) {
-        fprintf(stderr, "ERROR: failed to load shader: %s", filename);
-        exit(1);
+        fprintf(stderr, "ERROR: failed to load shader: %s\n", filename);
+        return VK_ERROR_INITIALIZATION_FAILED;
     }
     
     VkShaderModuleCreateInfo create_info = {0};
@@ -875,107 +2428,132 @@ Shader vulkanCreateShaderModule(VkDevice device, const char *filename) {
     VkResult res;
     VkShaderModule module;
     if ((res = vkCreateShaderModule(device, &create_info, NULL, &module)) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: failed to crate shader module. Error code: %d", res);
-        exit(1);
+        fprintf(stderr, "ERROR: failed to crate shader module. Error code: %d\n", res);
+        free(code);
+        return res;
     }
 
     fprintf(stderr, "INFO: Successfully loaded shader: %s\n", filename);
 
-    return (Shader) {
+    *out = (Shader) {
         module,
         code,
         shader_code_size
     }; 
+    return VK_SUCCESS;
 }
 
+Shader vulkanCreateShaderModule(VkDevice device, const char *filename) {
+    Shader shader;
+    if (vulkanTryCreateShaderModule(device, filename, &shader) != VK_SUCCESS) {
+        exit(1);
+    }
+    return shader;
+}
 
-void vulkanSwapchainCreateRenderPass(GPU gpu, VkDevice device, Swapchain *swapchain) {
-    VkAttachmentDescription color_attachment = {0};
-    color_attachment.format = swapchain->surfaceFormat.format;
-    // NOTE: this field is connected with multisampling
-    color_attachment.samples = gpu.multisampling;
-    color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-    color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-    color_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-    color_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    color_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    color_attachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-
-    VkAttachmentReference color_attachment_ref = {0};
-    color_attachment_ref.attachment = 0;
-    color_attachment_ref.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-   
 
-    VkAttachmentDescription depth_attachment = {0};
-    depth_attachment.format = swapchain->zBufferFormat;
-    depth_attachment.samples = gpu.multisampling;
-    depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-    depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-    depth_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-    depth_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    depth_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    depth_attachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;    
+/* Single subpass render pass, everything comes from the compiled graph */
+VkRenderPass vulkanCreateGraphRenderPass(VkDevice device, RenderGraph *graph, uint32_t pass_index) {
+    RenderGraphPass *pass = &graph->passes[pass_index];
 
-    VkAttachmentReference depth_attachment_ref = {0};
-    depth_attachment_ref.attachment = 1;
-    depth_attachment_ref.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    VkSubpassDescription subpass = {0};
+    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass.colorAttachmentCount = pass->color_count;
+    subpass.pColorAttachments = pass->colors;  
+    subpass.pResolveAttachments = pass->resolve_count > 0 ? pass->resolves : NULL;
+    subpass.pDepthStencilAttachment = pass->has_depth ? &pass->depth : NULL;
 
+    VkRenderPassCreateInfo render_pass_info = {0};
+    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    render_pass_info.attachmentCount = pass->attachment_count;
+    render_pass_info.pAttachments = pass->attachments;
+    render_pass_info.subpassCount = 1;
+    render_pass_info.pSubpasses = &subpass;
+    render_pass_info.dependencyCount = pass->dependency_count;
+    render_pass_info.pDependencies = pass->dependencies;
 
-    VkAttachmentDescription multisampling_color_resolve_attachment = {0};
-    multisampling_color_resolve_attachment.format = swapchain->surfaceFormat.format;
-    multisampling_color_resolve_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
-    multisampling_color_resolve_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-    multisampling_color_resolve_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE; 
-    multisampling_color_resolve_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-    multisampling_color_resolve_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    multisampling_color_resolve_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    multisampling_color_resolve_attachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    VkRenderPass render_pass;
+    VK_CHECK(vkCreateRenderPass(device, &render_pass_info, NULL, &render_pass));
+    return render_pass;
+}
 
-    VkAttachmentReference multisampling_color_resolve_attachment_reference= {0};
-    multisampling_color_resolve_attachment_reference.attachment = 2;
-    multisampling_color_resolve_attachment_reference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
 
+/* Post render pass is created in every mode, so the post pipelines always have one to be compatible with */
+void vulkanSwapchainCreateRenderPasses(VkDevice device, Swapchain *swapchain, RenderGraph *graph) {
+    swapchain->renderPass = vulkanCreateGraphRenderPass(device, graph, FRAME_PASS_SCENE);
 
-    VkSubpassDescription subpass = {0};
-    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-    subpass.colorAttachmentCount = 1;
-    subpass.pColorAttachments = &color_attachment_ref;  
-    subpass.pResolveAttachments = &multisampling_color_resolve_attachment_reference;
-    subpass.pDepthStencilAttachment = &depth_attachment_ref;
+    if (vulkanSwapchainUsesPostPass(*swapchain)) {
+        swapchain->postRenderPass = vulkanCreateGraphRenderPass(device, graph, FRAME_PASS_POST);
+    } else {
+        RenderGraph post_only = {0};
+        uint32_t output = renderGraphAddExternal(&post_only, swapchain->surfaceFormat.format, graph->resources[0].final_layout);
+        uint32_t pass = renderGraphAddPass(&post_only);
+        renderGraphUse(&post_only, pass, output, RENDER_GRAPH_COLOR_OVERWRITE);
+        renderGraphCompile(&post_only);
+        swapchain->postRenderPass = vulkanCreateGraphRenderPass(device, &post_only, pass);
+    }
 
-    VkSubpassDependency dependency = {0};
-    dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-    dependency.dstSubpass = 0;
-    dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |  VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
-    dependency.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT; 
-    dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |  VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-    dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |  VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT; 
+    fprintf(stderr, "INFO: Render pass created successfully\n");
+}
 
 
-    VkAttachmentDescription all_attachments[] = {color_attachment, depth_attachment, multisampling_color_resolve_attachment};
-    size_t all_attachments_size = sizeof all_attachments / sizeof(VkAttachmentDescription);
+void vulkanSwapchainFreeFramebuffers(VkDevice device, Swapchain *swapchain) {
+    for (size_t i=0;i<swapchain->framebufferCount;++i) {
+        vkDestroyFramebuffer(device, swapchain->framebuffers[i], NULL);
+        if (swapchain->postFramebuffers != NULL) {
+            vkDestroyFramebuffer(device, swapchain->postFramebuffers[i], NULL);
+        }
+    }
+    free(swapchain->framebuffers);
+    free(swapchain->postFramebuffers);
+    swapchain->framebuffers = NULL;
+    swapchain->postFramebuffers = NULL;
+    swapchain->framebufferCount = 0;
+}
 
-    VkRenderPassCreateInfo render_pass_info = {0};
-    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-    render_pass_info.attachmentCount = all_attachments_size;
-    render_pass_info.pAttachments = all_attachments;
-    render_pass_info.subpassCount = 1;
-    render_pass_info.pSubpasses = &subpass;
-    render_pass_info.dependencyCount = 1;
-    render_pass_info.pDependencies = &dependency;
 
+/* Framebuffers and render passes, attachments are freed separately since they can outlive an anti aliasing change */
+void vulkanSwapchainFreeRenderPasses(VkDevice device, Swapchain *swapchain) {
+    vulkanSwapchainFreeFramebuffers(device, swapchain);
+    vkDestroyRenderPass(device, swapchain->renderPass, NULL);
+    vkDestroyRenderPass(device, swapchain->postRenderPass, NULL);
+    swapchain->renderPass = VK_NULL_HANDLE;
+    swapchain->postRenderPass = VK_NULL_HANDLE;
+}
 
-    VK_CHECK(vkCreateRenderPass(device, &render_pass_info, NULL, &swapchain->renderPass));
 
-    fprintf(stderr, "INFO: Render pass created successfully\n");
+/* 
+ * Everything that is rendered into, depends on swapchain extent, anti aliasing and dynamic resolution settings.
+ * renderExtent starts at full size, vulkanUpdateDynamicResolution shrinks it.
+ * Render passes that are already there are kept, they don't depend on the extent
+ */
+void vulkanSwapchainCreateTargets(GPU gpu, VkDevice device, Swapchain *swapchain, AntiAliasing aa, bool scaled) {
+    swapchain->antiAliasing = aa;
+    swapchain->scaled = scaled;
+    swapchain->renderExtent = swapchain->extent;
+    swapchain->zBufferFormat = vulkanFindZBufferFormat(gpu);
+
+    RenderGraph graph = vulkanSwapchainBuildGraph(swapchain);
+    vulkanSwapchainCreateAttachments(gpu, device, swapchain, &graph);
+    if (swapchain->renderPass == VK_NULL_HANDLE) {
+        vulkanSwapchainCreateRenderPasses(device, swapchain, &graph);
+    }
+    vulkanSwapchainCreateFramebuffers(device, swapchain, &graph);
 }
 
 
 VulkanPipelineLayout vulkanCreatePipelineLayout(VkDevice device, VkDescriptorSetLayout layout) {
+    VkPushConstantRange push_constant_range = {0};
+    push_constant_range.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    push_constant_range.offset = 0;
+    push_constant_range.size = sizeof(PushConstants);
+
     VkPipelineLayoutCreateInfo pipeline_layout_info = {0};
     pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
     pipeline_layout_info.setLayoutCount = 1;
     pipeline_layout_info.pSetLayouts = &layout;
+    pipeline_layout_info.pushConstantRangeCount = 1;
+    pipeline_layout_info.pPushConstantRanges = &push_constant_range;
 
     VkPipelineLayout pipeline_layout;
     VK_CHECK(vkCreatePipelineLayout(device, &pipeline_layout_info, NULL, &pipeline_layout));
@@ -986,27 +2564,158 @@ VulkanPipelineLayout vulkanCreatePipelineLayout(VkDevice device, VkDescriptorSet
 }
 
 
-VkPipeline vulkanCreatePipeline(GPU gpu, VkDevice device, Swapchain swapchain, Shader frag, Shader vert, VkPipelineLayout pipeline_layout) {
-    VkResult err;
+bool vulkanPipelineCacheDataIsValid(VkPhysicalDeviceProperties props, char *file_data, size_t file_size) {
+    if (file_size < sizeof(PipelineCacheFileHeader)) {
+        return false;
+    }
 
-    VkPipelineShaderStageCreateInfo vert_shader_info = {0};
-    vert_shader_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    vert_shader_info.stage = VK_SHADER_STAGE_VERTEX_BIT;
-    vert_shader_info.module = vert.module;
-    vert_shader_info.pName = "main";    
+    PipelineCacheFileHeader header;
+    memcpy(&header, file_data, sizeof header);
 
+    if (header.magic != PIPELINE_CACHE_FILE_MAGIC ||
+        header.vendor_id != props.vendorID ||
+        header.device_id != props.deviceID ||
+        header.driver_version != props.driverVersion ||
+        memcmp(header.uuid, props.pipelineCacheUUID, VK_UUID_SIZE) != 0 ||
+        header.data_size != file_size - sizeof header) {
+        return false;
+    }
 
-    VkPipelineShaderStageCreateInfo frag_shader_info = {0};
-    frag_shader_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    frag_shader_info.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-    frag_shader_info.module = frag.module;
-    frag_shader_info.pName = "main";
+    /* Driver would reject a bad blob by itself, but some drivers are known to crash on them instead */ {
+        VkPipelineCacheHeaderVersionOne vulkan_header;
+        if (header.data_size < sizeof vulkan_header) {
+            return false;
+        }
+        memcpy(&vulkan_header, file_data + sizeof header, sizeof vulkan_header);
 
+        if (vulkan_header.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE ||
+            vulkan_header.vendorID != props.vendorID ||
+            vulkan_header.deviceID != props.deviceID ||
+            memcmp(vulkan_header.pipelineCacheUUID, props.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+            return false;
+        }
+    }
 
-    VkPipelineInputAssemblyStateCreateInfo input_assembly_info = {0};
-    input_assembly_info.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-    input_assembly_info.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-    input_assembly_info.primitiveRestartEnable = VK_FALSE;
+    return true;
+}
+
+
+/* Loads cache saved by vulkanSavePipelineCache, starts with an empty one if file is missing or was made by another gpu/driver */
+VkPipelineCache vulkanCreatePipelineCache(GPU gpu, VkDevice device, const char *filename) {
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(gpu.device, &props);
+
+    size_t file_size = 0;
+    char *file_data = NULL;
+    
+    // readEntireFile complains about missing files, and no cache is a normal thing on the first launch
+    FILE *file = fopen(filename, "rb");
+    if (file != NULL) {
+        fclose(file);
+        file_data = readEntireFile(filename, &file_size);
+    }
+
+    VkPipelineCacheCreateInfo cache_info = {0};
+    cache_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+
+    if (file_data != NULL && vulkanPipelineCacheDataIsValid(props, file_data, file_size)) {
+        cache_info.initialDataSize = file_size - sizeof(PipelineCacheFileHeader);
+        cache_info.pInitialData = file_data + sizeof(PipelineCacheFileHeader);
+        fprintf(stderr, "INFO: Pipeline cache loaded from %s(%zu bytes)\n", filename, cache_info.initialDataSize);
+    } else if (file_data != NULL) {
+        fprintf(stderr, "INFO: Pipeline cache in %s is stale or corrupted, starting from scratch\n", filename);
+    }
+
+    VkPipelineCache cache;
+    VK_CHECK(vkCreatePipelineCache(device, &cache_info, NULL, &cache));
+
+    free(file_data);
+    return cache;
+}
+
+
+void vulkanSavePipelineCache(GPU gpu, VkDevice device, VkPipelineCache cache, const char *filename) {
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(gpu.device, &props);
+
+    size_t data_size;
+    VK_CHECK(vkGetPipelineCacheData(device, cache, &data_size, NULL));
+
+    char *file_data = malloc(sizeof(PipelineCacheFileHeader) + data_size);
+    if (file_data == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate memory for pipeline cache\n");
+        return;
+    }
+
+    VkResult res = vkGetPipelineCacheData(device, cache, &data_size, file_data + sizeof(PipelineCacheFileHeader));
+    if (res != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to get pipeline cache data. Code: %d\n", res);
+        free(file_data);
+        return;
+    }
+
+    PipelineCacheFileHeader header = {0};
+    header.magic = PIPELINE_CACHE_FILE_MAGIC;
+    header.vendor_id = props.vendorID;
+    header.device_id = props.deviceID;
+    header.driver_version = props.driverVersion;
+    memcpy(header.uuid, props.pipelineCacheUUID, VK_UUID_SIZE);
+    header.data_size = data_size;
+    memcpy(file_data, &header, sizeof header);
+
+    if (writeEntireFileAtomic(filename, file_data, sizeof header + data_size)) {
+        fprintf(stderr, "INFO: Pipeline cache saved to %s(%zu bytes)\n", filename, data_size);
+    } else {
+        fprintf(stderr, "ERROR: failed to save pipeline cache to %s\n", filename);
+    }
+
+    free(file_data);
+}
+
+
+/* 
+ * Fills info so that it only points into itself, it has to stay where it is until the pipeline is created.
+ * Key's samples have to match the render pass, shader slots are not looked at, vert and frag are what is built
+ */
+void vulkanScenePipelineInfo(ScenePipelineInfo *info, VkRenderPass render_pass, VkExtent2D extent, Shader frag, Shader vert, VkPipelineLayout pipeline_layout, PipelineKey key) {
+    *info = (ScenePipelineInfo){0};
+
+    // base pipeline keeps the defaults written in the shaders
+    PipelineVariant base = {0};
+    VkSpecializationInfo *specialization = NULL;
+    if (memcmp(&key.variant, &base, sizeof base) != 0) {
+        for (uint32_t i=0; i<PIPELINE_MAX_CONSTANTS; ++i) {
+            info->constant_entries[i] = (VkSpecializationMapEntry){i, i * sizeof(uint32_t), sizeof(uint32_t)};
+            info->constants[i] = key.variant.constants[i];
+        }
+        // ids a stage doesn't declare are ignored, so both get the same info
+        info->specialization.mapEntryCount = PIPELINE_MAX_CONSTANTS;
+        info->specialization.pMapEntries = info->constant_entries;
+        info->specialization.dataSize = sizeof info->constants;
+        info->specialization.pData = info->constants;
+        specialization = &info->specialization;
+    }
+
+    VkPipelineShaderStageCreateInfo *vert_shader_info = &info->stages[0];
+    vert_shader_info->sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    vert_shader_info->stage = VK_SHADER_STAGE_VERTEX_BIT;
+    vert_shader_info->module = vert.module;
+    vert_shader_info->pName = "main";    
+    vert_shader_info->pSpecializationInfo = specialization;
+
+
+    VkPipelineShaderStageCreateInfo *frag_shader_info = &info->stages[1];
+    frag_shader_info->sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    frag_shader_info->stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    frag_shader_info->module = frag.module;
+    frag_shader_info->pName = "main";
+    frag_shader_info->pSpecializationInfo = specialization;
+
+
+    VkPipelineInputAssemblyStateCreateInfo *input_assembly_info = &info->input_assembly;
+    input_assembly_info->sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    input_assembly_info->topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    input_assembly_info->primitiveRestartEnable = VK_FALSE;
 
 
     VkVertexInputBindingDescription vertex_binding_description = {0};
@@ -1026,457 +2735,3655 @@ VkPipeline vulkanCreatePipeline(GPU gpu, VkDevice device, Swapchain swapchain, S
     vertex_color_description.format = VK_FORMAT_R32G32B32A32_SFLOAT;
     vertex_color_description.offset = offsetof(Vertex, color);
 
-    VkVertexInputAttributeDescription descriptions[] = { 
-        vertex_position_description,
-        vertex_color_description
-    };
-    size_t descriptions_size = sizeof descriptions / sizeof(VkVertexInputAttributeDescription);
-
-    VkPipelineVertexInputStateCreateInfo vertex_input_info = {0};
-    vertex_input_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    vertex_input_info.pVertexBindingDescriptions = &vertex_binding_description;
-    vertex_input_info.vertexBindingDescriptionCount = 1;
-    vertex_input_info.pVertexAttributeDescriptions = descriptions;
-    vertex_input_info.vertexAttributeDescriptionCount = descriptions_size;
+    VkVertexInputBindingDescription instance_binding_description = {0};
+    instance_binding_description.binding = 1;
+    instance_binding_description.stride = sizeof(InstanceData);
+    instance_binding_description.inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+
+    VkVertexInputAttributeDescription instance_orientation_description = {0};
+    instance_orientation_description.binding = 1;
+    instance_orientation_description.location = 2;
+    instance_orientation_description.format = VK_FORMAT_R32G32B32A32_SFLOAT;
+    instance_orientation_description.offset = offsetof(InstanceData, orientation);
+
+    // xyz is position, w is scale
+    VkVertexInputAttributeDescription instance_position_description = {0};
+    instance_position_description.binding = 1;
+    instance_position_description.location = 3;
+    instance_position_description.format = VK_FORMAT_R32G32B32A32_SFLOAT;
+    instance_position_description.offset = offsetof(InstanceData, position);
+
+    info->bindings[0] = vertex_binding_description;
+    info->bindings[1] = instance_binding_description;
+
+    info->attributes[0] = vertex_position_description;
+    info->attributes[1] = vertex_color_description;
+    info->attributes[2] = instance_orientation_description;
+    info->attributes[3] = instance_position_description;
+
+    VkPipelineVertexInputStateCreateInfo *vertex_input_info = &info->vertex_input;
+    vertex_input_info->sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    if (key.vertex_layout == VERTEX_LAYOUT_INSTANCED) {
+        vertex_input_info->pVertexBindingDescriptions = info->bindings;
+        vertex_input_info->vertexBindingDescriptionCount = sizeof info->bindings / sizeof(VkVertexInputBindingDescription);
+        vertex_input_info->pVertexAttributeDescriptions = info->attributes;
+        vertex_input_info->vertexAttributeDescriptionCount = sizeof info->attributes / sizeof(VkVertexInputAttributeDescription);
+    }
 
    
-    VkDynamicState dynamic_states[] = {
-        VK_DYNAMIC_STATE_VIEWPORT,
-        VK_DYNAMIC_STATE_SCISSOR
-    };
-
-    VkPipelineDynamicStateCreateInfo dynamic_state = {0};
-    dynamic_state.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-    dynamic_state.dynamicStateCount = sizeof dynamic_states / sizeof(VkDynamicState);
-    dynamic_state.pDynamicStates = dynamic_states;
-
-
-    VkViewport viewport = {0};
-    viewport.x = 0;
-    viewport.y = 0;
-    viewport.width = (float) swapchain.extent.width;
-    viewport.height = (float) swapchain.extent.height;
-    viewport.minDepth = 0;
-    viewport.maxDepth = 1;
-
-    VkRect2D scissors = {0};
-    scissors.offset = (VkOffset2D){0, 0};
-    scissors.extent = swapchain.extent;
-
-    VkPipelineViewportStateCreateInfo viewport_state_info = {0};
-    viewport_state_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-    viewport_state_info.viewportCount = 1;
-    viewport_state_info.pViewports = &viewport;
-    viewport_state_info.scissorCount = 1;
-    viewport_state_info.pScissors = &scissors;
+    info->dynamic_states[0] = VK_DYNAMIC_STATE_VIEWPORT;
+    info->dynamic_states[1] = VK_DYNAMIC_STATE_SCISSOR;
+
+    VkPipelineDynamicStateCreateInfo *dynamic_state = &info->dynamic_state;
+    dynamic_state->sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamic_state->dynamicStateCount = sizeof info->dynamic_states / sizeof(VkDynamicState);
+    dynamic_state->pDynamicStates = info->dynamic_states;
+
+
+    VkViewport *viewport = &info->viewport;
+    viewport->x = 0;
+    viewport->y = 0;
+    viewport->width = (float) extent.width;
+    viewport->height = (float) extent.height;
+    viewport->minDepth = 0;
+    viewport->maxDepth = 1;
+
+    VkRect2D *scissors = &info->scissors;
+    scissors->offset = (VkOffset2D){0, 0};
+    scissors->extent = extent;
+
+    VkPipelineViewportStateCreateInfo *viewport_state_info = &info->viewport_state;
+    viewport_state_info->sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    viewport_state_info->viewportCount = 1;
+    viewport_state_info->pViewports = viewport;
+    viewport_state_info->scissorCount = 1;
+    viewport_state_info->pScissors = scissors;
 
     
-    VkPipelineRasterizationStateCreateInfo rasterization_info = {0};
-    rasterization_info.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    uint32_t render_state = key.variant.render_state;
+    VkPipelineRasterizationStateCreateInfo *rasterization_info = &info->rasterization;
+    rasterization_info->sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
     // @TODO: try to change it to VK_TRUE. This thing requires a feature, and i don't wanna bother myself implementing it right now.
-    rasterization_info.depthClampEnable = VK_FALSE;
-    rasterization_info.rasterizerDiscardEnable = VK_FALSE;
-    rasterization_info.polygonMode = VK_POLYGON_MODE_FILL;
-    rasterization_info.lineWidth = 1.0f;
-    rasterization_info.cullMode = VK_CULL_MODE_NONE;
-    rasterization_info.frontFace = VK_FRONT_FACE_CLOCKWISE;
-    rasterization_info.depthBiasEnable = VK_FALSE;
-
-    // @TODO: check out multisampling. As of for now it is disabled
-    VkPipelineMultisampleStateCreateInfo multisampling_info = {0};
-    multisampling_info.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-    multisampling_info.rasterizationSamples = gpu.multisampling;   
-    // @SPEED: same as in createLogicalDevice
-    multisampling_info.sampleShadingEnable = VK_TRUE;
-    multisampling_info.sampleShadingEnable = VK_TRUE;
-
-
-    // @TODO: It is also empty for the same reason
-    VkPipelineColorBlendAttachmentState colorblend_attachment = {0};
-    colorblend_attachment.colorWriteMask = 
+    rasterization_info->depthClampEnable = VK_FALSE;
+    rasterization_info->rasterizerDiscardEnable = VK_FALSE;
+    rasterization_info->polygonMode = (render_state & RENDER_STATE_WIREFRAME) ? VK_POLYGON_MODE_LINE : VK_POLYGON_MODE_FILL;
+    rasterization_info->lineWidth = 1.0f;
+    rasterization_info->cullMode = (render_state & RENDER_STATE_CULL_BACK) ? VK_CULL_MODE_BACK_BIT : VK_CULL_MODE_NONE;
+    rasterization_info->frontFace = VK_FRONT_FACE_CLOCKWISE;
+    rasterization_info->depthBiasEnable = VK_FALSE;
+
+    // pipeline has to be recreated when samples or sample shading change, see vulkanSetAntiAliasing
+    VkPipelineMultisampleStateCreateInfo *multisampling_info = &info->multisampling;
+    multisampling_info->sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    multisampling_info->rasterizationSamples = (VkSampleCountFlagBits)key.samples;   
+    // @SPEED: runs fragment shader for every sample, the most expensive setting there is
+    multisampling_info->sampleShadingEnable = key.sample_shading;
+    multisampling_info->minSampleShading = 1.0f;
+
+
+    VkPipelineColorBlendAttachmentState *colorblend_attachment = &info->colorblend_attachment;
+    colorblend_attachment->colorWriteMask = 
         VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-    colorblend_attachment.blendEnable = VK_FALSE;
+    colorblend_attachment->blendEnable = (render_state & RENDER_STATE_BLEND) ? VK_TRUE : VK_FALSE;
+    colorblend_attachment->srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+    colorblend_attachment->dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+    colorblend_attachment->colorBlendOp = VK_BLEND_OP_ADD;
+    colorblend_attachment->srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+    colorblend_attachment->dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+    colorblend_attachment->alphaBlendOp = VK_BLEND_OP_ADD;
     
-    VkPipelineColorBlendStateCreateInfo colorblend_info = {0};
-    colorblend_info.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    VkPipelineColorBlendStateCreateInfo *colorblend_info = &info->colorblend;
+    colorblend_info->sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
 
     // @TODO: logic op is an extension, so i have to check if is is available
-    colorblend_info.logicOpEnable = VK_FALSE;
-    colorblend_info.logicOp = VK_LOGIC_OP_AND; // useless, as  logicOpEnable is set to VK_FALSE;
-    colorblend_info.attachmentCount = 1;
-    colorblend_info.pAttachments = &colorblend_attachment;
+    colorblend_info->logicOpEnable = VK_FALSE;
+    colorblend_info->logicOp = VK_LOGIC_OP_AND; // useless, as  logicOpEnable is set to VK_FALSE;
+    colorblend_info->attachmentCount = 1;
+    colorblend_info->pAttachments = colorblend_attachment;
+
+    VkPipelineDepthStencilStateCreateInfo *depth_stencil_info = &info->depth_stencil;
+    depth_stencil_info->sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    depth_stencil_info->depthTestEnable = VK_TRUE;
+    depth_stencil_info->depthWriteEnable = (render_state & RENDER_STATE_NO_DEPTH_WRITE) ? VK_FALSE : VK_TRUE;
+    depth_stencil_info->depthCompareOp = VK_COMPARE_OP_LESS;
+    depth_stencil_info->depthBoundsTestEnable = VK_FALSE;
+    depth_stencil_info->stencilTestEnable = VK_FALSE;
+
+    VkGraphicsPipelineCreateInfo *pipeline_info = &info->info;
+    pipeline_info->sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipeline_info->stageCount = 2;
+    pipeline_info->pStages = info->stages;
+    pipeline_info->pVertexInputState = vertex_input_info;
+    pipeline_info->pInputAssemblyState = input_assembly_info;
+    pipeline_info->pViewportState = viewport_state_info;
+    pipeline_info->pRasterizationState = rasterization_info;
+    pipeline_info->pMultisampleState = multisampling_info;
+    pipeline_info->pColorBlendState = colorblend_info;
+    pipeline_info->pDynamicState = dynamic_state;
+    pipeline_info->pDepthStencilState = depth_stencil_info;
+    pipeline_info->layout = pipeline_layout;
+    pipeline_info->renderPass = render_pass;
+    pipeline_info->subpass = 0;
+    pipeline_info->basePipelineHandle = VK_NULL_HANDLE;
+    pipeline_info->basePipelineIndex = -1;
+}
+
 
-    VkPipelineDepthStencilStateCreateInfo depth_stencil_info = {0};
-    depth_stencil_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-    depth_stencil_info.depthTestEnable = VK_TRUE;
-    depth_stencil_info.depthWriteEnable = VK_TRUE;
-    depth_stencil_info.depthCompareOp = VK_COMPARE_OP_LESS;
-    depth_stencil_info.depthBoundsTestEnable = VK_FALSE;
-    depth_stencil_info.stencilTestEnable = VK_FALSE;
+/* Key of the base pipeline for the swapchain's render pass, variants start from it */
+PipelineKey vulkanBasePipelineKey(Swapchain swapchain, ShaderSlot vert, ShaderSlot frag) {
+    PipelineKey key;
+    memset(&key, 0, sizeof key);
+    key.vert = vert;
+    key.frag = frag;
+    key.vertex_layout = vert == SHADER_PULL_VERT || vert == SHADER_CLUSTER_VERT ? VERTEX_LAYOUT_PULLED : VERTEX_LAYOUT_INSTANCED;
+    key.samples = swapchain.antiAliasing.samples;
+    key.sample_shading = swapchain.antiAliasing.sample_shading;
+    return key;
+}
 
-    VkPipelineShaderStageCreateInfo stages[] = {vert_shader_info, frag_shader_info}; 
 
-    VkGraphicsPipelineCreateInfo pipeline_info = {0};
-    pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    pipeline_info.stageCount = sizeof stages / sizeof (VkPipelineShaderStageCreateInfo);
-    pipeline_info.pStages = stages;
-    pipeline_info.pVertexInputState = &vertex_input_info;
-    pipeline_info.pInputAssemblyState = &input_assembly_info;
-    pipeline_info.pViewportState = &viewport_state_info;
-    pipeline_info.pRasterizationState = &rasterization_info;
-    pipeline_info.pMultisampleState = &multisampling_info;
-    pipeline_info.pColorBlendState = &colorblend_info;
-    pipeline_info.pDynamicState = &dynamic_state;
-    pipeline_info.pDepthStencilState = &depth_stencil_info;
-    pipeline_info.layout = pipeline_layout;
-    pipeline_info.renderPass = swapchain.renderPass;
-    pipeline_info.subpass = 0;
-    pipeline_info.basePipelineHandle = VK_NULL_HANDLE;
-    pipeline_info.basePipelineIndex = -1;
+/* Blocks until it's built, for pipelines needed right away */
+VkResult vulkanTryCreatePipelineFromKey(VkDevice device, Swapchain swapchain, Shader frag, Shader vert, VkPipelineLayout pipeline_layout, VkPipelineCache pipeline_cache, PipelineKey key, VkPipeline *out) {
+    VkResult err;
 
-    VkPipeline pipeline;
-    if ((err = vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipeline_info, NULL, &pipeline)) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: failed to create graphics pipeline. Error code: %d",err);
-        exit(1);
+    ScenePipelineInfo info;
+    vulkanScenePipelineInfo(&info, swapchain.renderPass, swapchain.extent, frag, vert, pipeline_layout, key);
+
+    if ((err = vkCreateGraphicsPipelines(device, pipeline_cache, 1, &info.info, NULL, out)) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create graphics pipeline. Error code: %d\n", err);
+        return err;
     }
 
     fprintf(stderr, "INFO: Pipeline created successfully\n");
+    return VK_SUCCESS;
+}
+
+VkPipeline vulkanCreatePipelineFromKey(VkDevice device, Swapchain swapchain, Shader frag, Shader vert, VkPipelineLayout pipeline_layout, VkPipelineCache pipeline_cache, PipelineKey key) {
+    VkPipeline pipeline;
+    if (vulkanTryCreatePipelineFromKey(device, swapchain, frag, vert, pipeline_layout, pipeline_cache, key, &pipeline) != VK_SUCCESS) {
+        exit(1);
+    }
     return pipeline;
 }
 
+/* Base pipeline with the fixed function vertex layout */
+VkPipeline vulkanCreatePipeline(VkDevice device, Swapchain swapchain, Shader frag, Shader vert, VkPipelineLayout pipeline_layout, VkPipelineCache pipeline_cache) {
+    PipelineKey key = vulkanBasePipelineKey(swapchain, SHADER_SCENE_VERT, SHADER_SCENE_FRAG);
+    return vulkanCreatePipelineFromKey(device, swapchain, frag, vert, pipeline_layout, pipeline_cache, key);
+}
 
+VkPipeline vulkanCreatePulledPipeline(VkDevice device, Swapchain swapchain, Shader frag, Shader vert, VkPipelineLayout pipeline_layout, VkPipelineCache pipeline_cache) {
+    PipelineKey key = vulkanBasePipelineKey(swapchain, SHADER_PULL_VERT, SHADER_SCENE_FRAG);
+    return vulkanCreatePipelineFromKey(device, swapchain, frag, vert, pipeline_layout, pipeline_cache, key);
+}
 
-void vulkanRecordCommandBuffer(VkCommandBuffer command_buffer, Swapchain swapchain, VkPipeline pipeline, VkPipelineLayout pipeline_layout, VulkanBuffer vertex_buffer, UniformBuffer uniform, uint32_t image_index, uint32_t vertices_count) {
-    VkCommandBufferBeginInfo begin_info = {0};
-    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+/* Task and mesh shaders instead of a vertex shader. Not a cache variant, back face culling is the only state it takes */
+VkResult vulkanTryCreateMeshletPipeline(VkDevice device, Swapchain swapchain, Shader frag, Shader task, Shader mesh, VkPipelineLayout pipeline_layout, VkPipelineCache pipeline_cache, bool cull_back, VkPipeline *out) {
+    PipelineKey key = vulkanBasePipelineKey(swapchain, SHADER_PULL_VERT, SHADER_SCENE_FRAG);
+    key.variant.render_state = cull_back ? RENDER_STATE_CULL_BACK : 0;
+
+    ScenePipelineInfo info;
+    vulkanScenePipelineInfo(&info, swapchain.renderPass, swapchain.extent, frag, mesh, pipeline_layout, key);
+    info.stages[0].stage = VK_SHADER_STAGE_MESH_BIT_EXT;
+    info.stages[2] = info.stages[0];
+    info.stages[2].stage = VK_SHADER_STAGE_TASK_BIT_EXT;
+    info.stages[2].module = task.module;
+    info.info.stageCount = 3;
+    info.info.pVertexInputState = NULL;
+    info.info.pInputAssemblyState = NULL;
 
-    VkResult res;
-    if ((res = vkBeginCommandBuffer(command_buffer, &begin_info)) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: failed to begin recording command buffer\nIt is probably an application bug");
-        exit(1);
-    } 
+    VkResult err;
+    if ((err = vkCreateGraphicsPipelines(device, pipeline_cache, 1, &info.info, NULL, out)) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create meshlet pipeline. Error code: %d\n", err);
+        return err;
+    }
 
-    VkClearValue clear_color = {{{0.0f, 0.0f, 0.0f, 1.0f}}};
-    VkClearValue clear_z_buffer = {{{1.0f, 0}}};
-    
-    VkClearValue all_clear_values[] = {clear_color, clear_z_buffer};
-    size_t all_clear_values_size = sizeof all_clear_values / sizeof(VkClearValue);
+    fprintf(stderr, "INFO: Meshlet pipeline created successfully\n");
+    return VK_SUCCESS;
+}
 
-    VkRenderPassBeginInfo render_pass_info = {0};
-    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-    render_pass_info.renderPass = swapchain.renderPass;
-    render_pass_info.framebuffer = swapchain.framebuffers[image_index];
-    render_pass_info.renderArea.offset = (VkOffset2D){0, 0};
-    render_pass_info.renderArea.extent = swapchain.extent;
-    render_pass_info.clearValueCount = all_clear_values_size;
-    render_pass_info.pClearValues = all_clear_values;
+VkPipeline vulkanCreateMeshletPipeline(VkDevice device, Swapchain swapchain, Shader frag, Shader task, Shader mesh, VkPipelineLayout pipeline_layout, VkPipelineCache pipeline_cache, bool cull_back) {
+    VkPipeline pipeline;
+    if (vulkanTryCreateMeshletPipeline(device, swapchain, frag, task, mesh, pipeline_layout, pipeline_cache, cull_back, &pipeline) != VK_SUCCESS) {
+        exit(1);
+    }
+    return pipeline;
+}
 
 
-    vkCmdBeginRenderPass(command_buffer, &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
-    
-        vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+/* Render state the gpu can't do is dropped here, so it doesn't split the cache into keys that build the same thing */
+PipelineKey vulkanPipelineKey(Vulkan *vulkan, ShaderSlot vert, ShaderSlot frag, PipelineVariant variant) {
+    PipelineKey key = vulkanBasePipelineKey(vulkan->swapchain, vert, frag);
+    key.variant = variant;
+    if (!vulkan->gpu.caps.fillModeNonSolid) {
+        key.variant.render_state &= ~RENDER_STATE_WIREFRAME;
+    }
+    return key;
+}
 
-        vkCmdBindDescriptorSets(
-            command_buffer, 
-            VK_PIPELINE_BIND_POINT_GRAPHICS,
-            pipeline_layout,
-            0,
-            1,
-            &uniform.set,
-            0, 
-            NULL
-        );
+bool pipelineKeyIsBase(PipelineKey key) {
+    PipelineVariant base;
+    memset(&base, 0, sizeof base);
+    return memcmp(&key.variant, &base, sizeof base) == 0;
+}
 
-        VkDeviceSize vertex_buffer_offset = 0;
-        vkCmdBindVertexBuffers(command_buffer, 0, 1, &vertex_buffer.buffer, &vertex_buffer_offset);
-         
-        VkViewport viewport = {0};
-        viewport.x = 0.0f;
-        viewport.y = 0.0f;
-        viewport.width = (float)swapchain.extent.width;
-        viewport.height = (float)swapchain.extent.height;
-        viewport.minDepth = 0.0f;
-        // ...
-        viewport.maxDepth = 1.0f;
-        vkCmdSetViewport(command_buffer, 0, 1, &viewport);
- 
-        VkRect2D scissors = {0};
-        scissors.offset = (VkOffset2D){0, 0};
-        scissors.extent = swapchain.extent;
-        vkCmdSetScissor(command_buffer, 0, 1, &scissors);
-    
-        vkCmdDraw(command_buffer, vertices_count, 1, 0, 0);
-    
-    vkCmdEndRenderPass(command_buffer);
-    if ((res = vkEndCommandBuffer(command_buffer)) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: Failed to record command buffer. Error code: %d", res);
+/* FNV-1a over the key bytes */
+uint32_t pipelineKeyHash(PipelineKey key) {
+    const uint8_t *bytes = (const uint8_t *)&key;
+    uint32_t hash = 2166136261u;
+    for (size_t i=0; i<sizeof key; ++i) {
+        hash = (hash ^ bytes[i]) * 16777619u;
     }
+    return hash;
 }
 
+/* Table slot that has the key, or the empty one where it would go */
+uint32_t pipelineVariantSlot(PipelineVariants *variants, PipelineKey key) {
+    uint32_t slot = pipelineKeyHash(key) & (PIPELINE_VARIANTS_TABLE - 1);
+    while (variants->table[slot].state != PIPELINE_VARIANT_EMPTY && memcmp(&variants->table[slot].key, &key, sizeof key) != 0) {
+        slot = (slot + 1) & (PIPELINE_VARIANTS_TABLE - 1);
+    }
+    return slot;
+}
 
-SyncObjects createSyncObjects(VkDevice device) {
-    SyncObjects objs;
 
-    VkSemaphoreCreateInfo semaphore_info = {0};
-    semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+/* Adds the key and queues its build, nothing if it is already known */
+void vulkanQueuePipelineVariant(Vulkan *vulkan, PipelineKey key) {
+    PipelineVariants *variants = vulkan->variants;
+    uint32_t slot = pipelineVariantSlot(variants, key);
+    if (variants->table[slot].state != PIPELINE_VARIANT_EMPTY) {
+        return;
+    }
+    if (variants->len == PIPELINE_VARIANTS_MAX) {
+        fprintf(stderr, "ERROR: too many pipeline variants(%d)", PIPELINE_VARIANTS_MAX);
+        exit(1);
+    }
 
-    VkFenceCreateInfo fence_info = {0};
-    fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+    variants->table[slot] = (PipelineVariantEntry){key, PIPELINE_VARIANT_QUEUED, VK_NULL_HANDLE};
+    variants->len += 1;
+    variants->queue[variants->queue_len++] = slot;
+}
 
-    bool res = true;
-    res = res && (vkCreateSemaphore(device, &semaphore_info, NULL, &objs.imageAvailable) == VK_SUCCESS); 
-    res = res && (vkCreateSemaphore(device, &semaphore_info, NULL, &objs.renderFinished) == VK_SUCCESS);
-    res = res && (vkCreateFence(device, &fence_info, NULL, &objs.inFlight) == VK_SUCCESS);
 
-    if (res != true) {
-        fprintf(stderr, "ERROR: Failed to allocate synchronisation primitives");
+/* Never waits for a build: fallback is returned until the variant is ready, and for good if it failed */
+VkPipeline vulkanPipelineVariant(Vulkan *vulkan, PipelineKey key, VkPipeline fallback) {
+    if (pipelineKeyIsBase(key)) {
+        return fallback;
+    }
+
+    PipelineVariantEntry *entry = &vulkan->variants->table[pipelineVariantSlot(vulkan->variants, key)];
+    if (entry->state == PIPELINE_VARIANT_READY) {
+        return entry->pipeline;
+    }
+    if (entry->state == PIPELINE_VARIANT_EMPTY) {
+        vulkanQueuePipelineVariant(vulkan, key);
+    }
+    return fallback;
+}
+
+
+/* Mesh shader path of cluster culling is taken */
+bool vulkanUseMeshlets(Vulkan *vulkan) {
+    return vulkan->settings.mesh_shaders && vulkan->clusters.mesh_shaders;
+}
+
+/* 
+ * Cluster culling is on and the draw list fits. Ranges are reserved for every meshlet of every instance, culling can't know how many survive.
+ * Walks the whole draw list, recording decides once and hands the result down
+ */
+bool vulkanUseClusters(Vulkan *vulkan, DrawList draw_list) {
+    if (!vulkan->settings.cluster_culling || !vulkan->clusters.created) {
+        return false;
+    }
+
+    bool meshlets = vulkanUseMeshlets(vulkan);
+    if (!meshlets && draw_list.len > CLUSTER_MAX_OBJECTS) {
+        return false;
+    }
+    uint64_t clusters = 0;
+    uint64_t indices = 0;
+    for (uint32_t i=0; i<draw_list.len; ++i) {
+        RenderObject object = draw_list.data[i];
+        uint32_t meshlet_count = vulkan->clusters.meshes[object.mesh_index].meshlet_count;
+        uint64_t task_groups = (uint64_t)object.instance_count * ((meshlet_count + MESHLET_TASK_GROUP_SIZE - 1) / MESHLET_TASK_GROUP_SIZE);
+        if (object.instance_count > CLUSTER_MAX_INSTANCES || (meshlets && task_groups > CLUSTER_MAX_TASK_GROUPS)) {
+            return false;
+        }
+        if (!meshlets && meshlet_count > vulkan->clusters.max_dispatch_x) {
+            return false;
+        }
+        clusters += (uint64_t)object.instance_count * meshlet_count;
+        indices += (uint64_t)object.instance_count * vulkan->meshes[object.mesh_index].lods[0].index_count;
+    }
+    return meshlets || (clusters <= CLUSTER_MAX_CLUSTERS && indices <= CLUSTER_MAX_INDICES);
+}
+
+
+/* Render thread, before recording. Only the path draws take asks for its variant, so the other one isn't built for nothing */
+void vulkanResolveScenePipelines(Vulkan *vulkan, bool clusters) {
+    PipelineVariants *variants = vulkan->variants;
+    if (variants == NULL) {
+        return;
+    }
+
+    PipelineVariant variant = vulkan->settings.scene_variant;
+    variants->scene_pipeline = vulkan->pipeline;
+    variants->bindless_pipeline = vulkan->bindless.pipeline;
+    variants->pulling_pipeline = vulkan->pulling.pipeline;
+    variants->cluster_pipeline = vulkan->clusters.pipeline;
+    if (clusters) {
+        // meshlet pipelines are not variants, vulkanClusterCullBack picks one of them
+        if (!vulkanUseMeshlets(vulkan)) {
+            PipelineKey key = vulkanPipelineKey(vulkan, SHADER_CLUSTER_VERT, SHADER_SCENE_FRAG, variant);
+            variants->cluster_pipeline = vulkanPipelineVariant(vulkan, key, vulkan->clusters.pipeline);
+        }
+    } else if (vulkan->settings.vertex_pulling && vulkan->pulling.created) {
+        PipelineKey key = vulkanPipelineKey(vulkan, SHADER_PULL_VERT, SHADER_SCENE_FRAG, variant);
+        variants->pulling_pipeline = vulkanPipelineVariant(vulkan, key, vulkan->pulling.pipeline);
+    } else if (vulkan->settings.bindless && vulkan->bindless.created) {
+        PipelineKey key = vulkanPipelineKey(vulkan, SHADER_BINDLESS_VERT, SHADER_SCENE_FRAG, variant);
+        variants->bindless_pipeline = vulkanPipelineVariant(vulkan, key, vulkan->bindless.pipeline);
+    } else {
+        PipelineKey key = vulkanPipelineKey(vulkan, SHADER_SCENE_VERT, SHADER_SCENE_FRAG, variant);
+        variants->scene_pipeline = vulkanPipelineVariant(vulkan, key, vulkan->pipeline);
+    }
+}
+
+
+
+VkResult vulkanTryCreateComputePipeline(VkDevice device, Shader shader, VkPipelineLayout pipeline_layout, VkPipelineCache pipeline_cache, VkPipeline *out) {
+    VkComputePipelineCreateInfo pipeline_info = {0};
+    pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipeline_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipeline_info.stage.module = shader.module;
+    pipeline_info.stage.pName = "main";
+    pipeline_info.layout = pipeline_layout;
+
+    VkResult res;
+    if ((res = vkCreateComputePipelines(device, pipeline_cache, 1, &pipeline_info, NULL, out)) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to create compute pipeline. Error code: %d\n", res);
+    }
+    return res;
+}
+
+VkPipeline vulkanCreateComputePipeline(VkDevice device, Shader shader, VkPipelineLayout pipeline_layout, VkPipelineCache pipeline_cache) {
+    VkPipeline pipeline;
+    if (vulkanTryCreateComputePipeline(device, shader, pipeline_layout, pipeline_cache, &pipeline) != VK_SUCCESS) {
         exit(1);
     }
+    return pipeline;
+}
 
-    fprintf(stderr, "INFO: Synchronisation primitives allocated successfully\n");
-    return objs; 
+
+
+DescriptorAllocator descriptorAllocatorCreate(VkDevice device) {
+    DescriptorAllocator allocator = {0};
+    allocator.device = device;
+    allocator.next_pool_sets = DESCRIPTOR_ALLOCATOR_FIRST_POOL_SETS;
+    return allocator;
 }
 
 
-UniformBuffer vulkanCreateUniformBuffer(GPU gpu, VkDevice device) {
-    size_t buffer_size = sizeof(Ubo);
-    VulkanBuffer buffer = vulkanCreateBuffer (
-        gpu, 
-        device,
-        VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-        buffer_size
-    );
-    
-    void *mapped_memory;
-    VK_CHECK(vkMapMemory (
-        device, 
-        buffer.memory,
-        0,
-        buffer_size, 
-        0,
-        &mapped_memory
-    ));
+void descriptorAllocatorCreatePool(DescriptorAllocator *allocator) {
+    if (allocator->pools_len == DESCRIPTOR_ALLOCATOR_MAX_POOLS) {
+        fprintf(stderr, "ERROR: Descriptor allocator is out of pools(%u)", DESCRIPTOR_ALLOCATOR_MAX_POOLS);
+        exit(1);
+    }
 
-    VkDescriptorPoolSize pool_size = {0};
-    pool_size.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    pool_size.descriptorCount = 1;
+    // descriptors per set are enough for any layout we have, cluster culling one has the most storage buffers
+    uint32_t sets = allocator->next_pool_sets;
+    VkDescriptorPoolSize pool_sizes[4] = {
+        {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, sets},
+        {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, sets},
+        {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, sets * 8},
+        {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, sets},
+    };
 
     VkDescriptorPoolCreateInfo pool_info = {0};
     pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    pool_info.poolSizeCount = 1;
-    pool_info.pPoolSizes = &pool_size;
-    pool_info.maxSets = 1;
-   
-    VkDescriptorPool descriptor_pool;
-    VK_CHECK(vkCreateDescriptorPool(device, &pool_info, NULL, &descriptor_pool));
+    pool_info.poolSizeCount = 4;
+    pool_info.pPoolSizes = pool_sizes;
+    pool_info.maxSets = sets;
+    VK_CHECK(vkCreateDescriptorPool(allocator->device, &pool_info, NULL, &allocator->pools[allocator->pools_len++]));
 
-    VkDescriptorSetLayout layout;
-    /* Creating layout */ { 
-        VkDescriptorSetLayoutBinding ubo_binding = {0};
-        ubo_binding.binding = 0;
-        ubo_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-        ubo_binding.descriptorCount = 1;
-        ubo_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
-        ubo_binding.pImmutableSamplers = NULL;
-    
-        VkDescriptorSetLayoutCreateInfo layout_info = {0};
-        layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-        layout_info.bindingCount = 1;
-        layout_info.pBindings = &ubo_binding;
-            
-    VK_CHECK(vkCreateDescriptorSetLayout(device, &layout_info, NULL, &layout));
+    if (allocator->next_pool_sets < DESCRIPTOR_ALLOCATOR_MAX_POOL_SETS) {
+        allocator->next_pool_sets *= 2;
     }
-    
-    VkDescriptorSetAllocateInfo info = {0};
-    info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-    info.descriptorPool = descriptor_pool;
-    info.descriptorSetCount = 1;
-    info.pSetLayouts = &layout;
+}
 
-    VkDescriptorSet set;
 
-    VK_CHECK(vkAllocateDescriptorSets(device, &info, &set));
+VkDescriptorSet descriptorAllocatorAllocate(DescriptorAllocator *allocator, VkDescriptorSetLayout layout) {
+    while (true) {
+        if (allocator->current == allocator->pools_len) {
+            descriptorAllocatorCreatePool(allocator);
+        }
 
-    VkDescriptorBufferInfo buffer_info = {0};
-    buffer_info.buffer = buffer.buffer;
-    buffer_info.offset = 0;
-    buffer_info.range = buffer_size;
+        VkDescriptorSetAllocateInfo alloc_info = {0};
+        alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        alloc_info.descriptorPool = allocator->pools[allocator->current];
+        alloc_info.descriptorSetCount = 1;
+        alloc_info.pSetLayouts = &layout;
 
-    VkWriteDescriptorSet descriptor_write = {0};
-    descriptor_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    descriptor_write.dstSet = set;
-    descriptor_write.dstBinding = 0; 
-    descriptor_write.dstArrayElement = 0;
-    descriptor_write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    descriptor_write.descriptorCount = 1;
-    descriptor_write.pBufferInfo = &buffer_info;
+        VkDescriptorSet set;
+        VkResult res = vkAllocateDescriptorSets(allocator->device, &alloc_info, &set);
+        if (res == VK_ERROR_OUT_OF_POOL_MEMORY || res == VK_ERROR_FRAGMENTED_POOL) {
+            allocator->current += 1;
+            continue;
+        }
+        VK_CHECK(res);
+        return set;
+    }
+}
 
-    vkUpdateDescriptorSets(device, 1, &descriptor_write, 0, NULL);
 
-    fprintf(stderr, "INFO: Uniform buffer allocated successfully\n");
-    return (UniformBuffer) {
-        buffer,
-        mapped_memory,
-        descriptor_pool,
-        set,
-        layout
-    };   
+/* Every set allocated so far becomes invalid */
+void descriptorAllocatorReset(DescriptorAllocator *allocator) {
+    for (uint32_t i=0; i<allocator->pools_len; ++i) {
+        VK_CHECK(vkResetDescriptorPool(allocator->device, allocator->pools[i], 0));
+    }
+    allocator->current = 0;
 }
 
 
+void descriptorAllocatorFree(DescriptorAllocator *allocator) {
+    for (uint32_t i=0; i<allocator->pools_len; ++i) {
+        vkDestroyDescriptorPool(allocator->device, allocator->pools[i], NULL);
+    }
+    *allocator = (DescriptorAllocator){0};
+}
 
-void freeVulkanImage(VkDevice device, VulkanImage image) {
-    vkDestroyImage(device, image.image, NULL);
-    vkFreeMemory(device, image.memory, NULL);
-    vkDestroyImageView(device, image.view, NULL);
+
+
+UniformRing vulkanCreateUniformRing(GPU gpu, VkDevice device, size_t block_size, uint32_t blocks_per_segment) {
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(gpu.device, &props);
+    VkDeviceSize alignment = props.limits.minUniformBufferOffsetAlignment;
+
+    UniformRing ring = {0};
+    ring.block_stride = (block_size + alignment - 1) / alignment * alignment;
+    ring.segment_size = ring.block_stride * blocks_per_segment;
+    ring.blocks_per_segment = blocks_per_segment;
+
+    size_t buffer_size = ring.segment_size * MAX_SWAPCHAIN_IMAGES;
+    // storage too, so the bindless buffers table can index into it
+    ring.buffer = vulkanCreateBuffer(
+        gpu,
+        device,
+        VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        buffer_size
+    );
+    VK_CHECK(vkMapMemory(device, ring.buffer.memory, 0, buffer_size, 0, &ring.mapped_memory));
+
+    fprintf(stderr, "INFO: Object ring allocated successfully(%u blocks per image)\n", blocks_per_segment);
+    return ring;
 }
 
-void freeSyncObjects(VkDevice device, SyncObjects objects) {
-    vkDestroySemaphore(device, objects.imageAvailable, NULL);
-    vkDestroySemaphore(device, objects.renderFinished, NULL);
-    vkDestroyFence(device, objects.inFlight, NULL);
+
+/* Copies block into the image's segment, returns dynamic offset to bind it with */
+uint32_t uniformRingWrite(UniformRing ring, uint32_t image_index, uint32_t block_index, void *data, size_t size) {
+    if (block_index >= ring.blocks_per_segment) {
+        fprintf(stderr, "ERROR: Object ring is full(%u blocks per image)", ring.blocks_per_segment);
+        exit(1);
+    }
+
+    VkDeviceSize offset = ring.block_stride * block_index;
+    memcpy((char *)ring.mapped_memory + ring.segment_size * image_index + offset, data, size);
+    return (uint32_t)offset;
 }
 
-void freeVulkanBuffer(VkDevice device, VulkanBuffer buffer) {
-    vkDestroyBuffer(device, buffer.buffer, NULL);
-    vkFreeMemory(device, buffer.memory, NULL);
+
+// @SPEED: instances are read straight from host visible memory, big static scenes would be better off in device local one
+InstanceBuffer vulkanCreateInstanceBuffer(GPU gpu, VkDevice device, uint32_t capacity) {
+    InstanceBuffer instances = {0};
+    // segments are also bound as storage buffers by culling, 256 is the largest minStorageBufferOffsetAlignment allowed
+    instances.segment_size = (sizeof(InstanceData) * capacity + 255) / 256 * 256;
+    instances.capacity = capacity;
+
+    size_t buffer_size = instances.segment_size * MAX_SWAPCHAIN_IMAGES;
+    instances.buffer = vulkanCreateBuffer(
+        gpu,
+        device,
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        buffer_size
+    );
+    VK_CHECK(vkMapMemory(device, instances.buffer.memory, 0, buffer_size, 0, &instances.mapped_memory));
+
+    instances.pending_images = calloc(capacity, sizeof(uint8_t));
+    instances.pending = malloc(capacity * sizeof(uint32_t));
+    if (instances.pending_images == NULL || instances.pending == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate memory for instance buffer");
+        exit(1);
+    }
+
+    fprintf(stderr, "INFO: Instance buffer allocated successfully(%u instances per image)\n", capacity);
+    return instances;
 }
 
-void freePipelineLayout(VkDevice device, VulkanPipelineLayout layout) {
-    vkDestroyPipelineLayout(device, layout.layout, NULL);
+/* Call after editing InstanceList, every image will pick up the changes on its next upload */
+void instanceBufferMarkDirty(InstanceBuffer *instances) {
+    instances->dirty_images = (1u << MAX_SWAPCHAIN_IMAGES) - 1;
+    for (uint32_t i=0; i<instances->pending_len; ++i) {
+        instances->pending_images[instances->pending[i]] = 0;
+    }
+    instances->pending_len = 0;
 }
 
-void freeShader(VkDevice device, Shader shader) {
-    vkDestroyShaderModule(device, shader.module, NULL);
-    free(shader.code);
+/*
+ * Call after editing only some entries of InstanceList, images copy just those on their next upload.
+ * Images past image_count don't exist yet, they get the whole list if they ever show up
+ */
+void instanceBufferMarkChanged(InstanceBuffer *instances, const uint32_t *indices, uint32_t count, uint32_t image_count) {
+    // per entry bookkeeping stops paying off long before everything changed
+    if (count * 2 >= instances->capacity) {
+        instanceBufferMarkDirty(instances);
+        return;
+    }
+
+    uint8_t images = (uint8_t)((1u << image_count) - 1);
+    instances->dirty_images |= ((1u << MAX_SWAPCHAIN_IMAGES) - 1) & ~(uint32_t)images;
+    for (uint32_t i=0; i<count; ++i) {
+        uint32_t index = indices[i];
+        if (instances->pending_images[index] == 0) {
+            instances->pending[instances->pending_len++] = index;
+        }
+        instances->pending_images[index] = images;
+    }
 }
 
-void freeSwapchain(VkDevice device, Swapchain swapchain) {
-    for (size_t i=0;i<swapchain.imageCount; ++i) {
-        vkDestroyImageView(device, swapchain.views[i], NULL);
+/* Image's segment must not be in use by the gpu */
+void instanceBufferUpload(InstanceBuffer *instances, uint32_t image_index, InstanceList list) {
+    if (list.len > instances->capacity) {
+        fprintf(stderr, "ERROR: Instance buffer is full(%u instances per image, %zu requested)", instances->capacity, list.len);
+        exit(1);
     }
-    vkDestroySwapchainKHR(device, swapchain.swapchain, NULL);
-    free(swapchain.images);
-    free(swapchain.views); 
 
-    for (size_t i=0;i<swapchain.framebufferCount;++i) {
-        vkDestroyFramebuffer(device, swapchain.framebuffers[i], NULL);
+    char *segment = (char *)instances->mapped_memory + instances->segment_size * image_index;
+    uint32_t image_bit = 1u << image_index;
+    bool full = instances->dirty_images & image_bit;
+    if (full) {
+        memcpy(segment, list.data, list.len * sizeof(InstanceData));
+        instances->dirty_images &= ~image_bit;
     }
-    free(swapchain.framebuffers);
 
-    vkDestroyRenderPass(device, swapchain.renderPass, NULL);
-    freeVulkanImage(device, swapchain.z_buffer);
-    freeVulkanImage(device, swapchain.MSAAbuffer);
+    // entries every image has seen leave the list
+    uint32_t kept = 0;
+    for (uint32_t i=0; i<instances->pending_len; ++i) {
+        uint32_t index = instances->pending[i];
+        if (instances->pending_images[index] & image_bit) {
+            if (!full) {
+                memcpy(segment + index * sizeof(InstanceData), &list.data[index], sizeof(InstanceData));
+            }
+            instances->pending_images[index] &= ~image_bit;
+        }
+        if (instances->pending_images[index] != 0) {
+            instances->pending[kept++] = index;
+        }
+    }
+    instances->pending_len = kept;
 }
 
-void freeUniformBuffer(VkDevice device, UniformBuffer uniform) {
-    vkDestroyDescriptorSetLayout(device, uniform.layout, NULL);
-    vkDestroyDescriptorPool(device, uniform.pool, NULL);
-    vkUnmapMemory(device, uniform.buffer.memory);    
-    freeVulkanBuffer(device, uniform.buffer);
-}
 
+/* Culling and command generation, has to be recorded outside of the render pass */
+void vulkanRecordCulling(VkCommandBuffer command_buffer, GpuDriven gpu_driven, uint32_t image_index, DrawList draw_list) {
+    if (draw_list.len > MAX_GPU_DRIVEN_OBJECTS) {
+        fprintf(stderr, "ERROR: Gpu driven rendering supports only %d objects", MAX_GPU_DRIVEN_OBJECTS);
+        exit(1);
+    }
 
+    // previous frames may still read visible instances and commands
+    vkCmdPipelineBarrier(
+        command_buffer,
+        VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+        VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        0, 0, NULL, 0, NULL, 0, NULL
+    );
 
-Vulkan vulkanCompleteInit(GLFWwindow *window, const char *validation_layers[], size_t validation_layer_count, const char *vertex_shader_path, const char *fragment_shader_path) {
-    VkInstance instance = vulkanInit(validation_layers, validation_layer_count);
+    vkCmdFillBuffer(command_buffer, gpu_driven.lod_counts.buffer, 0, VK_WHOLE_SIZE, 0);
+    vkCmdFillBuffer(command_buffer, gpu_driven.indirect.buffer, 0, VK_WHOLE_SIZE, 0);
 
-    VkSurfaceKHR surface;
-    VK_CHECK(glfwCreateWindowSurface(instance, window, NULL, &surface));
-    
-    GPU gpu = vulkanChooseGpu(instance, surface);
-    VkDevice device = createLogicalDevice(gpu);
+    VkMemoryBarrier barrier = {0};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, NULL, 0, NULL);
 
-    VkQueue graphics_queue;
-    VkQueue present_queue;
-    vkGetDeviceQueue (
-            device,
-            gpu.graphicsFamilyIndex,
-            0,
-            &graphics_queue
-    );
-    vkGetDeviceQueue (
-            device,
-            gpu.presentFamilyIndex,
-            0,
-            &present_queue
-    );
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, gpu_driven.layout, 0, 1, &gpu_driven.sets[image_index], 0, NULL);
 
-    Shader vert = vulkanCreateShaderModule(device, vertex_shader_path);
-    Shader frag = vulkanCreateShaderModule(device, fragment_shader_path);
+    /* Cull instances of every object and count them per lod */ {
+        vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, gpu_driven.cull_pipeline);
+        for (uint32_t i=0; i<draw_list.len; ++i) {
+            RenderObject object = draw_list.data[i];
+            if (object.instance_count == 0) {
+                continue;
+            }
 
-    Swapchain swapchain = vulkanInitSwapchain(gpu, device, surface, window); 
-    vulkanSwapchainCreateRenderPass(gpu, device, &swapchain);
-    vulkanSwapchainCreateFramebuffers(device, &swapchain);
+            CullPushConstants push_constants = {object.model, object.first_instance, object.instance_count, object.mesh_index, i, 0};
+            vkCmdPushConstants(command_buffer, gpu_driven.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CullPushConstants), &push_constants);
+            vkCmdDispatch(command_buffer, (object.instance_count + 63) / 64, 1, 1);
+        }
+    }
 
-    UniformBuffer uniform_buffer = vulkanCreateUniformBuffer(gpu, device);
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, NULL, 0, NULL);
 
-    VulkanPipelineLayout pipeline_layout = vulkanCreatePipelineLayout(device, uniform_buffer.layout);
-    VkPipeline pipeline = vulkanCreatePipeline(gpu, device, swapchain, frag, vert, pipeline_layout.layout); 
-    VkCommandPool command_pool = vulkanCreateCommandPool(device, gpu);
-    VkCommandBuffer command_buffer = vulkanCreateCommandBuffer(device, command_pool);
+    /* Turn lod counts into indirect commands */ {
+        vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, gpu_driven.compact_pipeline);
+        for (uint32_t i=0; i<draw_list.len; ++i) {
+            RenderObject object = draw_list.data[i];
+            uint32_t compact = gpu_driven.cmdDrawIndexedIndirectCount != NULL;
 
-    SyncObjects sync_objects = createSyncObjects(device);  
-    
-    return (Vulkan) {
-        instance,
-        surface,
-        gpu,
-        device,
-        graphics_queue,
-        present_queue,
-        swapchain,
-        pipeline_layout,
-        pipeline,
-        command_pool,
+            CullPushConstants push_constants = {object.model, object.first_instance, object.instance_count, object.mesh_index, i, compact};
+            vkCmdPushConstants(command_buffer, gpu_driven.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CullPushConstants), &push_constants);
+            vkCmdDispatch(command_buffer, 1, 1, 1);
+        }
+    }
+
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+    vkCmdPipelineBarrier(
         command_buffer,
-        sync_objects,
-        uniform_buffer,
-        vert,
-        frag,
-        (VulkanBuffer) {0},
-        (VulkanBuffer) {0},
-    };
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+        0, 1, &barrier, 0, NULL, 0, NULL
+    );
 }
 
 
-void vulkanCreateVertexBuffer(Vulkan *vulkan, Vertex *vertices, size_t vertices_size_bytes) {
-    vulkan->staging_buffer = vulkanCreateBuffer(vulkan->gpu, vulkan->device, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, vertices_size_bytes);
-    vulkanFillMemory(vulkan->device, vulkan->staging_buffer.memory, vertices, vertices_size_bytes); 
-    vulkan->vertex_buffer = vulkanCreateBuffer(vulkan->gpu, vulkan->device, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertices_size_bytes);
-    vulkanCopyBuffer(vulkan->device, vulkan->graphics_queue, vulkan->command_pool, vulkan->staging_buffer, vulkan->vertex_buffer, vertices_size_bytes);
+/* 
+ * Cones are tested only when the rasterizer culls back faces too, so clusters are never dropped for facing when they would be drawn.
+ * Compute path draws with the scene variant, culling waits until it is built
+ */
+bool vulkanClusterCullBack(Vulkan *vulkan) {
+    if (vulkan->variants == NULL || !(vulkan->settings.scene_variant.render_state & RENDER_STATE_CULL_BACK)) {
+        return false;
+    }
+    return vulkanUseMeshlets(vulkan) || vulkan->variants->cluster_pipeline != vulkan->clusters.pipeline;
 }
 
 
-void vulkanFree(Vulkan *vulkan) {
-    vkDeviceWaitIdle(vulkan->device);
+/* Triangles of visible clusters and their draw commands, has to be recorded outside of the render pass */
+void vulkanRecordClusterCulling(Vulkan *vulkan, VkCommandBuffer command_buffer, uint32_t image_index, DrawList draw_list) {
+    ClusterCulling *clusters = &vulkan->clusters;
+    if (draw_list.len == 0) {
+        return;
+    }
 
-    freeShader(vulkan->device, vulkan->frag);
-    freeShader(vulkan->device, vulkan->vert);
-    freeSyncObjects(vulkan->device, vulkan->sync);
-    vkDestroyCommandPool(vulkan->device, vulkan->command_pool, NULL);
+    // previous frames may still read indices, clusters and commands
+    vkCmdPipelineBarrier(
+        command_buffer,
+        VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+        VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        0, 0, NULL, 0, NULL, 0, NULL
+    );
+
+    // every object starts as an empty draw at the start of its index range, culling adds to index count
+    uint32_t commands[CLUSTER_MAX_OBJECTS * CLUSTER_OBJECT_STRIDE / sizeof(uint32_t)] = {0};
+    uint32_t cluster_bases[CLUSTER_MAX_OBJECTS];
+    uint32_t cluster_base = 0;
+    uint32_t index_base = 0;
+    for (uint32_t i=0; i<draw_list.len; ++i) {
+        RenderObject object = draw_list.data[i];
+        VkDrawIndexedIndirectCommand *command = (VkDrawIndexedIndirectCommand *)&commands[i * CLUSTER_OBJECT_STRIDE / sizeof(uint32_t)];
+        // instances are in the clusters already
+        command->instanceCount = 1;
+        command->firstIndex = index_base;
+        cluster_bases[i] = cluster_base;
+        cluster_base += object.instance_count * clusters->meshes[object.mesh_index].meshlet_count;
+        index_base += object.instance_count * vulkan->meshes[object.mesh_index].lods[0].index_count;
+    }
+    vkCmdUpdateBuffer(command_buffer, clusters->commands.buffer, 0, draw_list.len * CLUSTER_OBJECT_STRIDE, commands);
+
+    VkMemoryBarrier barrier = {0};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, NULL, 0, NULL);
+
+    // set 0 is the usual ubo set, the object block isn't read
+    VkDescriptorSet sets[] = {vulkan->uniform_buffer.sets[image_index], clusters->sets[image_index]};
+    uint32_t object_offset = 0;
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, clusters->cull_pipeline);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, clusters->cull_layout, 0, 2, sets, 1, &object_offset);
+
+    uint32_t cull_back = vulkanClusterCullBack(vulkan);
+    for (uint32_t i=0; i<draw_list.len; ++i) {
+        RenderObject object = draw_list.data[i];
+        MeshletRange range = clusters->meshes[object.mesh_index];
+        if (object.instance_count == 0 || range.meshlet_count == 0) {
+            continue;
+        }
+
+        VkDrawIndexedIndirectCommand *command = (VkDrawIndexedIndirectCommand *)&commands[i * CLUSTER_OBJECT_STRIDE / sizeof(uint32_t)];
+        ClusterCullPushConstants push_constants = {
+            object.model, object.first_instance, object.instance_count, range.first_meshlet, range.meshlet_count,
+            i, cluster_bases[i], command->firstIndex, cull_back
+        };
+        vkCmdPushConstants(command_buffer, clusters->cull_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof push_constants, &push_constants);
+        vkCmdDispatch(command_buffer, range.meshlet_count, object.instance_count, 1);
+    }
+
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(
+        command_buffer,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+        0, 1, &barrier, 0, NULL, 0, NULL
+    );
+}
+
+
+/* Records draws of objects [begin, end) into command buffer that is already inside the render pass. clusters is vulkanUseClusters of the whole list */
+void vulkanRecordDraws(Vulkan *vulkan, VkCommandBuffer command_buffer, uint32_t image_index, DrawList draw_list, uint32_t begin, uint32_t end, bool gpu_driven, bool clusters) {
+    Swapchain swapchain = vulkan->swapchain;
+    VkPipelineLayout pipeline_layout = vulkan->pipeline_layout.layout;
+    bool meshlets = clusters && vulkanUseMeshlets(vulkan);
+    bool pulling = !clusters && vulkan->settings.vertex_pulling && vulkan->pulling.created;
+    bool bindless = !clusters && !pulling && vulkan->settings.bindless && vulkan->bindless.created;
+    // variants are picked by vulkanResolveScenePipelines, record workers only read them
+    PipelineVariants *variants = vulkan->variants;
+    VkPipeline scene_pipeline = variants != NULL ? variants->scene_pipeline : vulkan->pipeline;
+    VkPipeline bindless_pipeline = variants != NULL ? variants->bindless_pipeline : vulkan->bindless.pipeline;
+    VkPipeline pulling_pipeline = variants != NULL ? variants->pulling_pipeline : vulkan->pulling.pipeline;
+    VkPipeline cluster_pipeline = variants != NULL ? variants->cluster_pipeline : vulkan->clusters.pipeline;
+
+    if (clusters) {
+        // set 1 has everything cluster shaders fetch, instances come from the clusters rather than the draw
+        pipeline_layout = meshlets ? vulkan->clusters.mesh_layout : vulkan->clusters.layout;
+        VkPipeline pipeline = meshlets ? vulkan->clusters.mesh_pipelines[vulkanClusterCullBack(vulkan)] : cluster_pipeline;
+        vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+        vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 1, 1, &vulkan->clusters.sets[image_index], 0, NULL);
+    } else if (pulling) {
+        // set 0 stays per object, its layout goes with the pulling push constants.
+        // culling outputs instances in the same layout, only the buffer differs
+        pipeline_layout = vulkan->pulling.layout;
+        VkDescriptorSet instances = gpu_driven ? vulkan->pulling.culled_set : vulkan->pulling.sets[image_index];
+        vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pulling_pipeline);
+        vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 1, 1, &instances, 0, NULL);
+    } else if (bindless) {
+        // both sets are bound once, object ring is reached through the buffers table
+        VkDescriptorSet sets[] = {vulkan->uniform_buffer.sets[image_index], vulkan->bindless.set};
+        uint32_t object_offset = 0;
+        vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, bindless_pipeline);
+        vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, vulkan->bindless.layout, 0, 2, sets, 1, &object_offset);
+    } else {
+        vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, scene_pipeline);
+    }
+
+    // culling outputs instances in the same layout, so the graphics pipeline doesn't care which path is used
+    VkBuffer vertex_buffers[] = {vulkan->vertex_buffer.buffer, vulkan->instance_buffer.buffer.buffer};
+    VkDeviceSize vertex_buffer_offsets[] = {0, vulkan->instance_buffer.segment_size * image_index};
+    if (gpu_driven) {
+        vertex_buffers[1] = vulkan->gpu_driven.visible_instances.buffer;
+        vertex_buffer_offsets[1] = 0;
+    }
+    if (!pulling && !clusters) {
+        vkCmdBindVertexBuffers(command_buffer, 0, 2, vertex_buffers, vertex_buffer_offsets);
+    }
+    // compacted indices of visible clusters replace the mesh pool ones
+    VkBuffer index_buffer = clusters ? vulkan->clusters.indices.buffer : vulkan->index_buffer.buffer;
+    if (!meshlets) {
+        vkCmdBindIndexBuffer(command_buffer, index_buffer, 0, VK_INDEX_TYPE_UINT32);
+    }
+     
+    VkViewport viewport = {0};
+    viewport.x = 0.0f;
+    viewport.y = 0.0f;
+    viewport.width = (float)swapchain.renderExtent.width;
+    viewport.height = (float)swapchain.renderExtent.height;
+    viewport.minDepth = 0.0f;
+    // ...
+    viewport.maxDepth = 1.0f;
+    vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+
+    VkRect2D scissors = {0};
+    scissors.offset = (VkOffset2D){0, 0};
+    scissors.extent = swapchain.renderExtent;
+    vkCmdSetScissor(command_buffer, 0, 1, &scissors);
+
+    for (uint32_t i=begin; i<end; ++i) {
+        RenderObject object = draw_list.data[i];
+
+        ObjectUbo object_ubo = {0};
+        object_ubo.tint = object.tint;
+        uint32_t object_offset = uniformRingWrite(vulkan->object_ring, image_index, i, &object_ubo, sizeof object_ubo);
+
+        if (bindless) {
+            BindlessPushConstants push_constants = {0};
+            push_constants.model = object.model;
+            push_constants.objects = vulkan->bindless.object_ring;
+            push_constants.object_block = (uint32_t)((vulkan->object_ring.segment_size * image_index + object_offset) / sizeof(vec4));
+            vkCmdPushConstants(command_buffer, vulkan->bindless.layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof push_constants, &push_constants);
+        } else {
+            // rebinding the same set with another dynamic offset, no allocations or descriptor writes per object
+            vkCmdBindDescriptorSets(
+                command_buffer, 
+                VK_PIPELINE_BIND_POINT_GRAPHICS,
+                pipeline_layout,
+                0,
+                1,
+                &vulkan->uniform_buffer.sets[image_index],
+                1, 
+                &object_offset
+            );
+
+            if (meshlets) {
+                MeshletRange range = vulkan->clusters.meshes[object.mesh_index];
+                MeshletPushConstants push_constants = {
+                    object.model, vulkan->pulling.decode[object.mesh_index], object.first_instance, range.first_meshlet, range.meshlet_count,
+                    vulkanClusterCullBack(vulkan)
+                };
+                VkShaderStageFlags stages = VK_SHADER_STAGE_TASK_BIT_EXT | VK_SHADER_STAGE_MESH_BIT_EXT;
+                vkCmdPushConstants(command_buffer, pipeline_layout, stages, 0, sizeof push_constants, &push_constants);
+            } else if (pulling || clusters) {
+                PullPushConstants push_constants = {object.model, vulkan->pulling.decode[object.mesh_index]};
+                vkCmdPushConstants(command_buffer, pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof push_constants, &push_constants);
+            } else {
+                PushConstants push_constants = {object.model};
+                vkCmdPushConstants(command_buffer, pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PushConstants), &push_constants);
+            }
+        }
+
+        MeshInfo mesh = vulkan->meshes[object.mesh_index];
+        if (meshlets) {
+            // a task workgroup per MESHLET_TASK_GROUP_SIZE meshlets of every instance
+            uint32_t meshlet_count = vulkan->clusters.meshes[object.mesh_index].meshlet_count;
+            if (object.instance_count > 0 && meshlet_count > 0) {
+                uint32_t groups = (meshlet_count + MESHLET_TASK_GROUP_SIZE - 1) / MESHLET_TASK_GROUP_SIZE;
+                vulkan->clusters.cmdDrawMeshTasks(command_buffer, groups, object.instance_count, 1);
+            }
+            continue;
+        }
+        if (clusters) {
+            vkCmdDrawIndexedIndirect(command_buffer, vulkan->clusters.commands.buffer, CLUSTER_OBJECT_STRIDE * i, 1, sizeof(VkDrawIndexedIndirectCommand));
+            continue;
+        }
+        if (!gpu_driven) {
+            MeshLod lod = mesh.lods[0];
+            vkCmdDrawIndexed(command_buffer, lod.index_count, object.instance_count, lod.first_index, lod.vertex_offset, object.first_instance);
+            continue;
+        }
+
+        VkBuffer indirect = vulkan->gpu_driven.indirect.buffer;
+        VkDeviceSize count_offset = GPU_DRIVEN_OBJECT_STRIDE * i;
+        VkDeviceSize commands_offset = count_offset + 16;
+        uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+        if (vulkan->gpu_driven.cmdDrawIndexedIndirectCount != NULL) {
+            vulkan->gpu_driven.cmdDrawIndexedIndirectCount(command_buffer, indirect, commands_offset, indirect, count_offset, mesh.lod_count, stride);
+        } else if (vulkan->gpu.caps.multiDrawIndirect) {
+            vkCmdDrawIndexedIndirect(command_buffer, indirect, commands_offset, mesh.lod_count, stride);
+        } else {
+            for (uint32_t lod=0; lod<mesh.lod_count; ++lod) {
+                vkCmdDrawIndexedIndirect(command_buffer, indirect, commands_offset + stride * lod, 1, stride);
+            }
+        }
+    }
+}
+
+
+/* Slice's secondary command buffer continues the swapchain render pass */
+void recordSlice(ParallelRecorder *recorder, uint32_t slice_index) {
+    RecordJob job = recorder->job;
+    Vulkan *vulkan = job.vulkan;
+    RecordSlice *slice = &recorder->slices[slice_index];
+    uint32_t begin = job.draw_list.len * slice_index / job.used_slices;
+    uint32_t end = job.draw_list.len * (slice_index + 1) / job.used_slices;
+
+    // previous recording of this image is done on gpu, images_in_flight fence was waited
+    VK_CHECK(vkResetCommandPool(vulkan->device, slice->pools[job.image_index], 0));
+    VkCommandBuffer command_buffer = slice->buffers[job.image_index];
+
+    VkCommandBufferInheritanceInfo inheritance_info = {0};
+    inheritance_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    inheritance_info.renderPass = vulkan->swapchain.renderPass;
+    inheritance_info.subpass = 0;
+    inheritance_info.framebuffer = vulkan->swapchain.framebuffers[job.image_index];
+    inheritance_info.pipelineStatistics = job.pipeline_statistics;
+
+    VkCommandBufferBeginInfo begin_info = {0};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    begin_info.pInheritanceInfo = &inheritance_info;
+    VK_CHECK(vkBeginCommandBuffer(command_buffer, &begin_info));
+
+    // slices of a batch are executed one after another, so its timestamps can be written from different secondaries
+    uint32_t batch = slice_index * job.draw_batches / job.used_slices;
+    bool batch_begins = slice_index == 0 || (slice_index - 1) * job.draw_batches / job.used_slices != batch;
+    bool batch_ends = slice_index + 1 == job.used_slices || (slice_index + 1) * job.draw_batches / job.used_slices != batch;
+    if (batch_begins) {
+        vulkanProfilerTimestamp(vulkan->profiler, command_buffer, job.image_index, job.draw_scopes[batch], false);
+    }
+    vulkanRecordDraws(vulkan, command_buffer, job.image_index, job.draw_list, begin, end, job.gpu_driven, job.clusters);
+    if (batch_ends) {
+        vulkanProfilerTimestamp(vulkan->profiler, command_buffer, job.image_index, job.draw_scopes[batch], true);
+    }
+
+    VK_CHECK(vkEndCommandBuffer(command_buffer));
+}
+
+
+void recordSliceJob(void *data, uint32_t begin, uint32_t end) {
+    for (uint32_t i=begin; i<end; ++i) {
+        TRACE_BEGIN(zone, "record secondary");
+        recordSlice(data, i);
+        TRACE_END(zone);
+    }
+}
+
+
+/* vulkan has to stay at the same address while the recorder exists */
+ParallelRecorder *vulkanCreateParallelRecorder(Vulkan *vulkan, JobSystem *jobs, uint32_t count) {
+    if (count == 0 || count > MAX_RECORD_SLICES) {
+        fprintf(stderr, "ERROR: Record slice count has to be in [1, %d], got %u", MAX_RECORD_SLICES, count);
+        exit(1);
+    }
+
+    ParallelRecorder *recorder = calloc(1, sizeof(ParallelRecorder));
+    if (recorder == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate memory for parallel recorder");
+        exit(1);
+    }
+    recorder->jobs = jobs;
+    recorder->count = count;
+
+    for (uint32_t i=0; i<count; ++i) {
+        RecordSlice *slice = &recorder->slices[i];
+
+        // command pools are externally synchronized, so every slice gets its own per swapchain image
+        for (size_t j=0; j<MAX_SWAPCHAIN_IMAGES; ++j) {
+            VkCommandPoolCreateInfo pool_info = {0};
+            pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+            pool_info.queueFamilyIndex = vulkan->gpu.graphicsFamilyIndex;
+            VK_CHECK(vkCreateCommandPool(vulkan->device, &pool_info, NULL, &slice->pools[j]));
+
+            VkCommandBufferAllocateInfo buffer_info = {0};
+            buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            buffer_info.commandPool = slice->pools[j];
+            buffer_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+            buffer_info.commandBufferCount = 1;
+            VK_CHECK(vkAllocateCommandBuffers(vulkan->device, &buffer_info, &slice->buffers[j]));
+        }
+    }
+
+    fprintf(stderr, "INFO: Parallel recorder created successfully(%u slices)\n", count);
+    return recorder;
+}
+
+
+/* Records every slice as a job and helps with them until all are done, returns number of secondary buffers to execute */
+uint32_t parallelRecorderRun(ParallelRecorder *recorder, RecordJob job) {
+    recorder->job = job;
+    JobCounter counter = {0};
+    jobsParallelFor(recorder->jobs, recordSliceJob, recorder, job.used_slices, 1, &counter);
+    jobsWait(recorder->jobs, &counter);
+    return job.used_slices;
+}
+
+
+void freeParallelRecorder(VkDevice device, ParallelRecorder *recorder) {
+    if (recorder == NULL) {
+        return;
+    }
+
+    for (uint32_t i=0; i<recorder->count; ++i) {
+        for (size_t j=0; j<MAX_SWAPCHAIN_IMAGES; ++j) {
+            vkDestroyCommandPool(device, recorder->slices[i].pools[j], NULL);
+        }
+    }
+    free(recorder);
+}
+
+
+/* Clamps requested settings to what gpu supports, MSAA without a supported sample count becomes off */
+AntiAliasing vulkanSupportedAntiAliasing(GPU gpu, AntiAliasing aa) {
+    if (aa.mode == ANTI_ALIASING_MSAA) {
+        aa.samples = vulkanBestSampleCount(gpu.device, aa.samples);
+        if (aa.samples == 0) {
+            aa.mode = ANTI_ALIASING_OFF;
+        }
+    }
+    if (aa.mode != ANTI_ALIASING_MSAA) {
+        aa.samples = VK_SAMPLE_COUNT_1_BIT;
+        aa.sample_shading = false;
+    }
+    aa.sample_shading = aa.sample_shading && gpu.caps.sampleRateShading;
+    return aa;
+}
+
+
+VkResult vulkanTryCreatePostPipeline(VkDevice device, Swapchain swapchain, PostProcess post, Shader frag, VkPipelineCache pipeline_cache, VkPipeline *out) {
+    VkPipelineShaderStageCreateInfo stages[2] = {0};
+    stages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+    stages[0].module = post.vert.module;
+    stages[0].pName = "main";
+    stages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    stages[1].module = frag.module;
+    stages[1].pName = "main";
+
+    // fullscreen triangle is generated from gl_VertexIndex
+    VkPipelineVertexInputStateCreateInfo vertex_input_info = {0};
+    vertex_input_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+
+    VkPipelineInputAssemblyStateCreateInfo input_assembly_info = {0};
+    input_assembly_info.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    input_assembly_info.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+    VkDynamicState dynamic_states[] = {
+        VK_DYNAMIC_STATE_VIEWPORT,
+        VK_DYNAMIC_STATE_SCISSOR
+    };
+    VkPipelineDynamicStateCreateInfo dynamic_state = {0};
+    dynamic_state.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamic_state.dynamicStateCount = sizeof dynamic_states / sizeof(VkDynamicState);
+    dynamic_state.pDynamicStates = dynamic_states;
+
+    VkPipelineViewportStateCreateInfo viewport_state_info = {0};
+    viewport_state_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    viewport_state_info.viewportCount = 1;
+    viewport_state_info.scissorCount = 1;
+
+    VkPipelineRasterizationStateCreateInfo rasterization_info = {0};
+    rasterization_info.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rasterization_info.polygonMode = VK_POLYGON_MODE_FILL;
+    rasterization_info.lineWidth = 1.0f;
+    rasterization_info.cullMode = VK_CULL_MODE_NONE;
+    rasterization_info.frontFace = VK_FRONT_FACE_CLOCKWISE;
+
+    VkPipelineMultisampleStateCreateInfo multisampling_info = {0};
+    multisampling_info.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    multisampling_info.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+    VkPipelineColorBlendAttachmentState colorblend_attachment = {0};
+    colorblend_attachment.colorWriteMask = 
+        VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+    colorblend_attachment.blendEnable = VK_FALSE;
+
+    VkPipelineColorBlendStateCreateInfo colorblend_info = {0};
+    colorblend_info.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    colorblend_info.attachmentCount = 1;
+    colorblend_info.pAttachments = &colorblend_attachment;
+
+    VkGraphicsPipelineCreateInfo pipeline_info = {0};
+    pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipeline_info.stageCount = 2;
+    pipeline_info.pStages = stages;
+    pipeline_info.pVertexInputState = &vertex_input_info;
+    pipeline_info.pInputAssemblyState = &input_assembly_info;
+    pipeline_info.pViewportState = &viewport_state_info;
+    pipeline_info.pRasterizationState = &rasterization_info;
+    pipeline_info.pMultisampleState = &multisampling_info;
+    pipeline_info.pColorBlendState = &colorblend_info;
+    pipeline_info.pDynamicState = &dynamic_state;
+    pipeline_info.layout = post.layout;
+    pipeline_info.renderPass = swapchain.postRenderPass;
+    pipeline_info.subpass = 0;
+    pipeline_info.basePipelineHandle = VK_NULL_HANDLE;
+    pipeline_info.basePipelineIndex = -1;
+
+    VkResult res;
+    if ((res = vkCreateGraphicsPipelines(device, pipeline_cache, 1, &pipeline_info, NULL, out)) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create post process pipeline. Error code: %d\n", res);
+    }
+    return res;
+}
+
+VkPipeline vulkanCreatePostPipeline(VkDevice device, Swapchain swapchain, PostProcess post, Shader frag, VkPipelineCache pipeline_cache) {
+    VkPipeline pipeline;
+    if (vulkanTryCreatePostPipeline(device, swapchain, post, frag, pipeline_cache, &pipeline) != VK_SUCCESS) {
+        exit(1);
+    }
+    return pipeline;
+}
+
+
+/* 
+ * sceneColor is recreated with the targets, so instead of keeping sets that have to follow it 
+ * a fresh one is written every time the image's command buffer is recorded
+ */
+VkDescriptorSet vulkanPostProcessWriteSet(Vulkan *vulkan, uint32_t image_index) {
+    PostProcess *post = &vulkan->post_process;
+    VkDescriptorSet set = descriptorAllocatorAllocate(&vulkan->frame_descriptors[image_index], post->set_layout);
+
+    VkDescriptorImageInfo image_info = {0};
+    image_info.sampler = post->sampler;
+    image_info.imageView = vulkan->swapchain.attachments[vulkan->swapchain.sceneColorResource].view;
+    image_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+    VkWriteDescriptorSet write = {0};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = set;
+    write.dstBinding = 0;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    write.pImageInfo = &image_info;
+    vkUpdateDescriptorSets(vulkan->device, 1, &write, 0, NULL);
+    return set;
+}
+
+
+/* FXAA and dynamic resolution can't be turned on until this is called */
+void vulkanCreatePostProcess(Vulkan *vulkan, const char *vertex_shader_path, const char *fxaa_shader_path, const char *upscale_shader_path) {
+    VkDevice device = vulkan->device;
+    PostProcess post = {0};
+
+    post.vert = vulkanCreateShaderModule(device, vertex_shader_path);
+    post.fxaa_frag = vulkanCreateShaderModule(device, fxaa_shader_path);
+    post.upscale_frag = vulkanCreateShaderModule(device, upscale_shader_path);
+
+    /* FXAA and upscale sample between texels */ {
+        VkSamplerCreateInfo sampler_info = {0};
+        sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+        sampler_info.magFilter = VK_FILTER_LINEAR;
+        sampler_info.minFilter = VK_FILTER_LINEAR;
+        sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+        sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        sampler_info.maxLod = 0.0f;
+        VK_CHECK(vkCreateSampler(device, &sampler_info, NULL, &post.sampler));
+    }
+
+    /* Descriptors */ {
+        VkDescriptorSetLayoutBinding scene_binding = {0};
+        scene_binding.binding = 0;
+        scene_binding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        scene_binding.descriptorCount = 1;
+        scene_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+        VkDescriptorSetLayoutCreateInfo layout_info = {0};
+        layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        layout_info.bindingCount = 1;
+        layout_info.pBindings = &scene_binding;
+        VK_CHECK(vkCreateDescriptorSetLayout(device, &layout_info, NULL, &post.set_layout));
+    }
+
+    /* Pipeline layout */ {
+        VkPushConstantRange push_constant_range = {0};
+        push_constant_range.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+        push_constant_range.offset = 0;
+        push_constant_range.size = sizeof(PostPushConstants);
+
+        VkPipelineLayoutCreateInfo layout_info = {0};
+        layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        layout_info.setLayoutCount = 1;
+        layout_info.pSetLayouts = &post.set_layout;
+        layout_info.pushConstantRangeCount = 1;
+        layout_info.pPushConstantRanges = &push_constant_range;
+        VK_CHECK(vkCreatePipelineLayout(device, &layout_info, NULL, &post.layout));
+    }
+
+    post.fxaa_pipeline = vulkanCreatePostPipeline(device, vulkan->swapchain, post, post.fxaa_frag, vulkan->pipeline_cache);
+    post.upscale_pipeline = vulkanCreatePostPipeline(device, vulkan->swapchain, post, post.upscale_frag, vulkan->pipeline_cache);
+    post.created = true;
+    vulkan->post_process = post;
+
+    fprintf(stderr, "INFO: Post pass created successfully\n");
+}
+
+
+void vulkanRecordPostProcess(Vulkan *vulkan, VkCommandBuffer command_buffer, uint32_t image_index) {
+    VkDescriptorSet set = vulkanPostProcessWriteSet(vulkan, image_index);
+
+    Swapchain swapchain = vulkan->swapchain;
+    PostProcess post = vulkan->post_process;
+
+    VkRenderPassBeginInfo render_pass_info = {0};
+    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    render_pass_info.renderPass = swapchain.postRenderPass;
+    render_pass_info.framebuffer = swapchain.postFramebuffers[image_index];
+    render_pass_info.renderArea.offset = (VkOffset2D){0, 0};
+    render_pass_info.renderArea.extent = swapchain.extent;
+
+    // FXAA samples with uv_scale too, so with both on it antialiases while upscaling
+    VkPipeline pipeline = swapchain.antiAliasing.mode == ANTI_ALIASING_FXAA ? post.fxaa_pipeline : post.upscale_pipeline;
+
+    vkCmdBeginRenderPass(command_buffer, &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
+        vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+
+        VkViewport viewport = {0};
+        viewport.width = (float)swapchain.extent.width;
+        viewport.height = (float)swapchain.extent.height;
+        viewport.maxDepth = 1.0f;
+        vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+
+        VkRect2D scissors = {0};
+        scissors.extent = swapchain.extent;
+        vkCmdSetScissor(command_buffer, 0, 1, &scissors);
+
+        vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, post.layout, 0, 1, &set, 0, NULL);
+
+        PostPushConstants push = {0};
+        push.inverse_size = (vec2){1.0f / swapchain.extent.width, 1.0f / swapchain.extent.height};
+        push.uv_scale = (vec2){(float)swapchain.renderExtent.width / swapchain.extent.width, (float)swapchain.renderExtent.height / swapchain.extent.height};
+        vkCmdPushConstants(command_buffer, post.layout, VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof push, &push);
+        vkCmdDraw(command_buffer, 3, 1, 0, 0);
+    vkCmdEndRenderPass(command_buffer);
+}
+
+
+
+void vulkanRecordCommandBuffer(Vulkan *vulkan, VkCommandBuffer command_buffer, uint32_t image_index, DrawList draw_list) {
+    Swapchain swapchain = vulkan->swapchain;
+    bool clusters = vulkanUseClusters(vulkan, draw_list);
+    bool meshlets = clusters && vulkanUseMeshlets(vulkan);
+    // culling slots are limited, huge draw lists are drawn directly
+    bool gpu_driven = !clusters && vulkan->settings.gpu_driven && vulkan->gpu_driven.supported && draw_list.len <= MAX_GPU_DRIVEN_OBJECTS;
+    bool parallel = vulkan->settings.parallel_recording && vulkan->recorder != NULL && draw_list.len > 0;
+
+    VkCommandBufferBeginInfo begin_info = {0};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+
+    VkResult res;
+    if ((res = vkBeginCommandBuffer(command_buffer, &begin_info)) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to begin recording command buffer\nIt is probably an application bug");
+        exit(1);
+    } 
+    // previous recording of this image is done, so are the sets it used
+    descriptorAllocatorReset(&vulkan->frame_descriptors[image_index]);
+    vulkanResolveScenePipelines(vulkan, clusters);
+
+    GpuProfiler *profiler = vulkan->profiler;
+    vulkanProfilerReset(profiler, command_buffer, image_index);
+    // imageAvailable blocks only color output, top of pipe would count acquire and vsync waits as gpu time.
+    // Culling that runs ahead of the wait is partly left out, it is small next to the scene
+    uint32_t frame_scope = vulkanProfilerBeginAt(profiler, command_buffer, image_index, "frame", false, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+
+    if (gpu_driven) {
+        uint32_t scope = vulkanProfilerBegin(profiler, command_buffer, image_index, "culling", false);
+        vulkanRecordCulling(command_buffer, vulkan->gpu_driven, image_index, draw_list);
+        vulkanProfilerEnd(profiler, command_buffer, image_index, scope);
+    } else if (clusters && !meshlets) {
+        uint32_t scope = vulkanProfilerBegin(profiler, command_buffer, image_index, "clusters", false);
+        vulkanRecordClusterCulling(vulkan, command_buffer, image_index, draw_list);
+        vulkanProfilerEnd(profiler, command_buffer, image_index, scope);
+    }
+
+    VkClearValue clear_color = {{{0.0f, 0.0f, 0.0f, 1.0f}}};
+    VkClearValue clear_z_buffer = {{{1.0f, 0}}};
+    
+    VkClearValue all_clear_values[] = {clear_color, clear_z_buffer};
+    size_t all_clear_values_size = sizeof all_clear_values / sizeof(VkClearValue);
+
+    VkRenderPassBeginInfo render_pass_info = {0};
+    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    render_pass_info.renderPass = swapchain.renderPass;
+    render_pass_info.framebuffer = swapchain.framebuffers[image_index];
+    render_pass_info.renderArea.offset = (VkOffset2D){0, 0};
+    render_pass_info.renderArea.extent = swapchain.renderExtent;
+    render_pass_info.clearValueCount = all_clear_values_size;
+    render_pass_info.pClearValues = all_clear_values;
+
+    // secondaries can be counted only if they inherit the query.
+    // Mesh tasks can't draw while vertex or input assembly statistics are counted, and the pool counts vertex invocations
+    bool scene_statistics = (!parallel || vulkan->gpu.caps.inheritedQueries) && !meshlets;
+    uint32_t scene_scope = vulkanProfilerBegin(profiler, command_buffer, image_index, "scene", scene_statistics);
+    if (parallel) {
+        ParallelRecorder *recorder = vulkan->recorder;
+
+        // small lists are not worth splitting into many jobs
+        uint32_t used_slices = (draw_list.len + MIN_DRAWS_PER_RECORD_SLICE - 1) / MIN_DRAWS_PER_RECORD_SLICE;
+        used_slices = uint32Clamp(used_slices, 1, recorder->count);
+
+        RecordJob job = {vulkan, image_index, draw_list, used_slices, gpu_driven, clusters, 0, {0}, 0};
+        if (profiler != NULL && (profiler->recorded_statistics[image_index] & (1u << scene_scope))) {
+            job.pipeline_statistics = GPU_PROFILER_STATISTICS;
+        }
+        job.draw_batches = profiler != NULL ? vulkanProfilerReserveDraws(profiler, image_index, used_slices, job.draw_scopes) : 0;
+        uint32_t secondary_count = parallelRecorderRun(recorder, job);
+
+        VkCommandBuffer secondary_buffers[MAX_RECORD_SLICES];
+        for (uint32_t i=0; i<secondary_count; ++i) {
+            secondary_buffers[i] = recorder->slices[i].buffers[image_index];
+        }
+
+        vkCmdBeginRenderPass(command_buffer, &render_pass_info, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+            vkCmdExecuteCommands(command_buffer, secondary_count, secondary_buffers);
+        vkCmdEndRenderPass(command_buffer);
+    } else {
+        uint32_t draw_scopes[GPU_PROFILER_DRAW_BATCHES];
+        uint32_t draw_batches = vulkanProfilerReserveDraws(profiler, image_index, profiler != NULL ? draw_list.len : 0, draw_scopes);
+        vkCmdBeginRenderPass(command_buffer, &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
+            if (draw_batches == 0) {
+                vulkanRecordDraws(vulkan, command_buffer, image_index, draw_list, 0, draw_list.len, gpu_driven, clusters);
+            }
+            // same split as record slices, batch timestamps leave out load and store of the pass
+            for (uint32_t batch=0; batch<draw_batches; ++batch) {
+                uint32_t begin = draw_list.len * batch / draw_batches;
+                uint32_t end = draw_list.len * (batch + 1) / draw_batches;
+                vulkanProfilerTimestamp(profiler, command_buffer, image_index, draw_scopes[batch], false);
+                vulkanRecordDraws(vulkan, command_buffer, image_index, draw_list, begin, end, gpu_driven, clusters);
+                vulkanProfilerTimestamp(profiler, command_buffer, image_index, draw_scopes[batch], true);
+            }
+        vkCmdEndRenderPass(command_buffer);
+    }
+    vulkanProfilerEnd(profiler, command_buffer, image_index, scene_scope);
+
+    if (vulkanSwapchainUsesPostPass(swapchain)) {
+        uint32_t scope = vulkanProfilerBegin(profiler, command_buffer, image_index, "post", false);
+        vulkanRecordPostProcess(vulkan, command_buffer, image_index);
+        vulkanProfilerEnd(profiler, command_buffer, image_index, scope);
+    }
+
+    if (vulkan->headless) {
+        uint32_t scope = vulkanProfilerBegin(profiler, command_buffer, image_index, "readback", false);
+        // render pass dependency already covers the last write -> transfer read
+        VkBufferImageCopy region = {0};
+        region.bufferOffset = vulkan->readback_stride * image_index;
+        region.bufferRowLength = 0;
+        region.bufferImageHeight = 0;
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.mipLevel = 0;
+        region.imageSubresource.baseArrayLayer = 0;
+        region.imageSubresource.layerCount = 1;
+        region.imageExtent = (VkExtent3D){swapchain.extent.width, swapchain.extent.height, 1};
+        vkCmdCopyImageToBuffer(command_buffer, swapchain.images[image_index], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, vulkan->readback_buffer.buffer, 1, &region);
+
+        VkMemoryBarrier barrier = {0};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &barrier, 0, NULL, 0, NULL);
+        vulkanProfilerEnd(profiler, command_buffer, image_index, scope);
+    }
+
+    vulkanProfilerEnd(profiler, command_buffer, image_index, frame_scope);
+
+    if ((res = vkEndCommandBuffer(command_buffer)) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to record command buffer. Error code: %d", res);
+    }
+}
+
+
+/* present_fence only where swapchain maintenance1 is enabled */
+SyncObjects createSyncObjects(VkDevice device, bool present_fence) {
+    SyncObjects objs = {0};
+
+    VkSemaphoreCreateInfo semaphore_info = {0};
+    semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+    VkFenceCreateInfo fence_info = {0};
+    fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
+    bool res = true;
+    res = res && (vkCreateSemaphore(device, &semaphore_info, NULL, &objs.imageAvailable) == VK_SUCCESS); 
+    res = res && (vkCreateSemaphore(device, &semaphore_info, NULL, &objs.renderFinished) == VK_SUCCESS);
+    res = res && (vkCreateFence(device, &fence_info, NULL, &objs.inFlight) == VK_SUCCESS);
+    if (present_fence) {
+        res = res && (vkCreateFence(device, &fence_info, NULL, &objs.presentDone) == VK_SUCCESS);
+    }
+
+    if (res != true) {
+        fprintf(stderr, "ERROR: Failed to allocate synchronisation primitives");
+        exit(1);
+    }
+
+    fprintf(stderr, "INFO: Synchronisation primitives allocated successfully\n");
+    return objs; 
+}
+
+
+UniformBuffer vulkanCreateUniformBuffer(GPU gpu, VkDevice device, UniformRing object_ring, DescriptorAllocator *descriptors) {
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(gpu.device, &props);
+    VkDeviceSize alignment = props.limits.minUniformBufferOffsetAlignment;
+    VkDeviceSize stride = (sizeof(Ubo) + alignment - 1) / alignment * alignment;
+
+    size_t buffer_size = stride * MAX_SWAPCHAIN_IMAGES;
+    VulkanBuffer buffer = vulkanCreateBuffer (
+        gpu, 
+        device,
+        VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        buffer_size
+    );
+    
+    void *mapped_memory;
+    VK_CHECK(vkMapMemory (
+        device, 
+        buffer.memory,
+        0,
+        buffer_size, 
+        0,
+        &mapped_memory
+    ));
+
+    VkDescriptorSetLayout layout;
+    /* Creating layout */ { 
+        VkDescriptorSetLayoutBinding ubo_binding = {0};
+        ubo_binding.binding = 0;
+        ubo_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        ubo_binding.descriptorCount = 1;
+        // cluster culling reads the camera too, in compute or task and mesh shaders
+        ubo_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_COMPUTE_BIT;
+        if (gpu.caps.meshShader) {
+            ubo_binding.stageFlags |= VK_SHADER_STAGE_TASK_BIT_EXT | VK_SHADER_STAGE_MESH_BIT_EXT;
+        }
+        ubo_binding.pImmutableSamplers = NULL;
+
+        VkDescriptorSetLayoutBinding object_binding = {0};
+        object_binding.binding = 1;
+        object_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+        object_binding.descriptorCount = 1;
+        object_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+        if (gpu.caps.meshShader) {
+            object_binding.stageFlags |= VK_SHADER_STAGE_MESH_BIT_EXT;
+        }
+        object_binding.pImmutableSamplers = NULL;
+
+        VkDescriptorSetLayoutBinding bindings[] = {ubo_binding, object_binding};
+    
+        VkDescriptorSetLayoutCreateInfo layout_info = {0};
+        layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        layout_info.bindingCount = sizeof bindings / sizeof(VkDescriptorSetLayoutBinding);
+        layout_info.pBindings = bindings;
+            
+    VK_CHECK(vkCreateDescriptorSetLayout(device, &layout_info, NULL, &layout));
+    }
+
+    UniformBuffer uniform = {0};
+    uniform.buffer = buffer;
+    uniform.mapped_memory = mapped_memory;
+    uniform.stride = stride;
+    uniform.layout = layout;
+    
+    for (size_t i=0; i<MAX_SWAPCHAIN_IMAGES; ++i) {
+        uniform.sets[i] = descriptorAllocatorAllocate(descriptors, layout);
+    }
+
+    VkDescriptorBufferInfo buffer_infos[MAX_SWAPCHAIN_IMAGES];
+    VkDescriptorBufferInfo object_buffer_infos[MAX_SWAPCHAIN_IMAGES];
+    VkWriteDescriptorSet descriptor_writes[MAX_SWAPCHAIN_IMAGES * 2];
+    for (size_t i=0; i<MAX_SWAPCHAIN_IMAGES; ++i) {
+        buffer_infos[i] = (VkDescriptorBufferInfo){0};
+        buffer_infos[i].buffer = buffer.buffer;
+        buffer_infos[i].offset = stride * i;
+        buffer_infos[i].range = sizeof(Ubo);
+
+        // dynamic offsets are relative to the image's segment
+        object_buffer_infos[i] = (VkDescriptorBufferInfo){0};
+        object_buffer_infos[i].buffer = object_ring.buffer.buffer;
+        object_buffer_infos[i].offset = object_ring.segment_size * i;
+        object_buffer_infos[i].range = sizeof(ObjectUbo);
+
+        VkWriteDescriptorSet *ubo_write = &descriptor_writes[i * 2];
+        *ubo_write = (VkWriteDescriptorSet){0};
+        ubo_write->sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        ubo_write->dstSet = uniform.sets[i];
+        ubo_write->dstBinding = 0; 
+        ubo_write->dstArrayElement = 0;
+        ubo_write->descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        ubo_write->descriptorCount = 1;
+        ubo_write->pBufferInfo = &buffer_infos[i];
+
+        VkWriteDescriptorSet *object_write = &descriptor_writes[i * 2 + 1];
+        *object_write = (VkWriteDescriptorSet){0};
+        object_write->sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        object_write->dstSet = uniform.sets[i];
+        object_write->dstBinding = 1; 
+        object_write->dstArrayElement = 0;
+        object_write->descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+        object_write->descriptorCount = 1;
+        object_write->pBufferInfo = &object_buffer_infos[i];
+    }
+
+    vkUpdateDescriptorSets(device, MAX_SWAPCHAIN_IMAGES * 2, descriptor_writes, 0, NULL);
+
+    fprintf(stderr, "INFO: Uniform buffer allocated successfully\n");
+    return uniform;
+}
+
+
+/* Ubo slot of the given swapchain image, only safe to write once that image's previous frame has finished */
+Ubo *uniformBufferSlot(UniformBuffer uniform, uint32_t image_index) {
+    return (Ubo *)((char *)uniform.mapped_memory + uniform.stride * image_index);
+}
+
+
+
+void freeVulkanImage(VkDevice device, VulkanImage image) {
+    vkDestroyImage(device, image.image, NULL);
+    vkFreeMemory(device, image.memory, NULL);
+    vkDestroyImageView(device, image.view, NULL);
+}
+
+void freeSyncObjects(VkDevice device, SyncObjects objects) {
+    vkDestroySemaphore(device, objects.imageAvailable, NULL);
+    vkDestroySemaphore(device, objects.renderFinished, NULL);
+    vkDestroyFence(device, objects.inFlight, NULL);
+    if (objects.presentDone != VK_NULL_HANDLE) {
+        vkDestroyFence(device, objects.presentDone, NULL);
+    }
+}
+
+void freeVulkanBuffer(VkDevice device, VulkanBuffer buffer) {
+    vkDestroyBuffer(device, buffer.buffer, NULL);
+    vkFreeMemory(device, buffer.memory, NULL);
+}
+
+void freePipelineLayout(VkDevice device, VulkanPipelineLayout layout) {
+    vkDestroyPipelineLayout(device, layout.layout, NULL);
+}
+
+void freeShader(VkDevice device, Shader shader) {
+    vkDestroyShaderModule(device, shader.module, NULL);
+    free(shader.code);
+}
+
+void vulkanSwapchainFreeAttachments(VkDevice device, Swapchain *swapchain) {
+    for (size_t i=0; i<RENDER_GRAPH_MAX_RESOURCES; ++i) {
+        freeVulkanImage(device, swapchain->attachments[i]);
+        swapchain->attachments[i] = (VulkanImage){0};
+    }
+}
+
+void freeSwapchain(VkDevice device, Swapchain swapchain) {
+    vulkanSwapchainFreeRenderPasses(device, &swapchain);
+    vulkanSwapchainFreeAttachments(device, &swapchain);
+    for (size_t i=0; i<ATTACHMENT_MEMORY_KINDS; ++i) {
+        vkFreeMemory(device, swapchain.attachmentMemory[i].memory, NULL);
+    }
+
+    for (size_t i=0;i<swapchain.imageCount; ++i) {
+        vkDestroyImageView(device, swapchain.views[i], NULL);
+    }
+    if (swapchain.imageMemories != NULL) {
+        for (size_t i=0;i<swapchain.imageCount; ++i) {
+            vkDestroyImage(device, swapchain.images[i], NULL);
+            vkFreeMemory(device, swapchain.imageMemories[i], NULL);
+        }
+        free(swapchain.imageMemories);
+    } else {
+        vkDestroySwapchainKHR(device, swapchain.swapchain, NULL);
+    }
+    free(swapchain.images);
+    free(swapchain.views); 
+}
+
+void freeUniformRing(VkDevice device, UniformRing ring) {
+    vkUnmapMemory(device, ring.buffer.memory);    
+    freeVulkanBuffer(device, ring.buffer);
+}
+
+void freeUniformBuffer(VkDevice device, UniformBuffer uniform) {
+    vkDestroyDescriptorSetLayout(device, uniform.layout, NULL);
+    vkUnmapMemory(device, uniform.buffer.memory);    
+    freeVulkanBuffer(device, uniform.buffer);
+}
+
+void freePostProcess(VkDevice device, PostProcess post) {
+    if (!post.created) {
+        return;
+    }
+    vkDestroyPipeline(device, post.fxaa_pipeline, NULL);
+    vkDestroyPipeline(device, post.upscale_pipeline, NULL);
+    vkDestroyPipelineLayout(device, post.layout, NULL);
+    vkDestroyDescriptorSetLayout(device, post.set_layout, NULL);
+    vkDestroySampler(device, post.sampler, NULL);
+    freeShader(device, post.vert);
+    freeShader(device, post.fxaa_frag);
+    freeShader(device, post.upscale_frag);
+}
+
+
+
+/* surface and window are VK_NULL_HANDLE and NULL in headless mode, then offscreen images of headless_extent are used */
+Vulkan vulkanCompleteInitFromInstance(VkInstance instance, VkSurfaceKHR surface, GLFWwindow *window, VkExtent2D headless_extent, const char *vertex_shader_path, const char *fragment_shader_path, const char *pipeline_cache_path) {
+    TRACE_BEGIN(device_zone, "choose gpu and create device");
+    GPU gpu = vulkanChooseGpu(instance, surface);
+    VkDevice device = createLogicalDevice(gpu);
+
+    VkQueue graphics_queue;
+    VkQueue present_queue;
+    vkGetDeviceQueue (
+            device,
+            gpu.graphicsFamilyIndex,
+            0,
+            &graphics_queue
+    );
+    vkGetDeviceQueue (
+            device,
+            gpu.presentFamilyIndex,
+            0,
+            &present_queue
+    );
+    TRACE_END(device_zone);
+
+    TRACE_BEGIN(shaders_zone, "load shaders");
+    Shader vert = vulkanCreateShaderModule(device, vertex_shader_path);
+    Shader frag = vulkanCreateShaderModule(device, fragment_shader_path);
+    TRACE_END(shaders_zone);
+
+    // same as before anti aliasing became configurable: best MSAA up to 8x
+    AntiAliasing anti_aliasing = vulkanSupportedAntiAliasing(gpu, (AntiAliasing){ANTI_ALIASING_MSAA, gpu.multisampling, false});
+
+    TRACE_BEGIN(swapchain_zone, "create swapchain");
+    Swapchain swapchain;
+    if (gpu.headless) {
+        swapchain = vulkanInitOffscreenSwapchain(gpu, device, headless_extent);
+    } else {
+        swapchain = vulkanInitSwapchain(gpu, device, surface, window, VULKAN_DEFAULT_PRESENT_MODE, VK_NULL_HANDLE); 
+    }
+    vulkanSwapchainCreateTargets(gpu, device, &swapchain, anti_aliasing, false);
+    TRACE_END(swapchain_zone);
+
+    DescriptorAllocator descriptors = descriptorAllocatorCreate(device);
+    UniformRing object_ring = vulkanCreateUniformRing(gpu, device, sizeof(ObjectUbo), OBJECT_RING_CAPACITY);
+    UniformBuffer uniform_buffer = vulkanCreateUniformBuffer(gpu, device, object_ring, &descriptors);
+
+    TRACE_BEGIN(pipeline_zone, "create pipeline");
+    VulkanPipelineLayout pipeline_layout = vulkanCreatePipelineLayout(device, uniform_buffer.layout);
+    VkPipelineCache pipeline_cache = vulkanCreatePipelineCache(gpu, device, pipeline_cache_path);
+    VkPipeline pipeline = vulkanCreatePipeline(device, swapchain, frag, vert, pipeline_layout.layout, pipeline_cache); 
+    TRACE_END(pipeline_zone);
+    VkCommandPool command_pool = vulkanCreateCommandPool(device, gpu);
+    GpuProfiler *profiler = vulkanCreateGpuProfiler(gpu, device);
+
+    Vulkan vulkan = {0};
+    vulkan.instance = instance;
+    vulkan.surface = surface;
+    vulkan.gpu = gpu;
+    vulkan.device = device;
+    vulkan.graphics_queue = graphics_queue;
+    vulkan.present_queue = present_queue;
+    vulkan.swapchain = swapchain;
+    vulkan.pipeline_layout = pipeline_layout;
+    vulkan.pipeline_cache = pipeline_cache;
+    vulkan.pipeline_cache_path = pipeline_cache_path;
+    vulkan.pipeline = pipeline;
+    vulkan.command_pool = command_pool;
+    vulkan.profiler = profiler;
+    vulkan.resolution.scale = RESOLUTION_SCALE_MAX;
+    vulkan.descriptors = descriptors;
+    for (size_t i=0; i<MAX_SWAPCHAIN_IMAGES; ++i) {
+        vulkan.command_buffers[i] = vulkanCreateCommandBuffer(device, command_pool);
+        vulkan.images_in_flight[i] = VK_NULL_HANDLE;
+        vulkan.frame_descriptors[i] = descriptorAllocatorCreate(device);
+    }
+    for (size_t i=0; i<MAX_FRAMES_IN_FLIGHT; ++i) {
+        vulkan.sync[i] = createSyncObjects(device, gpu.caps.swapchainMaintenance1 && !gpu.headless);
+    }
+    vulkan.settings.reuse_command_buffers = true;
+    vulkan.settings.gpu_driven = true;
+    vulkan.settings.anti_aliasing = anti_aliasing;
+    vulkan.settings.target_frame_ms = 16.6f;
+    vulkan.settings.present_mode = VULKAN_DEFAULT_PRESENT_MODE;
+    vulkan.first_present_id = 1;
+    if (gpu.caps.presentWait && !gpu.headless) {
+        vulkan.wait_for_present = (PFN_vkWaitForPresentKHR)vkGetDeviceProcAddr(device, "vkWaitForPresentKHR");
+    }
+    vulkan.uniform_buffer = uniform_buffer;
+    vulkan.object_ring = object_ring;
+    vulkan.vert = vert;
+    vulkan.frag = frag;
+
+    if (gpu.headless) {
+        vulkan.headless = true;
+        vulkan.readback_stride = (VkDeviceSize)headless_extent.width * headless_extent.height * 4;
+        
+        // @SPEED: HOST_CACHED memory would make reading it back faster
+        size_t readback_size = vulkan.readback_stride * swapchain.imageCount;
+        vulkan.readback_buffer = vulkanCreateBuffer(
+            gpu,
+            device,
+            VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            readback_size
+        );
+        VK_CHECK(vkMapMemory(device, vulkan.readback_buffer.memory, 0, readback_size, 0, &vulkan.readback_memory));
+    }
+    
+    return vulkan;
+}
+
+
+Vulkan vulkanCompleteInit(GLFWwindow *window, const char *validation_layers[], size_t validation_layer_count, const char *vertex_shader_path, const char *fragment_shader_path, const char *pipeline_cache_path) {
+    TRACE_BEGIN(zone, "create instance and surface");
+    VkInstance instance = vulkanInit(validation_layers, validation_layer_count, false);
+
+    VkSurfaceKHR surface;
+    VK_CHECK(glfwCreateWindowSurface(instance, window, NULL, &surface));
+    TRACE_END(zone);
+
+    return vulkanCompleteInitFromInstance(instance, surface, window, (VkExtent2D){0, 0}, vertex_shader_path, fragment_shader_path, pipeline_cache_path);
+}
+
+
+/* No window, surface or swapchain. Frames go to offscreen images and can be read back with vulkanReadbackImage */
+Vulkan vulkanCompleteInitHeadless(VkExtent2D extent, const char *validation_layers[], size_t validation_layer_count, const char *vertex_shader_path, const char *fragment_shader_path, const char *pipeline_cache_path) {
+    TRACE_BEGIN(zone, "create instance");
+    VkInstance instance = vulkanInit(validation_layers, validation_layer_count, true);
+    TRACE_END(zone);
+
+    return vulkanCompleteInitFromInstance(instance, VK_NULL_HANDLE, NULL, extent, vertex_shader_path, fragment_shader_path, pipeline_cache_path);
+}
+
+
+/* Waits for the frame that rendered the image, returned rgba8 pixels stay valid until the image is rendered again */
+void *vulkanReadbackImage(Vulkan *vulkan, uint32_t image_index) {
+    if (!vulkan->headless) {
+        fprintf(stderr, "ERROR: Only headless frames can be read back");
+        exit(1);
+    }
+
+    if (vulkan->images_in_flight[image_index] != VK_NULL_HANDLE) {
+        vkWaitForFences(vulkan->device, 1, &vulkan->images_in_flight[image_index], VK_TRUE, UINT64_MAX);
+    }
+    return (char *)vulkan->readback_memory + vulkan->readback_stride * image_index;
+}
+
+
+/* Has to be called whenever something baked into the recorded command buffers changes */
+void vulkanInvalidateCommandBuffers(Vulkan *vulkan) {
+    for (size_t i=0; i<MAX_SWAPCHAIN_IMAGES; ++i) {
+        vulkan->command_buffers_recorded[i] = false;
+    }
+}
+
+
+/* Writes data straight into mapped device local memory, returns false if gpu has no memory suitable for that */
+bool vulkanTryCreateBufferDirect(GPU gpu, VkDevice device, VkBufferUsageFlags usage, void *data, size_t size, VulkanBuffer *out_buffer) {
+    VkBufferCreateInfo buffer_info = {0};
+    buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO; 
+    buffer_info.size = size;
+    buffer_info.usage = usage;
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    VkBuffer buffer;
+    VK_CHECK(vkCreateBuffer(device, &buffer_info, NULL, &buffer));
+
+    VkMemoryRequirements reqs;
+    vkGetBufferMemoryRequirements(device, buffer, &reqs);
+
+    bool coherent;
+    int64_t memory_type_index = vulkanFindDirectUploadMemoryType(gpu, reqs.memoryTypeBits, &coherent);
+    if (memory_type_index == -1) {
+        vkDestroyBuffer(device, buffer, NULL);
+        return false;
+    }
+
+    VkMemoryAllocateInfo alloc_info = {0};
+    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.allocationSize = reqs.size;
+    alloc_info.memoryTypeIndex = memory_type_index;
+
+    VkDeviceMemory memory;
+    VK_CHECK(vkAllocateMemory(device, &alloc_info, NULL, &memory));
+    vkBindBufferMemory(device, buffer, memory, 0);
+
+    void *mapped_memory;
+    VK_CHECK(vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0, &mapped_memory));
+    memcpy(mapped_memory, data, size);
+    if (!coherent) {
+        // whole size from offset 0 keeps us clear of nonCoherentAtomSize rounding
+        VkMappedMemoryRange range = {0};
+        range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+        range.memory = memory;
+        range.offset = 0;
+        range.size = VK_WHOLE_SIZE;
+        VK_CHECK(vkFlushMappedMemoryRanges(device, 1, &range));
+    }
+    vkUnmapMemory(device, memory);
+
+    *out_buffer = (VulkanBuffer) {
+        buffer,
+        memory
+    };
+    return true;
+}
+
+
+/* 
+ * Creates device local buffer filled with data. On unified memory and resizable BAR data is written straight into
+ * mapped vram, otherwise it goes through a staging buffer and a copy on the graphics queue.
+ */
+VulkanBuffer vulkanCreateBufferWithData(Vulkan *vulkan, VkBufferUsageFlags usage, void *data, size_t size) {
+    VulkanBuffer buffer;
+    if (vulkanTryCreateBufferDirect(vulkan->gpu, vulkan->device, usage, data, size, &buffer)) {
+        fprintf(stderr, "INFO: Uploaded %zu bytes directly to device local memory\n", size);
+        return buffer;
+    }
+
+    VulkanBuffer staging_buffer = vulkanCreateBuffer(vulkan->gpu, vulkan->device, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, size);
+    vulkanFillMemory(vulkan->device, staging_buffer.memory, data, size); 
+    buffer = vulkanCreateBuffer(vulkan->gpu, vulkan->device, VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, size);
+    // vulkanCopyBuffer waits for the queue, so staging memory can go right away
+    vulkanCopyBuffer(vulkan->device, vulkan->graphics_queue, vulkan->command_pool, staging_buffer, buffer, size);
+    freeVulkanBuffer(vulkan->device, staging_buffer);
+
+    fprintf(stderr, "INFO: Uploaded %zu bytes through staging buffer\n", size);
+    return buffer;
+}
+
+
+void vulkanUploadMeshPool(Vulkan *vulkan, MeshPool *pool) {
+    vulkan->vertex_buffer = vulkanCreateBufferWithData(vulkan, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, pool->vertices, pool->vertices_len * sizeof(Vertex));
+    vulkan->index_buffer = vulkanCreateBufferWithData(vulkan, VK_BUFFER_USAGE_INDEX_BUFFER_BIT, pool->indices, pool->indices_len * sizeof(uint32_t));
+    memcpy(vulkan->meshes, pool->meshes, sizeof pool->meshes);
+    vulkan->meshes_len = pool->meshes_len;
+}
+
+
+/* Needs mesh pool and instance buffer to be created first, gpu_driven.supported stays false if gpu can't do it */
+void vulkanCreateGpuDriven(Vulkan *vulkan, const char *cull_shader_path, const char *compact_shader_path) {
+    GpuDriven gpu_driven = {0};
+    VkDevice device = vulkan->device;
+
+    // without it indirect commands can't point at instances, our culling output is useless then
+    if (!vulkan->gpu.caps.drawIndirectFirstInstance) {
+        fprintf(stderr, "INFO: Gpu driven rendering is not supported(no drawIndirectFirstInstance)\n");
+        vulkan->gpu_driven = gpu_driven;
+        return;
+    }
+    gpu_driven.supported = true;
+
+    if (vulkan->gpu.caps.drawIndirectCount) {
+        gpu_driven.cmdDrawIndexedIndirectCount = (PFN_vkCmdDrawIndexedIndirectCountKHR)vkGetDeviceProcAddr(device, "vkCmdDrawIndexedIndirectCountKHR");
+    }
+
+    gpu_driven.cull_shader = vulkanCreateShaderModule(device, cull_shader_path);
+    gpu_driven.compact_shader = vulkanCreateShaderModule(device, compact_shader_path);
+
+    /* Buffers */ {
+        uint32_t instance_capacity = vulkan->instance_buffer.capacity;
+
+        gpu_driven.mesh_table = vulkanCreateBufferWithData(vulkan, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, vulkan->meshes, sizeof vulkan->meshes);
+        gpu_driven.lod_counts = vulkanCreateBuffer(
+            vulkan->gpu,
+            device,
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            MAX_GPU_DRIVEN_OBJECTS * MAX_LODS * sizeof(uint32_t)
+        );
+        gpu_driven.visible_instances = vulkanCreateBuffer(
+            vulkan->gpu,
+            device,
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            (size_t)instance_capacity * MAX_LODS * sizeof(InstanceData)
+        );
+        gpu_driven.indirect = vulkanCreateBuffer(
+            vulkan->gpu,
+            device,
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            MAX_GPU_DRIVEN_OBJECTS * GPU_DRIVEN_OBJECT_STRIDE
+        );
+    }
+
+    /* Descriptors, one set per swapchain image because of ubo and instance segments */ {
+        VkDescriptorSetLayoutBinding bindings[6] = {0};
+        for (uint32_t i=0; i<6; ++i) {
+            bindings[i].binding = i;
+            bindings[i].descriptorType = i == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            bindings[i].descriptorCount = 1;
+            bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        }
+
+        VkDescriptorSetLayoutCreateInfo layout_info = {0};
+        layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        layout_info.bindingCount = 6;
+        layout_info.pBindings = bindings;
+        VK_CHECK(vkCreateDescriptorSetLayout(device, &layout_info, NULL, &gpu_driven.set_layout));
+
+        for (uint32_t i=0; i<MAX_SWAPCHAIN_IMAGES; ++i) {
+            gpu_driven.sets[i] = descriptorAllocatorAllocate(&vulkan->descriptors, gpu_driven.set_layout);
+
+            VkDescriptorBufferInfo buffer_infos[6] = {
+                {vulkan->uniform_buffer.buffer.buffer, vulkan->uniform_buffer.stride * i, sizeof(Ubo)},
+                {vulkan->instance_buffer.buffer.buffer, vulkan->instance_buffer.segment_size * i, vulkan->instance_buffer.segment_size},
+                {gpu_driven.mesh_table.buffer, 0, VK_WHOLE_SIZE},
+                {gpu_driven.lod_counts.buffer, 0, VK_WHOLE_SIZE},
+                {gpu_driven.visible_instances.buffer, 0, VK_WHOLE_SIZE},
+                {gpu_driven.indirect.buffer, 0, VK_WHOLE_SIZE},
+            };
+
+            VkWriteDescriptorSet writes[6] = {0};
+            for (uint32_t j=0; j<6; ++j) {
+                writes[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                writes[j].dstSet = gpu_driven.sets[i];
+                writes[j].dstBinding = j;
+                writes[j].descriptorCount = 1;
+                writes[j].descriptorType = bindings[j].descriptorType;
+                writes[j].pBufferInfo = &buffer_infos[j];
+            }
+            vkUpdateDescriptorSets(device, 6, writes, 0, NULL);
+        }
+    }
+
+    /* Pipelines */ {
+        VkPushConstantRange push_constant_range = {0};
+        push_constant_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        push_constant_range.offset = 0;
+        push_constant_range.size = sizeof(CullPushConstants);
+
+        VkPipelineLayoutCreateInfo pipeline_layout_info = {0};
+        pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        pipeline_layout_info.setLayoutCount = 1;
+        pipeline_layout_info.pSetLayouts = &gpu_driven.set_layout;
+        pipeline_layout_info.pushConstantRangeCount = 1;
+        pipeline_layout_info.pPushConstantRanges = &push_constant_range;
+        VK_CHECK(vkCreatePipelineLayout(device, &pipeline_layout_info, NULL, &gpu_driven.layout));
+
+        gpu_driven.cull_pipeline = vulkanCreateComputePipeline(device, gpu_driven.cull_shader, gpu_driven.layout, vulkan->pipeline_cache);
+        gpu_driven.compact_pipeline = vulkanCreateComputePipeline(device, gpu_driven.compact_shader, gpu_driven.layout, vulkan->pipeline_cache);
+    }
+
+    fprintf(stderr, "INFO: Gpu driven rendering initialized(draw count: %d, multi draw: %d)\n", gpu_driven.cmdDrawIndexedIndirectCount != NULL, vulkan->gpu.caps.multiDrawIndirect);
+    vulkan->gpu_driven = gpu_driven;
+}
+
+
+void freeGpuDriven(VkDevice device, GpuDriven gpu_driven) {
+    if (!gpu_driven.supported) {
+        return;
+    }
+
+    vkDestroyPipeline(device, gpu_driven.cull_pipeline, NULL);
+    vkDestroyPipeline(device, gpu_driven.compact_pipeline, NULL);
+    vkDestroyPipelineLayout(device, gpu_driven.layout, NULL);
+    vkDestroyDescriptorSetLayout(device, gpu_driven.set_layout, NULL);
+    freeVulkanBuffer(device, gpu_driven.mesh_table);
+    freeVulkanBuffer(device, gpu_driven.lod_counts);
+    freeVulkanBuffer(device, gpu_driven.visible_instances);
+    freeVulkanBuffer(device, gpu_driven.indirect);
+    freeShader(device, gpu_driven.cull_shader);
+    freeShader(device, gpu_driven.compact_shader);
+}
+
+
+/* Index of the buffer in the table. Only before the first frame is recorded, buffer binding isn't update after bind */
+uint32_t vulkanBindlessAddBuffer(Vulkan *vulkan, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range) {
+    Bindless *bindless = &vulkan->bindless;
+    if (bindless->buffers_len >= bindless->buffer_capacity) {
+        fprintf(stderr, "ERROR: Bindless buffers table is full(%u)", bindless->buffer_capacity);
+        exit(1);
+    }
+
+    VkDescriptorBufferInfo buffer_info = {buffer, offset, range};
+
+    VkWriteDescriptorSet write = {0};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = bindless->set;
+    write.dstBinding = 0;
+    write.dstArrayElement = bindless->buffers_len;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    write.pBufferInfo = &buffer_info;
+    vkUpdateDescriptorSets(vulkan->device, 1, &write, 0, NULL);
+
+    return bindless->buffers_len++;
+}
+
+
+/* Index of the image in the table. Slots are never reused, so writing a new one is fine while frames are in flight */
+uint32_t vulkanBindlessAddImage(Vulkan *vulkan, VkImageView view, VkSampler sampler, VkImageLayout layout) {
+    Bindless *bindless = &vulkan->bindless;
+    if (bindless->images_len >= bindless->image_capacity) {
+        fprintf(stderr, "ERROR: Bindless images table is full(%u)", bindless->image_capacity);
+        exit(1);
+    }
+
+    VkDescriptorImageInfo image_info = {sampler, view, layout};
+
+    VkWriteDescriptorSet write = {0};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = bindless->set;
+    write.dstBinding = 1;
+    write.dstArrayElement = bindless->images_len;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    write.pImageInfo = &image_info;
+    vkUpdateDescriptorSets(vulkan->device, 1, &write, 0, NULL);
+
+    return bindless->images_len++;
+}
+
+
+/* Does nothing without descriptor indexing, draws then keep the per object set */
+void vulkanCreateBindless(Vulkan *vulkan, const char *vertex_shader_path) {
+    if (!vulkan->gpu.caps.descriptorIndexing || !vulkan->gpu.caps.shaderStorageBufferArrayDynamicIndexing) {
+        fprintf(stderr, "INFO: Bindless tables aren't supported, objects are bound one by one\n");
+        return;
+    }
+
+    VkDevice device = vulkan->device;
+    Bindless bindless = {0};
+    bindless.vert = vulkanCreateShaderModule(device, vertex_shader_path);
+
+    /* Tables are as big as per stage limits let them be */ {
+        VkPhysicalDeviceProperties props;
+        vkGetPhysicalDeviceProperties(vulkan->gpu.device, &props);
+        VkPhysicalDeviceLimits limits = props.limits;
+        // update after bind limits are at least as high as these
+        uint32_t buffers = BINDLESS_MAX_BUFFERS;
+        buffers = uint32Clamp(buffers, 1, limits.maxPerStageDescriptorStorageBuffers);
+        buffers = uint32Clamp(buffers, 1, limits.maxDescriptorSetStorageBuffers);
+
+        // combined image samplers count as both, a few resources are left for the ubo set and attachments
+        uint32_t images = BINDLESS_MAX_IMAGES;
+        images = uint32Clamp(images, 1, limits.maxPerStageDescriptorSampledImages);
+        images = uint32Clamp(images, 1, limits.maxPerStageDescriptorSamplers);
+        images = uint32Clamp(images, 1, limits.maxDescriptorSetSampledImages);
+        images = uint32Clamp(images, 1, limits.maxDescriptorSetSamplers);
+        images = uint32Clamp(images, 1, limits.maxPerStageResources - buffers - 16);
+
+        bindless.buffer_capacity = buffers;
+        bindless.image_capacity = images;
+    }
+
+    /* Descriptors */ {
+        VkDescriptorSetLayoutBinding bindings[2] = {0};
+        bindings[0].binding = 0;
+        bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        bindings[0].descriptorCount = bindless.buffer_capacity;
+        bindings[0].stageFlags = VK_SHADER_STAGE_ALL_GRAPHICS;
+        bindings[1].binding = 1;
+        bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        bindings[1].descriptorCount = bindless.image_capacity;
+        bindings[1].stageFlags = VK_SHADER_STAGE_ALL_GRAPHICS;
+
+        // slots that were never written are fine as long as shaders don't read them
+        VkDescriptorBindingFlags binding_flags[2] = {
+            VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT,
+            VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT |
+            VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT | VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT,
+        };
+        VkDescriptorSetLayoutBindingFlagsCreateInfo flags_info = {0};
+        flags_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO;
+        flags_info.bindingCount = 2;
+        flags_info.pBindingFlags = binding_flags;
+
+        VkDescriptorSetLayoutCreateInfo layout_info = {0};
+        layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        layout_info.pNext = &flags_info;
+        layout_info.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT;
+        layout_info.bindingCount = 2;
+        layout_info.pBindings = bindings;
+        VK_CHECK(vkCreateDescriptorSetLayout(device, &layout_info, NULL, &bindless.set_layout));
+
+        // single set for the whole run, it gets a pool of its own since update after bind pools are special
+        VkDescriptorPoolSize pool_sizes[2] = {
+            {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, bindless.buffer_capacity},
+            {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, bindless.image_capacity},
+        };
+        VkDescriptorPoolCreateInfo pool_info = {0};
+        pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+        pool_info.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT;
+        pool_info.poolSizeCount = 2;
+        pool_info.pPoolSizes = pool_sizes;
+        pool_info.maxSets = 1;
+        VK_CHECK(vkCreateDescriptorPool(device, &pool_info, NULL, &bindless.pool));
+
+        VkDescriptorSetVariableDescriptorCountAllocateInfo count_info = {0};
+        count_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_VARIABLE_DESCRIPTOR_COUNT_ALLOCATE_INFO;
+        count_info.descriptorSetCount = 1;
+        count_info.pDescriptorCounts = &bindless.image_capacity;
+
+        VkDescriptorSetAllocateInfo alloc_info = {0};
+        alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        alloc_info.pNext = &count_info;
+        alloc_info.descriptorPool = bindless.pool;
+        alloc_info.descriptorSetCount = 1;
+        alloc_info.pSetLayouts = &bindless.set_layout;
+        VK_CHECK(vkAllocateDescriptorSets(device, &alloc_info, &bindless.set));
+    }
+
+    /* Pipeline, set 0 is the usual ubo set so view and projection stay where they were */ {
+        VkDescriptorSetLayout set_layouts[] = {vulkan->uniform_buffer.layout, bindless.set_layout};
+
+        VkPushConstantRange push_constant_range = {0};
+        push_constant_range.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+        push_constant_range.offset = 0;
+        push_constant_range.size = sizeof(BindlessPushConstants);
+
+        VkPipelineLayoutCreateInfo layout_info = {0};
+        layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        layout_info.setLayoutCount = 2;
+        layout_info.pSetLayouts = set_layouts;
+        layout_info.pushConstantRangeCount = 1;
+        layout_info.pPushConstantRanges = &push_constant_range;
+        VK_CHECK(vkCreatePipelineLayout(device, &layout_info, NULL, &bindless.layout));
+
+        bindless.pipeline = vulkanCreatePipeline(device, vulkan->swapchain, vulkan->frag, bindless.vert, bindless.layout, vulkan->pipeline_cache);
+    }
+
+    bindless.created = true;
+    vulkan->bindless = bindless;
+    vulkan->bindless.object_ring = vulkanBindlessAddBuffer(vulkan, vulkan->object_ring.buffer.buffer, 0, VK_WHOLE_SIZE);
+    vulkan->settings.bindless = true;
+    vulkanInvalidateCommandBuffers(vulkan);
+
+    fprintf(stderr, "INFO: Bindless tables created successfully(%u buffers, %u images)\n", bindless.buffer_capacity, bindless.image_capacity);
+}
+
+
+void freeBindless(VkDevice device, Bindless bindless) {
+    if (!bindless.created) {
+        return;
+    }
+
+    vkDestroyPipeline(device, bindless.pipeline, NULL);
+    vkDestroyPipelineLayout(device, bindless.layout, NULL);
+    vkDestroyDescriptorPool(device, bindless.pool, NULL);
+    vkDestroyDescriptorSetLayout(device, bindless.set_layout, NULL);
+    freeShader(device, bindless.vert);
+}
+
+
+/* 
+ * Needs the mesh pool uploaded, instance buffer created and gpu driven rendering set up first.
+ * Packs the pool's vertices into a storage buffer of their own, pool can be freed afterwards
+ */
+void vulkanCreateVertexPulling(Vulkan *vulkan, MeshPool *pool, const char *vertex_shader_path) {
+    VkDevice device = vulkan->device;
+    VertexPulling pulling = {0};
+    pulling.vert = vulkanCreateShaderModule(device, vertex_shader_path);
+
+    /* Vertices */ {
+        PackedVertex *packed = malloc(pool->vertices_len * sizeof(PackedVertex));
+        if (packed == NULL) {
+            fprintf(stderr, "ERROR: failed to allocate memory for packed vertices");
+            exit(1);
+        }
+        meshPoolPackVertices(pool, packed, pulling.decode);
+        pulling.vertices = vulkanCreateBufferWithData(vulkan, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, packed, pool->vertices_len * sizeof(PackedVertex));
+        free(packed);
+    }
+
+    /* Descriptors: packed vertices and instances */ {
+        VkDescriptorSetLayoutBinding bindings[2] = {0};
+        for (uint32_t i=0; i<2; ++i) {
+            bindings[i].binding = i;
+            bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            bindings[i].descriptorCount = 1;
+            bindings[i].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+        }
+
+        VkDescriptorSetLayoutCreateInfo layout_info = {0};
+        layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        layout_info.bindingCount = 2;
+        layout_info.pBindings = bindings;
+        VK_CHECK(vkCreateDescriptorSetLayout(device, &layout_info, NULL, &pulling.set_layout));
+
+        // segment offsets are aligned for storage buffers already, culling binds them the same way
+        uint32_t set_count = vulkan->gpu_driven.supported ? MAX_SWAPCHAIN_IMAGES + 1 : MAX_SWAPCHAIN_IMAGES;
+        for (uint32_t i=0; i<set_count; ++i) {
+            VkDescriptorSet set = descriptorAllocatorAllocate(&vulkan->descriptors, pulling.set_layout);
+            VkDescriptorBufferInfo buffer_infos[2] = {
+                {pulling.vertices.buffer, 0, VK_WHOLE_SIZE},
+                {vulkan->instance_buffer.buffer.buffer, vulkan->instance_buffer.segment_size * i, vulkan->instance_buffer.segment_size},
+            };
+            if (i == MAX_SWAPCHAIN_IMAGES) {
+                buffer_infos[1] = (VkDescriptorBufferInfo){vulkan->gpu_driven.visible_instances.buffer, 0, VK_WHOLE_SIZE};
+                pulling.culled_set = set;
+            } else {
+                pulling.sets[i] = set;
+            }
+
+            VkWriteDescriptorSet writes[2] = {0};
+            for (uint32_t j=0; j<2; ++j) {
+                writes[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                writes[j].dstSet = set;
+                writes[j].dstBinding = j;
+                writes[j].descriptorCount = 1;
+                writes[j].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+                writes[j].pBufferInfo = &buffer_infos[j];
+            }
+            vkUpdateDescriptorSets(device, 2, writes, 0, NULL);
+        }
+    }
+
+    /* Pipeline, set 0 is the usual ubo set */ {
+        VkDescriptorSetLayout set_layouts[] = {vulkan->uniform_buffer.layout, pulling.set_layout};
+
+        VkPushConstantRange push_constant_range = {0};
+        push_constant_range.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+        push_constant_range.offset = 0;
+        push_constant_range.size = sizeof(PullPushConstants);
+
+        VkPipelineLayoutCreateInfo layout_info = {0};
+        layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        layout_info.setLayoutCount = 2;
+        layout_info.pSetLayouts = set_layouts;
+        layout_info.pushConstantRangeCount = 1;
+        layout_info.pPushConstantRanges = &push_constant_range;
+        VK_CHECK(vkCreatePipelineLayout(device, &layout_info, NULL, &pulling.layout));
+
+        pulling.pipeline = vulkanCreatePulledPipeline(device, vulkan->swapchain, vulkan->frag, pulling.vert, pulling.layout, vulkan->pipeline_cache);
+    }
+
+    pulling.created = true;
+    vulkan->pulling = pulling;
+    vulkanInvalidateCommandBuffers(vulkan);
+
+    fprintf(stderr, "INFO: Vertex pulling set up successfully(%zu bytes of vertices instead of %zu)\n",
+        pool->vertices_len * sizeof(PackedVertex), pool->vertices_len * sizeof(Vertex));
+}
+
+
+void freeVertexPulling(VkDevice device, VertexPulling pulling) {
+    if (!pulling.created) {
+        return;
+    }
+
+    vkDestroyPipeline(device, pulling.pipeline, NULL);
+    vkDestroyPipelineLayout(device, pulling.layout, NULL);
+    vkDestroyDescriptorSetLayout(device, pulling.set_layout, NULL);
+    freeVulkanBuffer(device, pulling.vertices);
+    freeShader(device, pulling.vert);
+}
+
+
+/* Usual ubo set, then the cluster set. Every cluster stage has a layout of its own because of push constants */
+VkPipelineLayout vulkanCreateClusterPipelineLayout(Vulkan *vulkan, VkDescriptorSetLayout set_layout, VkShaderStageFlags stages, uint32_t push_constants_size) {
+    VkDescriptorSetLayout set_layouts[] = {vulkan->uniform_buffer.layout, set_layout};
+
+    VkPushConstantRange push_constant_range = {0};
+    push_constant_range.stageFlags = stages;
+    push_constant_range.offset = 0;
+    push_constant_range.size = push_constants_size;
+
+    VkPipelineLayoutCreateInfo layout_info = {0};
+    layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    layout_info.setLayoutCount = 2;
+    layout_info.pSetLayouts = set_layouts;
+    layout_info.pushConstantRangeCount = 1;
+    layout_info.pPushConstantRanges = &push_constant_range;
+
+    VkPipelineLayout layout;
+    VK_CHECK(vkCreatePipelineLayout(vulkan->device, &layout_info, NULL, &layout));
+    return layout;
+}
+
+
+/* 
+ * Needs vertex pulling set up first, meshlets point into its packed vertices. Pool can be freed afterwards.
+ * Task and mesh shaders are only loaded when the gpu has them, the compute path works everywhere
+ */
+void vulkanCreateClusterCulling(Vulkan *vulkan, MeshletPool *pool, const char *cull_shader_path, const char *vertex_shader_path, const char *task_shader_path, const char *mesh_shader_path) {
+    if (!vulkan->pulling.created || pool->meshlets_len == 0) {
+        fprintf(stderr, "INFO: Cluster culling is not supported(needs vertex pulling and meshlets)\n");
+        return;
+    }
+
+    VkDevice device = vulkan->device;
+    ClusterCulling clusters = {0};
+    clusters.mesh_shaders = vulkan->gpu.caps.meshShader;
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(vulkan->gpu.device, &props);
+    clusters.max_dispatch_x = props.limits.maxComputeWorkGroupCount[0];
+    memcpy(clusters.meshes, pool->meshes, sizeof pool->meshes);
+    clusters.cull_shader = vulkanCreateShaderModule(device, cull_shader_path);
+    clusters.vert = vulkanCreateShaderModule(device, vertex_shader_path);
+    if (clusters.mesh_shaders) {
+        clusters.task = vulkanCreateShaderModule(device, task_shader_path);
+        clusters.mesh = vulkanCreateShaderModule(device, mesh_shader_path);
+        clusters.cmdDrawMeshTasks = (PFN_vkCmdDrawMeshTasksEXT)vkGetDeviceProcAddr(device, "vkCmdDrawMeshTasksEXT");
+    }
+
+    /* Buffers */ {
+        clusters.meshlets = vulkanCreateBufferWithData(vulkan, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, pool->meshlets, pool->meshlets_len * sizeof(Meshlet));
+        clusters.meshlet_vertices = vulkanCreateBufferWithData(vulkan, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, pool->vertices, pool->vertices_len * sizeof(uint32_t));
+        clusters.meshlet_triangles = vulkanCreateBufferWithData(vulkan, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, pool->triangles, pool->triangles_len * sizeof(uint32_t));
+        // instance and meshlet of every visible cluster
+        clusters.clusters = vulkanCreateBuffer(
+            vulkan->gpu,
+            device,
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            CLUSTER_MAX_CLUSTERS * 2 * sizeof(uint32_t)
+        );
+        clusters.indices = vulkanCreateBuffer(
+            vulkan->gpu,
+            device,
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            CLUSTER_MAX_INDICES * sizeof(uint32_t)
+        );
+        clusters.commands = vulkanCreateBuffer(
+            vulkan->gpu,
+            device,
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            CLUSTER_MAX_OBJECTS * CLUSTER_OBJECT_STRIDE
+        );
+    }
+
+    /* Descriptors: packed vertices and instances like vertex pulling, then meshlets and culling output */ {
+        VkShaderStageFlags stages = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_COMPUTE_BIT;
+        if (clusters.mesh_shaders) {
+            stages |= VK_SHADER_STAGE_TASK_BIT_EXT | VK_SHADER_STAGE_MESH_BIT_EXT;
+        }
+
+        VkDescriptorSetLayoutBinding bindings[8] = {0};
+        for (uint32_t i=0; i<8; ++i) {
+            bindings[i].binding = i;
+            bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            bindings[i].descriptorCount = 1;
+            bindings[i].stageFlags = stages;
+        }
+
+        VkDescriptorSetLayoutCreateInfo layout_info = {0};
+        layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        layout_info.bindingCount = 8;
+        layout_info.pBindings = bindings;
+        VK_CHECK(vkCreateDescriptorSetLayout(device, &layout_info, NULL, &clusters.set_layout));
+
+        for (uint32_t i=0; i<MAX_SWAPCHAIN_IMAGES; ++i) {
+            clusters.sets[i] = descriptorAllocatorAllocate(&vulkan->descriptors, clusters.set_layout);
+
+            VkDescriptorBufferInfo buffer_infos[8] = {
+                {vulkan->pulling.vertices.buffer, 0, VK_WHOLE_SIZE},
+                {vulkan->instance_buffer.buffer.buffer, vulkan->instance_buffer.segment_size * i, vulkan->instance_buffer.segment_size},
+                {clusters.meshlets.buffer, 0, VK_WHOLE_SIZE},
+                {clusters.meshlet_vertices.buffer, 0, VK_WHOLE_SIZE},
+                {clusters.meshlet_triangles.buffer, 0, VK_WHOLE_SIZE},
+                {clusters.clusters.buffer, 0, VK_WHOLE_SIZE},
+                {clusters.indices.buffer, 0, VK_WHOLE_SIZE},
+                {clusters.commands.buffer, 0, VK_WHOLE_SIZE},
+            };
+
+            VkWriteDescriptorSet writes[8] = {0};
+            for (uint32_t j=0; j<8; ++j) {
+                writes[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                writes[j].dstSet = clusters.sets[i];
+                writes[j].dstBinding = j;
+                writes[j].descriptorCount = 1;
+                writes[j].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+                writes[j].pBufferInfo = &buffer_infos[j];
+            }
+            vkUpdateDescriptorSets(device, 8, writes, 0, NULL);
+        }
+    }
+
+    /* Pipelines */ {
+        clusters.cull_layout = vulkanCreateClusterPipelineLayout(vulkan, clusters.set_layout, VK_SHADER_STAGE_COMPUTE_BIT, sizeof(ClusterCullPushConstants));
+        clusters.cull_pipeline = vulkanCreateComputePipeline(device, clusters.cull_shader, clusters.cull_layout, vulkan->pipeline_cache);
+
+        clusters.layout = vulkanCreateClusterPipelineLayout(vulkan, clusters.set_layout, VK_SHADER_STAGE_VERTEX_BIT, sizeof(PullPushConstants));
+        clusters.pipeline = vulkanCreatePulledPipeline(device, vulkan->swapchain, vulkan->frag, clusters.vert, clusters.layout, vulkan->pipeline_cache);
+
+        if (clusters.mesh_shaders) {
+            VkShaderStageFlags stages = VK_SHADER_STAGE_TASK_BIT_EXT | VK_SHADER_STAGE_MESH_BIT_EXT;
+            clusters.mesh_layout = vulkanCreateClusterPipelineLayout(vulkan, clusters.set_layout, stages, sizeof(MeshletPushConstants));
+            for (uint32_t cull_back=0; cull_back<2; ++cull_back) {
+                clusters.mesh_pipelines[cull_back] = vulkanCreateMeshletPipeline(
+                    device, vulkan->swapchain, vulkan->frag, clusters.task, clusters.mesh, clusters.mesh_layout, vulkan->pipeline_cache, cull_back
+                );
+            }
+        }
+    }
+
+    clusters.created = true;
+    vulkan->clusters = clusters;
+    vulkanInvalidateCommandBuffers(vulkan);
+
+    fprintf(stderr, "INFO: Cluster culling set up successfully(%zu meshlets, mesh shaders: %d)\n", pool->meshlets_len, clusters.mesh_shaders);
+}
+
+
+void freeClusterCulling(VkDevice device, ClusterCulling clusters) {
+    if (!clusters.created) {
+        return;
+    }
+
+    vkDestroyPipeline(device, clusters.cull_pipeline, NULL);
+    vkDestroyPipeline(device, clusters.pipeline, NULL);
+    vkDestroyPipelineLayout(device, clusters.cull_layout, NULL);
+    vkDestroyPipelineLayout(device, clusters.layout, NULL);
+    if (clusters.mesh_shaders) {
+        vkDestroyPipeline(device, clusters.mesh_pipelines[0], NULL);
+        vkDestroyPipeline(device, clusters.mesh_pipelines[1], NULL);
+        vkDestroyPipelineLayout(device, clusters.mesh_layout, NULL);
+        freeShader(device, clusters.task);
+        freeShader(device, clusters.mesh);
+    }
+    vkDestroyDescriptorSetLayout(device, clusters.set_layout, NULL);
+    freeVulkanBuffer(device, clusters.meshlets);
+    freeVulkanBuffer(device, clusters.meshlet_vertices);
+    freeVulkanBuffer(device, clusters.meshlet_triangles);
+    freeVulkanBuffer(device, clusters.clusters);
+    freeVulkanBuffer(device, clusters.indices);
+    freeVulkanBuffer(device, clusters.commands);
+    freeShader(device, clusters.cull_shader);
+    freeShader(device, clusters.vert);
+}
+
+
+void freeRetiredSwapchain(VkDevice device, RetiredSwapchain retired) {
+    for (uint32_t i=0; i<retired.pipeline_count; ++i) {
+        vkDestroyPipeline(device, retired.pipelines[i], NULL);
+    }
+    freeSwapchain(device, retired.swapchain);
+}
+
+
+/* Clears flags of fences that are signaled now, true while any flag is left */
+bool vulkanFencesPending(VkDevice device, bool *pending, VkFence *fences, uint32_t count) {
+    bool any = false;
+    for (uint32_t i=0; i<count; ++i) {
+        if (pending[i] && vkGetFenceStatus(device, fences[i]) == VK_SUCCESS) {
+            pending[i] = false;
+        }
+        any = any || pending[i];
+    }
+    return any;
+}
+
+
+/* 
+ * Frees retired swapchains whose frames have finished, never waits. Call once a frame.
+ * A fence seen signaled after retirement covers every earlier submission, so each frame slot has to be seen signaled once.
+ * Presents of the old images are covered by present fences where swapchain maintenance1 is enabled.
+ * Without it nothing reports them, so the swapchain waits for one more round: every frame slot is submitted again and its fence seen signaled
+ */
+void vulkanCollectRetired(Vulkan *vulkan) {
+    VkFence in_flight[MAX_FRAMES_IN_FLIGHT];
+    VkFence present_done[MAX_FRAMES_IN_FLIGHT];
+    for (size_t frame=0; frame<MAX_FRAMES_IN_FLIGHT; ++frame) {
+        in_flight[frame] = vulkan->sync[frame].inFlight;
+        present_done[frame] = vulkan->sync[frame].presentDone;
+    }
+
+    uint32_t kept = 0;
+    for (uint32_t i=0; i<vulkan->retired_len; ++i) {
+        RetiredSwapchain *retired = &vulkan->retired[i];
+
+        bool pending = vulkanFencesPending(vulkan->device, retired->pending, in_flight, MAX_FRAMES_IN_FLIGHT);
+        pending = vulkanFencesPending(vulkan->device, retired->pending_present, present_done, MAX_FRAMES_IN_FLIGHT) || pending;
+        if (!pending && retired->extra_round) {
+            if (retired->round_present_id == 0) {
+                retired->round_present_id = vulkan->present_id + MAX_FRAMES_IN_FLIGHT;
+            }
+            pending = true;
+            if (vulkan->present_id >= retired->round_present_id) {
+                // every slot's fence now belongs to a frame submitted after the old presents were queued
+                for (size_t frame=0; frame<MAX_FRAMES_IN_FLIGHT; ++frame) {
+                    retired->pending[frame] = true;
+                }
+                retired->extra_round = false;
+                pending = vulkanFencesPending(vulkan->device, retired->pending, in_flight, MAX_FRAMES_IN_FLIGHT);
+            }
+        }
+
+        if (pending) {
+            vulkan->retired[kept++] = *retired;
+        } else {
+            freeRetiredSwapchain(vulkan->device, *retired);
+        }
+    }
+    vulkan->retired_len = kept;
+}
+
+
+/* Frames in flight may still render into the swapchain, so it is freed later by vulkanCollectRetired. Returned entry is valid until the next call */
+RetiredSwapchain *vulkanRetireSwapchain(Vulkan *vulkan, Swapchain swapchain) {
+    if (vulkan->retired_len == vulkan->retired_capacity) {
+        // resized faster than frames finish, there is just more to free later
+        uint32_t capacity = vulkan->retired_capacity == 0 ? 4 : vulkan->retired_capacity * 2;
+        RetiredSwapchain *retired = realloc(vulkan->retired, capacity * sizeof(RetiredSwapchain));
+        if (retired == NULL) {
+            fprintf(stderr, "ERROR: failed to allocate memory for retired swapchains");
+            exit(1);
+        }
+        vulkan->retired = retired;
+        vulkan->retired_capacity = capacity;
+    }
+
+    RetiredSwapchain retired = {0};
+    retired.swapchain = swapchain;
+    retired.extra_round = vulkan->sync[0].presentDone == VK_NULL_HANDLE;
+    for (size_t frame=0; frame<MAX_FRAMES_IN_FLIGHT; ++frame) {
+        retired.pending[frame] = vkGetFenceStatus(vulkan->device, vulkan->sync[frame].inFlight) != VK_SUCCESS;
+        retired.pending_present[frame] = 
+            !retired.extra_round && vkGetFenceStatus(vulkan->device, vulkan->sync[frame].presentDone) != VK_SUCCESS;
+    }
+    vulkan->retired[vulkan->retired_len++] = retired;
+    return &vulkan->retired[vulkan->retired_len - 1];
+}
+
+
+/* 
+ * Fence to chain into the frame's present with VkSwapchainPresentFenceInfoEXT, VK_NULL_HANDLE without swapchain maintenance1.
+ * It was last used MAX_FRAMES_IN_FLIGHT presents ago, so the wait before reusing it is almost never a wait
+ */
+VkFence vulkanPresentFence(Vulkan *vulkan, SyncObjects sync) {
+    if (sync.presentDone == VK_NULL_HANDLE) {
+        return VK_NULL_HANDLE;
+    }
+
+    VK_CHECK(vkWaitForFences(vulkan->device, 1, &sync.presentDone, VK_TRUE, UINT64_MAX));
+    VK_CHECK(vkResetFences(vulkan->device, 1, &sync.presentDone));
+    return sync.presentDone;
+}
+
+
+/* Modules and layout the key is built from, false when its slots weren't created or don't go together */
+bool vulkanPipelineVariantStages(Vulkan *vulkan, PipelineKey key, Shader *vert, Shader *frag, VkPipelineLayout *layout) {
+    if (key.frag != SHADER_SCENE_FRAG || key.vertex_layout != vulkanBasePipelineKey(vulkan->swapchain, key.vert, key.frag).vertex_layout) {
+        return false;
+    }
+
+    if (key.vert == SHADER_SCENE_VERT) {
+        *vert = vulkan->vert;
+        *layout = vulkan->pipeline_layout.layout;
+    } else if (key.vert == SHADER_BINDLESS_VERT && vulkan->bindless.created) {
+        *vert = vulkan->bindless.vert;
+        *layout = vulkan->bindless.layout;
+    } else if (key.vert == SHADER_PULL_VERT && vulkan->pulling.created) {
+        *vert = vulkan->pulling.vert;
+        *layout = vulkan->pulling.layout;
+    } else if (key.vert == SHADER_CLUSTER_VERT && vulkan->clusters.created) {
+        *vert = vulkan->clusters.vert;
+        *layout = vulkan->clusters.layout;
+    } else {
+        return false;
+    }
+    *frag = vulkan->frag;
+    return true;
+}
+
+
+void pipelineBatchJob(void *data, uint32_t begin, uint32_t end) {
+    (void)begin;
+    (void)end;
+    PipelineBatch *batch = data;
+    TRACE_BEGIN(zone, "build pipeline variants");
+
+    VkGraphicsPipelineCreateInfo infos[PIPELINE_BATCH_MAX];
+    for (uint32_t i=0; i<batch->len; ++i) {
+        infos[i] = batch->infos[i].info;
+    }
+    // a pipeline that fails comes back as VK_NULL_HANDLE, the rest of the batch is still created
+    batch->result = vkCreateGraphicsPipelines(batch->device, batch->cache, batch->len, infos, NULL, batch->pipelines);
+
+    TRACE_END(zone);
+}
+
+
+/* Queued variants go to idle batches. Ones for another sample count stay queued until their render pass is back */
+void vulkanSubmitPipelineVariants(Vulkan *vulkan) {
+    PipelineVariants *variants = vulkan->variants;
+    Swapchain swapchain = vulkan->swapchain;
+
+    uint32_t kept = 0;
+    uint32_t next = 0;
+    for (uint32_t b=0; b<PIPELINE_BATCHES_MAX && next<variants->queue_len; ++b) {
+        PipelineBatch *batch = &variants->batches[b];
+        if (batch->busy) {
+            continue;
+        }
+
+        batch->len = 0;
+        while (next < variants->queue_len && batch->len < PIPELINE_BATCH_MAX) {
+            uint32_t slot = variants->queue[next++];
+            PipelineVariantEntry *entry = &variants->table[slot];
+            if (entry->key.samples != (uint32_t)swapchain.antiAliasing.samples) {
+                variants->queue[kept++] = slot;
+                continue;
+            }
+
+            Shader vert, frag;
+            VkPipelineLayout layout;
+            if (!vulkanPipelineVariantStages(vulkan, entry->key, &vert, &frag, &layout)) {
+                entry->state = PIPELINE_VARIANT_FAILED;
+                continue;
+            }
+
+            vulkanScenePipelineInfo(&batch->infos[batch->len], swapchain.renderPass, swapchain.extent, frag, vert, layout, entry->key);
+            batch->entries[batch->len] = slot;
+            batch->pipelines[batch->len] = VK_NULL_HANDLE;
+            batch->len += 1;
+            entry->state = PIPELINE_VARIANT_BUILDING;
+        }
+
+        if (batch->len > 0) {
+            batch->busy = true;
+            batch->device = vulkan->device;
+            batch->cache = vulkan->pipeline_cache;
+            jobsSubmitBackground(variants->jobs, pipelineBatchJob, batch, 0, 1, &batch->counter);
+        }
+    }
+
+    // whatever didn't fit waits for the next free batch
+    while (next < variants->queue_len) {
+        variants->queue[kept++] = variants->queue[next++];
+    }
+    variants->queue_len = kept;
+}
+
+
+/* Finished batches hand their pipelines to the table, with wait the ones still building are waited for too */
+void vulkanCollectPipelineBatches(Vulkan *vulkan, bool wait) {
+    PipelineVariants *variants = vulkan->variants;
+    if (variants == NULL) {
+        return;
+    }
+
+    uint32_t built = 0;
+    uint32_t failed = 0;
+    VkResult result = VK_SUCCESS;
+    for (uint32_t b=0; b<PIPELINE_BATCHES_MAX; ++b) {
+        PipelineBatch *batch = &variants->batches[b];
+        if (!batch->busy || (!wait && atomic_load(&batch->counter.pending) > 0)) {
+            continue;
+        }
+
+        // also makes sure the worker let go of the counter before it is reused
+        jobsWait(variants->jobs, &batch->counter);
+        for (uint32_t i=0; i<batch->len; ++i) {
+            PipelineVariantEntry *entry = &variants->table[batch->entries[i]];
+            entry->pipeline = batch->pipelines[i];
+            entry->state = entry->pipeline != VK_NULL_HANDLE ? PIPELINE_VARIANT_READY : PIPELINE_VARIANT_FAILED;
+            built += entry->pipeline != VK_NULL_HANDLE;
+            failed += entry->pipeline == VK_NULL_HANDLE;
+        }
+        result = batch->result != VK_SUCCESS ? batch->result : result;
+        batch->busy = false;
+    }
+
+    if (failed > 0) {
+        fprintf(stderr, "INFO: %u pipeline variants failed to build(error code: %d), base pipelines are used instead\n", failed, result);
+    }
+    if (built > 0) {
+        // recorded command buffers still bind the fallback
+        vulkanInvalidateCommandBuffers(vulkan);
+    }
+}
+
+
+void vulkanCollectRetiredVariants(Vulkan *vulkan) {
+    PipelineVariants *variants = vulkan->variants;
+    uint32_t kept = 0;
+    for (uint32_t i=0; i<variants->retired_len; ++i) {
+        RetiredVariant *retired = &variants->retired[i];
+
+        // same rule as vulkanCollectRetired
+        bool pending = false;
+        for (size_t frame=0; frame<MAX_FRAMES_IN_FLIGHT; ++frame) {
+            if (retired->pending[frame] && vkGetFenceStatus(vulkan->device, vulkan->sync[frame].inFlight) == VK_SUCCESS) {
+                retired->pending[frame] = false;
+            }
+            pending = pending || retired->pending[frame];
+        }
+
+        if (pending) {
+            variants->retired[kept++] = *retired;
+        } else {
+            vkDestroyPipeline(vulkan->device, retired->pipeline, NULL);
+        }
+    }
+    variants->retired_len = kept;
+}
+
+
+/* 
+ * Variants built from the slot's shader are retired and queued again, SHADER_SLOTS does it for every variant.
+ * For shader reloads and render passes that became incompatible, draws fall back to base pipelines until the rebuilds are done
+ */
+void vulkanRebuildPipelineVariants(Vulkan *vulkan, ShaderSlot slot) {
+    PipelineVariants *variants = vulkan->variants;
+    bool scene_slot = 
+        slot == SHADER_SCENE_VERT || slot == SHADER_SCENE_FRAG || slot == SHADER_BINDLESS_VERT || slot == SHADER_PULL_VERT || slot == SHADER_CLUSTER_VERT;
+    if (variants == NULL || (!scene_slot && slot != SHADER_SLOTS)) {
+        return;
+    }
+
+    // builds in flight use the old module or render pass
+    vulkanCollectPipelineBatches(vulkan, true);
+
+    uint32_t requeued = 0;
+    for (uint32_t i=0; i<PIPELINE_VARIANTS_TABLE; ++i) {
+        PipelineVariantEntry *entry = &variants->table[i];
+        bool built = entry->state == PIPELINE_VARIANT_READY || entry->state == PIPELINE_VARIANT_FAILED;
+        bool uses_slot = slot == SHADER_SLOTS || entry->key.vert == (uint32_t)slot || entry->key.frag == (uint32_t)slot;
+        if (!built || !uses_slot) {
+            continue;
+        }
+
+        if (entry->state == PIPELINE_VARIANT_READY) {
+            if (variants->retired_len == PIPELINE_VARIANTS_MAX) {
+                // rebuilt faster than frames finish, let them catch up
+                vkDeviceWaitIdle(vulkan->device);
+                vulkanCollectRetiredVariants(vulkan);
+            }
+
+            RetiredVariant retired = {0};
+            retired.pipeline = entry->pipeline;
+            for (size_t frame=0; frame<MAX_FRAMES_IN_FLIGHT; ++frame) {
+                retired.pending[frame] = vkGetFenceStatus(vulkan->device, vulkan->sync[frame].inFlight) != VK_SUCCESS;
+            }
+            variants->retired[variants->retired_len++] = retired;
+        }
+
+        entry->state = PIPELINE_VARIANT_QUEUED;
+        entry->pipeline = VK_NULL_HANDLE;
+        variants->queue[variants->queue_len++] = i;
+        requeued += 1;
+    }
+
+    if (requeued > 0) {
+        vulkanInvalidateCommandBuffers(vulkan);
+        fprintf(stderr, "INFO: Rebuilding %u pipeline variants\n", requeued);
+    }
+}
+
+
+/* Frame boundary, render thread. Never waits for a build */
+void vulkanUpdatePipelineVariants(Vulkan *vulkan) {
+    if (vulkan->variants == NULL) {
+        return;
+    }
+
+    vulkanCollectRetiredVariants(vulkan);
+    vulkanCollectPipelineBatches(vulkan, false);
+    vulkanSubmitPipelineVariants(vulkan);
+}
+
+
+/* 
+ * Keys of the last run listed in usage_path are queued and submitted right away, so they build while the rest loads.
+ * vulkan and jobs have to stay where they are until vulkanFree. usage_path can be NULL, nothing is loaded or saved then
+ */
+void vulkanCreatePipelineVariants(Vulkan *vulkan, JobSystem *jobs, const char *usage_path) {
+    PipelineVariants *variants = calloc(1, sizeof(PipelineVariants));
+    if (variants == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate memory for pipeline variants");
+        exit(1);
+    }
+    variants->jobs = jobs;
+    variants->usage_path = usage_path;
+    variants->scene_pipeline = vulkan->pipeline;
+    variants->bindless_pipeline = vulkan->bindless.pipeline;
+    vulkan->variants = variants;
+
+    // no list is a normal thing on the first launch, same as with the pipeline cache
+    FILE *file = usage_path != NULL ? fopen(usage_path, "rb") : NULL;
+    if (file != NULL) {
+        fclose(file);
+        size_t size = 0;
+        char *data = readEntireFile(usage_path, &size);
+
+        PipelineUsageHeader header = {0};
+        if (data != NULL && size >= sizeof header) {
+            memcpy(&header, data, sizeof header);
+        }
+        bool valid = header.magic == PIPELINE_USAGE_MAGIC && header.version == PIPELINE_USAGE_VERSION &&
+                     header.count <= PIPELINE_VARIANTS_MAX && size == sizeof header + header.count * sizeof(PipelineKey);
+
+        if (valid) {
+            for (uint32_t i=0; i<header.count; ++i) {
+                PipelineKey key;
+                memcpy(&key, data + sizeof header + i * sizeof key, sizeof key);
+                if (!vulkan->gpu.caps.fillModeNonSolid) {
+                    key.variant.render_state &= ~RENDER_STATE_WIREFRAME;
+                }
+                if (!pipelineKeyIsBase(key)) {
+                    vulkanQueuePipelineVariant(vulkan, key);
+                }
+            }
+            fprintf(stderr, "INFO: Pre-warming %u pipeline variants from %s\n", variants->queue_len, usage_path);
+        } else if (data != NULL) {
+            fprintf(stderr, "INFO: Pipeline usage in %s is stale or corrupted, ignoring it\n", usage_path);
+        }
+        free(data);
+    }
+
+    vulkanSubmitPipelineVariants(vulkan);
+}
+
+
+/* Every key that was asked for, whether it was built in the end or not, a failure may be down to this run's settings */
+void vulkanSavePipelineUsage(PipelineVariants *variants) {
+    if (variants->usage_path == NULL) {
+        return;
+    }
+
+    PipelineUsageHeader header = {PIPELINE_USAGE_MAGIC, PIPELINE_USAGE_VERSION, 0};
+    char *data = malloc(sizeof header + variants->len * sizeof(PipelineKey));
+    if (data == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate memory for pipeline usage");
+        exit(1);
+    }
+    for (uint32_t i=0; i<PIPELINE_VARIANTS_TABLE; ++i) {
+        if (variants->table[i].state != PIPELINE_VARIANT_EMPTY) {
+            memcpy(data + sizeof header + header.count * sizeof(PipelineKey), &variants->table[i].key, sizeof(PipelineKey));
+            header.count += 1;
+        }
+    }
+    memcpy(data, &header, sizeof header);
+
+    if (writeEntireFileAtomic(variants->usage_path, data, sizeof header + header.count * sizeof(PipelineKey))) {
+        fprintf(stderr, "INFO: Pipeline usage saved to %s(%u variants)\n", variants->usage_path, header.count);
+    } else {
+        fprintf(stderr, "INFO: Failed to save pipeline usage to %s\n", variants->usage_path);
+    }
+    free(data);
+}
+
+
+/* Device has to be idle, jobs have to be alive */
+void freePipelineVariants(Vulkan *vulkan) {
+    PipelineVariants *variants = vulkan->variants;
+    if (variants == NULL) {
+        return;
+    }
+
+    vulkanCollectPipelineBatches(vulkan, true);
+    vulkanSavePipelineUsage(variants);
+    for (uint32_t i=0; i<PIPELINE_VARIANTS_TABLE; ++i) {
+        if (variants->table[i].state == PIPELINE_VARIANT_READY) {
+            vkDestroyPipeline(vulkan->device, variants->table[i].pipeline, NULL);
+        }
+    }
+    for (uint32_t i=0; i<variants->retired_len; ++i) {
+        vkDestroyPipeline(vulkan->device, variants->retired[i].pipeline, NULL);
+    }
+    free(variants);
+    vulkan->variants = NULL;
+}
+
+
+static const char *shader_slot_names[SHADER_SLOTS] = {
+    "scene vertex", "scene fragment", "bindless vertex", "pulling vertex", "cluster vertex", "meshlet task", "meshlet mesh",
+    "cull", "compact", "cluster cull", "post vertex", "fxaa", "upscale"
+};
+// extra glslc arguments, mesh shaders need SPIR-V 1.4
+static const char *shader_slot_options[SHADER_SLOTS] = {
+    [SHADER_MESHLET_TASK] = "--target-env=vulkan1.1spv1.4",
+    [SHADER_MESHLET_MESH] = "--target-env=vulkan1.1spv1.4",
+};
+
+Shader *vulkanShaderSlotShader(Vulkan *vulkan, ShaderSlot slot) {
+    switch (slot) {
+        case SHADER_SCENE_VERT: return &vulkan->vert;
+        case SHADER_SCENE_FRAG: return &vulkan->frag;
+        case SHADER_BINDLESS_VERT: return &vulkan->bindless.vert;
+        case SHADER_PULL_VERT: return &vulkan->pulling.vert;
+        case SHADER_CLUSTER_VERT: return &vulkan->clusters.vert;
+        case SHADER_MESHLET_TASK: return &vulkan->clusters.task;
+        case SHADER_MESHLET_MESH: return &vulkan->clusters.mesh;
+        case SHADER_CULL: return &vulkan->gpu_driven.cull_shader;
+        case SHADER_COMPACT: return &vulkan->gpu_driven.compact_shader;
+        case SHADER_CLUSTER_CULL: return &vulkan->clusters.cull_shader;
+        case SHADER_POST_VERT: return &vulkan->post_process.vert;
+        case SHADER_FXAA: return &vulkan->post_process.fxaa_frag;
+        case SHADER_UPSCALE: return &vulkan->post_process.upscale_frag;
+        default: break;
+    }
+    fprintf(stderr, "ERROR: unknown shader slot %d", slot);
+    exit(1);
+}
+
+
+/* Pipelines built from the slot's shader, returns how many were written to out. None if the slot's pass wasn't created */
+uint32_t vulkanShaderSlotPipelines(Vulkan *vulkan, ShaderSlot slot, VkPipeline *out[SHADER_RELOAD_MAX_PIPELINES]) {
+    bool created = true;
+    if (slot == SHADER_BINDLESS_VERT) {
+        created = vulkan->bindless.created;
+    } else if (slot == SHADER_PULL_VERT) {
+        created = vulkan->pulling.created;
+    } else if (slot == SHADER_CLUSTER_VERT || slot == SHADER_CLUSTER_CULL) {
+        created = vulkan->clusters.created;
+    } else if (slot == SHADER_MESHLET_TASK || slot == SHADER_MESHLET_MESH) {
+        created = vulkan->clusters.created && vulkan->clusters.mesh_shaders;
+    } else if (slot == SHADER_CULL || slot == SHADER_COMPACT) {
+        created = vulkan->gpu_driven.supported;
+    } else if (slot == SHADER_POST_VERT || slot == SHADER_FXAA || slot == SHADER_UPSCALE) {
+        created = vulkan->post_process.created;
+    }
+    if (!created) {
+        return 0;
+    }
+
+    uint32_t count = 0;
+    switch (slot) {
+        case SHADER_SCENE_VERT:
+            out[count++] = &vulkan->pipeline;
+            break;
+        case SHADER_SCENE_FRAG:
+            out[count++] = &vulkan->pipeline;
+            if (vulkan->bindless.created) {
+                out[count++] = &vulkan->bindless.pipeline;
+            }
+            if (vulkan->pulling.created) {
+                out[count++] = &vulkan->pulling.pipeline;
+            }
+            if (vulkan->clusters.created) {
+                out[count++] = &vulkan->clusters.pipeline;
+            }
+            if (vulkan->clusters.mesh_shaders) {
+                out[count++] = &vulkan->clusters.mesh_pipelines[0];
+                out[count++] = &vulkan->clusters.mesh_pipelines[1];
+            }
+            break;
+        case SHADER_BINDLESS_VERT:
+            out[count++] = &vulkan->bindless.pipeline;
+            break;
+        case SHADER_PULL_VERT:
+            out[count++] = &vulkan->pulling.pipeline;
+            break;
+        case SHADER_CLUSTER_VERT:
+            out[count++] = &vulkan->clusters.pipeline;
+            break;
+        case SHADER_MESHLET_TASK:
+        case SHADER_MESHLET_MESH:
+            out[count++] = &vulkan->clusters.mesh_pipelines[0];
+            out[count++] = &vulkan->clusters.mesh_pipelines[1];
+            break;
+        case SHADER_CULL:
+            out[count++] = &vulkan->gpu_driven.cull_pipeline;
+            break;
+        case SHADER_COMPACT:
+            out[count++] = &vulkan->gpu_driven.compact_pipeline;
+            break;
+        case SHADER_CLUSTER_CULL:
+            out[count++] = &vulkan->clusters.cull_pipeline;
+            break;
+        case SHADER_POST_VERT:
+            out[count++] = &vulkan->post_process.fxaa_pipeline;
+            out[count++] = &vulkan->post_process.upscale_pipeline;
+            break;
+        case SHADER_FXAA:
+            out[count++] = &vulkan->post_process.fxaa_pipeline;
+            break;
+        case SHADER_UPSCALE:
+            out[count++] = &vulkan->post_process.upscale_pipeline;
+            break;
+        default:
+            break;
+    }
+    return count;
+}
+
+
+/* 
+ * Slot's pipelines with shader in place of the slot's one, in vulkanShaderSlotPipelines order.
+ * Nothing is left behind on failure, the ones built before it are destroyed
+ */
+VkResult vulkanBuildSlotPipelines(Vulkan *vulkan, Swapchain swapchain, ShaderSlot slot, Shader shader, VkPipeline out[SHADER_RELOAD_MAX_PIPELINES], uint32_t *out_count) {
+    VkDevice device = vulkan->device;
+    VkPipelineCache cache = vulkan->pipeline_cache;
+
+    Shader vert = slot == SHADER_SCENE_VERT ? shader : vulkan->vert;
+    Shader frag = slot == SHADER_SCENE_FRAG ? shader : vulkan->frag;
+    Shader bindless_vert = slot == SHADER_BINDLESS_VERT ? shader : vulkan->bindless.vert;
+    Shader pull_vert = slot == SHADER_PULL_VERT ? shader : vulkan->pulling.vert;
+    ClusterCulling clusters = vulkan->clusters;
+    clusters.vert = slot == SHADER_CLUSTER_VERT ? shader : clusters.vert;
+    clusters.task = slot == SHADER_MESHLET_TASK ? shader : clusters.task;
+    clusters.mesh = slot == SHADER_MESHLET_MESH ? shader : clusters.mesh;
+    PostProcess post = vulkan->post_process;
+    post.vert = slot == SHADER_POST_VERT ? shader : post.vert;
+    Shader fxaa = slot == SHADER_FXAA ? shader : post.fxaa_frag;
+    Shader upscale = slot == SHADER_UPSCALE ? shader : post.upscale_frag;
+
+    PipelineKey instanced = vulkanBasePipelineKey(swapchain, SHADER_SCENE_VERT, SHADER_SCENE_FRAG);
+    PipelineKey pulled = vulkanBasePipelineKey(swapchain, SHADER_PULL_VERT, SHADER_SCENE_FRAG);
+
+    VkPipeline *live[SHADER_RELOAD_MAX_PIPELINES];
+    uint32_t count = vulkanShaderSlotPipelines(vulkan, slot, live);
+    VkResult res = VK_SUCCESS;
+    uint32_t built = 0;
+    for (; built<count && res == VK_SUCCESS; ++built) {
+        VkPipeline *target = live[built];
+        VkPipeline *pipeline = &out[built];
+        if (target == &vulkan->pipeline) {
+            res = vulkanTryCreatePipelineFromKey(device, swapchain, frag, vert, vulkan->pipeline_layout.layout, cache, instanced, pipeline);
+        } else if (target == &vulkan->bindless.pipeline) {
+            res = vulkanTryCreatePipelineFromKey(device, swapchain, frag, bindless_vert, vulkan->bindless.layout, cache, instanced, pipeline);
+        } else if (target == &vulkan->pulling.pipeline) {
+            res = vulkanTryCreatePipelineFromKey(device, swapchain, frag, pull_vert, vulkan->pulling.layout, cache, pulled, pipeline);
+        } else if (target == &vulkan->clusters.pipeline) {
+            res = vulkanTryCreatePipelineFromKey(device, swapchain, frag, clusters.vert, clusters.layout, cache, pulled, pipeline);
+        } else if (target == &vulkan->clusters.mesh_pipelines[0] || target == &vulkan->clusters.mesh_pipelines[1]) {
+            bool cull_back = target == &vulkan->clusters.mesh_pipelines[1];
+            res = vulkanTryCreateMeshletPipeline(device, swapchain, frag, clusters.task, clusters.mesh, clusters.mesh_layout, cache, cull_back, pipeline);
+        } else if (target == &vulkan->clusters.cull_pipeline) {
+            res = vulkanTryCreateComputePipeline(device, shader, clusters.cull_layout, cache, pipeline);
+        } else if (target == &vulkan->gpu_driven.cull_pipeline || target == &vulkan->gpu_driven.compact_pipeline) {
+            res = vulkanTryCreateComputePipeline(device, shader, vulkan->gpu_driven.layout, cache, pipeline);
+        } else if (target == &vulkan->post_process.fxaa_pipeline) {
+            res = vulkanTryCreatePostPipeline(device, swapchain, post, fxaa, cache, pipeline);
+        } else {
+            res = vulkanTryCreatePostPipeline(device, swapchain, post, upscale, cache, pipeline);
+        }
+    }
+
+    if (res != VK_SUCCESS) {
+        // the last one failed, everything before it was built
+        for (uint32_t i=0; i+1<built; ++i) {
+            vkDestroyPipeline(device, out[i], NULL);
+        }
+        *out_count = 0;
+        return res;
+    }
+    *out_count = count;
+    return VK_SUCCESS;
+}
+
+
+/* Watcher thread. Nothing it reads from vulkan changes until the result is taken, except targets, which are locked */
+bool vulkanShaderChanged(void *user, uint32_t id, const char *spv_path) {
+    Vulkan *vulkan = user;
+    ShaderReloader *reloader = vulkan->reloader;
+    TRACE_BEGIN(zone, "build reloaded pipelines");
+
+    ShaderReload reload = {0};
+    reload.slot = (ShaderSlot)id;
+    if (vulkanTryCreateShaderModule(vulkan->device, spv_path, &reload.shader) != VK_SUCCESS) {
+        fprintf(stderr, "INFO: %s shader can't be loaded, keeping the old one\n", shader_slot_names[reload.slot]);
+        TRACE_END(zone);
+        return false;
+    }
+
+    pthread_mutex_lock(&reloader->targets_lock);
+    VkResult res = vulkanBuildSlotPipelines(vulkan, reloader->swapchain, reload.slot, reload.shader, reload.pipelines, &reload.pipeline_count);
+    reload.targets_generation = reloader->targets_generation;
+    pthread_mutex_unlock(&reloader->targets_lock);
+
+    if (res != VK_SUCCESS) {
+        fprintf(stderr, "INFO: %s pipelines can't be built, keeping the old shader\n", shader_slot_names[reload.slot]);
+        freeShader(vulkan->device, reload.shader);
+        TRACE_END(zone);
+        return false;
+    }
+
+    reloader->result = reload;
+    atomic_store_explicit(&reloader->has_result, true, memory_order_release);
+    TRACE_END(zone);
+    return true;
+}
+
+bool vulkanShaderReloadReady(void *user) {
+    Vulkan *vulkan = user;
+    return !atomic_load_explicit(&vulkan->reloader->has_result, memory_order_acquire);
+}
+
+
+/* 
+ * Watches sources of every slot that was loaded, sources[slot] compiles to outputs[slot], NULL skips the slot.
+ * vulkan has to stay where it is until vulkanFree
+ */
+void vulkanStartShaderReload(Vulkan *vulkan, const char *sources[SHADER_SLOTS], const char *outputs[SHADER_SLOTS]) {
+    ShaderReloader *reloader = calloc(1, sizeof(ShaderReloader));
+    if (reloader == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate memory for shader reloader");
+        exit(1);
+    }
+    pthread_mutex_init(&reloader->targets_lock, NULL);
+    reloader->swapchain = vulkan->swapchain;
+    atomic_init(&reloader->has_result, false);
+    vulkan->reloader = reloader;
+
+    reloader->watcher = shaderWatcherCreate(vulkanShaderChanged, vulkanShaderReloadReady, vulkan);
+    for (uint32_t slot=0; slot<SHADER_SLOTS; ++slot) {
+        VkPipeline *pipelines[SHADER_RELOAD_MAX_PIPELINES];
+        bool created = vulkanShaderSlotPipelines(vulkan, slot, pipelines) > 0;
+        if (sources[slot] != NULL && outputs[slot] != NULL && created) {
+            shaderWatcherAdd(reloader->watcher, sources[slot], outputs[slot], shader_slot_options[slot], slot);
+        }
+    }
+    shaderWatcherStart(reloader->watcher);
+}
+
+
+/* Render passes are about to change, reload builds wait until vulkanUnlockTargets. Variant batches use them too, those are finished first */
+void vulkanLockTargets(Vulkan *vulkan) {
+    vulkanCollectPipelineBatches(vulkan, true);
+    if (vulkan->reloader != NULL) {
+        pthread_mutex_lock(&vulkan->reloader->targets_lock);
+    }
+}
+
+/* Later builds use the new targets, ones made before are rebuilt when they are applied */
+void vulkanUnlockTargets(Vulkan *vulkan) {
+    ShaderReloader *reloader = vulkan->reloader;
+    if (reloader != NULL) {
+        reloader->swapchain = vulkan->swapchain;
+        reloader->targets_generation += 1;
+        pthread_mutex_unlock(&reloader->targets_lock);
+    }
+}
+
+
+void vulkanCollectRetiredPipelines(Vulkan *vulkan) {
+    ShaderReloader *reloader = vulkan->reloader;
+    uint32_t kept = 0;
+    for (uint32_t i=0; i<reloader->retired_len; ++i) {
+        RetiredPipelines *retired = &reloader->retired[i];
+
+        // same rule as vulkanCollectRetired
+        bool pending = false;
+        for (size_t frame=0; frame<MAX_FRAMES_IN_FLIGHT; ++frame) {
+            if (retired->pending[frame] && vkGetFenceStatus(vulkan->device, vulkan->sync[frame].inFlight) == VK_SUCCESS) {
+                retired->pending[frame] = false;
+            }
+            pending = pending || retired->pending[frame];
+        }
+
+        if (pending) {
+            reloader->retired[kept++] = *retired;
+        } else {
+            for (uint32_t j=0; j<retired->count; ++j) {
+                vkDestroyPipeline(vulkan->device, retired->pipelines[j], NULL);
+            }
+        }
+    }
+    reloader->retired_len = kept;
+}
+
+
+/* 
+ * Frame boundary, render thread. Takes the watcher's result if there is one, never waits for a build.
+ * Only when targets changed while it was built are its pipelines rebuilt here
+ */
+void vulkanApplyShaderReload(Vulkan *vulkan) {
+    ShaderReloader *reloader = vulkan->reloader;
+    if (reloader == NULL) {
+        return;
+    }
+
+    vulkanCollectRetiredPipelines(vulkan);
+    if (!atomic_load_explicit(&reloader->has_result, memory_order_acquire)) {
+        return;
+    }
+
+    ShaderReload reload = reloader->result;
+    if (reload.targets_generation != reloader->targets_generation) {
+        // never used, nothing to wait for
+        for (uint32_t i=0; i<reload.pipeline_count; ++i) {
+            vkDestroyPipeline(vulkan->device, reload.pipelines[i], NULL);
+        }
+        if (vulkanBuildSlotPipelines(vulkan, vulkan->swapchain, reload.slot, reload.shader, reload.pipelines, &reload.pipeline_count) != VK_SUCCESS) {
+            fprintf(stderr, "INFO: %s pipelines can't be rebuilt for the new targets, keeping the old shader\n", shader_slot_names[reload.slot]);
+            freeShader(vulkan->device, reload.shader);
+            atomic_store_explicit(&reloader->has_result, false, memory_order_release);
+            return;
+        }
+    }
+
+    if (reloader->retired_len == MAX_RETIRED_PIPELINES) {
+        // reloaded faster than frames finish, let them catch up
+        vkDeviceWaitIdle(vulkan->device);
+        vulkanCollectRetiredPipelines(vulkan);
+    }
+
+    RetiredPipelines retired = {0};
+    VkPipeline *live[SHADER_RELOAD_MAX_PIPELINES];
+    retired.count = vulkanShaderSlotPipelines(vulkan, reload.slot, live);
+    for (uint32_t i=0; i<retired.count; ++i) {
+        retired.pipelines[i] = *live[i];
+        *live[i] = reload.pipelines[i];
+    }
+    for (size_t frame=0; frame<MAX_FRAMES_IN_FLIGHT; ++frame) {
+        retired.pending[frame] = vkGetFenceStatus(vulkan->device, vulkan->sync[frame].inFlight) != VK_SUCCESS;
+    }
+    reloader->retired[reloader->retired_len++] = retired;
+
+    // variant batches do need them while they build, the rebuilds are submitted with the new module
+    vulkanRebuildPipelineVariants(vulkan, reload.slot);
+
+    // pipelines don't need their modules after creation
+    Shader *shader = vulkanShaderSlotShader(vulkan, reload.slot);
+    freeShader(vulkan->device, *shader);
+    *shader = reload.shader;
+
+    atomic_store_explicit(&reloader->has_result, false, memory_order_release);
+    vulkanInvalidateCommandBuffers(vulkan);
+    fprintf(stderr, "INFO: Reloaded %s shader(%u pipelines)\n", shader_slot_names[reload.slot], retired.count);
+}
+
+
+/* Device has to be idle */
+void freeShaderReloader(Vulkan *vulkan) {
+    ShaderReloader *reloader = vulkan->reloader;
+    if (reloader == NULL) {
+        return;
+    }
+
+    shaderWatcherStop(reloader->watcher);
+    if (atomic_load(&reloader->has_result)) {
+        for (uint32_t i=0; i<reloader->result.pipeline_count; ++i) {
+            vkDestroyPipeline(vulkan->device, reloader->result.pipelines[i], NULL);
+        }
+        freeShader(vulkan->device, reloader->result.shader);
+    }
+    for (uint32_t i=0; i<reloader->retired_len; ++i) {
+        for (uint32_t j=0; j<reloader->retired[i].count; ++j) {
+            vkDestroyPipeline(vulkan->device, reloader->retired[i].pipelines[j], NULL);
+        }
+    }
+    pthread_mutex_destroy(&reloader->targets_lock);
+    free(reloader);
+    vulkan->reloader = NULL;
+}
+
+
+void vulkanFree(Vulkan *vulkan) {
+    vkDeviceWaitIdle(vulkan->device);
+
+    freeShaderReloader(vulkan);
+    freePipelineVariants(vulkan);
+    // device is idle, old presents are the only thing left and swapchains go before the surface anyway
+    for (uint32_t i=0; i<vulkan->retired_len; ++i) {
+        freeRetiredSwapchain(vulkan->device, vulkan->retired[i]);
+    }
+    free(vulkan->retired);
+    freeShader(vulkan->device, vulkan->frag);
+    freeShader(vulkan->device, vulkan->vert);
+    for (size_t i=0; i<MAX_FRAMES_IN_FLIGHT; ++i) {
+        freeSyncObjects(vulkan->device, vulkan->sync[i]);
+    }
+    vkDestroyCommandPool(vulkan->device, vulkan->command_pool, NULL);
+    freeGpuProfiler(vulkan->device, vulkan->profiler);
     freePipelineLayout(vulkan->device, vulkan->pipeline_layout);
 
     freeUniformBuffer(vulkan->device, vulkan->uniform_buffer);
+    freeUniformRing(vulkan->device, vulkan->object_ring);
+    freeParallelRecorder(vulkan->device, vulkan->recorder);
+    freeGpuDriven(vulkan->device, vulkan->gpu_driven);
+    freePostProcess(vulkan->device, vulkan->post_process);
+    freeBindless(vulkan->device, vulkan->bindless);
+    freeVertexPulling(vulkan->device, vulkan->pulling);
+    freeClusterCulling(vulkan->device, vulkan->clusters);
+    descriptorAllocatorFree(&vulkan->descriptors);
+    for (size_t i=0; i<MAX_SWAPCHAIN_IMAGES; ++i) {
+        descriptorAllocatorFree(&vulkan->frame_descriptors[i]);
+    }
     freeVulkanBuffer(vulkan->device, vulkan->vertex_buffer); 
-    freeVulkanBuffer(vulkan->device, vulkan->staging_buffer);
+    freeVulkanBuffer(vulkan->device, vulkan->index_buffer);
+    vkUnmapMemory(vulkan->device, vulkan->instance_buffer.buffer.memory);
+    freeVulkanBuffer(vulkan->device, vulkan->instance_buffer.buffer);
+    free(vulkan->instance_buffer.pending_images);
+    free(vulkan->instance_buffer.pending);
     vkDestroyPipeline(vulkan->device, vulkan->pipeline, NULL);
+    vulkanSavePipelineCache(vulkan->gpu, vulkan->device, vulkan->pipeline_cache, vulkan->pipeline_cache_path);
+    vkDestroyPipelineCache(vulkan->device, vulkan->pipeline_cache, NULL);
+    if (vulkan->headless) {
+        vkUnmapMemory(vulkan->device, vulkan->readback_buffer.memory);
+        freeVulkanBuffer(vulkan->device, vulkan->readback_buffer);
+    }
     freeSwapchain(vulkan->device, vulkan->swapchain);
     vkDestroyDevice(vulkan->device, NULL);
-    vkDestroySurfaceKHR(vulkan->instance, vulkan->surface, NULL); 
+    if (vulkan->surface != VK_NULL_HANDLE) {
+        vkDestroySurfaceKHR(vulkan->instance, vulkan->surface, NULL); 
+    }
     vkDestroyInstance(vulkan->instance, NULL);
 }
 
+/* Old pipeline is destroyed right away when retired is NULL, the device has to be idle then */
+void vulkanDropPipeline(Vulkan *vulkan, VkPipeline pipeline, RetiredSwapchain *retired) {
+    if (retired == NULL) {
+        vkDestroyPipeline(vulkan->device, pipeline, NULL);
+        return;
+    }
+
+    if (retired->pipeline_count == RETIRED_SWAPCHAIN_MAX_PIPELINES) {
+        fprintf(stderr, "ERROR: too many pipelines retired with a swapchain(%d)", RETIRED_SWAPCHAIN_MAX_PIPELINES);
+        exit(1);
+    }
+    retired->pipelines[retired->pipeline_count++] = pipeline;
+}
+
+
+/* Every base scene pipeline. Old ones are freed with retired, or right away on an idle device when it is NULL */
+void vulkanRecreateScenePipelines(Vulkan *vulkan, RetiredSwapchain *retired) {
+    vulkanDropPipeline(vulkan, vulkan->pipeline, retired);
+    vulkan->pipeline = vulkanCreatePipeline(vulkan->device, vulkan->swapchain, vulkan->frag, vulkan->vert, vulkan->pipeline_layout.layout, vulkan->pipeline_cache);
+
+    Bindless *bindless = &vulkan->bindless;
+    if (bindless->created) {
+        vulkanDropPipeline(vulkan, bindless->pipeline, retired);
+        bindless->pipeline = vulkanCreatePipeline(vulkan->device, vulkan->swapchain, vulkan->frag, bindless->vert, bindless->layout, vulkan->pipeline_cache);
+    }
+
+    VertexPulling *pulling = &vulkan->pulling;
+    if (pulling->created) {
+        vulkanDropPipeline(vulkan, pulling->pipeline, retired);
+        pulling->pipeline = vulkanCreatePulledPipeline(vulkan->device, vulkan->swapchain, vulkan->frag, pulling->vert, pulling->layout, vulkan->pipeline_cache);
+    }
+
+    ClusterCulling *clusters = &vulkan->clusters;
+    if (clusters->created) {
+        vulkanDropPipeline(vulkan, clusters->pipeline, retired);
+        clusters->pipeline = vulkanCreatePulledPipeline(vulkan->device, vulkan->swapchain, vulkan->frag, clusters->vert, clusters->layout, vulkan->pipeline_cache);
+    }
+    if (clusters->mesh_shaders) {
+        for (uint32_t cull_back=0; cull_back<2; ++cull_back) {
+            vulkanDropPipeline(vulkan, clusters->mesh_pipelines[cull_back], retired);
+            clusters->mesh_pipelines[cull_back] = vulkanCreateMeshletPipeline(
+                vulkan->device, vulkan->swapchain, vulkan->frag, clusters->task, clusters->mesh, clusters->mesh_layout, vulkan->pipeline_cache, cull_back
+            );
+        }
+    }
+}
+
+
+/* Scene and post pipelines, after their render passes became incompatible. Frames in flight keep the old ones until retired is freed */
+void vulkanRecreatePipelines(Vulkan *vulkan, RetiredSwapchain *retired) {
+    vulkanRecreateScenePipelines(vulkan, retired);
+    vulkanRebuildPipelineVariants(vulkan, SHADER_SLOTS);
+
+    PostProcess *post = &vulkan->post_process;
+    if (post->created) {
+        vulkanDropPipeline(vulkan, post->fxaa_pipeline, retired);
+        vulkanDropPipeline(vulkan, post->upscale_pipeline, retired);
+        post->fxaa_pipeline = vulkanCreatePostPipeline(vulkan->device, vulkan->swapchain, *post, post->fxaa_frag, vulkan->pipeline_cache);
+        post->upscale_pipeline = vulkanCreatePostPipeline(vulkan->device, vulkan->swapchain, *post, post->upscale_frag, vulkan->pipeline_cache);
+    }
+}
+
+
+/* 
+ * Doesn't wait for the device: new swapchain is created from the old one, which is retired and freed once its frames are done.
+ * Render passes, and so pipelines, are kept unless the surface format changed, attachment memory is reused when it fits.
+ * Reusing the memory while old frames are in flight is ordered by the same render pass dependencies that let frames share the z buffer
+ */
 void vulkanRecreateSwapchain(Vulkan *vulkan, GLFWwindow *window) {
+    Swapchain old = vulkan->swapchain;
+    Swapchain swapchain = vulkanInitSwapchain(vulkan->gpu, vulkan->device, vulkan->surface, window, vulkan->settings.present_mode, old.swapchain);
+
+    bool same_format = swapchain.surfaceFormat.format == old.surfaceFormat.format;
+    if (same_format) {
+        swapchain.renderPass = old.renderPass;
+        swapchain.postRenderPass = old.postRenderPass;
+        old.renderPass = VK_NULL_HANDLE;
+        old.postRenderPass = VK_NULL_HANDLE;
+    }
+
+    memcpy(swapchain.attachmentMemory, old.attachmentMemory, sizeof old.attachmentMemory);
+    vulkanSwapchainCreateTargets(vulkan->gpu, vulkan->device, &swapchain, vulkan->settings.anti_aliasing, vulkan->settings.dynamic_resolution);
+    for (size_t i=0; i<ATTACHMENT_MEMORY_KINDS; ++i) {
+        if (swapchain.attachmentMemory[i].memory == old.attachmentMemory[i].memory) {
+            // new swapchain owns it now
+            old.attachmentMemory[i].memory = VK_NULL_HANDLE;
+        }
+    }
+
+    // old render passes are only freed with the retired swapchain, after reload builds moved on to the new ones
+    vulkanLockTargets(vulkan);
+    RetiredSwapchain *retired = vulkanRetireSwapchain(vulkan, old);
+    vulkan->swapchain = swapchain;
+    vulkan->first_present_id = vulkan->present_id + 1;
+    if (!same_format) {
+        vulkanRecreatePipelines(vulkan, retired);
+    }
+    vulkanUnlockTargets(vulkan);
+    // new extent, controller starts over from full resolution
+    vulkan->resolution = (ResolutionController){RESOLUTION_SCALE_MAX, 0.0f, 0};
+
+    // images_in_flight are kept: command buffers and uniform slots are per image index and outlive the swapchain
+    vulkanInvalidateCommandBuffers(vulkan);
+}
+
+/* 
+ * Rebuilds only what depends on the changed settings: attachments, render passes and framebuffers always,
+ * scene pipeline when samples or sample shading change
+ */
+void vulkanRebuildTargets(Vulkan *vulkan, AntiAliasing aa, bool scaled) {
     vkDeviceWaitIdle(vulkan->device);
 
-    freeSwapchain(vulkan->device, vulkan->swapchain);
+    Swapchain *swapchain = &vulkan->swapchain;
+    AntiAliasing old = swapchain->antiAliasing;
+    vulkanLockTargets(vulkan);
+
+    // attachments are cheap to recreate, their memory is kept
+    vulkanSwapchainFreeRenderPasses(vulkan->device, swapchain);
+    vulkanSwapchainFreeAttachments(vulkan->device, swapchain);
+    AttachmentMemory old_memory[ATTACHMENT_MEMORY_KINDS];
+    memcpy(old_memory, swapchain->attachmentMemory, sizeof old_memory);
+    vulkanSwapchainCreateTargets(vulkan->gpu, vulkan->device, swapchain, aa, scaled);
+    for (size_t i=0; i<ATTACHMENT_MEMORY_KINDS; ++i) {
+        if (swapchain->attachmentMemory[i].memory != old_memory[i].memory) {
+            vkFreeMemory(vulkan->device, old_memory[i].memory, NULL);
+        }
+    }
+    vulkan->settings.anti_aliasing = aa;
+    vulkan->settings.dynamic_resolution = scaled;
+    vulkan->resolution = (ResolutionController){RESOLUTION_SCALE_MAX, 0.0f, 0};
+
+    // single sample render passes of off and FXAA are compatible, so switching between those keeps the pipeline
+    if (old.samples != aa.samples || old.sample_shading != aa.sample_shading) {
+        vulkanRecreateScenePipelines(vulkan, NULL);
+    }
+    vulkanUnlockTargets(vulkan);
+    vulkanInvalidateCommandBuffers(vulkan);
+}
+
+
+void vulkanSetAntiAliasing(Vulkan *vulkan, AntiAliasing aa) {
+    aa = vulkanSupportedAntiAliasing(vulkan->gpu, aa);
+    if (aa.mode == ANTI_ALIASING_FXAA && !vulkan->post_process.created) {
+        fprintf(stderr, "INFO: FXAA pass wasn't created, anti aliasing is off\n");
+        aa = (AntiAliasing){ANTI_ALIASING_OFF, VK_SAMPLE_COUNT_1_BIT, false};
+    }
+
+    vulkanRebuildTargets(vulkan, aa, vulkan->settings.dynamic_resolution);
+
+    const char *mode_names[] = {"off", "MSAA", "FXAA"};
+    fprintf(stderr, "INFO: Anti aliasing: %s(samples: %d, sample shading: %d)\n", mode_names[aa.mode], aa.samples, aa.sample_shading);
+}
+
+
+/* Recreates the swapchain, falls back to FIFO when the surface doesn't support the mode */
+void vulkanSetPresentMode(Vulkan *vulkan, GLFWwindow *window, VkPresentModeKHR mode) {
+    vulkan->settings.present_mode = mode;
+    if (vulkan->headless) {
+        fprintf(stderr, "INFO: Headless frames are not presented, present mode is ignored\n");
+        return;
+    }
+
+    vulkanRecreateSwapchain(vulkan, window);
+    fprintf(stderr, "INFO: Present mode: %s\n", vulkanPresentModeName(vulkan->swapchain.presentMode));
+}
+
+
+/* 
+ * Waits until the present with the id reaches the display. False when present wait is not supported,
+ * the id belongs to a retired swapchain or the timeout runs out
+ */
+bool vulkanWaitForPresent(Vulkan *vulkan, uint64_t present_id, uint64_t timeout_ns) {
+    if (vulkan->wait_for_present == NULL || present_id < vulkan->first_present_id || present_id > vulkan->present_id) {
+        return false;
+    }
+    return vulkan->wait_for_present(vulkan->device, vulkan->swapchain.swapchain, present_id, timeout_ns) == VK_SUCCESS;
+}
+
+
+/* Scene is rendered at a fraction of the swapchain resolution and upscaled by the post pass */
+void vulkanSetDynamicResolution(Vulkan *vulkan, bool enabled) {
+    if (enabled && !vulkan->post_process.created) {
+        fprintf(stderr, "INFO: Post pass wasn't created, dynamic resolution is off\n");
+        enabled = false;
+    }
+    if (enabled && vulkan->profiler == NULL) {
+        fprintf(stderr, "INFO: Gpu frame time is not measured, dynamic resolution is off\n");
+        enabled = false;
+    }
+
+    vulkanRebuildTargets(vulkan, vulkan->settings.anti_aliasing, enabled);
+    fprintf(stderr, "INFO: Dynamic resolution: %s(target: %.2fms)\n", enabled ? "on" : "off", vulkan->settings.target_frame_ms);
+}
+
+
+/* 
+ * Moves results of the image's previous frame into the scope histories.
+ * Call only after images_in_flight fence of the image was waited on, results that are not ready are skipped
+ */
+void vulkanProfilerCollect(Vulkan *vulkan, uint32_t image_index) {
+    GpuProfiler *profiler = vulkan->profiler;
+    if (profiler == NULL) {
+        return;
+    }
+
+    profiler->frame_image = image_index;
+    profiler->frame_valid = false;
+    if (vulkan->images_in_flight[image_index] == VK_NULL_HANDLE) {
+        return;
+    }
+
+    for (uint32_t scope=0; scope<profiler->scope_count; ++scope) {
+        if (!(profiler->recorded[image_index] & (1u << scope))) {
+            continue;
+        }
+
+        uint32_t query = image_index * GPU_PROFILER_MAX_SCOPES + scope;
+        uint64_t timestamps[2];
+        VkResult res = vkGetQueryPoolResults(
+                vulkan->device,
+                profiler->timestamps,
+                query * 2,
+                2,
+                sizeof timestamps,
+                timestamps,
+                sizeof(uint64_t),
+                VK_QUERY_RESULT_64_BIT
+        );
+        if (res != VK_SUCCESS) {
+            continue;
+        }
+
+        GpuProfilerScope *entry = &profiler->scopes[scope];
+        uint64_t ticks = (timestamps[1] - timestamps[0]) & profiler->valid_mask;
+        float ms = (float)((double)ticks * profiler->period_ns / 1000000.0);
+        entry->ms[entry->next] = ms;
+        entry->has_statistics[entry->next] = false;
+
+        if (profiler->recorded_statistics[image_index] & (1u << scope)) {
+            res = vkGetQueryPoolResults(
+                    vulkan->device,
+                    profiler->statistics,
+                    query,
+                    1,
+                    sizeof entry->statistics[entry->next],
+                    entry->statistics[entry->next],
+                    sizeof entry->statistics[entry->next],
+                    VK_QUERY_RESULT_64_BIT
+            );
+            entry->has_statistics[entry->next] = res == VK_SUCCESS;
+        }
+
+        entry->next = (entry->next + 1) % GPU_PROFILER_HISTORY;
+        entry->len = entry->len < GPU_PROFILER_HISTORY ? entry->len + 1 : GPU_PROFILER_HISTORY;
+
+        if (strcmp(entry->name, "frame") == 0) {
+            profiler->frame_valid = true;
+            profiler->frame_ms = ms;
+        }
+    }
+}
+
+
+/* 
+ * Gpu time of the image's previous frame from the imageAvailable wait on, false when it wasn't rendered yet or timestamps are not supported.
+ * vulkanProfilerCollect has to be called for the image first
+ */
+bool vulkanReadGpuFrameTime(Vulkan *vulkan, uint32_t image_index, float *out_ms) {
+    GpuProfiler *profiler = vulkan->profiler;
+    if (profiler == NULL || profiler->frame_image != image_index || !profiler->frame_valid) {
+        return false;
+    }
+
+    *out_ms = profiler->frame_ms;
+    return true;
+}
+
+
+/* Fills rows with min/avg/max over the last GPU_PROFILER_HISTORY frames of every measured scope, returns number of rows */
+uint32_t vulkanProfilerTable(Vulkan *vulkan, GpuProfileRow *rows, uint32_t max_rows) {
+    GpuProfiler *profiler = vulkan->profiler;
+    if (profiler == NULL) {
+        return 0;
+    }
+
+    uint32_t count = 0;
+    for (uint32_t scope=0; scope<profiler->scope_count && count<max_rows; ++scope) {
+        GpuProfilerScope *entry = &profiler->scopes[scope];
+        if (entry->len == 0) {
+            continue;
+        }
+
+        GpuProfileRow row = {0};
+        row.name = entry->name;
+        row.min_ms = entry->ms[0];
+        row.max_ms = entry->ms[0];
+
+        uint64_t statistics[GPU_PROFILER_STATISTICS_LEN] = {0};
+        uint32_t statistics_frames = 0;
+        for (uint32_t i=0; i<entry->len; ++i) {
+            row.min_ms = entry->ms[i] < row.min_ms ? entry->ms[i] : row.min_ms;
+            row.max_ms = entry->ms[i] > row.max_ms ? entry->ms[i] : row.max_ms;
+            row.avg_ms += entry->ms[i];
+
+            if (entry->has_statistics[i]) {
+                for (uint32_t k=0; k<GPU_PROFILER_STATISTICS_LEN; ++k) {
+                    statistics[k] += entry->statistics[i][k];
+                }
+                statistics_frames += 1;
+            }
+        }
+        row.avg_ms /= entry->len;
+
+        if (statistics_frames > 0) {
+            row.has_statistics = true;
+            row.vertex_invocations = statistics[0] / statistics_frames;
+            row.clipping_invocations = statistics[1] / statistics_frames;
+            row.clipping_primitives = statistics[2] / statistics_frames;
+            row.fragment_invocations = statistics[3] / statistics_frames;
+        }
+        rows[count++] = row;
+    }
+    return count;
+}
+
+
+/* Feeds gpu time of a finished frame into the controller, changes renderExtent once per RESOLUTION_CONTROLLER_PERIOD frames at most */
+void vulkanUpdateDynamicResolution(Vulkan *vulkan, float gpu_ms) {
+    if (!vulkan->settings.dynamic_resolution) {
+        return;
+    }
+
+    ResolutionController *controller = &vulkan->resolution;
+    controller->accumulated_ms += gpu_ms;
+    controller->frames += 1;
+    if (controller->frames < RESOLUTION_CONTROLLER_PERIOD) {
+        return;
+    }
+
+    float average_ms = controller->accumulated_ms / controller->frames;
+    controller->accumulated_ms = 0.0f;
+    controller->frames = 0;
+
+    float target_ms = vulkan->settings.target_frame_ms;
+    bool too_slow = average_ms > target_ms;
+    bool headroom = average_ms < target_ms * RESOLUTION_HEADROOM;
+    if (!too_slow && !headroom) {
+        return;
+    }
+
+    // gpu time scales with pixel count, that is with scale squared
+    float scale = controller->scale * sqrtf(target_ms / fmaxf(average_ms, 0.001f));
+    scale = roundf(scale / RESOLUTION_SCALE_STEP) * RESOLUTION_SCALE_STEP;
+    scale = fminf(fmaxf(scale, RESOLUTION_SCALE_MIN), RESOLUTION_SCALE_MAX);
+    if (scale == controller->scale) {
+        return;
+    }
+    controller->scale = scale;
+
+    Swapchain *swapchain = &vulkan->swapchain;
+    swapchain->renderExtent.width = (uint32_t)fmaxf(1.0f, roundf(swapchain->extent.width * scale));
+    swapchain->renderExtent.height = (uint32_t)fmaxf(1.0f, roundf(swapchain->extent.height * scale));
+    vulkanInvalidateCommandBuffers(vulkan);
 
-    vulkan->swapchain = vulkanInitSwapchain(vulkan->gpu, vulkan->device, vulkan->surface, window);
-    vulkanSwapchainCreateRenderPass(vulkan->gpu, vulkan->device, &vulkan->swapchain);
-    vulkanSwapchainCreateFramebuffers(vulkan->device, &vulkan->swapchain);
+    fprintf(stderr, "INFO: Render scale %.2f(%ux%u), gpu frame: %.2fms\n", scale, swapchain->renderExtent.width, swapchain->renderExtent.height, average_ms);
 }
 
 #endif
@@ -160,6 +160,22 @@ vec4 vec4_sub(vec4 a, vec4 b) {
     return (vec4) {a.x - b.x, a.y - b.y, a.z - b.z, a.w - b.w};
 }
 
+vec3 vec3_lerp(vec3 a, vec3 b, float t) {
+    return (vec3) {a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t};
+}
+
+float vec3_dot(vec3 a, vec3 b) {
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+vec3 vec3_cross(vec3 a, vec3 b) {
+    return (vec3) {a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x};
+}
+
+float vec3_length(vec3 v) {
+    return sqrtf(vec3_dot(v, v));
+}
+
 void dump_mat3t(mat3t m) {
     for (size_t i=0; i<3; ++i) {
         for (size_t j=0; j<3; ++j) {
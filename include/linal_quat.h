@@ -86,6 +86,16 @@ quaternion quat_lerp(quaternion q1, quaternion q2, float t) {
     return res;
 }
 
+/* Normalized lerp along the shorter arc, close enough to slerp for small steps */
+quaternion quat_nlerp(quaternion q1, quaternion q2, float t) {
+    float dot = q1.x * q2.x + q1.y * q2.y + q1.z * q2.z + q1.w * q2.w;
+    if (dot < 0.0f) {
+        q2 = (quaternion){-q2.x, -q2.y, -q2.z, -q2.w};
+    }
+    quaternion res = quat_lerp(q1, q2, t);
+    return quat_len(res) > 0.0f ? quat_normalized(res) : res;
+}
+
 /* specified angle is from 0 to 1 */
 quaternion quat_from_angle_axis(float angle, vec3 axis) {
     float s = sin(angle * M_PI);
@@ -0,0 +1,240 @@
+#ifndef MESH_POOL_H
+#define MESH_POOL_H
+
+#include "stdlib.h"
+#include "stdio.h"
+#include "stdint.h"
+#include "string.h"
+#include "float.h"
+
+#include "linal.h"
+#include "misc.h"
+
+/*
+ * All meshes share one vertex and one index buffer, so gpu can draw any of them
+ * from a single indirect command without rebinding anything
+ */
+#define MAX_MESHES 16
+#define MAX_LODS 4
+
+/* Layouts of MeshLod and MeshInfo match std430 structs in cull shaders */
+typedef struct {
+    uint32_t first_index;
+    uint32_t index_count;
+    int32_t vertex_offset;
+    // lod is used while distance to the object is below max_distance, measured in object radii
+    float max_distance;
+} MeshLod;
+
+typedef struct {
+    vec4 bounds; // xyz is center, w is radius
+    uint32_t lod_count;
+    uint32_t pad[3];
+    MeshLod lods[MAX_LODS];
+} MeshInfo;
+
+/* 
+ * Vertex pulling layout, 12 bytes instead of sizeof(Vertex). Position is quantized to 16 bits per axis inside
+ * the bounding box of its mesh and decoded as min + q * scale, color is rgba8 unorm
+ */
+typedef struct {
+    uint32_t position_xy;
+    uint32_t position_z; // upper half is free
+    uint32_t color;
+} PackedVertex;
+
+typedef struct {
+    vec4 min; // w is unused
+    vec4 scale;
+} VertexDecode;
+
+typedef struct {
+    Vertex *vertices;
+    size_t vertices_len;
+    size_t vertices_capacity;
+    uint32_t *indices;
+    size_t indices_len;
+    size_t indices_capacity;
+    MeshInfo meshes[MAX_MESHES];
+    uint32_t meshes_len;
+} MeshPool;
+
+
+void meshPoolReserve(MeshPool *pool, size_t vertices_count, size_t indices_count) {
+    if (pool->vertices_len + vertices_count > pool->vertices_capacity) {
+        size_t new_capacity = pool->vertices_len + vertices_count;
+        Vertex *new_vertices = realloc(pool->vertices, new_capacity * sizeof(Vertex));
+        if (new_vertices == NULL) {
+            fprintf(stderr, "ERROR: failed to allocate memory for mesh pool vertices");
+            exit(1);
+        }
+        pool->vertices = new_vertices;
+        pool->vertices_capacity = new_capacity;
+    }
+
+    if (pool->indices_len + indices_count > pool->indices_capacity) {
+        size_t new_capacity = pool->indices_len + indices_count;
+        uint32_t *new_indices = realloc(pool->indices, new_capacity * sizeof(uint32_t));
+        if (new_indices == NULL) {
+            fprintf(stderr, "ERROR: failed to allocate memory for mesh pool indices");
+            exit(1);
+        }
+        pool->indices = new_indices;
+        pool->indices_capacity = new_capacity;
+    }
+}
+
+
+uint32_t meshPoolHashVertex(Vertex v) {
+    uint32_t words[sizeof(Vertex) / sizeof(uint32_t)];
+    memcpy(words, &v, sizeof words);
+
+    // FNV-1a over the words
+    uint32_t hash = 2166136261u;
+    for (size_t i=0; i<sizeof words / sizeof(uint32_t); ++i) {
+        hash = (hash ^ words[i]) * 16777619u;
+    }
+    return hash;
+}
+
+
+/*
+ * Adds triangle list as a new lod of the mesh, identical vertices are merged.
+ * Lods have to be added from the most detailed one, bounds are computed from the first lod
+ */
+void meshPoolAddLod(MeshPool *pool, uint32_t mesh_index, Vertex *triangles, size_t triangles_vertex_count, float max_distance) {
+    if (mesh_index >= MAX_MESHES) {
+        fprintf(stderr, "ERROR: Mesh pool supports only %d meshes", MAX_MESHES);
+        exit(1);
+    }
+    MeshInfo *mesh = &pool->meshes[mesh_index];
+    if (mesh->lod_count >= MAX_LODS) {
+        fprintf(stderr, "ERROR: Mesh pool supports only %d lods per mesh", MAX_LODS);
+        exit(1);
+    }
+    if (mesh_index >= pool->meshes_len) {
+        pool->meshes_len = mesh_index + 1;
+    }
+
+    meshPoolReserve(pool, triangles_vertex_count, triangles_vertex_count);
+    size_t base_vertex = pool->vertices_len;
+
+    // open addressing table of indices into the lod's vertices, UINT32_MAX is empty slot
+    size_t table_size = 1;
+    while (table_size < triangles_vertex_count * 2) {
+        table_size *= 2;
+    }
+    uint32_t *table = malloc(table_size * sizeof(uint32_t));
+    if (table == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate memory for vertex deduplication");
+        exit(1);
+    }
+    memset(table, 0xff, table_size * sizeof(uint32_t));
+
+    MeshLod lod = {0};
+    lod.first_index = pool->indices_len;
+    lod.index_count = triangles_vertex_count;
+    lod.vertex_offset = base_vertex;
+    lod.max_distance = max_distance;
+
+    uint32_t unique_count = 0;
+    for (size_t i=0; i<triangles_vertex_count; ++i) {
+        Vertex v = triangles[i];
+        size_t slot = meshPoolHashVertex(v) & (table_size - 1);
+
+        while (table[slot] != UINT32_MAX && memcmp(&pool->vertices[base_vertex + table[slot]], &v, sizeof(Vertex)) != 0) {
+            slot = (slot + 1) & (table_size - 1);
+        }
+
+        if (table[slot] == UINT32_MAX) {
+            table[slot] = unique_count;
+            pool->vertices[base_vertex + unique_count] = v;
+            unique_count += 1;
+        }
+        pool->indices[pool->indices_len++] = table[slot];
+    }
+    free(table);
+    pool->vertices_len += unique_count;
+
+    if (mesh->lod_count == 0) {
+        vec3 min = {FLT_MAX, FLT_MAX, FLT_MAX};
+        vec3 max = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+        for (uint32_t i=0; i<unique_count; ++i) {
+            vec3 p = pool->vertices[base_vertex + i].pos;
+            min = (vec3){fminf(min.x, p.x), fminf(min.y, p.y), fminf(min.z, p.z)};
+            max = (vec3){fmaxf(max.x, p.x), fmaxf(max.y, p.y), fmaxf(max.z, p.z)};
+        }
+
+        vec3 center = vec3_scale(vec3_add(min, max), 0.5f);
+        float radius = 0.0f;
+        for (uint32_t i=0; i<unique_count; ++i) {
+            vec3 d = vec3_sub(pool->vertices[base_vertex + i].pos, center);
+            radius = fmaxf(radius, sqrtf(d.x * d.x + d.y * d.y + d.z * d.z));
+        }
+        mesh->bounds = (vec4){center.x, center.y, center.z, radius};
+    }
+    mesh->lods[mesh->lod_count++] = lod;
+
+    fprintf(stderr, "INFO: Mesh(%u) lod(%u): %zu vertices merged into %u\n", mesh_index, mesh->lod_count - 1, triangles_vertex_count, unique_count);
+}
+
+
+uint32_t packUnorm(float value, float max) {
+    value = value < 0.0f ? 0.0f : (value > 1.0f ? 1.0f : value);
+    return (uint32_t)(value * max + 0.5f);
+}
+
+/* 
+ * out has vertices_len entries and decode meshes_len. Every vertex belongs to a single lod,
+ * so walking the indices of each lod reaches all of them, boxes include every lod of the mesh
+ */
+void meshPoolPackVertices(const MeshPool *pool, PackedVertex *out, VertexDecode *decode) {
+    memset(out, 0, pool->vertices_len * sizeof(PackedVertex));
+
+    for (uint32_t m=0; m<pool->meshes_len; ++m) {
+        const MeshInfo *mesh = &pool->meshes[m];
+        vec3 min = {FLT_MAX, FLT_MAX, FLT_MAX};
+        vec3 max = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+        for (uint32_t l=0; l<mesh->lod_count; ++l) {
+            MeshLod lod = mesh->lods[l];
+            for (uint32_t i=0; i<lod.index_count; ++i) {
+                vec3 p = pool->vertices[lod.vertex_offset + pool->indices[lod.first_index + i]].pos;
+                min = (vec3){fminf(min.x, p.x), fminf(min.y, p.y), fminf(min.z, p.z)};
+                max = (vec3){fmaxf(max.x, p.x), fmaxf(max.y, p.y), fmaxf(max.z, p.z)};
+            }
+        }
+        if (mesh->lod_count == 0) {
+            continue;
+        }
+
+        // flat axes decode to min whatever is stored
+        vec3 size = vec3_sub(max, min);
+        vec3 inverse = {size.x > 0.0f ? 1.0f / size.x : 0.0f, size.y > 0.0f ? 1.0f / size.y : 0.0f, size.z > 0.0f ? 1.0f / size.z : 0.0f};
+        decode[m].min = (vec4){min.x, min.y, min.z, 0.0f};
+        decode[m].scale = (vec4){size.x / 65535.0f, size.y / 65535.0f, size.z / 65535.0f, 0.0f};
+
+        for (uint32_t l=0; l<mesh->lod_count; ++l) {
+            MeshLod lod = mesh->lods[l];
+            for (uint32_t i=0; i<lod.index_count; ++i) {
+                uint32_t index = lod.vertex_offset + pool->indices[lod.first_index + i];
+                Vertex v = pool->vertices[index];
+                vec3 q = vec3_sub(v.pos, min);
+                PackedVertex packed = {0};
+                packed.position_xy = packUnorm(q.x * inverse.x, 65535.0f) | (packUnorm(q.y * inverse.y, 65535.0f) << 16);
+                packed.position_z = packUnorm(q.z * inverse.z, 65535.0f);
+                packed.color = packUnorm(v.color.x, 255.0f) | (packUnorm(v.color.y, 255.0f) << 8) |
+                               (packUnorm(v.color.z, 255.0f) << 16) | (packUnorm(v.color.w, 255.0f) << 24);
+                out[index] = packed;
+            }
+        }
+    }
+}
+
+
+void meshPoolFree(MeshPool *pool) {
+    free(pool->vertices);
+    free(pool->indices);
+    *pool = (MeshPool){0};
+}
+
+#endif /* MESH_POOL_H */
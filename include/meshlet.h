@@ -0,0 +1,214 @@
+#ifndef MESHLET_H
+#define MESHLET_H
+
+#include "stdlib.h"
+#include "stdio.h"
+#include "stdint.h"
+#include "string.h"
+#include "float.h"
+
+#include "linal.h"
+#include "mesh_pool.h"
+
+/*
+ * Meshlets: small clusters of a mesh's most detailed lod, culled one by one on the gpu.
+ * Limits fit mesh shader outputs, 124 triangles keep the primitive indices of one meshlet under 512 bytes
+ */
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 124
+
+/* Layout matches std430 structs in cluster shaders */
+typedef struct {
+    vec4 sphere; // xyz is center, w is radius, in object space
+    // xyz is the average facing, w is the cutoff. Cutoff of 1 means triangles face too many ways to reject the cluster
+    vec4 cone;
+    uint32_t vertex_offset; // into meshlet vertices
+    uint32_t triangle_offset; // into meshlet triangles
+    uint32_t vertex_count;
+    uint32_t triangle_count;
+} Meshlet;
+
+typedef struct {
+    uint32_t first_meshlet;
+    uint32_t meshlet_count;
+} MeshletRange;
+
+typedef struct {
+    Meshlet *meshlets;
+    size_t meshlets_len;
+    size_t meshlets_capacity;
+    // pool vertex indices, lod vertex offset included
+    uint32_t *vertices;
+    size_t vertices_len;
+    size_t vertices_capacity;
+    // three meshlet local vertex indices per triangle, 8 bits each
+    uint32_t *triangles;
+    size_t triangles_len;
+    size_t triangles_capacity;
+    MeshletRange meshes[MAX_MESHES];
+} MeshletPool;
+
+
+void *meshletGrow(void *data, size_t *capacity, size_t needed, size_t element_size) {
+    if (needed <= *capacity) {
+        return data;
+    }
+
+    size_t new_capacity = *capacity == 0 ? 256 : *capacity;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    void *grown = realloc(data, new_capacity * element_size);
+    if (grown == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate memory for meshlets");
+        exit(1);
+    }
+    *capacity = new_capacity;
+    return grown;
+}
+
+
+/*
+ * Sphere around the meshlet's vertices and cone of its triangle normals.
+ * Front faces are clockwise on screen, so cross(c - a, b - a) points towards the camera for them
+ */
+void meshletComputeBounds(MeshletPool *out, const MeshPool *pool, Meshlet *meshlet) {
+    const uint32_t *vertices = &out->vertices[meshlet->vertex_offset];
+    const uint32_t *triangles = &out->triangles[meshlet->triangle_offset];
+
+    vec3 min = {FLT_MAX, FLT_MAX, FLT_MAX};
+    vec3 max = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    for (uint32_t i=0; i<meshlet->vertex_count; ++i) {
+        vec3 p = pool->vertices[vertices[i]].pos;
+        min = (vec3){fminf(min.x, p.x), fminf(min.y, p.y), fminf(min.z, p.z)};
+        max = (vec3){fmaxf(max.x, p.x), fmaxf(max.y, p.y), fmaxf(max.z, p.z)};
+    }
+    vec3 center = vec3_scale(vec3_add(min, max), 0.5f);
+    float radius = 0.0f;
+    for (uint32_t i=0; i<meshlet->vertex_count; ++i) {
+        radius = fmaxf(radius, vec3_length(vec3_sub(pool->vertices[vertices[i]].pos, center)));
+    }
+    meshlet->sphere = (vec4){center.x, center.y, center.z, radius};
+
+    // degenerate triangles have no facing and don't limit the cone
+    vec3 normals[MESHLET_MAX_TRIANGLES];
+    uint32_t normal_count = 0;
+    vec3 sum = {0, 0, 0};
+    for (uint32_t i=0; i<meshlet->triangle_count; ++i) {
+        uint32_t t = triangles[i];
+        vec3 a = pool->vertices[vertices[t & 0xff]].pos;
+        vec3 b = pool->vertices[vertices[(t >> 8) & 0xff]].pos;
+        vec3 c = pool->vertices[vertices[(t >> 16) & 0xff]].pos;
+        vec3 n = vec3_cross(vec3_sub(c, a), vec3_sub(b, a));
+        float length = vec3_length(n);
+        if (length > 0.0f) {
+            normals[normal_count++] = vec3_scale(n, 1.0f / length);
+            sum = vec3_add(sum, normals[normal_count - 1]);
+        }
+    }
+
+    meshlet->cone = (vec4){0, 0, 0, 1};
+    float sum_length = vec3_length(sum);
+    if (normal_count == 0 || sum_length == 0.0f) {
+        return;
+    }
+    vec3 axis = vec3_scale(sum, 1.0f / sum_length);
+    float min_dot = 1.0f;
+    for (uint32_t i=0; i<normal_count; ++i) {
+        min_dot = fminf(min_dot, vec3_dot(normals[i], axis));
+    }
+
+    // a cone this wide almost never rejects anything, it is not worth the test
+    if (min_dot <= 0.1f) {
+        return;
+    }
+    // sine of the cone angle, cluster is back facing when the view direction is outside of the cone widened by it
+    meshlet->cone = (vec4){axis.x, axis.y, axis.z, sqrtf(1.0f - min_dot * min_dot)};
+}
+
+
+void meshletFlush(MeshletPool *out, const MeshPool *pool, Meshlet *meshlet, uint8_t *local) {
+    if (meshlet->triangle_count == 0) {
+        return;
+    }
+
+    meshletComputeBounds(out, pool, meshlet);
+    out->meshlets = meshletGrow(out->meshlets, &out->meshlets_capacity, out->meshlets_len + 1, sizeof(Meshlet));
+    out->meshlets[out->meshlets_len++] = *meshlet;
+
+    for (uint32_t i=0; i<meshlet->vertex_count; ++i) {
+        local[out->vertices[meshlet->vertex_offset + i]] = 0xff;
+    }
+    *meshlet = (Meshlet){0};
+    meshlet->vertex_offset = out->vertices_len;
+    meshlet->triangle_offset = out->triangles_len;
+}
+
+
+/*
+ * Splits the first lod of every mesh greedily in index order. Meshes are tessellated patch by patch,
+ * so consecutive triangles are close to each other already and clusters come out compact enough to cull
+ */
+void meshletPoolBuild(MeshletPool *out, const MeshPool *pool) {
+    *out = (MeshletPool){0};
+    // meshlet local index of every pool vertex, 0xff while it is not in the current meshlet
+    uint8_t *local = malloc(pool->vertices_len);
+    if (local == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate memory for meshlet building");
+        exit(1);
+    }
+    memset(local, 0xff, pool->vertices_len);
+
+    for (uint32_t m=0; m<pool->meshes_len; ++m) {
+        const MeshInfo *mesh = &pool->meshes[m];
+        out->meshes[m].first_meshlet = out->meshlets_len;
+        if (mesh->lod_count == 0) {
+            continue;
+        }
+
+        MeshLod lod = mesh->lods[0];
+        Meshlet meshlet = {0};
+        meshlet.vertex_offset = out->vertices_len;
+        meshlet.triangle_offset = out->triangles_len;
+        for (uint32_t i=0; i+2<lod.index_count; i+=3) {
+            uint32_t corners[3];
+            uint32_t new_vertices = 0;
+            for (uint32_t k=0; k<3; ++k) {
+                corners[k] = lod.vertex_offset + pool->indices[lod.first_index + i + k];
+                bool seen = local[corners[k]] != 0xff || (k > 0 && corners[k] == corners[0]) || (k > 1 && corners[k] == corners[1]);
+                new_vertices += seen ? 0 : 1;
+            }
+            if (meshlet.vertex_count + new_vertices > MESHLET_MAX_VERTICES || meshlet.triangle_count == MESHLET_MAX_TRIANGLES) {
+                meshletFlush(out, pool, &meshlet, local);
+            }
+
+            uint32_t triangle = 0;
+            for (uint32_t k=0; k<3; ++k) {
+                if (local[corners[k]] == 0xff) {
+                    local[corners[k]] = meshlet.vertex_count++;
+                    out->vertices = meshletGrow(out->vertices, &out->vertices_capacity, out->vertices_len + 1, sizeof(uint32_t));
+                    out->vertices[out->vertices_len++] = corners[k];
+                }
+                triangle |= (uint32_t)local[corners[k]] << (k * 8);
+            }
+            out->triangles = meshletGrow(out->triangles, &out->triangles_capacity, out->triangles_len + 1, sizeof(uint32_t));
+            out->triangles[out->triangles_len++] = triangle;
+            meshlet.triangle_count += 1;
+        }
+        meshletFlush(out, pool, &meshlet, local);
+
+        out->meshes[m].meshlet_count = out->meshlets_len - out->meshes[m].first_meshlet;
+        fprintf(stderr, "INFO: Mesh(%u): %u triangles split into %u meshlets\n", m, lod.index_count / 3, out->meshes[m].meshlet_count);
+    }
+    free(local);
+}
+
+
+void meshletPoolFree(MeshletPool *pool) {
+    free(pool->meshlets);
+    free(pool->vertices);
+    free(pool->triangles);
+    *pool = (MeshletPool){0};
+}
+
+#endif /* MESHLET_H */
@@ -1,6 +1,9 @@
 #ifndef MISC_H
 #define MISC_H
 
+#include "stdint.h"
+#include "time.h"
+
 #include "linal_quat.h"
 #include "linal.h"
 
@@ -16,4 +19,15 @@ typedef struct {
     vec3 position; 
 } Model;
 
+/* Monotonic wall clock, unlike clock() it keeps going while the thread waits. Every timer in the program uses it */
+uint64_t monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+double monotonicSeconds() {
+    return monotonicNs() / 1e9;
+}
+
 #endif /* MISC_H */
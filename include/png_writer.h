@@ -0,0 +1,133 @@
+/* Minimal png writer, rgba8 only and no compression (stored deflate blocks) */
+
+#ifndef PNG_WRITER_H
+#define PNG_WRITER_H
+
+#include "stdint.h"
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "stdbool.h"
+
+#include "file_helpers.h"
+
+uint32_t pngCrc32(uint32_t crc, const uint8_t *data, size_t size) {
+    static uint32_t table[256];
+    static bool table_ready = false;
+    if (!table_ready) {
+        for (uint32_t i=0; i<256; ++i) {
+            uint32_t c = i;
+            for (int k=0; k<8; ++k) {
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+        table_ready = true;
+    }
+
+    crc = ~crc;
+    for (size_t i=0; i<size; ++i) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+void pngPutU32(uint8_t *out, uint32_t value) {
+    out[0] = (uint8_t)(value >> 24);
+    out[1] = (uint8_t)(value >> 16);
+    out[2] = (uint8_t)(value >> 8);
+    out[3] = (uint8_t)value;
+}
+
+/* Writes length, type, data and crc of the chunk, returns number of bytes written */
+size_t pngPutChunk(uint8_t *out, const char *type, const uint8_t *data, uint32_t size) {
+    pngPutU32(out, size);
+    memcpy(out + 4, type, 4);
+    if (size > 0) {
+        memcpy(out + 8, data, size);
+    }
+    pngPutU32(out + 8 + size, pngCrc32(0, out + 4, size + 4));
+    return size + 12;
+}
+
+
+/* rgba has width * height tightly packed pixels, top row first */
+bool writePng(const char *filename, const uint8_t *rgba, uint32_t width, uint32_t height) {
+    const uint32_t max_block = 65535;
+
+    size_t row_size = (size_t)width * 4 + 1; // filter byte in front of every row
+    size_t raw_size = row_size * height;
+    size_t block_count = (raw_size + max_block - 1) / max_block;
+    size_t zlib_size = 2 + raw_size + block_count * 5 + 4;
+    size_t png_size = 8 + (12 + 13) + (12 + zlib_size) + 12;
+
+    if (zlib_size > UINT32_MAX) {
+        fprintf(stderr, "%s: image is too big(%ux%u)\n", __FUNCTION__, width, height);
+        return false;
+    }
+
+    uint8_t *png = malloc(png_size);
+    uint8_t *zlib = malloc(zlib_size);
+    if (png == NULL || zlib == NULL) {
+        fprintf(stderr, "%s: failed to allocate memory\n", __FUNCTION__);
+        free(png);
+        free(zlib);
+        return false;
+    }
+
+    /* zlib stream of stored blocks */ {
+        size_t zp = 0;
+        zlib[zp++] = 0x78;
+        zlib[zp++] = 0x01;
+
+        uint32_t adler_a = 1;
+        uint32_t adler_b = 0;
+        size_t raw_pos = 0;
+        while (raw_pos < raw_size) {
+            uint32_t block_size = raw_size - raw_pos > max_block ? max_block : (uint32_t)(raw_size - raw_pos);
+            bool last = raw_pos + block_size == raw_size;
+
+            zlib[zp++] = last ? 1 : 0;
+            zlib[zp++] = (uint8_t)block_size;
+            zlib[zp++] = (uint8_t)(block_size >> 8);
+            zlib[zp++] = (uint8_t)~block_size;
+            zlib[zp++] = (uint8_t)(~block_size >> 8);
+
+            for (uint32_t i=0; i<block_size; ++i, ++raw_pos) {
+                size_t x = raw_pos % row_size;
+                size_t y = raw_pos / row_size;
+                uint8_t byte = x == 0 ? 0 : rgba[y * (row_size - 1) + x - 1];
+
+                zlib[zp++] = byte;
+                adler_a = (adler_a + byte) % 65521;
+                adler_b = (adler_b + adler_a) % 65521;
+            }
+        }
+
+        pngPutU32(zlib + zp, (adler_b << 16) | adler_a);
+    }
+
+    size_t pp = 0;
+    const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    memcpy(png, signature, 8);
+    pp += 8;
+
+    uint8_t header[13];
+    pngPutU32(header, width);
+    pngPutU32(header + 4, height);
+    header[8] = 8;  // bit depth
+    header[9] = 6;  // rgba
+    header[10] = 0; // deflate
+    header[11] = 0; // adaptive filtering
+    header[12] = 0; // no interlace
+    pp += pngPutChunk(png + pp, "IHDR", header, 13);
+    pp += pngPutChunk(png + pp, "IDAT", zlib, (uint32_t)zlib_size);
+    pp += pngPutChunk(png + pp, "IEND", NULL, 0);
+
+    bool result = writeEntireFileAtomic(filename, png, pp);
+    free(zlib);
+    free(png);
+    return result;
+}
+
+#endif /* PNG_WRITER_H */
@@ -0,0 +1,397 @@
+/*
+ * Small render graph: passes declare which attachments they write and which images they sample,
+ * compiling derives load/store ops, layouts, subpass dependencies and which attachments may share memory.
+ * It is only data, vulkan objects are created from it in lava.h
+ */
+
+#ifndef RENDER_GRAPH_H
+#define RENDER_GRAPH_H
+
+#include "stdint.h"
+#include "stdlib.h"
+#include "stdio.h"
+#include "stdbool.h"
+
+#include "vulkan/vulkan.h"
+
+#define RENDER_GRAPH_MAX_RESOURCES 8
+#define RENDER_GRAPH_MAX_PASSES 8
+#define RENDER_GRAPH_MAX_ACCESSES 4
+#define RENDER_GRAPH_NONE UINT32_MAX
+
+typedef enum {
+    RENDER_GRAPH_COLOR,           // cleared by the first pass that uses it
+    RENDER_GRAPH_COLOR_OVERWRITE, // pass writes every pixel, old contents are never loaded
+    RENDER_GRAPH_DEPTH,
+    RENDER_GRAPH_RESOLVE,         // resolves the pass's multisampled colors, in the order they were added
+    RENDER_GRAPH_SAMPLED,         // read by fragment shaders, not an attachment of the pass
+} RenderGraphUsage;
+
+typedef struct {
+    VkFormat format;
+    VkSampleCountFlagBits samples;
+    // swapchain image, not allocated by the graph. final_layout is what presentation or readback expects
+    bool external;
+    VkImageLayout final_layout;
+    // filled by renderGraphCompile
+    uint32_t first_pass;
+    uint32_t last_pass;
+    bool sampled;
+    bool transient; // lives inside a single pass, so it is never stored and can be lazily allocated
+} RenderGraphResource;
+
+typedef struct {
+    uint32_t resource;
+    RenderGraphUsage usage;
+} RenderGraphAccess;
+
+typedef struct {
+    RenderGraphAccess accesses[RENDER_GRAPH_MAX_ACCESSES];
+    uint32_t access_count;
+    // filled by renderGraphCompile, attachments are in the order accesses were added
+    VkAttachmentDescription attachments[RENDER_GRAPH_MAX_ACCESSES];
+    uint32_t attachment_resources[RENDER_GRAPH_MAX_ACCESSES];
+    uint32_t attachment_count;
+    VkAttachmentReference colors[RENDER_GRAPH_MAX_ACCESSES];
+    uint32_t color_count;
+    VkAttachmentReference resolves[RENDER_GRAPH_MAX_ACCESSES];
+    uint32_t resolve_count;
+    VkAttachmentReference depth;
+    bool has_depth;
+    VkSubpassDependency dependencies[2];
+    uint32_t dependency_count;
+} RenderGraphPass;
+
+typedef struct {
+    RenderGraphResource resources[RENDER_GRAPH_MAX_RESOURCES];
+    uint32_t resource_count;
+    RenderGraphPass passes[RENDER_GRAPH_MAX_PASSES];
+    uint32_t pass_count;
+} RenderGraph;
+
+
+uint32_t renderGraphAddResource(RenderGraph *graph, VkFormat format, VkSampleCountFlagBits samples) {
+    if (graph->resource_count >= RENDER_GRAPH_MAX_RESOURCES) {
+        fprintf(stderr, "ERROR: Render graph supports only %d resources", RENDER_GRAPH_MAX_RESOURCES);
+        exit(1);
+    }
+    RenderGraphResource resource = {0};
+    resource.format = format;
+    resource.samples = samples;
+    graph->resources[graph->resource_count] = resource;
+    return graph->resource_count++;
+}
+
+
+uint32_t renderGraphAddExternal(RenderGraph *graph, VkFormat format, VkImageLayout final_layout) {
+    uint32_t resource = renderGraphAddResource(graph, format, VK_SAMPLE_COUNT_1_BIT);
+    graph->resources[resource].external = true;
+    graph->resources[resource].final_layout = final_layout;
+    return resource;
+}
+
+
+/* Passes run in the order they are added */
+uint32_t renderGraphAddPass(RenderGraph *graph) {
+    if (graph->pass_count >= RENDER_GRAPH_MAX_PASSES) {
+        fprintf(stderr, "ERROR: Render graph supports only %d passes", RENDER_GRAPH_MAX_PASSES);
+        exit(1);
+    }
+    graph->passes[graph->pass_count] = (RenderGraphPass){0};
+    return graph->pass_count++;
+}
+
+
+void renderGraphUse(RenderGraph *graph, uint32_t pass_index, uint32_t resource, RenderGraphUsage usage) {
+    RenderGraphPass *pass = &graph->passes[pass_index];
+    if (pass->access_count >= RENDER_GRAPH_MAX_ACCESSES) {
+        fprintf(stderr, "ERROR: Render graph pass can use only %d resources", RENDER_GRAPH_MAX_ACCESSES);
+        exit(1);
+    }
+    pass->accesses[pass->access_count++] = (RenderGraphAccess){resource, usage};
+}
+
+
+VkPipelineStageFlags renderGraphStage(RenderGraphUsage usage) {
+    switch (usage) {
+        case RENDER_GRAPH_DEPTH: return VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+        case RENDER_GRAPH_SAMPLED: return VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+        default: return VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    }
+}
+
+
+VkAccessFlags renderGraphWriteAccess(RenderGraphUsage usage) {
+    switch (usage) {
+        case RENDER_GRAPH_DEPTH: return VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        case RENDER_GRAPH_SAMPLED: return 0;
+        default: return VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    }
+}
+
+
+VkAccessFlags renderGraphAccess(RenderGraphUsage usage) {
+    switch (usage) {
+        case RENDER_GRAPH_DEPTH: return VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        case RENDER_GRAPH_SAMPLED: return VK_ACCESS_SHADER_READ_BIT;
+        case RENDER_GRAPH_COLOR: return VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        default: return VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    }
+}
+
+
+VkImageLayout renderGraphLayout(RenderGraphUsage usage) {
+    switch (usage) {
+        case RENDER_GRAPH_DEPTH: return VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+        case RENDER_GRAPH_SAMPLED: return VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        default: return VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    }
+}
+
+
+VkImageUsageFlags renderGraphImageUsage(RenderGraph *graph, uint32_t resource) {
+    VkImageUsageFlags flags = 0;
+    for (uint32_t p=0; p<graph->pass_count; ++p) {
+        RenderGraphPass *pass = &graph->passes[p];
+        for (uint32_t a=0; a<pass->access_count; ++a) {
+            if (pass->accesses[a].resource != resource) {
+                continue;
+            }
+            switch (pass->accesses[a].usage) {
+                case RENDER_GRAPH_DEPTH: flags |= VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT; break;
+                case RENDER_GRAPH_SAMPLED: flags |= VK_IMAGE_USAGE_SAMPLED_BIT; break;
+                default: flags |= VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT; break;
+            }
+        }
+    }
+    if (graph->resources[resource].transient) {
+        flags |= VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+    }
+    return flags;
+}
+
+
+/*
+ * Internal resources of the same kind whose lifetimes don't overlap may be placed at the same memory,
+ * decided from lifetimes only, so dependencies don't change when sizes do
+ */
+bool renderGraphMayAlias(RenderGraph *graph, uint32_t a, uint32_t b) {
+    if (a == b) {
+        return true;
+    }
+    RenderGraphResource ra = graph->resources[a];
+    RenderGraphResource rb = graph->resources[b];
+    if (ra.external || rb.external || ra.transient != rb.transient) {
+        return false;
+    }
+    return ra.last_pass < rb.first_pass || rb.last_pass < ra.first_pass;
+}
+
+
+/* Closest access to the resource before (direction -1) or after (1) the pass, NULL if there is none in the frame */
+RenderGraphAccess *renderGraphNeighbourUse(RenderGraph *graph, uint32_t resource, uint32_t pass_index, int direction) {
+    for (int64_t p=(int64_t)pass_index + direction; p>=0 && p<graph->pass_count; p+=direction) {
+        RenderGraphPass *pass = &graph->passes[p];
+        for (uint32_t a=0; a<pass->access_count; ++a) {
+            if (pass->accesses[a].resource == resource) {
+                return &pass->accesses[a];
+            }
+        }
+    }
+    return NULL;
+}
+
+
+void renderGraphCompilePass(RenderGraph *graph, uint32_t pass_index) {
+    RenderGraphPass *pass = &graph->passes[pass_index];
+    pass->attachment_count = 0;
+    pass->color_count = 0;
+    pass->resolve_count = 0;
+    pass->has_depth = false;
+
+    VkSubpassDependency in = {0};
+    in.srcSubpass = VK_SUBPASS_EXTERNAL;
+    in.dstSubpass = 0;
+    VkSubpassDependency out = {0};
+    out.srcSubpass = 0;
+    out.dstSubpass = VK_SUBPASS_EXTERNAL;
+
+    for (uint32_t a=0; a<pass->access_count; ++a) {
+        RenderGraphAccess access = pass->accesses[a];
+        RenderGraphResource resource = graph->resources[access.resource];
+
+        /* everything that touched this memory before, previous frame included since attachments are shared between frames */ {
+            in.dstStageMask |= renderGraphStage(access.usage);
+            in.dstAccessMask |= renderGraphAccess(access.usage);
+            for (uint32_t p=0; p<graph->pass_count; ++p) {
+                RenderGraphPass *other = &graph->passes[p];
+                for (uint32_t o=0; o<other->access_count; ++o) {
+                    if (renderGraphMayAlias(graph, access.resource, other->accesses[o].resource)) {
+                        in.srcStageMask |= renderGraphStage(other->accesses[o].usage);
+                        in.srcAccessMask |= renderGraphWriteAccess(other->accesses[o].usage);
+                    }
+                }
+            }
+            if (resource.external && resource.final_layout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL) {
+                // previous readback of the image
+                in.srcStageMask |= VK_PIPELINE_STAGE_TRANSFER_BIT;
+            }
+        }
+
+        if (access.usage == RENDER_GRAPH_SAMPLED) {
+            continue;
+        }
+
+        RenderGraphAccess *previous = renderGraphNeighbourUse(graph, access.resource, pass_index, -1);
+        RenderGraphAccess *next = renderGraphNeighbourUse(graph, access.resource, pass_index, 1);
+        bool keeps_contents = access.usage == RENDER_GRAPH_COLOR || access.usage == RENDER_GRAPH_DEPTH;
+
+        VkAttachmentDescription description = {0};
+        description.format = resource.format;
+        description.samples = resource.samples;
+        if (keeps_contents) {
+            description.loadOp = previous != NULL ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR;
+        } else {
+            description.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+        }
+        // nothing after the pass reads it, storing would be pure bandwidth
+        description.storeOp = next != NULL || resource.external ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        description.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+        description.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        description.initialLayout = description.loadOp == VK_ATTACHMENT_LOAD_OP_LOAD ? renderGraphLayout(previous->usage) : VK_IMAGE_LAYOUT_UNDEFINED;
+        if (next != NULL) {
+            description.finalLayout = renderGraphLayout(next->usage);
+        } else if (resource.external) {
+            description.finalLayout = resource.final_layout;
+        } else {
+            description.finalLayout = renderGraphLayout(access.usage);
+        }
+
+        uint32_t index = pass->attachment_count++;
+        pass->attachments[index] = description;
+        pass->attachment_resources[index] = access.resource;
+
+        VkAttachmentReference reference = {index, renderGraphLayout(access.usage)};
+        switch (access.usage) {
+            case RENDER_GRAPH_DEPTH: pass->depth = reference; pass->has_depth = true; break;
+            case RENDER_GRAPH_RESOLVE: pass->resolves[pass->resolve_count++] = reference; break;
+            default: pass->colors[pass->color_count++] = reference; break;
+        }
+
+        /* layout transition at the end of the pass has to finish before whatever reads it outside of render passes */ {
+            VkPipelineStageFlags dst_stage = 0;
+            VkAccessFlags dst_access = 0;
+            if (next != NULL && next->usage == RENDER_GRAPH_SAMPLED) {
+                dst_stage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+                dst_access = VK_ACCESS_SHADER_READ_BIT;
+            } else if (next == NULL && resource.external && resource.final_layout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL) {
+                dst_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+                dst_access = VK_ACCESS_TRANSFER_READ_BIT;
+            }
+            if (dst_stage != 0) {
+                out.srcStageMask |= renderGraphStage(access.usage);
+                out.srcAccessMask |= renderGraphWriteAccess(access.usage);
+                out.dstStageMask |= dst_stage;
+                out.dstAccessMask |= dst_access;
+            }
+        }
+    }
+
+    if (pass->resolve_count != 0 && pass->resolve_count != pass->color_count) {
+        fprintf(stderr, "ERROR: Render graph pass has %u colors but %u resolves", pass->color_count, pass->resolve_count);
+        exit(1);
+    }
+
+    pass->dependency_count = 0;
+    if (in.srcStageMask == 0) {
+        in.srcStageMask = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+    }
+    pass->dependencies[pass->dependency_count++] = in;
+    if (out.dstStageMask != 0) {
+        pass->dependencies[pass->dependency_count++] = out;
+    }
+}
+
+
+void renderGraphCompile(RenderGraph *graph) {
+    for (uint32_t r=0; r<graph->resource_count; ++r) {
+        graph->resources[r].first_pass = RENDER_GRAPH_NONE;
+        graph->resources[r].last_pass = 0;
+        graph->resources[r].sampled = false;
+    }
+
+    for (uint32_t p=0; p<graph->pass_count; ++p) {
+        RenderGraphPass *pass = &graph->passes[p];
+        for (uint32_t a=0; a<pass->access_count; ++a) {
+            RenderGraphResource *resource = &graph->resources[pass->accesses[a].resource];
+            if (resource->first_pass == RENDER_GRAPH_NONE) {
+                resource->first_pass = p;
+            }
+            resource->last_pass = p;
+            resource->sampled = resource->sampled || pass->accesses[a].usage == RENDER_GRAPH_SAMPLED;
+        }
+    }
+
+    for (uint32_t r=0; r<graph->resource_count; ++r) {
+        RenderGraphResource *resource = &graph->resources[r];
+        resource->transient = !resource->external && !resource->sampled && resource->first_pass == resource->last_pass;
+    }
+
+    for (uint32_t p=0; p<graph->pass_count; ++p) {
+        renderGraphCompilePass(graph, p);
+    }
+}
+
+
+/*
+ * Places internal resources of one kind (transient or not) so that ones with overlapping lifetimes never overlap in memory.
+ * reqs and offsets are indexed by resource, returns size of the memory block they need
+ */
+VkDeviceSize renderGraphPlaceMemory(RenderGraph *graph, bool transient, const VkMemoryRequirements *reqs, VkDeviceSize *offsets) {
+    uint32_t order[RENDER_GRAPH_MAX_RESOURCES];
+    uint32_t count = 0;
+    for (uint32_t r=0; r<graph->resource_count; ++r) {
+        RenderGraphResource resource = graph->resources[r];
+        if (!resource.external && resource.first_pass != RENDER_GRAPH_NONE && resource.transient == transient) {
+            order[count++] = r;
+        }
+    }
+
+    // biggest first packs tighter
+    for (uint32_t i=1; i<count; ++i) {
+        for (uint32_t j=i; j>0 && reqs[order[j]].size > reqs[order[j - 1]].size; --j) {
+            uint32_t tmp = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = tmp;
+        }
+    }
+
+    VkDeviceSize total = 0;
+    for (uint32_t i=0; i<count; ++i) {
+        uint32_t r = order[i];
+        VkDeviceSize offset = 0;
+
+        bool moved = true;
+        while (moved) {
+            moved = false;
+            for (uint32_t j=0; j<i; ++j) {
+                uint32_t placed = order[j];
+                if (renderGraphMayAlias(graph, r, placed)) {
+                    continue;
+                }
+                if (offset < offsets[placed] + reqs[placed].size && offsets[placed] < offset + reqs[r].size) {
+                    offset = (offsets[placed] + reqs[placed].size + reqs[r].alignment - 1) / reqs[r].alignment * reqs[r].alignment;
+                    moved = true;
+                }
+            }
+        }
+
+        offsets[r] = offset;
+        if (offset + reqs[r].size > total) {
+            total = offset + reqs[r].size;
+        }
+    }
+    return total;
+}
+
+#endif /* RENDER_GRAPH_H */
@@ -0,0 +1,340 @@
+/*
+ * Scene graph in structure of arrays pools. Nodes are addressed by handles, a destroyed node's slot is reused
+ * with a new generation so stale handles are caught.
+ * Setters only mark the node dirty, sceneUpdate recomputes world transforms of dirty subtrees and lists the nodes it touched,
+ * so the cost of a frame follows what changed and not the scene size
+ */
+
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "stdint.h"
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "stdbool.h"
+
+#include "linal.h"
+#include "linal_quat.h"
+
+#define SCENE_NONE UINT32_MAX
+#define SCENE_ALIVE 1
+#define SCENE_DIRTY 2
+
+typedef struct {
+    uint32_t index;
+    uint32_t generation;
+} SceneHandle;
+
+typedef struct {
+    uint32_t len;
+    uint32_t capacity;
+
+    // local transform. Scale is uniform, so world transforms compose without shear and are stored the same way
+    vec3 *position;
+    quaternion *orientation;
+    float *scale;
+    vec3 *world_position;
+    quaternion *world_orientation;
+    float *world_scale;
+    // bounding spheres, xyz is the center and w the radius
+    vec4 *local_bounds;
+    vec4 *world_bounds;
+
+    uint32_t *parent;
+    uint32_t *first_child;
+    uint32_t *next_sibling;
+    uint32_t *prev_sibling;
+    // whatever the owner maps nodes to(instance slot for example), SCENE_NONE if nothing
+    uint32_t *user;
+    uint32_t *generation;
+    uint8_t *flags;
+
+    uint32_t *free_nodes;
+    uint32_t free_len;
+
+    // nodes that were set since the last update, each is listed once
+    uint32_t *dirty;
+    uint32_t dirty_len;
+    // nodes whose world transform was recomputed by the last update
+    uint32_t *changed;
+    uint32_t changed_len;
+} Scene;
+
+
+void sceneGrow(Scene *scene) {
+    uint32_t capacity = scene->capacity == 0 ? 64 : scene->capacity * 2;
+
+    bool ok = true;
+#define SCENE_GROW(field) \
+    do { \
+        void *grown = realloc(scene->field, capacity * sizeof(*scene->field)); \
+        ok = ok && grown != NULL; \
+        scene->field = grown != NULL ? grown : scene->field; \
+    } while (0)
+
+    SCENE_GROW(position);
+    SCENE_GROW(orientation);
+    SCENE_GROW(scale);
+    SCENE_GROW(world_position);
+    SCENE_GROW(world_orientation);
+    SCENE_GROW(world_scale);
+    SCENE_GROW(local_bounds);
+    SCENE_GROW(world_bounds);
+    SCENE_GROW(parent);
+    SCENE_GROW(first_child);
+    SCENE_GROW(next_sibling);
+    SCENE_GROW(prev_sibling);
+    SCENE_GROW(user);
+    SCENE_GROW(generation);
+    SCENE_GROW(flags);
+    SCENE_GROW(free_nodes);
+    SCENE_GROW(dirty);
+    SCENE_GROW(changed);
+#undef SCENE_GROW
+
+    if (!ok) {
+        fprintf(stderr, "ERROR: failed to allocate memory for scene");
+        exit(1);
+    }
+    // generations start here and are never reset, a reused slot keeps counting
+    memset(&scene->generation[scene->capacity], 0, (capacity - scene->capacity) * sizeof(*scene->generation));
+    memset(&scene->flags[scene->capacity], 0, (capacity - scene->capacity) * sizeof(*scene->flags));
+    scene->capacity = capacity;
+}
+
+void sceneFree(Scene *scene) {
+    free(scene->position);
+    free(scene->orientation);
+    free(scene->scale);
+    free(scene->world_position);
+    free(scene->world_orientation);
+    free(scene->world_scale);
+    free(scene->local_bounds);
+    free(scene->world_bounds);
+    free(scene->parent);
+    free(scene->first_child);
+    free(scene->next_sibling);
+    free(scene->prev_sibling);
+    free(scene->user);
+    free(scene->generation);
+    free(scene->flags);
+    free(scene->free_nodes);
+    free(scene->dirty);
+    free(scene->changed);
+    *scene = (Scene){0};
+}
+
+/* Destroys every node, memory is kept. Generations go on, so old handles stay invalid */
+void sceneClear(Scene *scene) {
+    for (uint32_t i=0; i<scene->len; ++i) {
+        scene->generation[i] += 1;
+        // dirty list is dropped below, so no slot is in it anymore
+        scene->flags[i] = 0;
+    }
+    scene->len = 0;
+    scene->free_len = 0;
+    scene->dirty_len = 0;
+    scene->changed_len = 0;
+}
+
+
+bool sceneValid(const Scene *scene, SceneHandle handle) {
+    return handle.index < scene->len &&
+           (scene->flags[handle.index] & SCENE_ALIVE) &&
+           scene->generation[handle.index] == handle.generation;
+}
+
+uint32_t sceneIndex(const Scene *scene, SceneHandle handle) {
+    if (!sceneValid(scene, handle)) {
+        fprintf(stderr, "ERROR: stale scene handle(index: %u, generation: %u)", handle.index, handle.generation);
+        exit(1);
+    }
+    return handle.index;
+}
+
+
+void sceneMarkDirty(Scene *scene, uint32_t node) {
+    if (!(scene->flags[node] & SCENE_DIRTY)) {
+        scene->flags[node] |= SCENE_DIRTY;
+        scene->dirty[scene->dirty_len++] = node;
+    }
+}
+
+
+/* parent can be a null handle({SCENE_NONE, 0}) for a root. local_bounds is in the node's own space */
+SceneHandle sceneCreateNode(Scene *scene, SceneHandle parent, vec3 position, quaternion orientation, float scale, vec4 local_bounds, uint32_t user) {
+    uint32_t parent_index = parent.index == SCENE_NONE ? SCENE_NONE : sceneIndex(scene, parent);
+
+    uint32_t node;
+    if (scene->free_len > 0) {
+        node = scene->free_nodes[--scene->free_len];
+    } else {
+        if (scene->len == scene->capacity) {
+            sceneGrow(scene);
+        }
+        node = scene->len++;
+    }
+
+    scene->position[node] = position;
+    scene->orientation[node] = orientation;
+    scene->scale[node] = scale;
+    scene->local_bounds[node] = local_bounds;
+    scene->user[node] = user;
+    // a slot destroyed since the last update may still be in the dirty list, it must not be listed twice
+    scene->flags[node] = SCENE_ALIVE | (scene->flags[node] & SCENE_DIRTY);
+
+    scene->parent[node] = parent_index;
+    scene->first_child[node] = SCENE_NONE;
+    scene->prev_sibling[node] = SCENE_NONE;
+    scene->next_sibling[node] = SCENE_NONE;
+    if (parent_index != SCENE_NONE) {
+        uint32_t first = scene->first_child[parent_index];
+        scene->next_sibling[node] = first;
+        if (first != SCENE_NONE) {
+            scene->prev_sibling[first] = node;
+        }
+        scene->first_child[parent_index] = node;
+    }
+
+    sceneMarkDirty(scene, node);
+    return (SceneHandle){node, scene->generation[node]};
+}
+
+
+/* Destroys the node together with its subtree */
+void sceneDestroyNode(Scene *scene, SceneHandle handle) {
+    uint32_t node = sceneIndex(scene, handle);
+
+    uint32_t parent = scene->parent[node];
+    uint32_t prev = scene->prev_sibling[node];
+    uint32_t next = scene->next_sibling[node];
+    if (prev != SCENE_NONE) {
+        scene->next_sibling[prev] = next;
+    } else if (parent != SCENE_NONE) {
+        scene->first_child[parent] = next;
+    }
+    if (next != SCENE_NONE) {
+        scene->prev_sibling[next] = prev;
+    }
+
+    // subtree is walked through first_child/next_sibling, slots are freed on the way back up
+    uint32_t current = node;
+    while (true) {
+        while (scene->first_child[current] != SCENE_NONE) {
+            current = scene->first_child[current];
+        }
+
+        uint32_t up = current == node ? SCENE_NONE : scene->parent[current];
+        if (up != SCENE_NONE) {
+            scene->first_child[up] = scene->next_sibling[current];
+        }
+
+        // a dirty slot stays in the dirty list, sceneUpdate skips dead nodes
+        scene->flags[current] &= SCENE_DIRTY;
+        scene->generation[current] += 1;
+        scene->free_nodes[scene->free_len++] = current;
+
+        if (current == node) {
+            break;
+        }
+        current = up;
+    }
+}
+
+
+void sceneSetTransform(Scene *scene, SceneHandle handle, vec3 position, quaternion orientation, float scale) {
+    uint32_t node = sceneIndex(scene, handle);
+    scene->position[node] = position;
+    scene->orientation[node] = orientation;
+    scene->scale[node] = scale;
+    sceneMarkDirty(scene, node);
+}
+
+void sceneSetPosition(Scene *scene, SceneHandle handle, vec3 position) {
+    uint32_t node = sceneIndex(scene, handle);
+    scene->position[node] = position;
+    sceneMarkDirty(scene, node);
+}
+
+void sceneSetOrientation(Scene *scene, SceneHandle handle, quaternion orientation) {
+    uint32_t node = sceneIndex(scene, handle);
+    scene->orientation[node] = orientation;
+    sceneMarkDirty(scene, node);
+}
+
+quaternion sceneOrientation(const Scene *scene, SceneHandle handle) {
+    return scene->orientation[sceneIndex(scene, handle)];
+}
+
+
+void sceneComputeWorld(Scene *scene, uint32_t node) {
+    uint32_t parent = scene->parent[node];
+    if (parent == SCENE_NONE) {
+        scene->world_position[node] = scene->position[node];
+        scene->world_orientation[node] = scene->orientation[node];
+        scene->world_scale[node] = scene->scale[node];
+    } else {
+        quaternion parent_orientation = scene->world_orientation[parent];
+        float parent_scale = scene->world_scale[parent];
+        vec3 offset = vec_rotate_by_quat(vec3_scale(scene->position[node], parent_scale), parent_orientation);
+        scene->world_position[node] = vec3_add(scene->world_position[parent], offset);
+        scene->world_orientation[node] = quat_mult(parent_orientation, scene->orientation[node]);
+        scene->world_scale[node] = parent_scale * scene->scale[node];
+    }
+
+    vec4 bounds = scene->local_bounds[node];
+    float world_scale = scene->world_scale[node];
+    vec3 center = vec_rotate_by_quat(vec3_scale((vec3){bounds.x, bounds.y, bounds.z}, world_scale), scene->world_orientation[node]);
+    center = vec3_add(center, scene->world_position[node]);
+    scene->world_bounds[node] = (vec4){center.x, center.y, center.z, bounds.w * world_scale};
+
+    scene->flags[node] &= ~SCENE_DIRTY;
+    scene->changed[scene->changed_len++] = node;
+}
+
+
+bool sceneHasDirtyAncestor(const Scene *scene, uint32_t node) {
+    for (uint32_t p=scene->parent[node]; p!=SCENE_NONE; p=scene->parent[p]) {
+        if (scene->flags[p] & SCENE_DIRTY) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/* Recomputes world transforms and bounds below every dirty node, changed lists every node that was recomputed */
+void sceneUpdate(Scene *scene) {
+    scene->changed_len = 0;
+
+    for (uint32_t i=0; i<scene->dirty_len; ++i) {
+        uint32_t root = scene->dirty[i];
+        if (!(scene->flags[root] & SCENE_ALIVE)) {
+            scene->flags[root] = 0;
+            continue;
+        }
+        // already recomputed as a part of another subtree, or will be
+        if (!(scene->flags[root] & SCENE_DIRTY) || sceneHasDirtyAncestor(scene, root)) {
+            continue;
+        }
+
+        // pre order walk, parents are always computed before children
+        sceneComputeWorld(scene, root);
+        uint32_t current = scene->first_child[root];
+        while (current != SCENE_NONE) {
+            sceneComputeWorld(scene, current);
+            if (scene->first_child[current] != SCENE_NONE) {
+                current = scene->first_child[current];
+                continue;
+            }
+            while (current != root && scene->next_sibling[current] == SCENE_NONE) {
+                current = scene->parent[current];
+            }
+            current = current == root ? SCENE_NONE : scene->next_sibling[current];
+        }
+    }
+    scene->dirty_len = 0;
+}
+
+#endif /* SCENE_H */
@@ -0,0 +1,180 @@
+/*
+ * Development helper: a thread polls modification times of shader sources and recompiles changed ones with glslc.
+ * What happens with the fresh SPIR-V is up to the callback, it runs on the watcher thread too.
+ * Polling rather than inotify, so the same code works on windows
+ */
+
+#ifndef SHADER_WATCH_H
+#define SHADER_WATCH_H
+
+#include "stdint.h"
+#include "stdlib.h"
+#include "stdio.h"
+#include "stdbool.h"
+#include "stdatomic.h"
+#include "pthread.h"
+#include "time.h"
+#ifndef _WIN32
+#include "sys/stat.h"
+#endif
+
+#include "file_helpers.h"
+#include "trace.h"
+
+#define SHADER_WATCH_MAX 16
+#define SHADER_WATCH_POLL_MS 250
+
+typedef struct {
+    const char *source;
+    const char *output;
+    const char *options; // extra glslc arguments, never NULL
+    uint32_t id;
+    // last seen, a change in either is an edit. Nanoseconds, a whole second misses quick saves that keep the size
+    uint64_t mtime;
+    uint64_t size;
+} ShaderWatchEntry;
+
+/* spv_path has the new code. True keeps it, it then replaces output so the next start picks it up too */
+typedef bool (*ShaderChanged)(void *user, uint32_t id, const char *spv_path);
+/* False while the owner can't take another change, edits wait for it instead of being dropped */
+typedef bool (*ShaderWatchReady)(void *user);
+
+typedef struct {
+    pthread_t thread;
+    _Atomic bool quit;
+    ShaderWatchEntry entries[SHADER_WATCH_MAX];
+    uint32_t len;
+    ShaderChanged changed;
+    ShaderWatchReady ready;
+    void *user;
+} ShaderWatcher;
+
+
+/* Modification time in nanoseconds and size, false while the file is missing */
+bool shaderWatchStat(const char *path, uint64_t *mtime, uint64_t *size) {
+#ifdef _WIN32
+    // mingw stat() only has seconds, write time is in 100ns units
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &data)) {
+        return false;
+    }
+    *mtime = (((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime) * 100;
+    *size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+#else
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return false;
+    }
+    *mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ull + (uint64_t)st.st_mtim.tv_nsec;
+    *size = (uint64_t)st.st_size;
+#endif
+    return true;
+}
+
+
+ShaderWatcher *shaderWatcherCreate(ShaderChanged changed, ShaderWatchReady ready, void *user) {
+    ShaderWatcher *watcher = calloc(1, sizeof(ShaderWatcher));
+    if (watcher == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate memory for shader watcher");
+        exit(1);
+    }
+    atomic_init(&watcher->quit, false);
+    watcher->changed = changed;
+    watcher->ready = ready;
+    watcher->user = user;
+    return watcher;
+}
+
+
+/* Before shaderWatcherStart. Edits made before this are not picked up. options can be NULL */
+void shaderWatcherAdd(ShaderWatcher *watcher, const char *source, const char *output, const char *options, uint32_t id) {
+    if (watcher->len == SHADER_WATCH_MAX) {
+        fprintf(stderr, "ERROR: too many watched shaders(%u)", SHADER_WATCH_MAX);
+        exit(1);
+    }
+
+    ShaderWatchEntry entry = {source, output, options != NULL ? options : "", id, 0, 0};
+    shaderWatchStat(source, &entry.mtime, &entry.size);
+    watcher->entries[watcher->len++] = entry;
+}
+
+
+/* glslc writes next to the output, the output itself is only replaced once the callback accepted the code */
+bool shaderWatchCompile(ShaderWatcher *watcher, ShaderWatchEntry entry) {
+    char spv_path[1024];
+    char command[2048];
+    snprintf(spv_path, sizeof spv_path, "%s.reload", entry.output);
+    snprintf(command, sizeof command, "glslc %s \"%s\" -o \"%s\"", entry.options, entry.source, spv_path);
+
+    TRACE_BEGIN(zone, "compile shader");
+    int status = system(command);
+    TRACE_END(zone);
+    if (status != 0) {
+        // glslc already printed why
+        fprintf(stderr, "INFO: %s failed to compile, keeping the old shader\n", entry.source);
+        remove(spv_path);
+        return false;
+    }
+
+    if (!watcher->changed(watcher->user, entry.id, spv_path)) {
+        remove(spv_path);
+        return false;
+    }
+    return replaceFile(spv_path, entry.output);
+}
+
+
+void *shaderWatcherMain(void *arg) {
+    ShaderWatcher *watcher = arg;
+    traceThreadName("shader watcher");
+
+    while (!atomic_load(&watcher->quit)) {
+        struct timespec ts = {0, SHADER_WATCH_POLL_MS * 1000000L};
+        nanosleep(&ts, NULL);
+
+        if (watcher->ready != NULL && !watcher->ready(watcher->user)) {
+            continue;
+        }
+
+        for (uint32_t i=0; i<watcher->len; ++i) {
+            ShaderWatchEntry *entry = &watcher->entries[i];
+            uint64_t mtime;
+            uint64_t size;
+            // editors may replace the file instead of writing it, it can be briefly missing
+            if (!shaderWatchStat(entry->source, &mtime, &size) || (mtime == entry->mtime && size == entry->size)) {
+                continue;
+            }
+
+            entry->mtime = mtime;
+            entry->size = size;
+            // one change per poll, the owner has to be ready again before the next one
+            if (shaderWatchCompile(watcher, *entry)) {
+                break;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+void shaderWatcherStart(ShaderWatcher *watcher) {
+    if (pthread_create(&watcher->thread, NULL, shaderWatcherMain, watcher) != 0) {
+        fprintf(stderr, "ERROR: failed to create shader watcher thread");
+        exit(1);
+    }
+    fprintf(stderr, "INFO: Watching %u shaders for changes\n", watcher->len);
+}
+
+
+void shaderWatcherStop(ShaderWatcher *watcher) {
+    if (watcher == NULL) {
+        return;
+    }
+
+    atomic_store(&watcher->quit, true);
+    pthread_join(watcher->thread, NULL);
+    free(watcher);
+}
+
+#endif /* SHADER_WATCH_H */
@@ -0,0 +1,187 @@
+/*
+ * Fixed timestep simulation on its own thread.
+ * Input comes in through a single producer single consumer queue, state goes out through a triple buffer,
+ * so neither side ever waits for the other. What is simulated is up to the tick callback
+ */
+
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include "stdint.h"
+#include "stdlib.h"
+#include "stdio.h"
+#include "stdbool.h"
+#include "stdatomic.h"
+#include "pthread.h"
+#include "time.h"
+
+#include "benchmark.h"
+#include "misc.h"
+#include "trace.h"
+
+#define INPUT_QUEUE_CAPACITY 256 // power of two
+#define SIMULATION_MAX_CATCH_UP 0.25 // after a longer stall ticks are dropped instead of replayed all at once
+
+/* Input deltas, one producer(glfw callbacks) and one consumer(simulation) */
+typedef struct {
+    _Atomic uint32_t head; // next to read, written by the consumer
+    _Atomic uint32_t tail; // next to write, written by the producer
+    FrameInput events[INPUT_QUEUE_CAPACITY];
+} InputQueue;
+
+/* False when full, the event is dropped */
+bool inputQueuePush(InputQueue *queue, FrameInput event) {
+    uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    if (tail - head >= INPUT_QUEUE_CAPACITY) {
+        return false;
+    }
+
+    queue->events[tail % INPUT_QUEUE_CAPACITY] = event;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+bool inputQueuePop(InputQueue *queue, FrameInput *out) {
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    if (head == tail) {
+        return false;
+    }
+
+    *out = queue->events[head % INPUT_QUEUE_CAPACITY];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return true;
+}
+
+/* Sums every queued delta into one */
+FrameInput inputQueueDrain(InputQueue *queue) {
+    FrameInput sum = {0};
+    FrameInput event;
+    while (inputQueuePop(queue, &event)) {
+        sum.camera_pitch += event.camera_pitch;
+        sum.camera_yaw += event.camera_yaw;
+        sum.camera_forward += event.camera_forward;
+        sum.model_pitch += event.model_pitch;
+        sum.model_yaw += event.model_yaw;
+    }
+    return sum;
+}
+
+
+/*
+ * Indices of three slots the owner keeps: writer fills back, reader looks at front, middle is handed over.
+ * Both swaps are a single exchange, TRIPLE_BUFFER_FRESH marks a middle the reader hasn't taken yet
+ */
+#define TRIPLE_BUFFER_FRESH 4u
+
+typedef struct {
+    _Atomic uint32_t middle;
+    uint32_t back;  // writer only
+    uint32_t front; // reader only
+} TripleBuffer;
+
+TripleBuffer tripleBufferCreate() {
+    TripleBuffer buffer = {0};
+    atomic_init(&buffer.middle, 1);
+    buffer.back = 2;
+    buffer.front = 0;
+    return buffer;
+}
+
+/* Writer is done with back, returns the slot to write next */
+uint32_t tripleBufferPublish(TripleBuffer *buffer) {
+    uint32_t old = atomic_exchange_explicit(&buffer->middle, buffer->back | TRIPLE_BUFFER_FRESH, memory_order_acq_rel);
+    buffer->back = old & ~TRIPLE_BUFFER_FRESH;
+    return buffer->back;
+}
+
+/* Slot with the latest published data, fresh is set if it changed since the last call */
+uint32_t tripleBufferAcquire(TripleBuffer *buffer, bool *fresh) {
+    *fresh = false;
+    if (atomic_load_explicit(&buffer->middle, memory_order_relaxed) & TRIPLE_BUFFER_FRESH) {
+        uint32_t old = atomic_exchange_explicit(&buffer->middle, buffer->front, memory_order_acq_rel);
+        buffer->front = old & ~TRIPLE_BUFFER_FRESH;
+        *fresh = true;
+    }
+    return buffer->front;
+}
+
+
+/* time is when the tick is scheduled, not when it runs, so consumers see evenly spaced states */
+typedef void (*SimulationTick)(void *user, uint64_t tick, double time);
+
+typedef struct {
+    pthread_t thread;
+    _Atomic bool quit;
+    double dt;
+    SimulationTick tick;
+    void *user;
+} SimulationThread;
+
+
+void *simulationMain(void *arg) {
+    SimulationThread *simulation = arg;
+    traceThreadName("simulation");
+
+    uint64_t tick = 0;
+    double next_tick = monotonicSeconds();
+    while (!atomic_load(&simulation->quit)) {
+        double now = monotonicSeconds();
+        if (now - next_tick > SIMULATION_MAX_CATCH_UP) {
+            next_tick = now;
+        }
+
+        while (next_tick <= now) {
+            TRACE_BEGIN(zone, "tick");
+            simulation->tick(simulation->user, tick, next_tick);
+            TRACE_END(zone);
+            tick += 1;
+            next_tick += simulation->dt;
+        }
+
+        double sleep_time = next_tick - monotonicSeconds();
+        if (sleep_time > 0.0) {
+            struct timespec ts;
+            ts.tv_sec = (time_t)sleep_time;
+            ts.tv_nsec = (long)((sleep_time - ts.tv_sec) * 1e9);
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+
+SimulationThread *simulationStart(double rate, SimulationTick tick, void *user) {
+    SimulationThread *simulation = calloc(1, sizeof(SimulationThread));
+    if (simulation == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate memory for simulation");
+        exit(1);
+    }
+    atomic_init(&simulation->quit, false);
+    simulation->dt = 1.0 / rate;
+    simulation->tick = tick;
+    simulation->user = user;
+
+    if (pthread_create(&simulation->thread, NULL, simulationMain, simulation) != 0) {
+        fprintf(stderr, "ERROR: failed to create simulation thread");
+        exit(1);
+    }
+
+    fprintf(stderr, "INFO: Simulation thread started(%.1f ticks per second)\n", rate);
+    return simulation;
+}
+
+
+void simulationStop(SimulationThread *simulation) {
+    if (simulation == NULL) {
+        return;
+    }
+
+    atomic_store(&simulation->quit, true);
+    pthread_join(simulation->thread, NULL);
+    free(simulation);
+}
+
+#endif /* SIMULATION_H */
@@ -0,0 +1,194 @@
+/*
+ * Cpu instrumentation zones, exported as chrome trace json(chrome://tracing, ui.perfetto.dev).
+ * Every thread writes into its own ring, so recording takes no locks. Zones are compiled out in RELEASE_MODE
+ * unless TRACE_IN_RELEASE is defined
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "stdint.h"
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "stdbool.h"
+#include "stdatomic.h"
+#include "time.h"
+
+#include "file_helpers.h"
+#include "misc.h"
+
+#if !defined(RELEASE_MODE) || defined(TRACE_IN_RELEASE)
+#define TRACE_ENABLED 1
+#else
+#define TRACE_ENABLED 0
+#endif
+
+#define TRACE_MAX_THREADS 32
+#define TRACE_RING_EVENTS 8192 // per thread, oldest events are overwritten
+
+typedef struct {
+    const char *name;
+    uint64_t begin_ns;
+    uint64_t end_ns;
+} TraceEvent;
+
+typedef struct {
+    const char *thread_name;
+    // only the owning thread writes, total number of events ever written
+    _Atomic uint64_t written;
+    TraceEvent events[TRACE_RING_EVENTS];
+} TraceRing;
+
+typedef struct {
+    const char *name;
+    uint64_t begin_ns;
+} TraceZone;
+
+static TraceRing *trace_rings[TRACE_MAX_THREADS];
+static _Atomic uint32_t trace_ring_count;
+static _Thread_local TraceRing *trace_thread_ring;
+static uint64_t trace_epoch_ns;
+
+
+/* Timestamps in the trace are relative to this call, call it first thing in main */
+void traceInit() {
+    trace_epoch_ns = monotonicNs();
+}
+
+
+/* Ring of the calling thread, registered on first use. NULL when all TRACE_MAX_THREADS rings are taken */
+TraceRing *traceThreadRing() {
+    if (trace_thread_ring != NULL) {
+        return trace_thread_ring;
+    }
+
+    uint32_t slot = atomic_fetch_add(&trace_ring_count, 1);
+    if (slot >= TRACE_MAX_THREADS) {
+        return NULL;
+    }
+
+    TraceRing *ring = calloc(1, sizeof(TraceRing));
+    if (ring == NULL) {
+        return NULL;
+    }
+    atomic_init(&ring->written, 0);
+    trace_rings[slot] = ring;
+    trace_thread_ring = ring;
+    return ring;
+}
+
+
+/* Name has to outlive the trace, it is written unescaped so use plain literals */
+void traceThreadName(const char *name) {
+    TraceRing *ring = traceThreadRing();
+    if (ring != NULL) {
+        ring->thread_name = name;
+    }
+}
+
+
+TraceZone traceBegin(const char *name) {
+    return (TraceZone){name, monotonicNs()};
+}
+
+
+void traceEnd(TraceZone zone) {
+    TraceRing *ring = traceThreadRing();
+    if (ring == NULL) {
+        return;
+    }
+
+    uint64_t written = atomic_load_explicit(&ring->written, memory_order_relaxed);
+    ring->events[written % TRACE_RING_EVENTS] = (TraceEvent){zone.name, zone.begin_ns, monotonicNs()};
+    atomic_store_explicit(&ring->written, written + 1, memory_order_release);
+}
+
+
+/* Other threads must not trace anymore */
+void traceFree() {
+    uint32_t ring_count = atomic_load(&trace_ring_count);
+    ring_count = ring_count < TRACE_MAX_THREADS ? ring_count : TRACE_MAX_THREADS;
+    for (uint32_t i=0; i<ring_count; ++i) {
+        free(trace_rings[i]);
+        trace_rings[i] = NULL;
+    }
+    atomic_store(&trace_ring_count, 0);
+    trace_thread_ring = NULL;
+}
+
+
+#if TRACE_ENABLED
+#define TRACE_BEGIN(zone, name) TraceZone zone = traceBegin(name)
+#define TRACE_END(zone) traceEnd(zone)
+#else
+#define TRACE_BEGIN(zone, name) do {} while (0)
+#define TRACE_END(zone) do {} while (0)
+#endif
+
+
+/*
+ * Writes the last TRACE_RING_EVENTS events of every thread.
+ * Events that threads overwrite while this runs can come out torn, call it when the other threads are idle
+ */
+bool traceWriteChromeJson(const char *filename) {
+    size_t capacity = 1024;
+    size_t len = 0;
+    char *json = malloc(capacity);
+    if (json == NULL) {
+        fprintf(stderr, "%s: failed to allocate memory\n", __FUNCTION__);
+        return false;
+    }
+
+// every entry is far below 512 bytes, names are not checked though
+#define TRACE_APPEND(...) \
+    do { \
+        if (capacity - len < 512) { \
+            capacity *= 2; \
+            char *grown = realloc(json, capacity); \
+            if (grown == NULL) { \
+                fprintf(stderr, "%s: failed to allocate memory\n", __FUNCTION__); \
+                free(json); \
+                return false; \
+            } \
+            json = grown; \
+        } \
+        len += snprintf(json + len, capacity - len, __VA_ARGS__); \
+    } while (0)
+
+    TRACE_APPEND("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+
+    uint32_t ring_count = atomic_load(&trace_ring_count);
+    ring_count = ring_count < TRACE_MAX_THREADS ? ring_count : TRACE_MAX_THREADS;
+    for (uint32_t tid=0; tid<ring_count; ++tid) {
+        TraceRing *ring = trace_rings[tid];
+        if (ring == NULL) {
+            continue;
+        }
+
+        if (ring->thread_name != NULL) {
+            TRACE_APPEND("%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", tid, ring->thread_name);
+            first = false;
+        }
+
+        uint64_t written = atomic_load_explicit(&ring->written, memory_order_acquire);
+        uint64_t begin = written > TRACE_RING_EVENTS ? written - TRACE_RING_EVENTS : 0;
+        for (uint64_t i=begin; i<written; ++i) {
+            TraceEvent event = ring->events[i % TRACE_RING_EVENTS];
+            double ts_us = (double)(event.begin_ns - trace_epoch_ns) / 1000.0;
+            double dur_us = (double)(event.end_ns - event.begin_ns) / 1000.0;
+            TRACE_APPEND("%s{\"ph\":\"X\",\"name\":\"%s\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", first ? "" : ",\n", event.name, tid, ts_us, dur_us);
+            first = false;
+        }
+    }
+
+    TRACE_APPEND("\n]}\n");
+#undef TRACE_APPEND
+
+    bool result = writeEntireFileAtomic(filename, json, len);
+    free(json);
+    return result;
+}
+
+#endif /* TRACE_H */
@@ -0,0 +1,145 @@
+#version 450
+
+// FXAA: finds edges by luma contrast, walks along them and resamples across the edge
+
+#define EDGE_THRESHOLD_MIN 0.0312
+#define EDGE_THRESHOLD_MAX 0.125
+#define SUBPIXEL_QUALITY 0.75
+#define ITERATIONS 12
+
+layout(binding = 0) uniform sampler2D scene;
+
+layout(push_constant) uniform PushConstants {
+    vec2 inverseSize;
+    vec2 uvScale; // with dynamic resolution only the top left part of the scene is rendered
+} push;
+
+layout(location = 0) in vec2 screenUv;
+layout(location = 0) out vec4 outColor;
+
+const float QUALITY[ITERATIONS] = float[](1.0, 1.0, 1.0, 1.0, 1.0, 1.5, 2.0, 2.0, 2.0, 2.0, 4.0, 8.0);
+
+float luma(vec3 color) {
+    return sqrt(dot(color, vec3(0.299, 0.587, 0.114)));
+}
+
+// edge walk and neighbours stay inside the rendered region, past it is whatever a larger frame left there
+vec2 rendered(vec2 at) {
+    return clamp(at, 0.5 * push.inverseSize, push.uvScale - 0.5 * push.inverseSize);
+}
+
+float lumaAt(vec2 at) {
+    return luma(texture(scene, rendered(at)).rgb);
+}
+
+float lumaNear(vec2 at, vec2 texels) {
+    return lumaAt(at + texels * push.inverseSize);
+}
+
+void main() {
+    vec2 uv = min(screenUv * push.uvScale, push.uvScale - 0.5 * push.inverseSize);
+    vec3 center = texture(scene, uv).rgb;
+    float lumaC = luma(center);
+    float lumaD = lumaNear(uv, vec2( 0, -1));
+    float lumaU = lumaNear(uv, vec2( 0,  1));
+    float lumaL = lumaNear(uv, vec2(-1,  0));
+    float lumaR = lumaNear(uv, vec2( 1,  0));
+
+    float lumaMin = min(lumaC, min(min(lumaD, lumaU), min(lumaL, lumaR)));
+    float lumaMax = max(lumaC, max(max(lumaD, lumaU), max(lumaL, lumaR)));
+    float lumaRange = lumaMax - lumaMin;
+
+    // not an edge, most pixels exit here
+    if (lumaRange < max(EDGE_THRESHOLD_MIN, lumaMax * EDGE_THRESHOLD_MAX)) {
+        outColor = vec4(center, 1.0);
+        return;
+    }
+
+    float lumaDL = lumaNear(uv, vec2(-1, -1));
+    float lumaUR = lumaNear(uv, vec2( 1,  1));
+    float lumaUL = lumaNear(uv, vec2(-1,  1));
+    float lumaDR = lumaNear(uv, vec2( 1, -1));
+
+    float lumaDU = lumaD + lumaU;
+    float lumaLR = lumaL + lumaR;
+    float lumaLeftCorners = lumaDL + lumaUL;
+    float lumaDownCorners = lumaDL + lumaDR;
+    float lumaRightCorners = lumaDR + lumaUR;
+    float lumaUpCorners = lumaUR + lumaUL;
+
+    float edgeHorizontal = abs(-2.0 * lumaL + lumaLeftCorners) + abs(-2.0 * lumaC + lumaDU) * 2.0 + abs(-2.0 * lumaR + lumaRightCorners);
+    float edgeVertical = abs(-2.0 * lumaU + lumaUpCorners) + abs(-2.0 * lumaC + lumaLR) * 2.0 + abs(-2.0 * lumaD + lumaDownCorners);
+    bool isHorizontal = edgeHorizontal >= edgeVertical;
+
+    // which side of the pixel the edge is on
+    float luma1 = isHorizontal ? lumaD : lumaL;
+    float luma2 = isHorizontal ? lumaU : lumaR;
+    float gradient1 = luma1 - lumaC;
+    float gradient2 = luma2 - lumaC;
+    bool is1Steepest = abs(gradient1) >= abs(gradient2);
+    float gradientScaled = 0.25 * max(abs(gradient1), abs(gradient2));
+
+    float stepLength = isHorizontal ? push.inverseSize.y : push.inverseSize.x;
+    float lumaLocalAverage = 0.0;
+    if (is1Steepest) {
+        stepLength = -stepLength;
+        lumaLocalAverage = 0.5 * (luma1 + lumaC);
+    } else {
+        lumaLocalAverage = 0.5 * (luma2 + lumaC);
+    }
+
+    vec2 edgeUv = uv;
+    if (isHorizontal) {
+        edgeUv.y += stepLength * 0.5;
+    } else {
+        edgeUv.x += stepLength * 0.5;
+    }
+
+    // walk both ways along the edge until luma changes enough
+    vec2 offset = isHorizontal ? vec2(push.inverseSize.x, 0.0) : vec2(0.0, push.inverseSize.y);
+    vec2 uv1 = edgeUv - offset;
+    vec2 uv2 = edgeUv + offset;
+    float lumaEnd1 = lumaAt(uv1) - lumaLocalAverage;
+    float lumaEnd2 = lumaAt(uv2) - lumaLocalAverage;
+    bool reached1 = abs(lumaEnd1) >= gradientScaled;
+    bool reached2 = abs(lumaEnd2) >= gradientScaled;
+
+    for (int i = 0; i < ITERATIONS && !(reached1 && reached2); ++i) {
+        if (!reached1) {
+            uv1 -= offset * QUALITY[i];
+            lumaEnd1 = lumaAt(uv1) - lumaLocalAverage;
+            reached1 = abs(lumaEnd1) >= gradientScaled;
+        }
+        if (!reached2) {
+            uv2 += offset * QUALITY[i];
+            lumaEnd2 = lumaAt(uv2) - lumaLocalAverage;
+            reached2 = abs(lumaEnd2) >= gradientScaled;
+        }
+    }
+
+    float distance1 = isHorizontal ? uv.x - uv1.x : uv.y - uv1.y;
+    float distance2 = isHorizontal ? uv2.x - uv.x : uv2.y - uv.y;
+    bool isDirection1 = distance1 < distance2;
+    float distanceFinal = min(distance1, distance2);
+    float edgeLength = distance1 + distance2;
+    float pixelOffset = -distanceFinal / edgeLength + 0.5;
+
+    // only move towards the end whose luma variation matches the center
+    bool isLumaCenterSmaller = lumaC < lumaLocalAverage;
+    bool correctVariation = ((isDirection1 ? lumaEnd1 : lumaEnd2) < 0.0) != isLumaCenterSmaller;
+    float finalOffset = correctVariation ? pixelOffset : 0.0;
+
+    // subpixel aliasing, thin lines and single pixel details
+    float lumaAverage = (1.0 / 12.0) * (2.0 * (lumaDU + lumaLR) + lumaLeftCorners + lumaRightCorners);
+    float subpixelOffset1 = clamp(abs(lumaAverage - lumaC) / lumaRange, 0.0, 1.0);
+    float subpixelOffset2 = (-2.0 * subpixelOffset1 + 3.0) * subpixelOffset1 * subpixelOffset1;
+    finalOffset = max(finalOffset, subpixelOffset2 * subpixelOffset2 * SUBPIXEL_QUALITY);
+
+    vec2 finalUv = uv;
+    if (isHorizontal) {
+        finalUv.y += finalOffset * stepLength;
+    } else {
+        finalUv.x += finalOffset * stepLength;
+    }
+    outColor = vec4(texture(scene, rendered(finalUv)).rgb, 1.0);
+}
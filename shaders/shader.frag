@@ -1,8 +1,21 @@
 #version 450
 
+// 0 vertex colors, 1 depth, 2 flat white, 3 see-through. Set by pipeline variants, the branches are compiled out
+layout(constant_id = 0) const uint SHADING = 0;
+
 layout(location = 0) in vec3 fragColor;
 layout(location = 0) out vec4 outColor;
 
 void main() {
-    outColor = vec4(fragColor, 1);
+    if (SHADING == 1) {
+        // depth is packed close to 1, spread the near part out
+        float depth = 1.0 - pow(gl_FragCoord.z, 64.0);
+        outColor = vec4(depth, depth, depth, 1);
+    } else if (SHADING == 2) {
+        outColor = vec4(1, 1, 1, 1);
+    } else if (SHADING == 3) {
+        outColor = vec4(fragColor, 0.3);
+    } else {
+        outColor = vec4(fragColor, 1);
+    }
 }
@@ -1,17 +1,32 @@
 #version 450
 
 layout(binding = 0) uniform UniformBufferObject {
-    mat4 model;
     mat4 view;
     mat4 proj;
 } ubo;
 
+layout(binding = 1) uniform ObjectBufferObject {
+    vec4 tint;
+} object;
+
+layout(push_constant) uniform PushConstants {
+    mat4 model;
+} push;
+
 layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inColor;
+// per instance
+layout(location = 2) in vec4 inOrientation;
+layout(location = 3) in vec4 inPositionScale;
 
 layout(location = 0) out vec3 fragColor;
 
+vec3 rotate(vec3 v, vec4 q) {
+    return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
 void main() {
-    gl_Position = ubo.proj * ubo.view * ubo.model * vec4(inPosition, 1.0);
-    fragColor = inColor;
+    vec3 instancePosition = rotate(inPosition * inPositionScale.w, inOrientation) + inPositionScale.xyz;
+    gl_Position = ubo.proj * ubo.view * push.model * vec4(instancePosition, 1.0);
+    fragColor = inColor * object.tint.rgb;
 }
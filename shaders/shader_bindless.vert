@@ -0,0 +1,38 @@
+#version 450
+#extension GL_EXT_nonuniform_qualifier : require
+
+layout(set = 0, binding = 0) uniform UniformBufferObject {
+    mat4 view;
+    mat4 proj;
+} ubo;
+
+// bindless buffers table, object blocks are read from the object ring through it
+layout(set = 1, binding = 0) readonly buffer Blocks {
+    vec4 data[];
+} buffers[];
+
+layout(push_constant) uniform PushConstants {
+    mat4 model;
+    uint objects;
+    uint objectBlock;
+} push;
+
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec3 inColor;
+// per instance
+layout(location = 2) in vec4 inOrientation;
+layout(location = 3) in vec4 inPositionScale;
+
+layout(location = 0) out vec3 fragColor;
+
+vec3 rotate(vec3 v, vec4 q) {
+    return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
+void main() {
+    vec4 tint = buffers[push.objects].data[push.objectBlock];
+
+    vec3 instancePosition = rotate(inPosition * inPositionScale.w, inOrientation) + inPositionScale.xyz;
+    gl_Position = ubo.proj * ubo.view * push.model * vec4(instancePosition, 1.0);
+    fragColor = inColor * tint.rgb;
+}
@@ -0,0 +1,77 @@
+#version 450
+
+// must match MESHLET_MAX_VERTICES in meshlet.h
+#define MESHLET_MAX_VERTICES 64
+
+struct Meshlet {
+    vec4 sphere;
+    vec4 cone;
+    uint vertexOffset;
+    uint triangleOffset;
+    uint vertexCount;
+    uint triangleCount;
+};
+
+layout(set = 0, binding = 0) uniform UniformBufferObject {
+    mat4 view;
+    mat4 proj;
+} ubo;
+
+layout(set = 0, binding = 1) uniform ObjectBufferObject {
+    vec4 tint;
+} object;
+
+// PackedVertex, 3 words each
+layout(std430, set = 1, binding = 0) readonly buffer Vertices {
+    uint words[];
+} vertices;
+
+// InstanceData, orientation then position and scale
+layout(std430, set = 1, binding = 1) readonly buffer Instances {
+    vec4 data[];
+} instances;
+
+layout(std430, set = 1, binding = 2) readonly buffer Meshlets {
+    Meshlet meshlets[];
+};
+
+layout(std430, set = 1, binding = 3) readonly buffer MeshletVertices {
+    uint meshletVertices[];
+};
+
+layout(std430, set = 1, binding = 5) readonly buffer Clusters {
+    uvec2 clusters[];
+};
+
+layout(push_constant) uniform PushConstants {
+    mat4 model;
+    vec4 decodeMin;
+    vec4 decodeScale;
+} push;
+
+layout(location = 0) out vec3 fragColor;
+
+vec3 rotate(vec3 v, vec4 q) {
+    return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
+void main() {
+    // indices written by cluster_cull.comp: visible cluster times MESHLET_MAX_VERTICES plus meshlet local vertex
+    uvec2 cluster = clusters[gl_VertexIndex / MESHLET_MAX_VERTICES];
+    uint corner = gl_VertexIndex % MESHLET_MAX_VERTICES;
+    uint vertex = meshletVertices[meshlets[cluster.y].vertexOffset + corner];
+
+    uint base = vertex * 3;
+    uint xy = vertices.words[base];
+    uint z = vertices.words[base + 1];
+    vec3 quantized = vec3(xy & 0xffffu, xy >> 16, z & 0xffffu);
+    vec3 position = push.decodeMin.xyz + quantized * push.decodeScale.xyz;
+    vec3 color = unpackUnorm4x8(vertices.words[base + 2]).rgb;
+
+    vec4 orientation = instances.data[cluster.x * 2];
+    vec4 positionScale = instances.data[cluster.x * 2 + 1];
+
+    vec3 instancePosition = rotate(position * positionScale.w, orientation) + positionScale.xyz;
+    gl_Position = ubo.proj * ubo.view * push.model * vec4(instancePosition, 1.0);
+    fragColor = color * object.tint.rgb;
+}
@@ -0,0 +1,19 @@
+#version 450
+
+// Bilinear upscale of the rendered part of the scene to the whole swapchain image
+
+layout(binding = 0) uniform sampler2D scene;
+
+layout(push_constant) uniform PushConstants {
+    vec2 inverseSize;
+    vec2 uvScale;
+} push;
+
+layout(location = 0) in vec2 screenUv;
+layout(location = 0) out vec4 outColor;
+
+void main() {
+    // clamped half a texel in, so filtering doesn't pull in texels outside the rendered area
+    vec2 uv = min(screenUv * push.uvScale, push.uvScale - 0.5 * push.inverseSize);
+    outColor = vec4(texture(scene, uv).rgb, 1.0);
+}
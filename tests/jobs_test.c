@@ -0,0 +1,144 @@
+#include "stdio.h"
+#include "assert.h"
+
+#include "jobs.h"
+
+#define STEAL_JOBS 100000
+#define THIEVES 3
+#define FOR_COUNT 10000
+
+typedef struct {
+    JobDeque *deque;
+    _Atomic uint32_t *taken;
+    _Atomic bool *done;
+} Thief;
+
+void *thiefMain(void *arg) {
+    Thief *thief = arg;
+    while (!atomic_load(thief->done)) {
+        Job job;
+        if (jobDequeSteal(thief->deque, &job)) {
+            atomic_fetch_add(&thief->taken[job.begin], 1);
+        }
+    }
+    // owner is done pushing, whatever is left goes to the thieves
+    Job job;
+    while (jobDequeSteal(thief->deque, &job)) {
+        atomic_fetch_add(&thief->taken[job.begin], 1);
+    }
+    return NULL;
+}
+
+void countRange(void *data, uint32_t begin, uint32_t end) {
+    _Atomic uint32_t *hits = data;
+    for (uint32_t i=begin; i<end; ++i) {
+        atomic_fetch_add(&hits[i], 1);
+    }
+}
+
+Job jobAt(uint32_t index) {
+    return (Job){NULL, NULL, index, index + 1, NULL};
+}
+
+int main() {
+    /* owner pops newest first, thieves steal oldest first */ {
+        JobDeque *deque = calloc(1, sizeof(JobDeque));
+        for (uint32_t i=0; i<4; ++i) {
+            assert(jobDequePush(deque, jobAt(i)));
+        }
+
+        Job job;
+        assert(jobDequePop(deque, &job) && job.begin == 3);
+        assert(jobDequeSteal(deque, &job) && job.begin == 0);
+        assert(jobDequePop(deque, &job) && job.begin == 2);
+        assert(jobDequeSteal(deque, &job) && job.begin == 1);
+        assert(!jobDequePop(deque, &job));
+        assert(!jobDequeSteal(deque, &job));
+        free(deque);
+    }
+
+    /* push fails once the deque is full and works again after a steal */ {
+        JobDeque *deque = calloc(1, sizeof(JobDeque));
+        for (uint32_t i=0; i<JOB_DEQUE_CAPACITY; ++i) {
+            assert(jobDequePush(deque, jobAt(i)));
+        }
+        assert(!jobDequePush(deque, jobAt(JOB_DEQUE_CAPACITY)));
+
+        Job job;
+        assert(jobDequeSteal(deque, &job) && job.begin == 0);
+        assert(jobDequePush(deque, jobAt(JOB_DEQUE_CAPACITY)));
+        assert(jobDequePop(deque, &job) && job.begin == JOB_DEQUE_CAPACITY);
+        free(deque);
+    }
+
+    /* owner popping against thieves takes every job exactly once */ {
+        JobDeque *deque = calloc(1, sizeof(JobDeque));
+        _Atomic uint32_t *taken = calloc(STEAL_JOBS, sizeof(_Atomic uint32_t));
+        _Atomic bool done = false;
+
+        Thief thief = {deque, taken, &done};
+        pthread_t threads[THIEVES];
+        for (uint32_t i=0; i<THIEVES; ++i) {
+            pthread_create(&threads[i], NULL, thiefMain, &thief);
+        }
+
+        // push in bursts and pop some back, keeps the single job race of jobDequePop busy
+        uint32_t next = 0;
+        while (next < STEAL_JOBS) {
+            for (uint32_t i=0; i<8 && next<STEAL_JOBS; ++i) {
+                while (!jobDequePush(deque, jobAt(next))) {
+                    sched_yield();
+                }
+                next += 1;
+            }
+            Job job;
+            for (uint32_t i=0; i<4 && jobDequePop(deque, &job); ++i) {
+                atomic_fetch_add(&taken[job.begin], 1);
+            }
+        }
+        atomic_store(&done, true);
+        for (uint32_t i=0; i<THIEVES; ++i) {
+            pthread_join(threads[i], NULL);
+        }
+
+        for (uint32_t i=0; i<STEAL_JOBS; ++i) {
+            assert(atomic_load(&taken[i]) == 1);
+        }
+        free(taken);
+        free(deque);
+    }
+
+    /* parallel for covers the range once, with and without a counter */ {
+        JobSystem *jobs = jobsCreate(THIEVES);
+        _Atomic uint32_t *hits = calloc(FOR_COUNT, sizeof(_Atomic uint32_t));
+
+        JobCounter counter = {0};
+        jobsParallelFor(jobs, countRange, hits, FOR_COUNT, 0, &counter);
+        jobsWait(jobs, &counter);
+        for (uint32_t i=0; i<FOR_COUNT; ++i) {
+            assert(atomic_load(&hits[i]) == 1);
+        }
+
+        // nothing to wait on, the owner runs its own jobs until every index was hit twice
+        jobsParallelFor(jobs, countRange, hits, FOR_COUNT, 64, NULL);
+        for (uint32_t i=0; i<FOR_COUNT; ++i) {
+            while (atomic_load(&hits[i]) < 2) {
+                Job job;
+                if (jobsFind(jobs, 0, &job)) {
+                    jobsRun(jobs, job);
+                }
+            }
+        }
+        for (uint32_t i=0; i<FOR_COUNT; ++i) {
+            assert(atomic_load(&hits[i]) == 2);
+        }
+
+        jobsFree(jobs);
+        free(hits);
+    }
+
+    assert(jobsCoreCount() >= 1);
+
+    printf("jobs tests passed\n");
+    return 0;
+}
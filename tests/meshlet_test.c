@@ -0,0 +1,119 @@
+#include "stdio.h"
+#include "assert.h"
+#include "math.h"
+
+#include "meshlet.h"
+
+#define GRID 40
+
+bool nearly(float a, float b) {
+    return fabsf(a - b) < 1e-5f;
+}
+
+/* Two triangles per cell, neighbouring cells share their vertices */
+void addGrid(MeshPool *pool, uint32_t mesh_index) {
+    Vertex *triangles = malloc(GRID * GRID * 6 * sizeof(Vertex));
+    size_t len = 0;
+    for (uint32_t y=0; y<GRID; ++y) {
+        for (uint32_t x=0; x<GRID; ++x) {
+            Vertex a = {{(float)x, (float)y, 0}, {1, 1, 1, 1}};
+            Vertex b = {{(float)x + 1, (float)y, 0}, {1, 1, 1, 1}};
+            Vertex c = {{(float)x, (float)y + 1, 0}, {1, 1, 1, 1}};
+            Vertex d = {{(float)x + 1, (float)y + 1, 0}, {1, 1, 1, 1}};
+            triangles[len++] = a; triangles[len++] = b; triangles[len++] = c;
+            triangles[len++] = b; triangles[len++] = d; triangles[len++] = c;
+        }
+    }
+    meshPoolAddLod(pool, mesh_index, triangles, len, 100.0f);
+    free(triangles);
+}
+
+/* Nothing is shared, vertex limit is hit long before the triangle one */
+void addLoose(MeshPool *pool, uint32_t mesh_index, uint32_t triangle_count) {
+    Vertex *triangles = malloc(triangle_count * 3 * sizeof(Vertex));
+    for (uint32_t i=0; i<triangle_count * 3; ++i) {
+        triangles[i] = (Vertex){{(float)i, (float)(i % 3), 1}, {1, 0, 0, 1}};
+    }
+    meshPoolAddLod(pool, mesh_index, triangles, triangle_count * 3, 100.0f);
+    free(triangles);
+}
+
+/* Meshlets stay in limits and together give back the lod's triangles in index order */
+void checkMesh(const MeshletPool *meshlets, const MeshPool *pool, uint32_t mesh_index) {
+    MeshletRange range = meshlets->meshes[mesh_index];
+    MeshLod lod = pool->meshes[mesh_index].lods[0];
+    assert(range.meshlet_count > 0);
+
+    uint32_t triangle = 0;
+    for (uint32_t m=range.first_meshlet; m<range.first_meshlet + range.meshlet_count; ++m) {
+        Meshlet meshlet = meshlets->meshlets[m];
+        assert(meshlet.vertex_count > 0 && meshlet.vertex_count <= MESHLET_MAX_VERTICES);
+        assert(meshlet.triangle_count > 0 && meshlet.triangle_count <= MESHLET_MAX_TRIANGLES);
+
+        for (uint32_t t=0; t<meshlet.triangle_count; ++t) {
+            uint32_t packed = meshlets->triangles[meshlet.triangle_offset + t];
+            for (uint32_t k=0; k<3; ++k) {
+                uint32_t local = (packed >> (k * 8)) & 0xff;
+                assert(local < meshlet.vertex_count);
+                uint32_t vertex = meshlets->vertices[meshlet.vertex_offset + local];
+                assert(vertex == lod.vertex_offset + pool->indices[lod.first_index + triangle * 3 + k]);
+
+                vec3 p = pool->vertices[vertex].pos;
+                vec3 center = {meshlet.sphere.x, meshlet.sphere.y, meshlet.sphere.z};
+                assert(vec3_length(vec3_sub(p, center)) <= meshlet.sphere.w + 1e-4f);
+            }
+            triangle += 1;
+        }
+    }
+    assert(triangle * 3 == lod.index_count);
+}
+
+int main() {
+    /* vec3 helpers the bounds are built on */ {
+        vec3 x = {1, 0, 0};
+        vec3 y = {0, 1, 0};
+        vec3 z = vec3_cross(x, y);
+        assert(z.x == 0 && z.y == 0 && z.z == 1);
+        vec3 minus_z = vec3_cross(y, x);
+        assert(minus_z.z == -1);
+
+        vec3 a = {1, 2, 3};
+        vec3 b = {-4, 5, 0.5f};
+        assert(nearly(vec3_dot(a, b), 7.5f));
+        vec3 c = vec3_cross(a, b);
+        assert(nearly(vec3_dot(c, a), 0) && nearly(vec3_dot(c, b), 0));
+        assert(nearly(vec3_length((vec3){3, 4, 0}), 5));
+        assert(vec3_length((vec3){0, 0, 0}) == 0);
+        assert(nearly(vec3_length(a) * vec3_length(a), vec3_dot(a, a)));
+    }
+
+    /* shared and loose meshes split within limits and cover every triangle */ {
+        MeshPool pool = {0};
+        addGrid(&pool, 0);
+        addLoose(&pool, 1, 100);
+        // a single meshlet for one triangle
+        addLoose(&pool, 2, 1);
+
+        MeshletPool meshlets;
+        meshletPoolBuild(&meshlets, &pool);
+        for (uint32_t m=0; m<pool.meshes_len; ++m) {
+            checkMesh(&meshlets, &pool, m);
+        }
+
+        // 3200 triangles need at least 26 meshlets, loose ones fit 21 triangles each
+        assert(meshlets.meshes[0].meshlet_count >= (GRID * GRID * 2 + MESHLET_MAX_TRIANGLES - 1) / MESHLET_MAX_TRIANGLES);
+        assert(meshlets.meshes[1].meshlet_count == (100 + 20) / 21);
+        assert(meshlets.meshes[2].meshlet_count == 1);
+
+        // flat grid faces one way, so its cones are tight
+        Meshlet first = meshlets.meshlets[meshlets.meshes[0].first_meshlet];
+        assert(first.cone.w < 1.0f);
+        assert(nearly(fabsf(first.cone.z), 1));
+
+        meshletPoolFree(&meshlets);
+        meshPoolFree(&pool);
+    }
+
+    printf("meshlet tests passed\n");
+    return 0;
+}
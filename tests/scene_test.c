@@ -0,0 +1,108 @@
+#include "stdio.h"
+#include "assert.h"
+#include "math.h"
+
+#include "scene.h"
+
+#define ROOT ((SceneHandle){SCENE_NONE, 0})
+#define IDENTITY ((quaternion){0, 0, 0, 1})
+
+SceneHandle createAt(Scene *scene, SceneHandle parent, vec3 position, float scale) {
+    return sceneCreateNode(scene, parent, position, IDENTITY, scale, (vec4){0, 0, 0, 1}, SCENE_NONE);
+}
+
+bool listedOnce(const uint32_t *list, uint32_t len, uint32_t node) {
+    uint32_t count = 0;
+    for (uint32_t i=0; i<len; ++i) {
+        count += list[i] == node ? 1 : 0;
+    }
+    return count == 1;
+}
+
+int main() {
+    /* destroyed slot is reused with a new generation */ {
+        Scene scene = {0};
+        SceneHandle a = createAt(&scene, ROOT, (vec3){0, 0, 0}, 1);
+        sceneDestroyNode(&scene, a);
+        SceneHandle b = createAt(&scene, ROOT, (vec3){0, 0, 0}, 1);
+
+        assert(b.index == a.index);
+        assert(b.generation != a.generation);
+        assert(!sceneValid(&scene, a));
+        assert(sceneValid(&scene, b));
+        sceneFree(&scene);
+    }
+
+    /* handles from before a clear stay invalid */ {
+        Scene scene = {0};
+        SceneHandle old[8];
+        for (uint32_t i=0; i<8; ++i) {
+            old[i] = createAt(&scene, ROOT, (vec3){0, 0, 0}, 1);
+        }
+        sceneClear(&scene);
+        for (uint32_t i=0; i<8; ++i) {
+            SceneHandle fresh = createAt(&scene, ROOT, (vec3){0, 0, 0}, 1);
+            assert(fresh.index == old[i].index);
+            assert(!sceneValid(&scene, old[i]));
+            assert(sceneValid(&scene, fresh));
+        }
+        // slots reused after the clear are listed and updated again
+        sceneUpdate(&scene);
+        assert(scene.changed_len == 8);
+        sceneFree(&scene);
+    }
+
+    /* churn on a full scene between updates lists every slot once */ {
+        Scene scene = {0};
+        SceneHandle nodes[64];
+        for (uint32_t i=0; i<64; ++i) {
+            nodes[i] = createAt(&scene, ROOT, (vec3){(float)i, 0, 0}, 1);
+        }
+        assert(scene.len == scene.capacity);
+        sceneUpdate(&scene);
+
+        for (uint32_t round=0; round<1000; ++round) {
+            uint32_t i = round % 64;
+            sceneDestroyNode(&scene, nodes[i]);
+            nodes[i] = createAt(&scene, ROOT, (vec3){(float)round, 0, 0}, 1);
+            assert(scene.dirty_len <= scene.capacity);
+            assert(listedOnce(scene.dirty, scene.dirty_len, nodes[i].index));
+        }
+
+        sceneUpdate(&scene);
+        assert(scene.changed_len == 64);
+        assert(scene.dirty_len == 0);
+        for (uint32_t i=0; i<64; ++i) {
+            uint32_t node = sceneIndex(&scene, nodes[i]);
+            assert(scene.world_position[node].x == scene.position[node].x);
+        }
+        sceneFree(&scene);
+    }
+
+    /* world transforms follow the parent, destroying it takes the subtree */ {
+        Scene scene = {0};
+        SceneHandle parent = createAt(&scene, ROOT, (vec3){1, 0, 0}, 2);
+        SceneHandle child = createAt(&scene, parent, (vec3){1, 0, 0}, 1);
+        sceneUpdate(&scene);
+
+        uint32_t node = sceneIndex(&scene, child);
+        assert(fabsf(scene.world_position[node].x - 3.0f) < 1e-5f);
+        assert(scene.world_scale[node] == 2.0f);
+        assert(scene.world_bounds[node].w == 2.0f);
+
+        sceneSetPosition(&scene, parent, (vec3){0, 1, 0});
+        sceneUpdate(&scene);
+        assert(scene.changed_len == 2);
+        assert(fabsf(scene.world_position[node].x - 2.0f) < 1e-5f);
+        assert(fabsf(scene.world_position[node].y - 1.0f) < 1e-5f);
+
+        sceneDestroyNode(&scene, parent);
+        assert(!sceneValid(&scene, parent));
+        assert(!sceneValid(&scene, child));
+        assert(scene.free_len == 2);
+        sceneFree(&scene);
+    }
+
+    printf("scene tests passed\n");
+    return 0;
+}
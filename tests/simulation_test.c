@@ -0,0 +1,147 @@
+#include "stdio.h"
+#include "assert.h"
+#include "sched.h"
+
+#include "simulation.h"
+
+#define STREAM_EVENTS 1000000
+#define STREAM_STATES 1000000
+
+FrameInput eventAt(uint32_t i) {
+    return (FrameInput){(float)i, 1, 2, 3, 4};
+}
+
+void *producerMain(void *arg) {
+    InputQueue *queue = arg;
+    for (uint32_t i=0; i<STREAM_EVENTS; ++i) {
+        while (!inputQueuePush(queue, eventAt(i))) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/* Writer fills both halves, a reader seeing them differ is looking at a slot still being written */
+typedef struct {
+    uint64_t first;
+    uint64_t second;
+} State;
+
+typedef struct {
+    TripleBuffer buffer;
+    State slots[3];
+} Shared;
+
+void *writerMain(void *arg) {
+    Shared *shared = arg;
+    uint32_t back = shared->buffer.back;
+    for (uint64_t i=1; i<=STREAM_STATES; ++i) {
+        shared->slots[back].first = i;
+        shared->slots[back].second = i;
+        back = tripleBufferPublish(&shared->buffer);
+    }
+    return NULL;
+}
+
+bool distinctSlots(TripleBuffer *buffer) {
+    uint32_t middle = atomic_load(&buffer->middle) & ~TRIPLE_BUFFER_FRESH;
+    return middle != buffer->back && middle != buffer->front && buffer->back != buffer->front;
+}
+
+int main() {
+    /* events come out in order and push fails when full */ {
+        static InputQueue queue = {0};
+        for (uint32_t i=0; i<INPUT_QUEUE_CAPACITY; ++i) {
+            assert(inputQueuePush(&queue, eventAt(i)));
+        }
+        assert(!inputQueuePush(&queue, eventAt(INPUT_QUEUE_CAPACITY)));
+
+        FrameInput event;
+        for (uint32_t i=0; i<INPUT_QUEUE_CAPACITY; ++i) {
+            assert(inputQueuePop(&queue, &event));
+            assert(event.camera_pitch == (float)i);
+        }
+        assert(!inputQueuePop(&queue, &event));
+        assert(inputQueuePush(&queue, eventAt(7)));
+        assert(inputQueuePop(&queue, &event) && event.camera_pitch == 7.0f);
+    }
+
+    /* drain sums every field and empties the queue */ {
+        static InputQueue queue = {0};
+        for (uint32_t i=0; i<10; ++i) {
+            inputQueuePush(&queue, eventAt(i));
+        }
+        FrameInput sum = inputQueueDrain(&queue);
+        assert(sum.camera_pitch == 45.0f);
+        assert(sum.camera_yaw == 10.0f);
+        assert(sum.camera_forward == 20.0f);
+        assert(sum.model_pitch == 30.0f);
+        assert(sum.model_yaw == 40.0f);
+
+        FrameInput event;
+        assert(!inputQueuePop(&queue, &event));
+    }
+
+    /* consumer on another thread sees every event once and in order, across many wraps */ {
+        static InputQueue queue = {0};
+        pthread_t producer;
+        pthread_create(&producer, NULL, producerMain, &queue);
+
+        for (uint32_t i=0; i<STREAM_EVENTS; ++i) {
+            FrameInput event;
+            while (!inputQueuePop(&queue, &event)) {
+                sched_yield();
+            }
+            assert(event.camera_pitch == (float)i);
+            assert(event.model_yaw == 4.0f);
+        }
+        pthread_join(producer, NULL);
+    }
+
+    /* fresh only after a publish, slots never shared */ {
+        TripleBuffer buffer = tripleBufferCreate();
+        assert(distinctSlots(&buffer));
+
+        bool fresh;
+        uint32_t front = tripleBufferAcquire(&buffer, &fresh);
+        assert(!fresh);
+
+        uint32_t written = buffer.back;
+        tripleBufferPublish(&buffer);
+        assert(distinctSlots(&buffer));
+        front = tripleBufferAcquire(&buffer, &fresh);
+        assert(fresh && front == written);
+        assert(distinctSlots(&buffer));
+        assert(tripleBufferAcquire(&buffer, &fresh) == front && !fresh);
+
+        // two publishes before a read, the reader gets the latest one
+        tripleBufferPublish(&buffer);
+        written = buffer.back;
+        tripleBufferPublish(&buffer);
+        assert(distinctSlots(&buffer));
+        front = tripleBufferAcquire(&buffer, &fresh);
+        assert(fresh && front == written);
+        assert(distinctSlots(&buffer));
+    }
+
+    /* reader on another thread only sees whole states that never go back */ {
+        static Shared shared;
+        shared.buffer = tripleBufferCreate();
+        pthread_t writer;
+        pthread_create(&writer, NULL, writerMain, &shared);
+
+        uint64_t last = 0;
+        while (last < STREAM_STATES) {
+            bool fresh;
+            State state = shared.slots[tripleBufferAcquire(&shared.buffer, &fresh)];
+            assert(state.first == state.second);
+            assert(state.first >= last);
+            assert(fresh || state.first == last);
+            last = state.first;
+        }
+        pthread_join(writer, NULL);
+    }
+
+    printf("simulation tests passed\n");
+    return 0;
+}